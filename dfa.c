@@ -0,0 +1,2274 @@
+/*
+ dfa.c
+ Author: Jonathan Hamm
+
+ Description:
+    Implementation of the NFA to DFA conversion used by the lexical analyzer.
+
+    The NFAs produced by parseregex have edges labeled with whole terminal
+    strings, negated terminals, the '.' metacharacter and references to
+    other machines. Before subset construction these are flattened into a
+    byte level NFA:
+
+        - A terminal of n characters becomes a chain of n byte edges.
+        - A reference to another machine is replaced with a private copy of
+          that machine's NFA (an "instance"), entered and left through
+          epsilon edges.
+        - Edge annotations (attribute and type) are tracked as a "tag" that
+          is carried along each path. Along a path, the first annotated edge
+          decides the attribute and type of the token, as it does in nfa_match.
+
+    nfa_match never backtracks into a referenced machine: a reference always
+    consumes that machine's longest match, and a length annotation rejects
+    the path when the longest match is too long. An instance that cannot
+    tell the difference (the bytes that may follow it are disjoint from the
+    bytes that extend its match) is left as is. Any other instance is
+    "tracked": paths leaving it are pending on it, and whenever the instance
+    reaches its final node again, the paths that left it earlier are dropped.
+    A tracked instance with a length annotation keeps running past its bound
+    only to find out whether it would match again. Since an accept cannot be
+    taken back once the DFA has passed it, accepts on pending paths are
+    tentative, and dfa_match settles them with each state's live and kill
+    masks.
+
+    Several machines are combined by flattening each of them from its own
+    start state (a "root") and starting subset construction from all of
+    the roots at once. Accepts carry the index of the root they belong to.
+
+    bnfa_step does what dset_step does, on a bitset of flattened states and
+    without remembering the result, for lexers whose DFA would be too large.
+    The lazy DFA (ldfa_s) sits in between: it remembers the sets bnfa_step
+    reaches as DFA states in a cache of fixed size, which is emptied when
+    it fills up.
+
+    Machines that reference themselves, need more than DFA_MAXTRACK tracked
+    instances, or grow past FNFA_MAXSTATES or DFA_MAXSTATES, are not
+    converted, and lexf keeps using nfa_match for them.
+ */
+
+#include "dfa.h"
+#include "scanrun.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNFA_INITSIZE   64
+#define FKEY_INITSIZE   256
+#define FVISIT_MAX      1024
+
+#define FNFA_OVER       UINT32_MAX
+#define FNFA_NOPEND     -1
+
+#define FEDGE_BYTES     0
+#define FEDGE_EPSILON   1
+#define FEDGE_CONFLICT  2
+
+#define DSET_INITSIZE   64
+
+#define EOF_BYTE        ((uint8_t)EOF)
+#define BSET_TEST(set, b)   ((set)[(b) >> 3] & (1 << ((b) & 7)))
+#define BSET_ADD(set, b)    ((set)[(b) >> 3] |= (1 << ((b) & 7)))
+#define BSET_DEL(set, b)    ((set)[(b) >> 3] &= ~(1 << ((b) & 7)))
+
+#define NOLIMIT         LONG_MAX
+
+typedef struct fedge_s fedge_s;
+typedef struct fstate_s fstate_s;
+typedef struct forigin_s forigin_s;
+typedef struct ftag_s ftag_s;
+typedef struct finst_s finst_s;
+typedef struct fvisit_s fvisit_s;
+typedef struct fnfa_s fnfa_s;
+typedef struct dctx_s dctx_s;
+typedef struct dset_s dset_s;
+typedef struct dbuild_s dbuild_s;
+
+struct fedge_s
+{
+    uint8_t kind;
+    int8_t enter;
+    uint32_t dest;
+    uint8_t set[DFA_NSYMBOLS / 8];
+};
+
+/*
+    pend:   tracked instance this path is pending on, or FNFA_NOPEND
+    final:  tracked instance this state is the final node of, or -1
+    runs:   tracked instances this state is running inside of
+ */
+struct fstate_s
+{
+    bool accept;
+    uint16_t root;
+    int8_t pend;
+    int8_t final;
+    uint16_t tag;
+    uint32_t runs;
+    uint16_t nedges;
+    fedge_s *edges;
+};
+
+/*
+ The key a flattened state was created from. States in the middle of a
+ terminal's byte chain are keyed by the edge and their position in it.
+ */
+struct forigin_s
+{
+    int32_t inst;
+    nfa_node_s *node;
+    nfa_edge_s *edge;
+    uint16_t pos;
+    uint16_t tag;
+    uint32_t used;
+    int8_t pend;
+};
+
+struct ftag_s
+{
+    uint16_t root;
+    int attribute;
+    char *stype;
+    bool attlock;
+    bool typelock;
+};
+
+struct finst_s
+{
+    uint16_t root;
+    mach_s *mach;
+    int32_t parent;
+    nfa_edge_s *edge;
+    uint16_t tag;
+    long bound;
+    bool limited;
+    int8_t bit;
+    uint32_t runs;
+    uint32_t entry_used;
+};
+
+struct fvisit_s
+{
+    uint32_t n;
+    int32_t inst[FVISIT_MAX];
+    nfa_node_s *node[FVISIT_MAX];
+};
+
+struct dctx_s
+{
+    lex_s *lex;
+    llist_s *building;
+    llist_s *failed;
+};
+
+struct fnfa_s
+{
+    dctx_s *ctx;
+    bool failed;
+    uint32_t nstates;
+    uint32_t size;
+    fstate_s *states;
+    forigin_s *origins;
+    uint16_t ntags;
+    ftag_s *tags;
+    uint32_t ninsts;
+    finst_s *insts;
+    uint8_t ntracked;
+    uint16_t nroots;
+    mach_s **roots;
+    uint32_t *starts;
+    uint32_t nkeys;
+    uint32_t ksize;
+    int32_t *keys;
+    uint32_t nwork;
+    uint32_t *work;
+};
+
+struct dset_s
+{
+    uint32_t n;
+    uint32_t size;
+    uint32_t live;
+    uint32_t *states;
+};
+
+struct dbuild_s
+{
+    fnfa_s *nfa;
+    bool failed;
+    uint32_t nsets;
+    uint32_t size;
+    dset_s *sets;
+    uint32_t hsize;
+    int32_t *hash;
+    uint32_t msize;
+    uint32_t *mark;
+    uint32_t gen;
+    uint32_t *stack;
+};
+
+static void *safe_realloc(void *ptr, size_t size);
+static dfa_s *ctx_dfa(dctx_s *ctx, mach_s *mach);
+
+static bool dfa_accepts(dfa_s *dfa, uint32_t state);
+static long dfa_maxlen(dfa_s *dfa);
+static long dfa_longest(dfa_s *dfa, uint32_t state, long *memo, uint8_t *color);
+static void dfa_first(dfa_s *dfa, uint8_t *set);
+static void dfa_extend(dfa_s *dfa, uint8_t *set);
+
+static fnfa_s *fnfa_(dctx_s *ctx);
+static void free_fnfa(fnfa_s *f);
+static mach_s *fnfa_getmach(lex_s *lex, char *id);
+static uint16_t fnfa_tag(fnfa_s *f, uint16_t tag, nfa_edge_s *edge);
+static uint16_t fnfa_newtag(fnfa_s *f, ftag_s *t);
+static void fnfa_follow(fnfa_s *f, int32_t inst, nfa_node_s *node, uint8_t *set, fvisit_s *visit);
+static int32_t fnfa_inst(fnfa_s *f, int32_t parent, nfa_edge_s *edge, mach_s *mach, uint16_t tag, uint32_t used);
+static long fnfa_remaining(fnfa_s *f, int32_t inst, uint32_t used);
+static uint32_t fnfa_consume(fnfa_s *f, int32_t inst, uint32_t used, uint32_t len);
+static nfa_node_s *fnfa_skip(fnfa_s *f, int32_t inst, nfa_node_s *node);
+static uint32_t fnfa_newstate(fnfa_s *f);
+static forigin_s fnfa_key(int32_t inst, nfa_node_s *node, uint16_t tag, uint32_t used, int8_t pend);
+static uint32_t fnfa_state(fnfa_s *f, forigin_s *key);
+static void fnfa_addedge(fnfa_s *f, uint32_t src, uint8_t kind, const uint8_t *set, uint32_t dest, int8_t enter);
+static void fnfa_chain(fnfa_s *f, uint32_t src, forigin_s *o, nfa_edge_s *edge, uint16_t tag);
+static void fnfa_call(fnfa_s *f, uint32_t src, forigin_s *o, nfa_edge_s *edge, uint16_t tag);
+static void fnfa_return(fnfa_s *f, uint32_t src, forigin_s *o);
+static void fnfa_expand(fnfa_s *f, uint32_t s);
+static uint32_t fnfa_settle(fnfa_s *f, uint32_t s);
+static fnfa_s *flatten(dctx_s *ctx, mach_s **machs, uint16_t nmachs);
+
+static uint32_t dset_hash(dset_s *set);
+static int cmp_u32(const void *a, const void *b);
+static void dset_add(dset_s *set, uint32_t s);
+static bool dset_closure(dbuild_s *b, dset_s *set);
+static int32_t dset_lookup(dbuild_s *b, dset_s *set);
+static int32_t dset_step(dbuild_s *b, uint32_t d, int c);
+static void dset_accept(fnfa_s *f, dset_s *set, dfa_s *dfa, uint32_t d, int32_t *best);
+static void dset_addaccept(fnfa_s *f, dfa_info_s *info, uint16_t tag, int8_t pend);
+static uint16_t fnfa_classes(fnfa_s *f, uint8_t *classes);
+static dfa_s *determinize(fnfa_s *f);
+static dfa_s *dfa_combine(dctx_s *ctx);
+
+static bool dfa_sameinfo(dfa_info_s *a, dfa_info_s *b);
+static void bnfa_closure(bnfa_s *nfa, fnfa_s *f, uint32_t from, uint32_t *stack, uint32_t *mark);
+static int bnfa_close(bnfa_s *nfa);
+static uint32_t ldfa_hash(ldfa_s *l, uint64_t *set, uint32_t live);
+static int32_t ldfa_add(ldfa_s *l);
+static void ldfa_flush(ldfa_s *l);
+static void dfa_minimize(dfa_s *dfa);
+static void dfa_mergeclasses(dfa_s *dfa);
+static void dfa_pack(dfa_s *dfa);
+
+/*
+ Converts every machine of lex, setting mach->dfa for each machine that
+ could be converted, and lex->dfa to the combination of all of them if it
+ could be built. References are converted before the machines that use
+ them, since flattening needs to know how a referenced machine ends.
+ */
+void dfa_buildall(lex_s *lex)
+{
+    mach_s *mach;
+    dctx_s ctx;
+
+    ctx.lex = lex;
+    ctx.building = NULL;
+    ctx.failed = NULL;
+    for (mach = lex->machs; mach; mach = mach->next)
+        ctx_dfa(&ctx, mach);
+    lex->dfa = dfa_combine(&ctx);
+    free_llist(ctx.failed);
+}
+
+void free_dfa(dfa_s *dfa)
+{
+    uint32_t i;
+
+    if (!dfa)
+        return;
+    for (i = 0; i < dfa->nstates; i++)
+        free(dfa->info[i].accept);
+    free(dfa->machs);
+    free(dfa->info);
+    free(dfa->accel);
+    if (!dfa->mapped) {
+        free(dfa->trans);
+        free(dfa->flags);
+        free(dfa->base);
+        free(dfa->deflt);
+        free(dfa->next);
+        free(dfa->check);
+    }
+    free(dfa);
+}
+
+/*
+ Finds the states dfa_scan can stay in over a whole run of bytes at once:
+ every byte of one of the run classes loops back to the state, and the
+ state neither accepts tentatively nor touches a tracked reference, so only
+ the last byte of the run matters to the result.
+ */
+void dfa_accel(dfa_s *dfa)
+{
+    int class, c;
+    uint16_t i;
+    uint32_t s;
+    dfa_info_s *info;
+    static const int classes[] = {RUN_WORD, RUN_ALNUM, RUN_DIGIT, RUN_SPACE};
+
+    dfa->accel = calloc(dfa->nstates, sizeof(*dfa->accel));
+    if (!dfa->accel) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (s = DFA_START; s < dfa->nstates; s++) {
+        info = &dfa->info[s];
+        if (dfa->flags[s]) {
+            if (info->live || info->kill)
+                continue;
+            for (i = 0; i < info->naccept && info->accept[i].pend < 0; i++);
+            if (i < info->naccept)
+                continue;
+        }
+        for (class = 0; class < (int)(sizeof(classes) / sizeof(*classes)); class++) {
+            for (c = 0; c < DFA_NSYMBOLS; c++) {
+                if (run_member(classes[class], c) && dfa->trans[s * dfa->nclasses + dfa->classes[c]] != (int32_t)s)
+                    break;
+            }
+            if (c == DFA_NSYMBOLS) {
+                dfa->accel[s] = classes[class];
+                break;
+            }
+        }
+    }
+}
+
+/*
+ Size in bytes of the tables dfa_scan reads transitions from.
+ */
+size_t dfa_tablesize(dfa_s *dfa)
+{
+    return sizeof(dfa->classes) + dfa->nstates * (sizeof(*dfa->base) + sizeof(*dfa->deflt))
+            + dfa->ncomb * (sizeof(*dfa->next) + sizeof(*dfa->check));
+}
+
+void print_lexstats(lex_s *lex, FILE *stream)
+{
+    mach_s *mach;
+    dfa_s *dfa;
+
+    bnfa_s *nfa = lex->bnfa;
+    size_t nclosure = 0;
+    uint32_t i, nstart, most;
+
+    fprintf(stream, "%-24s%10s%10s%10s%12s%12s\n", "machine", "states", "minimal", "classes", "full", "packed");
+    for (mach = lex->machs; mach; mach = mach->next) {
+        dfa = mach->dfa;
+        if (dfa)
+            fprintf(stream, "%-24s%10u%10u%10u%12zu%12zu\n", mach->nterm->lexeme, dfa->nraw, dfa->nstates, dfa->nclasses,
+                    dfa->nstates * DFA_NSYMBOLS * sizeof(*dfa->trans), dfa_tablesize(dfa));
+        else
+            fprintf(stream, "%-24s%10s\n", mach->nterm->lexeme, "nfa");
+    }
+    dfa = lex->dfa;
+    if (dfa)
+        fprintf(stream, "%-24s%10u%10u%10u%12zu%12zu\n", "<combined>", dfa->nraw, dfa->nstates, dfa->nclasses,
+                dfa->nstates * DFA_NSYMBOLS * sizeof(*dfa->trans), dfa_tablesize(dfa));
+    else
+        fprintf(stream, "%-24s%10s\n", "<combined>", "none");
+    if (nfa) {
+        for (i = 0; i < nfa->nstates; i++)
+            nclosure += nfa->states[i].nclosure;
+        fprintf(stream, "bitset nfa: %u states, %u words per set, %zu closure entries\n",
+                nfa->nstates, nfa->nwords, nclosure);
+    }
+    if (lex->firstpos) {
+        for (i = 0, nstart = 0, most = 0; i < DFA_NSYMBOLS; i++) {
+            if (lex->firstpos[i + 1] > lex->firstpos[i])
+                nstart++;
+            if (lex->firstpos[i + 1] - lex->firstpos[i] > most)
+                most = lex->firstpos[i + 1] - lex->firstpos[i];
+        }
+        fprintf(stream, "first byte dispatch: %u bytes start tokens, %.2f of %u machines tried on average, %u at most\n",
+                nstart, nstart ? (double)lex->firstpos[DFA_NSYMBOLS] / nstart : 0.0, lex->nmachs, most);
+    }
+}
+
+void *safe_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+dfa_s *ctx_dfa(dctx_s *ctx, mach_s *mach)
+{
+    fnfa_s *f;
+
+    if (mach->dfa || llcontains(ctx->failed, mach) || llcontains(ctx->building, mach))
+        return mach->dfa;
+    llpush(&ctx->building, mach);
+    f = flatten(ctx, &mach, 1);
+    if (!f->failed)
+        mach->dfa = determinize(f);
+    free_fnfa(f);
+    free(llpop(&ctx->building));
+    if (!mach->dfa)
+        llpush(&ctx->failed, mach);
+    return mach->dfa;
+}
+
+/*
+ Combines all machines of the lexer, in list order, into a single DFA.
+ Only attempted once every machine could be converted on its own.
+ */
+dfa_s *dfa_combine(dctx_s *ctx)
+{
+    uint16_t n;
+    mach_s *mach, **machs;
+    fnfa_s *f;
+    dfa_s *dfa = NULL;
+
+    if (ctx->failed)
+        return NULL;
+    machs = safe_realloc(NULL, (ctx->lex->nmachs ? ctx->lex->nmachs : 1) * sizeof(*machs));
+    for (n = 0, mach = ctx->lex->machs; mach; mach = mach->next)
+        machs[n++] = mach;
+    f = flatten(ctx, machs, n);
+    if (!f->failed)
+        dfa = determinize(f);
+    free_fnfa(f);
+    free(machs);
+    return dfa;
+}
+
+bool dfa_accepts(dfa_s *dfa, uint32_t state)
+{
+    return dfa->info[state].naccept > 0;
+}
+
+/*
+ Length of the longest string the DFA accepts, or -1 if a cycle makes it
+ unbounded.
+ */
+long dfa_maxlen(dfa_s *dfa)
+{
+    long len, *memo;
+    uint8_t *color;
+
+    memo = safe_realloc(NULL, dfa->nstates * sizeof(*memo));
+    color = calloc(dfa->nstates, sizeof(*color));
+    if (!color) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    len = dfa_longest(dfa, DFA_START, memo, color);
+    free(memo);
+    free(color);
+    return (len == NOLIMIT) ? -1 : len;
+}
+
+long dfa_longest(dfa_s *dfa, uint32_t state, long *memo, uint8_t *color)
+{
+    int c;
+    int32_t next;
+    long len, best;
+
+    if (color[state] == 1)
+        return NOLIMIT;
+    if (color[state] == 2)
+        return memo[state];
+    color[state] = 1;
+    best = dfa_accepts(dfa, state) ? 0 : -1;
+    for (c = 0; c < dfa->nclasses && best != NOLIMIT; c++) {
+        next = dfa->trans[state * dfa->nclasses + c];
+        if (next == DFA_DEAD)
+            continue;
+        len = dfa_longest(dfa, next, memo, color);
+        if (len == NOLIMIT)
+            best = NOLIMIT;
+        else if (len > -1 && len + 1 > best)
+            best = len + 1;
+    }
+    color[state] = 2;
+    memo[state] = best;
+    return best;
+}
+
+void dfa_first(dfa_s *dfa, uint8_t *set)
+{
+    int c;
+
+    for (c = 0; c < DFA_NSYMBOLS; c++) {
+        if (dfa->trans[DFA_START * dfa->nclasses + dfa->classes[c]] != DFA_DEAD)
+            BSET_ADD(set, c);
+    }
+}
+
+/*
+ Bytes that may continue a match once the DFA has accepted.
+ */
+void dfa_extend(dfa_s *dfa, uint8_t *set)
+{
+    int c;
+    uint32_t i;
+
+    for (i = 0; i < dfa->nstates; i++) {
+        if (!dfa_accepts(dfa, i))
+            continue;
+        for (c = 0; c < DFA_NSYMBOLS; c++) {
+            if (dfa->trans[i * dfa->nclasses + dfa->classes[c]] != DFA_DEAD)
+                BSET_ADD(set, c);
+        }
+    }
+}
+
+fnfa_s *fnfa_(dctx_s *ctx)
+{
+    fnfa_s *f;
+
+    f = calloc(1, sizeof(*f));
+    if (!f) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    f->ctx = ctx;
+    f->size = FNFA_INITSIZE;
+    f->states = safe_realloc(NULL, f->size * sizeof(*f->states));
+    f->origins = safe_realloc(NULL, f->size * sizeof(*f->origins));
+    f->work = safe_realloc(NULL, f->size * sizeof(*f->work));
+    f->ksize = FKEY_INITSIZE;
+    f->keys = safe_realloc(NULL, f->ksize * sizeof(*f->keys));
+    memset(f->keys, -1, f->ksize * sizeof(*f->keys));
+    return f;
+}
+
+void free_fnfa(fnfa_s *f)
+{
+    uint32_t i;
+
+    for (i = 0; i < f->nstates; i++)
+        free(f->states[i].edges);
+    free(f->states);
+    free(f->origins);
+    free(f->work);
+    free(f->keys);
+    free(f->tags);
+    free(f->insts);
+    free(f->roots);
+    free(f->starts);
+    free(f);
+}
+
+mach_s *fnfa_getmach(lex_s *lex, char *id)
+{
+    mach_s *iter;
+
+    for (iter = lex->machs; iter && strcmp(iter->nterm->lexeme, id); iter = iter->next);
+    if (!iter) {
+        fprintf(stderr, "Regex Error: Regex %s never defined", id);
+        exit(EXIT_FAILURE);
+    }
+    return iter;
+}
+
+/*
+ Applies an edge's annotation to a tag. Terminal and epsilon edges fix the
+ attribute and type for the rest of the path. A reference to another machine
+ fixes the type, but its attribute may still be replaced by an annotated edge
+ further along the path, mirroring the LEXTYPE_NONTERM case of nfa_match.
+ Each root has tags of its own, so their order only depends on that root.
+ */
+uint16_t fnfa_tag(fnfa_s *f, uint16_t tag, nfa_edge_s *edge)
+{
+    ftag_s t = f->tags[tag];
+
+    if (edge->token->type.val == LEXTYPE_NONTERM) {
+        if (!t.attlock && edge->annotation.attribute > 0)
+            t.attribute = edge->annotation.attribute;
+        if (!t.typelock) {
+            t.stype = edge->annotation.type;
+            t.typelock = true;
+        }
+    }
+    else {
+        if (!t.attlock && edge->annotation.attribute > 0) {
+            t.attribute = edge->annotation.attribute;
+            t.attlock = true;
+        }
+        if (!t.typelock && edge->annotation.type) {
+            t.stype = edge->annotation.type;
+            t.typelock = true;
+        }
+    }
+    return fnfa_newtag(f, &t);
+}
+
+uint16_t fnfa_newtag(fnfa_s *f, ftag_s *t)
+{
+    uint16_t i;
+
+    for (i = 0; i < f->ntags; i++) {
+        if (f->tags[i].root == t->root && f->tags[i].attribute == t->attribute && f->tags[i].stype == t->stype
+            && f->tags[i].attlock == t->attlock && f->tags[i].typelock == t->typelock)
+            return i;
+    }
+    f->tags = safe_realloc(f->tags, (f->ntags + 1) * sizeof(*f->tags));
+    f->tags[f->ntags] = *t;
+    return f->ntags++;
+}
+
+/*
+ Collects the bytes that may be consumed first after reaching node in
+ instance inst, following epsilon edges, referenced machines that match
+ the empty string, and returns from instances.
+ */
+void fnfa_follow(fnfa_s *f, int32_t inst, nfa_node_s *node, uint8_t *set, fvisit_s *visit)
+{
+    uint16_t i;
+    uint32_t j;
+    char *lexeme;
+    nfa_edge_s *edge;
+    dfa_s *dfa;
+
+    for (j = 0; j < visit->n; j++) {
+        if (visit->inst[j] == inst && visit->node[j] == node)
+            return;
+    }
+    if (visit->n == FVISIT_MAX) {
+        memset(set, 0xFF, DFA_NSYMBOLS / 8);
+        return;
+    }
+    visit->inst[visit->n] = inst;
+    visit->node[visit->n++] = node;
+    for (i = 0; i < node->nedges && !f->failed; i++) {
+        edge = node->edges[i];
+        lexeme = edge->token->lexeme;
+        switch (edge->token->type.val) {
+            case LEXTYPE_EPSILON:
+                fnfa_follow(f, inst, edge->state, set, visit);
+                break;
+            case LEXTYPE_DOT:
+                memset(set, 0xFF, DFA_NSYMBOLS / 8);
+                break;
+            case LEXTYPE_TERM:
+                if (!*lexeme)
+                    break;
+                if (edge->negate) {
+                    for (j = 0; j < DFA_NSYMBOLS; j++) {
+                        if (lexeme[1] || j != (uint8_t)lexeme[0])
+                            BSET_ADD(set, j);
+                    }
+                }
+                else
+                    BSET_ADD(set, (uint8_t)lexeme[0]);
+                break;
+            case LEXTYPE_NONTERM:
+                dfa = ctx_dfa(f->ctx, fnfa_getmach(f->ctx->lex, lexeme));
+                if (!dfa) {
+                    f->failed = true;
+                    break;
+                }
+                dfa_first(dfa, set);
+                if (dfa_accepts(dfa, DFA_START))
+                    fnfa_follow(f, inst, edge->state, set, visit);
+                break;
+            default:
+                f->failed = true;
+                break;
+        }
+    }
+    if (node == f->insts[inst].mach->nfa->final && f->insts[inst].parent > -1)
+        fnfa_follow(f, f->insts[inst].parent, f->insts[inst].edge->state, set, visit);
+}
+
+/*
+ Returns the instance of mach referenced by edge, entered from parent with
+ the given tag after parent consumed used bytes. A new instance is tracked
+ unless leaving it early can never make a difference. A length annotation
+ the referenced machine cannot exceed is dropped.
+ */
+int32_t fnfa_inst(fnfa_s *f, int32_t parent, nfa_edge_s *edge, mach_s *mach, uint16_t tag, uint32_t used)
+{
+    uint32_t i;
+    long bound = -1, max;
+    bool track = false;
+    uint8_t ext[DFA_NSYMBOLS / 8], follow[DFA_NSYMBOLS / 8];
+    fvisit_s *visit;
+    finst_s *inst;
+    dfa_s *dfa;
+
+    for (i = 0; i < f->ninsts; i++) {
+        inst = &f->insts[i];
+        if (inst->parent == parent && inst->edge == edge && inst->tag == tag && inst->entry_used == used)
+            return i;
+    }
+    if (edge) {
+        dfa = ctx_dfa(f->ctx, mach);
+        if (!dfa) {
+            f->failed = true;
+            return -1;
+        }
+        if (edge->annotation.length > -1) {
+            max = dfa_maxlen(dfa);
+            if (max < 0 || max > edge->annotation.length)
+                bound = edge->annotation.length;
+        }
+        if (bound > -1) {
+            if (f->insts[parent].limited) {
+                f->failed = true;
+                return -1;
+            }
+            track = true;
+        }
+        else {
+            visit = malloc(sizeof(*visit));
+            if (!visit) {
+                perror("Memory Allocation Error");
+                exit(EXIT_FAILURE);
+            }
+            visit->n = 0;
+            memset(ext, 0, sizeof(ext));
+            memset(follow, 0, sizeof(follow));
+            dfa_extend(dfa, ext);
+            fnfa_follow(f, parent, edge->state, follow, visit);
+            free(visit);
+            for (i = 0; i < sizeof(ext); i++) {
+                if (ext[i] & follow[i])
+                    track = true;
+            }
+        }
+        if (track && f->ntracked == DFA_MAXTRACK)
+            f->failed = true;
+        if (f->failed)
+            return -1;
+    }
+    f->insts = safe_realloc(f->insts, (f->ninsts + 1) * sizeof(*f->insts));
+    inst = &f->insts[f->ninsts];
+    inst->root = f->tags[tag].root;
+    inst->mach = mach;
+    inst->parent = parent;
+    inst->edge = edge;
+    inst->tag = tag;
+    inst->entry_used = used;
+    inst->bound = bound;
+    inst->limited = bound > -1 || (parent > -1 && f->insts[parent].limited);
+    inst->bit = track ? f->ntracked++ : -1;
+    inst->runs = (parent > -1) ? f->insts[parent].runs : 0;
+    if (track)
+        inst->runs |= 1u << inst->bit;
+    return f->ninsts++;
+}
+
+/*
+ Number of bytes that may still be consumed by a state of instance inst
+ that has consumed used bytes since the instance was entered.
+ */
+long fnfa_remaining(fnfa_s *f, int32_t inst, uint32_t used)
+{
+    long rem = NOLIMIT, r;
+    finst_s *i;
+
+    while (inst > -1) {
+        i = &f->insts[inst];
+        if (!i->limited)
+            break;
+        if (used == FNFA_OVER)
+            return -1;
+        if (i->bound > -1) {
+            r = i->bound - (long)used;
+            if (r < rem)
+                rem = r;
+        }
+        used = (i->entry_used == FNFA_OVER) ? FNFA_OVER : used + i->entry_used;
+        inst = i->parent;
+    }
+    return rem;
+}
+
+/*
+ Byte count of a state of inst after consuming len more bytes. Past the
+ bound of a tracked instance the count saturates at FNFA_OVER.
+ */
+uint32_t fnfa_consume(fnfa_s *f, int32_t inst, uint32_t used, uint32_t len)
+{
+    if (!f->insts[inst].limited)
+        return 0;
+    if (fnfa_remaining(f, inst, used) < (long)len)
+        return FNFA_OVER;
+    return used + len;
+}
+
+/*
+ Skips the nodes that only lead on through an unannotated epsilon edge,
+ such as the ends of the branches of a union or character class. Bytes
+ leaving the branches then reach the same flattened state, instead of one
+ state per branch that subset construction would have to tell apart. The
+ final node of the instance's machine is never skipped, as it returns or
+ accepts.
+ */
+nfa_node_s *fnfa_skip(fnfa_s *f, int32_t inst, nfa_node_s *node)
+{
+    uint32_t i;
+    nfa_edge_s *edge;
+    nfa_node_s *final = f->insts[inst].mach->nfa->final;
+
+    for (i = 0; i < FVISIT_MAX && node != final && node->nedges == 1; i++) {
+        edge = node->edges[0];
+        if (edge->token->type.val != LEXTYPE_EPSILON || edge->annotation.attribute > 0 || edge->annotation.type)
+            break;
+        node = edge->state;
+    }
+    return node;
+}
+
+uint32_t fnfa_newstate(fnfa_s *f)
+{
+    if (f->nstates == f->size) {
+        f->size *= 2;
+        f->states = safe_realloc(f->states, f->size * sizeof(*f->states));
+        f->origins = safe_realloc(f->origins, f->size * sizeof(*f->origins));
+        f->work = safe_realloc(f->work, f->size * sizeof(*f->work));
+    }
+    if (f->nstates == FNFA_MAXSTATES)
+        f->failed = true;
+    memset(&f->states[f->nstates], 0, sizeof(*f->states));
+    memset(&f->origins[f->nstates], 0, sizeof(*f->origins));
+    return f->nstates++;
+}
+
+forigin_s fnfa_key(int32_t inst, nfa_node_s *node, uint16_t tag, uint32_t used, int8_t pend)
+{
+    return (forigin_s){.inst = inst, .node = node, .edge = NULL, .pos = 0, .tag = tag, .used = used, .pend = pend};
+}
+
+static inline uint32_t fkey_hash(forigin_s *key)
+{
+    uint64_t h;
+
+    h = (uintptr_t)key->node ^ ((uintptr_t)key->edge << 1);
+    h ^= (uint64_t)key->inst * 0x9E3779B97F4A7C15ull;
+    h ^= ((uint64_t)key->tag << 32) ^ ((uint64_t)key->pos << 48) ^ ((uint64_t)(uint8_t)key->pend << 56);
+    h ^= (uint64_t)key->used * 0xC2B2AE3D27D4EB4Full;
+    h *= 0xFF51AFD7ED558CCDull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static inline bool fkey_isequal(forigin_s *k1, forigin_s *k2)
+{
+    return k1->inst == k2->inst && k1->node == k2->node && k1->edge == k2->edge && k1->pos == k2->pos
+            && k1->tag == k2->tag && k1->used == k2->used && k1->pend == k2->pend;
+}
+
+/*
+ Returns the flattened state for key, creating it and adding it to the work
+ list if it does not exist yet.
+ */
+uint32_t fnfa_state(fnfa_s *f, forigin_s *key)
+{
+    uint32_t i, j, s, mask;
+    int32_t *old;
+    fstate_s *state;
+    finst_s *inst;
+
+    mask = f->ksize - 1;
+    for (i = fkey_hash(key) & mask; f->keys[i] > -1; i = (i + 1) & mask) {
+        if (fkey_isequal(&f->origins[f->keys[i]], key))
+            return f->keys[i];
+    }
+    s = fnfa_newstate(f);
+    f->origins[s] = *key;
+    state = &f->states[s];
+    inst = &f->insts[key->inst];
+    state->tag = key->tag;
+    state->root = inst->root;
+    state->pend = key->pend;
+    state->runs = inst->runs;
+    state->final = -1;
+    if (!key->edge && key->node == inst->mach->nfa->final) {
+        state->accept = inst->parent == -1;
+        state->final = inst->bit;
+    }
+    f->keys[i] = s;
+    f->work[f->nwork++] = s;
+    if (++f->nkeys * 2 > f->ksize) {
+        old = f->keys;
+        f->ksize *= 2;
+        f->keys = safe_realloc(NULL, f->ksize * sizeof(*f->keys));
+        memset(f->keys, -1, f->ksize * sizeof(*f->keys));
+        mask = f->ksize - 1;
+        for (i = 0; i < f->ksize / 2; i++) {
+            if (old[i] > -1) {
+                for (j = fkey_hash(&f->origins[old[i]]) & mask; f->keys[j] > -1; j = (j + 1) & mask);
+                f->keys[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    return s;
+}
+
+/*
+ Byte edges between the same two states are merged into one. The branches
+ of a union of single characters leave from states of their own, so they
+ stay separate edges, and their bytes separate classes until
+ dfa_mergeclasses.
+ */
+void fnfa_addedge(fnfa_s *f, uint32_t src, uint8_t kind, const uint8_t *set, uint32_t dest, int8_t enter)
+{
+    uint16_t i, j;
+    fstate_s *state = &f->states[src];
+    fedge_s *edge;
+
+    if (kind == FEDGE_BYTES) {
+        for (i = 0; i < state->nedges; i++) {
+            edge = &state->edges[i];
+            if (edge->kind == FEDGE_BYTES && edge->dest == dest) {
+                for (j = 0; j < DFA_NSYMBOLS / 8; j++)
+                    edge->set[j] |= set[j];
+                return;
+            }
+        }
+    }
+    state->edges = safe_realloc(state->edges, (state->nedges + 1) * sizeof(*state->edges));
+    edge = &state->edges[state->nedges++];
+    edge->kind = kind;
+    edge->enter = enter;
+    edge->dest = dest;
+    if (set)
+        memcpy(edge->set, set, sizeof(edge->set));
+    else
+        memset(edge->set, 0, sizeof(edge->set));
+}
+
+/*
+ Adds the byte edges leaving the state at o->pos in the chain of a
+ terminal, negated terminal or '.' edge. The low bit of pos is set once the
+ input differs from a negated terminal, which then matches any remaining
+ bytes. The EOF sentinel is never matched, as in tokmatch.
+ */
+void fnfa_chain(fnfa_s *f, uint32_t src, forigin_s *o, nfa_edge_s *edge, uint16_t tag)
+{
+    uint32_t i, len;
+    bool differs, last;
+    uint8_t set[DFA_NSYMBOLS / 8], any[DFA_NSYMBOLS / 8];
+    char *lexeme = edge->token->lexeme;
+    forigin_s key, dkey;
+
+    i = o->pos >> 1;
+    differs = o->pos & 1;
+    len = (edge->token->type.val == LEXTYPE_DOT) ? 1 : strlen(lexeme);
+    last = i == len - 1;
+    memset(any, 0xFF, sizeof(any));
+    BSET_DEL(any, EOF_BYTE);
+    if (last)
+        key = fnfa_key(o->inst, fnfa_skip(f, o->inst, edge->state), tag, fnfa_consume(f, o->inst, o->used, len), o->pend);
+    else {
+        key = *o;
+        key.node = NULL;
+        key.edge = edge;
+        key.tag = tag;
+        key.pos = (i + 1) << 1;
+    }
+    dkey = key;
+    if (!last)
+        dkey.pos |= 1;
+    if (edge->token->type.val == LEXTYPE_DOT)
+        fnfa_addedge(f, src, FEDGE_BYTES, any, fnfa_state(f, &key), -1);
+    else if (!edge->negate) {
+        memset(set, 0, sizeof(set));
+        if ((uint8_t)lexeme[i] != EOF_BYTE) {
+            BSET_ADD(set, (uint8_t)lexeme[i]);
+            fnfa_addedge(f, src, FEDGE_BYTES, set, fnfa_state(f, &key), -1);
+        }
+    }
+    else if (differs)
+        fnfa_addedge(f, src, FEDGE_BYTES, any, fnfa_state(f, &dkey), -1);
+    else {
+        memcpy(set, any, sizeof(set));
+        BSET_DEL(set, (uint8_t)lexeme[i]);
+        fnfa_addedge(f, src, FEDGE_BYTES, set, fnfa_state(f, &dkey), -1);
+        if (!last) {
+            memset(set, 0, sizeof(set));
+            BSET_ADD(set, (uint8_t)lexeme[i]);
+            fnfa_addedge(f, src, FEDGE_BYTES, set, fnfa_state(f, &key), -1);
+        }
+    }
+}
+
+/*
+ Expands a reference to another machine into an instance of that machine.
+ The instance's final node returns to the edge's destination in fnfa_return.
+ */
+void fnfa_call(fnfa_s *f, uint32_t src, forigin_s *o, nfa_edge_s *edge, uint16_t tag)
+{
+    int32_t i, inst;
+    mach_s *mach;
+    forigin_s key;
+
+    mach = fnfa_getmach(f->ctx->lex, edge->token->lexeme);
+    for (i = o->inst; i > -1; i = f->insts[i].parent) {
+        if (f->insts[i].mach == mach) {
+            f->failed = true;
+            return;
+        }
+    }
+    inst = fnfa_inst(f, o->inst, edge, mach, tag, o->used);
+    if (inst < 0)
+        return;
+    key = fnfa_key(inst, mach->nfa->start, tag, 0, o->pend);
+    fnfa_addedge(f, src, FEDGE_EPSILON, NULL, fnfa_state(f, &key), f->insts[inst].bit);
+}
+
+/*
+ Leaves an instance from its final node. Paths leaving a tracked instance
+ become pending on it; a path can only be pending on one instance at a
+ time, so leaving a second one is a conflict that stops the conversion if
+ it is ever reached. A tracked instance that went past its bound does not
+ return at all.
+ */
+void fnfa_return(fnfa_s *f, uint32_t src, forigin_s *o)
+{
+    uint32_t used = 0;
+    int8_t pend = o->pend;
+    finst_s *inst = &f->insts[o->inst], *parent = &f->insts[inst->parent];
+    forigin_s key;
+
+    if (inst->bound > -1 && o->used == FNFA_OVER)
+        return;
+    if (parent->limited)
+        used = (o->used == FNFA_OVER || inst->entry_used == FNFA_OVER) ? FNFA_OVER : inst->entry_used + o->used;
+    if (inst->bit > -1) {
+        if (pend != FNFA_NOPEND) {
+            fnfa_addedge(f, src, FEDGE_CONFLICT, NULL, src, -1);
+            return;
+        }
+        pend = inst->bit;
+    }
+    key = fnfa_key(inst->parent, inst->edge->state, inst->tag, used, pend);
+    fnfa_addedge(f, src, FEDGE_EPSILON, NULL, fnfa_state(f, &key), -1);
+}
+
+void fnfa_expand(fnfa_s *f, uint32_t s)
+{
+    uint16_t i, tag;
+    forigin_s o = f->origins[s], key;
+    finst_s inst = f->insts[o.inst];
+    nfa_edge_s *edge;
+
+    if (o.edge) {
+        fnfa_chain(f, s, &o, o.edge, o.tag);
+        return;
+    }
+    for (i = 0; i < o.node->nedges && !f->failed; i++) {
+        edge = o.node->edges[i];
+        tag = (inst.parent == -1) ? fnfa_tag(f, o.tag, edge) : o.tag;
+        switch (edge->token->type.val) {
+            case LEXTYPE_EPSILON:
+                key = fnfa_key(o.inst, edge->state, tag, o.used, o.pend);
+                fnfa_addedge(f, s, FEDGE_EPSILON, NULL, fnfa_state(f, &key), -1);
+                break;
+            case LEXTYPE_TERM:
+                if (!*edge->token->lexeme)
+                    break;
+            case LEXTYPE_DOT:
+                fnfa_chain(f, s, &o, edge, tag);
+                break;
+            case LEXTYPE_NONTERM:
+                fnfa_call(f, s, &o, edge, tag);
+                break;
+            default:
+                f->failed = true;
+                break;
+        }
+    }
+    if (o.node == inst.mach->nfa->final && inst.parent > -1)
+        fnfa_return(f, s, &o);
+}
+
+/*
+ Returns the copy of state s that is no longer pending on anything, for a
+ path whose tracked instance has stopped running.
+ */
+uint32_t fnfa_settle(fnfa_s *f, uint32_t s)
+{
+    forigin_s key = f->origins[s];
+
+    key.pend = FNFA_NOPEND;
+    s = fnfa_state(f, &key);
+    while (f->nwork && !f->failed)
+        fnfa_expand(f, f->work[--f->nwork]);
+    return s;
+}
+
+/*
+ Flattens machs, each from its own root. The settled copies of pending
+ states are created up front, so that every edge is known by the time the
+ byte classes are computed.
+ */
+fnfa_s *flatten(dctx_s *ctx, mach_s **machs, uint16_t nmachs)
+{
+    uint16_t i, tag;
+    uint32_t s;
+    fnfa_s *f;
+    ftag_s t;
+    forigin_s key;
+
+    f = fnfa_(ctx);
+    f->nroots = nmachs;
+    f->roots = safe_realloc(NULL, nmachs * sizeof(*f->roots));
+    f->starts = safe_realloc(NULL, nmachs * sizeof(*f->starts));
+    memcpy(f->roots, machs, nmachs * sizeof(*machs));
+    for (i = 0; i < nmachs && !f->failed; i++) {
+        memset(&t, 0, sizeof(t));
+        t.root = i;
+        tag = fnfa_newtag(f, &t);
+        key = fnfa_key(fnfa_inst(f, -1, NULL, machs[i], tag, 0), machs[i]->nfa->start, tag, 0, FNFA_NOPEND);
+        f->starts[i] = fnfa_state(f, &key);
+        while (f->nwork && !f->failed)
+            fnfa_expand(f, f->work[--f->nwork]);
+    }
+    for (s = 0; s < f->nstates && !f->failed; s++) {
+        if (f->states[s].pend != FNFA_NOPEND)
+            fnfa_settle(f, s);
+    }
+    return f;
+}
+
+uint32_t dset_hash(dset_s *set)
+{
+    uint32_t i, h = 2166136261u;
+
+    h ^= set->live;
+    h *= 16777619u;
+    for (i = 0; i < set->n; i++) {
+        h ^= set->states[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void dset_add(dset_s *set, uint32_t s)
+{
+    if (set->n == set->size) {
+        set->size = set->size ? 2 * set->size : DSET_INITSIZE;
+        set->states = safe_realloc(set->states, set->size * sizeof(*set->states));
+    }
+    set->states[set->n++] = s;
+}
+
+/*
+ Extends a set of flattened states with every state reachable through
+ epsilon edges, and sorts it so equal sets compare equal. Entering a
+ tracked instance that is still running from an earlier entry would mix
+ the two runs, so it fails the conversion, as does a conflict edge.
+ */
+bool dset_closure(dbuild_s *b, dset_s *set)
+{
+    bool ok = true;
+    uint32_t i, s, n = 0, top = 0;
+    fstate_s *state;
+    fedge_s *edge;
+
+    if (b->msize < b->nfa->nstates) {
+        b->mark = safe_realloc(b->mark, b->nfa->nstates * sizeof(*b->mark));
+        b->stack = safe_realloc(b->stack, b->nfa->nstates * sizeof(*b->stack));
+        memset(&b->mark[b->msize], 0, (b->nfa->nstates - b->msize) * sizeof(*b->mark));
+        b->msize = b->nfa->nstates;
+    }
+    b->gen++;
+    for (i = 0; i < set->n; i++) {
+        s = set->states[i];
+        if (b->mark[s] != b->gen) {
+            b->mark[s] = b->gen;
+            b->stack[top++] = s;
+            set->states[n++] = s;
+        }
+    }
+    set->n = n;
+    while (top) {
+        state = &b->nfa->states[b->stack[--top]];
+        for (i = 0; i < state->nedges; i++) {
+            edge = &state->edges[i];
+            if (edge->kind == FEDGE_BYTES)
+                continue;
+            if (edge->kind == FEDGE_CONFLICT || (edge->enter > -1 && (set->live & (1u << edge->enter)))) {
+                ok = false;
+                continue;
+            }
+            s = edge->dest;
+            if (b->mark[s] != b->gen) {
+                b->mark[s] = b->gen;
+                b->stack[top++] = s;
+                dset_add(set, s);
+            }
+        }
+    }
+    qsort(set->states, set->n, sizeof(*set->states), cmp_u32);
+    return ok;
+}
+
+/*
+ Returns the DFA state for a closed set, or adds it as a new state. The set
+ is owned by the builder afterwards if it is new, and freed otherwise.
+ */
+int32_t dset_lookup(dbuild_s *b, dset_s *set)
+{
+    uint32_t i, j, mask;
+    int32_t *old;
+    dset_s *d;
+
+    mask = b->hsize - 1;
+    for (i = dset_hash(set) & mask; b->hash[i] > -1; i = (i + 1) & mask) {
+        d = &b->sets[b->hash[i]];
+        if (d->n == set->n && d->live == set->live && !memcmp(d->states, set->states, set->n * sizeof(*set->states))) {
+            free(set->states);
+            return b->hash[i];
+        }
+    }
+    if (b->nsets == b->size) {
+        b->size *= 2;
+        b->sets = safe_realloc(b->sets, b->size * sizeof(*b->sets));
+    }
+    b->hash[i] = b->nsets;
+    b->sets[b->nsets] = *set;
+    if ((b->nsets + 1) * 2 > b->hsize) {
+        old = b->hash;
+        b->hsize *= 2;
+        b->hash = safe_realloc(NULL, b->hsize * sizeof(*b->hash));
+        memset(b->hash, -1, b->hsize * sizeof(*b->hash));
+        mask = b->hsize - 1;
+        for (i = 0; i < b->hsize / 2; i++) {
+            if (old[i] > -1) {
+                for (j = dset_hash(&b->sets[old[i]]) & mask; b->hash[j] > -1; j = (j + 1) & mask);
+                b->hash[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    return b->nsets++;
+}
+
+/*
+ Computes the transition from DFA state d on byte c. Paths pending on a
+ tracked instance that is no longer running are settled first. If a
+ tracked instance then reaches its final node, the paths that left it on
+ an earlier byte are dropped and the closure is taken again.
+ */
+int32_t dset_step(dbuild_s *b, uint32_t d, int c)
+{
+    bool ok;
+    uint32_t i, j, s, alive = 0, kill = 0;
+    fnfa_s *f = b->nfa;
+    fstate_s *state;
+    dset_s move, set;
+
+    move.n = 0;
+    move.size = 0;
+    move.live = 0;
+    move.states = NULL;
+    for (i = 0; i < b->sets[d].n; i++) {
+        state = &f->states[b->sets[d].states[i]];
+        for (j = 0; j < state->nedges; j++) {
+            if (state->edges[j].kind == FEDGE_BYTES && BSET_TEST(state->edges[j].set, c))
+                dset_add(&move, state->edges[j].dest);
+        }
+    }
+    if (!move.n)
+        return DFA_DEAD;
+    for (i = 0; i < move.n; i++)
+        alive |= f->states[move.states[i]].runs;
+    for (i = 0; i < move.n; i++) {
+        s = move.states[i];
+        if (f->states[s].pend != FNFA_NOPEND && !(alive & (1u << f->states[s].pend)))
+            move.states[i] = fnfa_settle(f, s);
+    }
+    set.live = alive;
+    for (;;) {
+        set.n = move.n;
+        set.size = move.n ? move.n : 1;
+        set.states = safe_realloc(NULL, set.size * sizeof(*set.states));
+        memcpy(set.states, move.states, move.n * sizeof(*move.states));
+        ok = dset_closure(b, &set);
+        for (i = 0; i < set.n; i++) {
+            if (f->states[set.states[i]].final > -1)
+                kill |= 1u << f->states[set.states[i]].final;
+        }
+        for (i = j = 0; i < move.n; i++) {
+            s = move.states[i];
+            if (f->states[s].pend == FNFA_NOPEND || !(kill & (1u << f->states[s].pend)))
+                move.states[j++] = s;
+        }
+        if (j == move.n)
+            break;
+        move.n = j;
+        free(set.states);
+    }
+    free(move.states);
+    if (!ok || f->failed)
+        b->failed = true;
+    if (!set.n) {
+        free(set.states);
+        return DFA_DEAD;
+    }
+    return dset_lookup(b, &set);
+}
+
+/*
+ When several paths of a root accept at once, the tag created last wins.
+ Tags are created in edge order, so this favors later alternatives, as the
+ '>=' comparison in nfa_match does for ties. Accepts on paths pending on a
+ tracked instance are recorded separately, one per instance.
+ */
+void dset_accept(fnfa_s *f, dset_s *set, dfa_s *dfa, uint32_t d, int32_t *best)
+{
+    uint16_t r;
+    uint32_t i, kill = 0;
+    int32_t tent[DFA_MAXTRACK];
+    fstate_s *state;
+    dfa_info_s *info = &dfa->info[d];
+
+    for (r = 0; r < f->nroots; r++)
+        best[r] = -1;
+    for (i = 0; i < DFA_MAXTRACK; i++)
+        tent[i] = -1;
+    for (i = 0; i < set->n; i++) {
+        state = &f->states[set->states[i]];
+        if (state->final > -1)
+            kill |= 1u << state->final;
+        if (!state->accept)
+            continue;
+        if (state->pend == FNFA_NOPEND) {
+            if ((int32_t)state->tag > best[state->root])
+                best[state->root] = state->tag;
+        }
+        else if ((int32_t)state->tag > tent[state->pend])
+            tent[state->pend] = state->tag;
+    }
+    info->live = set->live;
+    info->kill = kill;
+    info->naccept = 0;
+    info->accept = NULL;
+    for (r = 0; r < f->nroots; r++) {
+        if (best[r] > -1)
+            dset_addaccept(f, info, best[r], FNFA_NOPEND);
+    }
+    for (i = 0; i < DFA_MAXTRACK; i++) {
+        if (tent[i] > -1)
+            dset_addaccept(f, info, tent[i], i);
+    }
+    dfa->flags[d] = info->live || info->kill || info->naccept;
+}
+
+void dset_addaccept(fnfa_s *f, dfa_info_s *info, uint16_t tag, int8_t pend)
+{
+    info->accept = safe_realloc(info->accept, (info->naccept + 1) * sizeof(*info->accept));
+    info->accept[info->naccept++] = (dfa_accept_s){
+        .mach = f->tags[tag].root,
+        .pend = pend,
+        .attribute = f->tags[tag].attribute,
+        .stype = f->tags[tag].stype
+    };
+}
+
+/*
+ Splits the bytes into classes that no edge of the flattened NFA tells
+ apart, numbered in order of their smallest byte. Subset construction then
+ only has to step once per class, and dfa_mergeclasses coarsens them again
+ once the DFA is minimized.
+ */
+uint16_t fnfa_classes(fnfa_s *f, uint8_t *classes)
+{
+    int c;
+    uint16_t n = 1, k, map[2 * DFA_NSYMBOLS];
+    uint32_t i, j;
+    uint8_t *set, *last = NULL;
+
+    memset(classes, 0, DFA_NSYMBOLS);
+    for (i = 0; i < f->nstates; i++) {
+        for (j = 0; j < f->states[i].nedges; j++) {
+            set = f->states[i].edges[j].set;
+            if (last && !memcmp(set, last, DFA_NSYMBOLS / 8))
+                continue;
+            last = set;
+            for (k = 0; k < 2 * n; k++)
+                map[k] = UINT16_MAX;
+            for (c = 0, n = 0; c < DFA_NSYMBOLS; c++) {
+                k = 2 * classes[c] + !!BSET_TEST(set, c);
+                if (map[k] == UINT16_MAX)
+                    map[k] = n++;
+                classes[c] = map[k];
+            }
+        }
+    }
+    return n;
+}
+
+dfa_s *determinize(fnfa_s *f)
+{
+    int c;
+    uint32_t d, i;
+    int32_t *best;
+    uint8_t rep[DFA_NSYMBOLS];
+    dbuild_s b;
+    dset_s set;
+    dfa_s *dfa;
+
+    memset(&b, 0, sizeof(b));
+    b.nfa = f;
+    b.size = DSET_INITSIZE;
+    b.sets = safe_realloc(NULL, b.size * sizeof(*b.sets));
+    b.hsize = 2 * DSET_INITSIZE;
+    b.hash = safe_realloc(NULL, b.hsize * sizeof(*b.hash));
+    memset(b.hash, -1, b.hsize * sizeof(*b.hash));
+    dfa = calloc(1, sizeof(*dfa));
+    if (!dfa) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    dfa->nclasses = fnfa_classes(f, dfa->classes);
+    for (c = DFA_NSYMBOLS - 1; c >= 0; c--)
+        rep[dfa->classes[c]] = c;
+
+    set.n = f->nroots;
+    set.size = f->nroots;
+    set.live = 0;
+    set.states = safe_realloc(NULL, f->nroots * sizeof(*set.states));
+    memcpy(set.states, f->starts, f->nroots * sizeof(*set.states));
+    b.failed = !dset_closure(&b, &set);
+    dset_lookup(&b, &set);
+    for (d = 0; d < b.nsets && !b.failed; d++) {
+        if (b.nsets > DFA_MAXSTATES) {
+            b.failed = true;
+            break;
+        }
+        dfa->trans = safe_realloc(dfa->trans, b.nsets * dfa->nclasses * sizeof(*dfa->trans));
+        for (c = 0; c < dfa->nclasses && !b.failed; c++)
+            dfa->trans[d * dfa->nclasses + c] = dset_step(&b, d, rep[c]);
+    }
+    if (b.failed) {
+        free(dfa->trans);
+        free(dfa);
+        dfa = NULL;
+    }
+    else {
+        dfa->nstates = b.nsets;
+        dfa->nmachs = f->nroots;
+        dfa->machs = safe_realloc(NULL, f->nroots * sizeof(*dfa->machs));
+        memcpy(dfa->machs, f->roots, f->nroots * sizeof(*dfa->machs));
+        for (i = 0; i < f->ninsts; i++) {
+            if (f->insts[i].bit > -1)
+                dfa->bitmach[f->insts[i].bit] = f->insts[i].root;
+        }
+        dfa->trans = safe_realloc(dfa->trans, b.nsets * dfa->nclasses * sizeof(*dfa->trans));
+        dfa->flags = safe_realloc(NULL, b.nsets * sizeof(*dfa->flags));
+        dfa->info = safe_realloc(NULL, b.nsets * sizeof(*dfa->info));
+        best = safe_realloc(NULL, f->nroots * sizeof(*best));
+        for (d = 0; d < b.nsets; d++)
+            dset_accept(f, &b.sets[d], dfa, d, best);
+        free(best);
+        dfa->nraw = b.nsets;
+    }
+    for (d = 0; d < b.nsets; d++)
+        free(b.sets[d].states);
+    free(b.sets);
+    free(b.hash);
+    free(b.mark);
+    free(b.stack);
+    if (dfa) {
+        dfa_minimize(dfa);
+        dfa_mergeclasses(dfa);
+        dfa_pack(dfa);
+        dfa_accel(dfa);
+    }
+    return dfa;
+}
+
+bool dfa_sameinfo(dfa_info_s *a, dfa_info_s *b)
+{
+    uint16_t i;
+
+    if (a->live != b->live || a->kill != b->kill || a->naccept != b->naccept)
+        return false;
+    for (i = 0; i < a->naccept; i++) {
+        if (a->accept[i].mach != b->accept[i].mach || a->accept[i].pend != b->accept[i].pend
+                || a->accept[i].attribute != b->accept[i].attribute || a->accept[i].stype != b->accept[i].stype)
+            return false;
+    }
+    return true;
+}
+
+#define DFA_TARGET(dfa, s, c) \
+    (((s) == (dfa)->nstates || (dfa)->trans[(s) * (dfa)->nclasses + (c)] == DFA_DEAD) \
+        ? (dfa)->nstates : (uint32_t)(dfa)->trans[(s) * (dfa)->nclasses + (c)])
+
+/*
+ Hopcroft's algorithm. States start out grouped by what they report to
+ dfa_scan, and blocks are split until all states of a block agree on the
+ block each byte leads to. The dead state takes part as state nstates, so
+ states that can only die are merged into it.
+ */
+void dfa_minimize(dfa_s *dfa)
+{
+    int c;
+    uint32_t n = dfa->nstates + 1, i, j, k, s, b, nb, a, split, nblocks, ntouched, ncopy, nwork, nnew, dead;
+    uint32_t *pstart, *pred, *elems, *loc, *blk, *bstart, *bend, *bmark, *work, *touched, *copy, *newid;
+    bool *inwork;
+    int32_t *trans;
+    bool *flags;
+    dfa_info_s *info, none = {0};
+
+#define DFA_INFO(s) ((s) == dfa->nstates ? &none : &dfa->info[s])
+
+    pstart = calloc(dfa->nclasses * n + 1, sizeof(*pstart));
+    if (!pstart) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    pred = safe_realloc(NULL, dfa->nclasses * n * sizeof(*pred));
+    for (s = 0; s < n; s++) {
+        for (c = 0; c < dfa->nclasses; c++)
+            pstart[c * n + DFA_TARGET(dfa, s, c) + 1]++;
+    }
+    for (i = 0; i < dfa->nclasses * n; i++)
+        pstart[i + 1] += pstart[i];
+    copy = safe_realloc(NULL, dfa->nclasses * n * sizeof(*copy));
+    memcpy(copy, pstart, dfa->nclasses * n * sizeof(*copy));
+    for (s = 0; s < n; s++) {
+        for (c = 0; c < dfa->nclasses; c++)
+            pred[copy[c * n + DFA_TARGET(dfa, s, c)]++] = s;
+    }
+
+    elems = safe_realloc(NULL, n * sizeof(*elems));
+    loc = safe_realloc(NULL, n * sizeof(*loc));
+    blk = safe_realloc(NULL, n * sizeof(*blk));
+    bstart = safe_realloc(NULL, n * sizeof(*bstart));
+    bend = safe_realloc(NULL, n * sizeof(*bend));
+    bmark = calloc(n, sizeof(*bmark));
+    work = safe_realloc(NULL, n * sizeof(*work));
+    inwork = calloc(n, sizeof(*inwork));
+    touched = safe_realloc(NULL, n * sizeof(*touched));
+    if (!bmark || !inwork) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+
+    nblocks = 0;
+    for (s = 0; s < n; s++) {
+        for (b = 0; b < nblocks && !dfa_sameinfo(DFA_INFO(s), DFA_INFO(elems[b])); b++);
+        if (b == nblocks) {
+            elems[nblocks++] = s;
+            bend[b] = 0;
+        }
+        blk[s] = b;
+        bend[b]++;
+    }
+    for (b = 0, i = 0; b < nblocks; b++) {
+        bstart[b] = i;
+        i += bend[b];
+        bend[b] = bstart[b];
+    }
+    for (s = 0; s < n; s++) {
+        loc[s] = bend[blk[s]]++;
+        elems[loc[s]] = s;
+    }
+    for (b = 1, k = 0; b < nblocks; b++) {
+        if (bend[b] - bstart[b] > bend[k] - bstart[k])
+            k = b;
+    }
+    for (b = nwork = 0; b < nblocks; b++) {
+        if (b != k) {
+            work[nwork++] = b;
+            inwork[b] = true;
+        }
+    }
+
+    while (nwork) {
+        a = work[--nwork];
+        inwork[a] = false;
+        ncopy = bend[a] - bstart[a];
+        memcpy(copy, &elems[bstart[a]], ncopy * sizeof(*copy));
+        for (c = 0; c < dfa->nclasses; c++) {
+            ntouched = 0;
+            for (i = 0; i < ncopy; i++) {
+                for (j = pstart[c * n + copy[i]]; j < pstart[c * n + copy[i] + 1]; j++) {
+                    s = pred[j];
+                    b = blk[s];
+                    split = bstart[b] + bmark[b];
+                    if (loc[s] < split)
+                        continue;
+                    elems[loc[s]] = elems[split];
+                    loc[elems[split]] = loc[s];
+                    elems[split] = s;
+                    loc[s] = split;
+                    if (!bmark[b]++)
+                        touched[ntouched++] = b;
+                }
+            }
+            for (i = 0; i < ntouched; i++) {
+                b = touched[i];
+                split = bstart[b] + bmark[b];
+                bmark[b] = 0;
+                if (split == bend[b])
+                    continue;
+                nb = nblocks++;
+                bstart[nb] = bstart[b];
+                bend[nb] = split;
+                bstart[b] = split;
+                for (j = bstart[nb]; j < bend[nb]; j++)
+                    blk[elems[j]] = nb;
+                if (inwork[b] || bend[nb] - bstart[nb] <= bend[b] - bstart[b]) {
+                    work[nwork++] = nb;
+                    inwork[nb] = true;
+                }
+                else {
+                    work[nwork++] = b;
+                    inwork[b] = true;
+                }
+            }
+        }
+    }
+
+    /* number the blocks breadth first from the start state */
+    newid = safe_realloc(NULL, nblocks * sizeof(*newid));
+    for (b = 0; b < nblocks; b++)
+        newid[b] = UINT32_MAX;
+    dead = blk[dfa->nstates];
+    newid[blk[DFA_START]] = 0;
+    work[0] = blk[DFA_START];
+    for (i = 0, nnew = 1; i < nnew; i++) {
+        b = work[i];
+        s = (b == blk[DFA_START]) ? DFA_START : elems[bstart[b]];
+        for (c = 0; c < dfa->nclasses; c++) {
+            k = blk[DFA_TARGET(dfa, s, c)];
+            if (k != dead && newid[k] == UINT32_MAX) {
+                newid[k] = nnew;
+                work[nnew++] = k;
+            }
+        }
+    }
+    trans = safe_realloc(NULL, nnew * dfa->nclasses * sizeof(*trans));
+    flags = safe_realloc(NULL, nnew * sizeof(*flags));
+    info = safe_realloc(NULL, nnew * sizeof(*info));
+    for (i = 0; i < nnew; i++) {
+        b = work[i];
+        s = (b == blk[DFA_START]) ? DFA_START : elems[bstart[b]];
+        for (c = 0; c < dfa->nclasses; c++) {
+            k = blk[DFA_TARGET(dfa, s, c)];
+            trans[i * dfa->nclasses + c] = (k == dead) ? DFA_DEAD : (int32_t)newid[k];
+        }
+        info[i] = *DFA_INFO(s);
+        info[i].accept = NULL;
+        if (info[i].naccept) {
+            info[i].accept = safe_realloc(NULL, info[i].naccept * sizeof(*info[i].accept));
+            memcpy(info[i].accept, DFA_INFO(s)->accept, info[i].naccept * sizeof(*info[i].accept));
+        }
+        flags[i] = info[i].live || info[i].kill || info[i].naccept;
+    }
+#undef DFA_INFO
+
+    for (s = 0; s < dfa->nstates; s++)
+        free(dfa->info[s].accept);
+    free(dfa->trans);
+    free(dfa->flags);
+    free(dfa->info);
+    dfa->nstates = nnew;
+    dfa->trans = trans;
+    dfa->flags = flags;
+    dfa->info = info;
+
+    free(pstart);
+    free(pred);
+    free(copy);
+    free(elems);
+    free(loc);
+    free(blk);
+    free(bstart);
+    free(bend);
+    free(bmark);
+    free(work);
+    free(inwork);
+    free(touched);
+    free(newid);
+}
+
+/*
+ Merges the classes that lead every state to the same place. The classes
+ of the flattened NFA can only be as coarse as its edges, and bytes on
+ edges from different states are kept apart even when the DFA treats them
+ alike. Merged classes keep the number order of their smallest byte.
+ */
+void dfa_mergeclasses(dfa_s *dfa)
+{
+    int b;
+    uint16_t c, k, n = 0, rep[DFA_NSYMBOLS], map[DFA_NSYMBOLS];
+    uint32_t s;
+    int32_t *trans;
+
+    for (c = 0; c < dfa->nclasses; c++) {
+        for (k = 0; k < n; k++) {
+            for (s = 0; s < dfa->nstates && dfa->trans[s * dfa->nclasses + c] == dfa->trans[s * dfa->nclasses + rep[k]]; s++);
+            if (s == dfa->nstates)
+                break;
+        }
+        if (k == n)
+            rep[n++] = c;
+        map[c] = k;
+    }
+    if (n == dfa->nclasses)
+        return;
+    trans = safe_realloc(NULL, dfa->nstates * n * sizeof(*trans));
+    for (s = 0; s < dfa->nstates; s++) {
+        for (k = 0; k < n; k++)
+            trans[s * n + k] = dfa->trans[s * dfa->nclasses + rep[k]];
+    }
+    for (b = 0; b < DFA_NSYMBOLS; b++)
+        dfa->classes[b] = map[dfa->classes[b]];
+    free(dfa->trans);
+    dfa->trans = trans;
+    dfa->nclasses = n;
+}
+
+/*
+ Builds the comb compressed tables from trans. Each row keeps its most
+ common target as the default and only the other entries are placed, first
+ fit, with the fullest rows placed first. The tables are padded so that
+ base[state] + c is always in range.
+ */
+void dfa_pack(dfa_s *dfa)
+{
+    int c;
+    uint32_t i, s, b, size, top = 0, *count, *order, nbucket[DFA_NSYMBOLS + 2] = {0};
+    uint16_t *nentries;
+    int32_t t;
+
+    count = calloc(dfa->nstates + 1, sizeof(*count));
+    if (!count) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    order = safe_realloc(NULL, dfa->nstates * sizeof(*order));
+    nentries = safe_realloc(NULL, dfa->nstates * sizeof(*nentries));
+    dfa->base = safe_realloc(NULL, dfa->nstates * sizeof(*dfa->base));
+    dfa->deflt = safe_realloc(NULL, dfa->nstates * sizeof(*dfa->deflt));
+    for (s = 0; s < dfa->nstates; s++) {
+        t = DFA_DEAD;
+        for (c = 0; c < dfa->nclasses; c++) {
+            i = dfa->trans[s * dfa->nclasses + c] + 1;
+            if (++count[i] > count[t + 1])
+                t = i - 1;
+        }
+        dfa->deflt[s] = t;
+        nentries[s] = dfa->nclasses - count[t + 1];
+        for (c = 0; c < dfa->nclasses; c++)
+            count[dfa->trans[s * dfa->nclasses + c] + 1] = 0;
+        nbucket[dfa->nclasses - nentries[s] + 1]++;
+    }
+    for (i = 0; i <= dfa->nclasses; i++)
+        nbucket[i + 1] += nbucket[i];
+    for (s = 0; s < dfa->nstates; s++)
+        order[nbucket[dfa->nclasses - nentries[s]]++] = s;
+
+    size = 2 * dfa->nclasses;
+    dfa->next = safe_realloc(NULL, size * sizeof(*dfa->next));
+    dfa->check = safe_realloc(NULL, size * sizeof(*dfa->check));
+    memset(dfa->next, -1, size * sizeof(*dfa->next));
+    memset(dfa->check, -1, size * sizeof(*dfa->check));
+    for (i = 0; i < dfa->nstates; i++) {
+        s = order[i];
+        dfa->base[s] = 0;
+        if (!nentries[s])
+            continue;
+        for (b = 0;; b++) {
+            if (b + dfa->nclasses > size) {
+                dfa->next = safe_realloc(dfa->next, 2 * size * sizeof(*dfa->next));
+                dfa->check = safe_realloc(dfa->check, 2 * size * sizeof(*dfa->check));
+                memset(&dfa->next[size], -1, size * sizeof(*dfa->next));
+                memset(&dfa->check[size], -1, size * sizeof(*dfa->check));
+                size *= 2;
+            }
+            for (c = 0; c < dfa->nclasses; c++) {
+                if (dfa->trans[s * dfa->nclasses + c] != dfa->deflt[s] && dfa->check[b + c] > -1)
+                    break;
+            }
+            if (c == dfa->nclasses)
+                break;
+        }
+        dfa->base[s] = b;
+        for (c = 0; c < dfa->nclasses; c++) {
+            if (dfa->trans[s * dfa->nclasses + c] != dfa->deflt[s]) {
+                dfa->next[b + c] = dfa->trans[s * dfa->nclasses + c];
+                dfa->check[b + c] = s;
+            }
+        }
+        if (b > top)
+            top = b;
+    }
+    dfa->ncomb = top + dfa->nclasses;
+    dfa->next = safe_realloc(dfa->next, dfa->ncomb * sizeof(*dfa->next));
+    dfa->check = safe_realloc(dfa->check, dfa->ncomb * sizeof(*dfa->check));
+    free(count);
+    free(order);
+    free(nentries);
+}
+
+/*
+ Flattens all machines of the lexer, as for the combined DFA, and keeps
+ the result for bnfa_step. Returns NULL if the machines could not be
+ flattened.
+ */
+bnfa_s *bnfa_build(lex_s *lex)
+{
+    uint16_t n;
+    uint32_t i, j, *stack, *mark;
+    mach_s *mach, **machs;
+    fnfa_s *f;
+    fstate_s *state;
+    bnfa_s *nfa;
+    dctx_s ctx;
+
+    ctx.lex = lex;
+    ctx.building = NULL;
+    ctx.failed = NULL;
+    machs = safe_realloc(NULL, (lex->nmachs ? lex->nmachs : 1) * sizeof(*machs));
+    for (n = 0, mach = lex->machs; mach; mach = mach->next)
+        machs[n++] = mach;
+    f = flatten(&ctx, machs, n);
+    free(machs);
+    free_llist(ctx.failed);
+    if (f->failed) {
+        free_fnfa(f);
+        return NULL;
+    }
+
+    nfa = calloc(1, sizeof(*nfa));
+    if (!nfa) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    nfa->nstates = f->nstates;
+    nfa->nwords = (f->nstates + 63) / 64;
+    nfa->nclasses = fnfa_classes(f, nfa->classes);
+    nfa->nmachs = n;
+    nfa->ntracked = f->ntracked;
+    for (i = 0; i < f->ninsts; i++) {
+        if (f->insts[i].bit > -1)
+            nfa->bitmach[f->insts[i].bit] = f->insts[i].root;
+    }
+    nfa->ntags = f->ntags;
+    nfa->tags = safe_realloc(NULL, (f->ntags ? f->ntags : 1) * sizeof(*nfa->tags));
+    for (i = 0; i < f->ntags; i++) {
+        nfa->tags[i].root = f->tags[i].root;
+        nfa->tags[i].attribute = f->tags[i].attribute;
+        nfa->tags[i].stype = f->tags[i].stype;
+    }
+    nfa->nstarts = f->nroots;
+    nfa->starts = safe_realloc(NULL, f->nroots * sizeof(*nfa->starts));
+    memcpy(nfa->starts, f->starts, f->nroots * sizeof(*nfa->starts));
+    nfa->pending = calloc(5 * nfa->nwords, sizeof(*nfa->pending));
+    if (!nfa->pending) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    nfa->finals = &nfa->pending[nfa->nwords];
+    nfa->accepts = &nfa->pending[2 * nfa->nwords];
+    nfa->set = &nfa->pending[3 * nfa->nwords];
+    nfa->move = &nfa->pending[4 * nfa->nwords];
+    nfa->best = safe_realloc(NULL, n * sizeof(*nfa->best));
+    nfa->info.accept = safe_realloc(NULL, (n + DFA_MAXTRACK) * sizeof(*nfa->info.accept));
+
+    nfa->states = safe_realloc(NULL, f->nstates * sizeof(*nfa->states));
+    stack = safe_realloc(NULL, f->nstates * sizeof(*stack));
+    mark = calloc(f->nstates, sizeof(*mark));
+    if (!mark) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < f->nstates; i++) {
+        state = &f->states[i];
+        nfa->states[i].accept = state->accept;
+        nfa->states[i].pend = state->pend;
+        nfa->states[i].final = state->final;
+        nfa->states[i].tag = state->tag;
+        nfa->states[i].runs = state->runs;
+        nfa->states[i].settled = (state->pend != FNFA_NOPEND) ? fnfa_settle(f, i) : i;
+        nfa->states[i].nedges = 0;
+        nfa->states[i].edges = NULL;
+        for (j = 0; j < state->nedges; j++) {
+            if (state->edges[j].kind != FEDGE_BYTES)
+                continue;
+            nfa->states[i].edges = safe_realloc(nfa->states[i].edges, (nfa->states[i].nedges + 1) * sizeof(*nfa->states[i].edges));
+            nfa->states[i].edges[nfa->states[i].nedges].dest = state->edges[j].dest;
+            memcpy(nfa->states[i].edges[nfa->states[i].nedges++].set, state->edges[j].set, DFA_NSYMBOLS / 8);
+        }
+        bnfa_closure(nfa, f, i, stack, mark);
+        if (state->pend != FNFA_NOPEND)
+            nfa->pending[i / 64] |= 1ull << (i % 64);
+        if (state->final > -1)
+            nfa->finals[i / 64] |= 1ull << (i % 64);
+        if (state->accept)
+            nfa->accepts[i / 64] |= 1ull << (i % 64);
+    }
+    free(stack);
+    free(mark);
+    free_fnfa(f);
+    return nfa;
+}
+
+/*
+ Precomputes the epsilon closure of s, noting whether it enters tracked
+ references or reaches a conflict, which dset_closure would check for.
+ */
+void bnfa_closure(bnfa_s *nfa, fnfa_s *f, uint32_t from, uint32_t *stack, uint32_t *mark)
+{
+    uint32_t i, s, top = 0;
+    bnfa_state_s *bstate = &nfa->states[from];
+    fstate_s *state;
+    fedge_s *edge;
+
+    bstate->conflict = false;
+    bstate->enters = 0;
+    bstate->nclosure = 0;
+    bstate->closure = NULL;
+    mark[from] = from + 1;
+    stack[top++] = from;
+    while (top) {
+        s = stack[--top];
+        bstate->closure = safe_realloc(bstate->closure, (bstate->nclosure + 1) * sizeof(*bstate->closure));
+        bstate->closure[bstate->nclosure++] = s;
+        state = &f->states[s];
+        for (i = 0; i < state->nedges; i++) {
+            edge = &state->edges[i];
+            if (edge->kind == FEDGE_BYTES)
+                continue;
+            if (edge->kind == FEDGE_CONFLICT) {
+                bstate->conflict = true;
+                continue;
+            }
+            if (edge->enter > -1)
+                bstate->enters |= 1u << edge->enter;
+            if (mark[edge->dest] != from + 1) {
+                mark[edge->dest] = from + 1;
+                stack[top++] = edge->dest;
+            }
+        }
+    }
+}
+
+void free_bnfa(bnfa_s *nfa)
+{
+    uint32_t i;
+
+    if (!nfa)
+        return;
+    for (i = 0; i < nfa->nstates; i++) {
+        free(nfa->states[i].closure);
+        free(nfa->states[i].edges);
+    }
+    free(nfa->states);
+    free(nfa->tags);
+    free(nfa->starts);
+    free(nfa->pending);
+    free(nfa->best);
+    free(nfa->info.accept);
+    free(nfa);
+}
+
+#define BNFA_EACH(w, x, s, words, n) \
+    for (w = 0; w < (n); w++) \
+        for (x = (words)[w]; x && ((s = w * 64 + __builtin_ctzll(x)), 1); x &= x - 1)
+
+/*
+ Starts a scan, with nfa->set holding the closure of all roots.
+ */
+int bnfa_start(bnfa_s *nfa)
+{
+    uint32_t i;
+
+    memset(nfa->move, 0, nfa->nwords * sizeof(*nfa->move));
+    for (i = 0; i < nfa->nstarts; i++)
+        nfa->move[nfa->starts[i] / 64] |= 1ull << (nfa->starts[i] % 64);
+    return bnfa_close(nfa);
+}
+
+/*
+ Moves every state in nfa->set on byte c. Returns BNFA_DEAD when no state
+ is left, and BNFA_FAIL when the step runs into what keeps a DFA from
+ being built, in which case the scan has to be done by nfa_match.
+ */
+int bnfa_step(bnfa_s *nfa, uint8_t c)
+{
+    uint16_t i;
+    uint32_t w, s;
+    uint64_t x;
+    bnfa_state_s *state;
+
+    memset(nfa->move, 0, nfa->nwords * sizeof(*nfa->move));
+    BNFA_EACH(w, x, s, nfa->set, nfa->nwords) {
+        state = &nfa->states[s];
+        for (i = 0; i < state->nedges; i++) {
+            if (BSET_TEST(state->edges[i].set, c))
+                nfa->move[state->edges[i].dest / 64] |= 1ull << (state->edges[i].dest % 64);
+        }
+    }
+    return bnfa_close(nfa);
+}
+
+/*
+ Turns nfa->move into the next nfa->set the way dset_step does: settles
+ paths pending on a reference that stopped running, takes the closure and
+ drops the paths a reference matching again kills. Then fills nfa->info
+ as dset_accept would.
+ */
+int bnfa_close(bnfa_s *nfa)
+{
+    bool changed, conflict, empty;
+    uint16_t r;
+    uint32_t w, s, j, alive = 0, kill = 0, enters, final;
+    int32_t tent[DFA_MAXTRACK];
+    uint64_t x;
+    bnfa_state_s *state;
+
+    BNFA_EACH(w, x, s, nfa->move, nfa->nwords)
+        alive |= nfa->states[s].runs;
+    if (nfa->ntracked) {
+        for (w = 0; w < nfa->nwords; w++) {
+            for (x = nfa->move[w] & nfa->pending[w]; x; x &= x - 1) {
+                s = w * 64 + __builtin_ctzll(x);
+                if (!(alive & (1u << nfa->states[s].pend))) {
+                    nfa->move[w] &= ~(1ull << (s % 64));
+                    nfa->move[nfa->states[s].settled / 64] |= 1ull << (nfa->states[s].settled % 64);
+                }
+            }
+        }
+    }
+    do {
+        memset(nfa->set, 0, nfa->nwords * sizeof(*nfa->set));
+        conflict = false;
+        enters = 0;
+        BNFA_EACH(w, x, s, nfa->move, nfa->nwords) {
+            state = &nfa->states[s];
+            conflict |= state->conflict;
+            enters |= state->enters;
+            for (j = 0; j < state->nclosure; j++)
+                nfa->set[state->closure[j] / 64] |= 1ull << (state->closure[j] % 64);
+        }
+        final = 0;
+        changed = false;
+        if (nfa->ntracked) {
+            for (w = 0; w < nfa->nwords; w++) {
+                for (x = nfa->set[w] & nfa->finals[w]; x; x &= x - 1)
+                    final |= 1u << nfa->states[w * 64 + __builtin_ctzll(x)].final;
+            }
+            kill |= final;
+            for (w = 0; w < nfa->nwords; w++) {
+                for (x = nfa->move[w] & nfa->pending[w]; x; x &= x - 1) {
+                    s = w * 64 + __builtin_ctzll(x);
+                    if (kill & (1u << nfa->states[s].pend)) {
+                        nfa->move[w] &= ~(1ull << (s % 64));
+                        changed = true;
+                    }
+                }
+            }
+        }
+    } while (changed);
+    if (conflict || (enters & alive))
+        return BNFA_FAIL;
+    for (w = 0, empty = true; w < nfa->nwords && empty; w++)
+        empty = !nfa->set[w];
+    if (empty)
+        return BNFA_DEAD;
+
+    for (r = 0; r < nfa->nmachs; r++)
+        nfa->best[r] = -1;
+    for (j = 0; j < DFA_MAXTRACK; j++)
+        tent[j] = -1;
+    for (w = 0; w < nfa->nwords; w++) {
+        for (x = nfa->set[w] & nfa->accepts[w]; x; x &= x - 1) {
+            state = &nfa->states[w * 64 + __builtin_ctzll(x)];
+            if (state->pend == FNFA_NOPEND) {
+                if ((int32_t)state->tag > nfa->best[nfa->tags[state->tag].root])
+                    nfa->best[nfa->tags[state->tag].root] = state->tag;
+            }
+            else if ((int32_t)state->tag > tent[state->pend])
+                tent[state->pend] = state->tag;
+        }
+    }
+    nfa->info.live = alive;
+    nfa->info.kill = final;
+    nfa->info.naccept = 0;
+    for (r = 0; r < nfa->nmachs; r++) {
+        if (nfa->best[r] > -1)
+            nfa->info.accept[nfa->info.naccept++] = (dfa_accept_s){
+                .mach = r,
+                .pend = FNFA_NOPEND,
+                .attribute = nfa->tags[nfa->best[r]].attribute,
+                .stype = nfa->tags[nfa->best[r]].stype
+            };
+    }
+    for (j = 0; j < DFA_MAXTRACK; j++) {
+        if (tent[j] > -1)
+            nfa->info.accept[nfa->info.naccept++] = (dfa_accept_s){
+                .mach = nfa->tags[tent[j]].root,
+                .pend = j,
+                .attribute = nfa->tags[tent[j]].attribute,
+                .stype = nfa->tags[tent[j]].stype
+            };
+    }
+    return BNFA_LIVE;
+}
+
+ldfa_s *ldfa_(bnfa_s *nfa, uint32_t size)
+{
+    int c;
+    uint32_t hsize;
+    ldfa_s *l;
+
+    if (!size)
+        size = LDFA_DEFSTATES;
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    l->nfa = nfa;
+    l->size = size;
+    l->start = LDFA_UNKNOWN;
+    for (c = DFA_NSYMBOLS - 1; c >= 0; c--)
+        l->rep[nfa->classes[c]] = c;
+    for (hsize = 2; hsize < 2 * size; hsize *= 2);
+    l->hsize = hsize;
+    l->hash = safe_realloc(NULL, hsize * sizeof(*l->hash));
+    memset(l->hash, -1, hsize * sizeof(*l->hash));
+    l->sets = safe_realloc(NULL, (size_t)size * nfa->nwords * sizeof(*l->sets));
+    l->trans = safe_realloc(NULL, (size_t)size * nfa->nclasses * sizeof(*l->trans));
+    l->info = calloc(size, sizeof(*l->info));
+    if (!l->info) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    return l;
+}
+
+void free_ldfa(ldfa_s *l)
+{
+    uint32_t i;
+
+    if (!l)
+        return;
+    for (i = 0; i < l->size; i++)
+        free(l->info[i].accept);
+    free(l->hash);
+    free(l->sets);
+    free(l->trans);
+    free(l->info);
+    free(l);
+}
+
+void print_lazystats(ldfa_s *l, FILE *stream)
+{
+    unsigned long total = l->hits + l->misses;
+
+    fprintf(stream, "lazy dfa: %u of %u states cached, %lu hits, %lu misses, %lu flushes, %.1f%% hit rate\n",
+            l->nstates, l->size, l->hits, l->misses, l->flushes, total ? 100.0 * l->hits / total : 0.0);
+}
+
+uint32_t ldfa_hash(ldfa_s *l, uint64_t *set, uint32_t live)
+{
+    uint32_t i;
+    uint64_t h = live;
+
+    for (i = 0; i < l->nfa->nwords; i++)
+        h = (h ^ set[i]) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32) & (l->hsize - 1);
+}
+
+/*
+ Returns the cached state for the set and info bnfa_step left in l->nfa,
+ adding it if it is new. A full cache is flushed first, so indices of
+ states from before the call may be stale afterwards.
+ */
+int32_t ldfa_add(ldfa_s *l)
+{
+    uint32_t i, words = l->nfa->nwords;
+    int32_t d;
+    dfa_info_s *info = &l->nfa->info;
+
+    for (i = ldfa_hash(l, l->nfa->set, info->live); (d = l->hash[i]) > -1; i = (i + 1) & (l->hsize - 1)) {
+        if (l->info[d].live == info->live && !memcmp(&l->sets[(size_t)d * words], l->nfa->set, words * sizeof(*l->sets)))
+            return d;
+    }
+    if (l->nstates == l->size) {
+        ldfa_flush(l);
+        for (i = ldfa_hash(l, l->nfa->set, info->live); l->hash[i] > -1; i = (i + 1) & (l->hsize - 1));
+    }
+    d = l->nstates++;
+    l->hash[i] = d;
+    memcpy(&l->sets[(size_t)d * words], l->nfa->set, words * sizeof(*l->sets));
+    for (i = 0; i < l->nfa->nclasses; i++)
+        l->trans[(size_t)d * l->nfa->nclasses + i] = LDFA_UNKNOWN;
+    if (!l->info[d].accept)
+        l->info[d].accept = safe_realloc(NULL, (l->nfa->nmachs + DFA_MAXTRACK) * sizeof(*info->accept));
+    l->info[d].live = info->live;
+    l->info[d].kill = info->kill;
+    l->info[d].naccept = info->naccept;
+    memcpy(l->info[d].accept, info->accept, info->naccept * sizeof(*info->accept));
+    return d;
+}
+
+void ldfa_flush(ldfa_s *l)
+{
+    l->flushes++;
+    l->nstates = 0;
+    l->start = LDFA_UNKNOWN;
+    memset(l->hash, -1, l->hsize * sizeof(*l->hash));
+}
+
+/*
+ The start state, or LDFA_FAIL if the bitset NFA cannot match from it.
+ */
+int32_t ldfa_start(ldfa_s *l)
+{
+    int r;
+
+    if (l->start == LDFA_UNKNOWN) {
+        r = bnfa_start(l->nfa);
+        if (r == BNFA_FAIL)
+            return LDFA_FAIL;
+        l->start = (r == BNFA_DEAD) ? DFA_DEAD : ldfa_add(l);
+    }
+    return l->start;
+}
+
+/*
+ Computes the transition from state d on byte c, which was not cached yet.
+ */
+int32_t ldfa_step(ldfa_s *l, int32_t d, uint8_t c)
+{
+    int r;
+    int32_t next;
+    unsigned long flushes = l->flushes;
+
+    l->misses++;
+    memcpy(l->nfa->set, &l->sets[(size_t)d * l->nfa->nwords], l->nfa->nwords * sizeof(*l->sets));
+    r = bnfa_step(l->nfa, l->rep[l->nfa->classes[c]]);
+    if (r == BNFA_FAIL)
+        next = LDFA_FAIL;
+    else if (r == BNFA_DEAD)
+        next = DFA_DEAD;
+    else {
+        next = ldfa_add(l);
+        if (l->flushes != flushes)
+            return next;
+    }
+    l->trans[(size_t)d * l->nfa->nclasses + l->nfa->classes[c]] = next;
+    return next;
+}
@@ -0,0 +1,226 @@
+/*
+ dfa.h
+ Author: Jonathan Hamm
+
+ Description:
+    Library for converting the lexical analyzer's NFAs into DFAs. Each
+    machine's NFA is flattened into a byte level NFA, where references to
+    other machines are expanded inline, and is then determinized using
+    subset construction. The resulting transition tables are used by lexf
+    in place of the backtracking nfa_match. All machines of a lexer are also
+    combined into a single DFA, so lexf can match every machine in one scan.
+
+    The flattened NFA can also be kept as is and simulated a set of states
+    at a time (bnfa_s), which needs no subset construction.
+ */
+
+#ifndef DFA_H_
+#define DFA_H_
+
+#include "lex.h"
+#include <stdio.h>
+
+#define DFA_NSYMBOLS    256
+#define DFA_DEAD        -1
+#define DFA_START       0
+
+#define DFA_MAXSTATES   4096
+#define DFA_MAXTRACK    32
+#define FNFA_MAXSTATES  32768
+
+#define BNFA_LIVE       0
+#define BNFA_DEAD       1
+#define BNFA_FAIL       2
+
+#define LDFA_UNKNOWN    -2
+#define LDFA_FAIL       -3
+#define LDFA_DEFSTATES  1024
+
+typedef struct dfa_accept_s dfa_accept_s;
+typedef struct dfa_info_s dfa_info_s;
+typedef struct bnfa_s bnfa_s;
+typedef struct bnfa_edge_s bnfa_edge_s;
+typedef struct bnfa_state_s bnfa_state_s;
+typedef struct bnfa_tag_s bnfa_tag_s;
+typedef struct ldfa_s ldfa_s;
+
+/*
+ An accept of machine mach. pend is the tracked reference the accept is
+ tentative on, or -1 (see dfa.c).
+ */
+struct dfa_accept_s
+{
+    uint16_t mach;
+    int8_t pend;
+    int attribute;
+    char *stype;
+};
+
+/*
+ Per state bookkeeping, only needed by states that accept or are involved
+ with a tracked reference.
+    live:   tracked references still running in this state
+    kill:   tracked references that matched again, invalidating the
+            tentative accepts made earlier on them
+    accept: the state's accepts, the final ones first
+ */
+struct dfa_info_s
+{
+    uint32_t live;
+    uint32_t kill;
+    uint16_t naccept;
+    dfa_accept_s *accept;
+};
+
+/*
+ A DFA recognizing one or more machines at once. Accepts name the machine
+ by its index in machs, which follows the order of lex->machs.
+
+ Bytes that no machine tells apart share a class, and all tables are
+ indexed by classes[byte]. trans is the full transition table, used while
+ building. Scanning uses the comb compressed copy: a state's row is stored
+ at base[state] in next, with check telling which entries belong to it, and
+ every other class leads to deflt[state]. accel gives the run class a state
+ loops on (see scanrun.h), or RUN_NONE. mapped is set when the tables
+ lie in a lexer cache file mapped into memory (see lexcache.c), and are not
+ the DFA's to free.
+ */
+struct dfa_s
+{
+    uint32_t nstates;
+    uint32_t nraw;
+    uint16_t nmachs;
+    mach_s **machs;
+    uint16_t bitmach[DFA_MAXTRACK];
+    uint16_t nclasses;
+    uint8_t classes[DFA_NSYMBOLS];
+    int32_t *trans;
+    bool *flags;
+    dfa_info_s *info;
+    uint32_t ncomb;
+    uint32_t *base;
+    int16_t *deflt;
+    int16_t *next;
+    int16_t *check;
+    uint8_t *accel;
+    bool mapped;
+};
+
+struct bnfa_edge_s
+{
+    uint32_t dest;
+    uint8_t set[DFA_NSYMBOLS / 8];
+};
+
+/*
+ A state of the flattened NFA. closure lists the states reachable through
+ epsilon edges, the state itself included, and enters the tracked
+ references entered on the way. settled is the copy a pending state turns
+ into once the reference it is pending on stops running.
+ */
+struct bnfa_state_s
+{
+    bool accept;
+    bool conflict;
+    int8_t pend;
+    int8_t final;
+    uint16_t tag;
+    uint32_t runs;
+    uint32_t enters;
+    uint32_t settled;
+    uint32_t nclosure;
+    uint32_t *closure;
+    uint16_t nedges;
+    bnfa_edge_s *edges;
+};
+
+struct bnfa_tag_s
+{
+    uint16_t root;
+    int attribute;
+    char *stype;
+};
+
+/*
+ The flattened NFA of all machines, simulated with one bit per state.
+ set holds the states of the current step and info what the step reports,
+ as a dfa_info_s would for a DFA state.
+ */
+struct bnfa_s
+{
+    uint32_t nstates;
+    uint32_t nwords;
+    uint16_t nmachs;
+    uint16_t nclasses;
+    uint8_t classes[DFA_NSYMBOLS];
+    uint16_t ntags;
+    uint8_t ntracked;
+    uint16_t bitmach[DFA_MAXTRACK];
+    bnfa_state_s *states;
+    bnfa_tag_s *tags;
+    uint32_t nstarts;
+    uint32_t *starts;
+    uint64_t *pending;
+    uint64_t *finals;
+    uint64_t *accepts;
+    uint64_t *set;
+    uint64_t *move;
+    int32_t *best;
+    dfa_info_s info;
+};
+
+/*
+ A DFA built from nfa while scanning. States are the sets bnfa_step
+ reaches, at most size of them; trans is indexed by the NFA's byte
+ classes and starts out LDFA_UNKNOWN.
+ */
+struct ldfa_s
+{
+    bnfa_s *nfa;
+    uint32_t nstates;
+    uint32_t size;
+    int32_t start;
+    uint8_t rep[DFA_NSYMBOLS];
+    uint32_t hsize;
+    int32_t *hash;
+    uint64_t *sets;
+    int32_t *trans;
+    dfa_info_s *info;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long flushes;
+};
+
+static inline int32_t dfa_next(dfa_s *dfa, int32_t state, uint8_t c)
+{
+    uint32_t i = dfa->base[state] + dfa->classes[c];
+    
+    return (dfa->check[i] == state) ? dfa->next[i] : dfa->deflt[state];
+}
+
+extern void dfa_buildall(lex_s *lex);
+extern void free_dfa(dfa_s *dfa);
+extern void dfa_accel(dfa_s *dfa);
+extern size_t dfa_tablesize(dfa_s *dfa);
+extern bnfa_s *bnfa_build(lex_s *lex);
+extern void free_bnfa(bnfa_s *nfa);
+extern int bnfa_start(bnfa_s *nfa);
+extern int bnfa_step(bnfa_s *nfa, uint8_t c);
+extern ldfa_s *ldfa_(bnfa_s *nfa, uint32_t size);
+extern void free_ldfa(ldfa_s *l);
+extern int32_t ldfa_start(ldfa_s *l);
+extern int32_t ldfa_step(ldfa_s *l, int32_t d, uint8_t c);
+extern void print_lazystats(ldfa_s *l, FILE *stream);
+
+static inline int32_t ldfa_next(ldfa_s *l, int32_t d, uint8_t c)
+{
+    int32_t next = l->trans[(size_t)d * l->nfa->nclasses + l->nfa->classes[c]];
+    
+    if (next == LDFA_UNKNOWN)
+        return ldfa_step(l, d, c);
+    l->hits++;
+    return next;
+}
+extern void print_lexstats(lex_s *lex, FILE *stream);
+
+#endif
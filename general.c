@@ -14,24 +14,49 @@
 #include <errno.h>
 #include <math.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #if ((defined(__APPLE__) && defined(__MACH__)) || defined(__FreeBSD__))
     #include <malloc/malloc.h>
 #endif
 
 #define INITLINETABLE_SIZE 64
-#define INITFBUF_SIZE 128
+#define INITFBUF_SIZE 4096
 
+/*
+ Interned strings. Each distinct string is given an atom, a dense id, the
+ first time it is interned, so names can be compared as integers and used
+ to index tables. Atom 0 is the empty string, which stands for no name.
+ slots is an open addressed table of atoms, 0 in a free slot.
+ */
+static struct {
+    uint32_t n;
+    uint32_t size;
+    char **names;
+    uint32_t *hashes;
+    uint32_t nslots;
+    uint32_t *slots;
+    char *text;
+    size_t textleft;
+} atoms;
+
+static char *readfd(int fd, size_t hint);
 static void printline(char *buf, FILE *stream);
 static void llpush_(llist_s **list, llist_s *node);
 static bool default_eq(void *k1, void *k2);
 static int ndouble_digits(double val);
 static int nint_digits(long val);
+static uint32_t atom_hash(const char *str, size_t len);
+static void atom_grow(void);
 
 long safe_atol (char *str)
 {
     long i;
     
+    errno = 0;
     i = strtol(str, NULL, 10);
     if (errno) {
         perror("Error parsing number");
@@ -44,6 +69,7 @@ double safe_atod (char *str)
 {
     double d;
     
+    errno = 0;
     d = strtod(str, NULL);
     if(d == HUGE_VAL || d == HUGE_VALF || d == HUGE_VALL || errno) {
         perror("Error parsing number");
@@ -52,39 +78,83 @@ double safe_atod (char *str)
     return d;
 }
 
+/*
+ Returns the contents of file followed by an EOF byte. Regular files are
+ mapped copy on write behind an anonymous mapping that is at least one byte
+ longer, so the EOF byte either lands in the zero filled end of the file's
+ last page or on the page after it, and the file is never copied. Pipes and
+ other files that cannot be mapped are read into memory.
+ */
 char *readfile (const char *file)
 {
-    FILE *f;
-    size_t bsize, nbytes;
+    int fd;
+    struct stat st;
+    size_t size, len, page;
     char *buf;
     
-    bsize = INITFBUF_SIZE;
-    f = fopen (file, "r");
-    if (!f) {
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
         perror("File IO Error");
         printf("Could not read %s\n", file);
         exit(EXIT_FAILURE);
     }
-    buf = malloc(INITFBUF_SIZE);
+    if (fstat(fd, &st) < 0)
+        st.st_size = 0;
+    else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        page = sysconf(_SC_PAGESIZE);
+        size = st.st_size;
+        len = (size / page + 1) * page;
+        buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf != MAP_FAILED) {
+            if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                close(fd);
+                buf[size] = EOF;
+                return buf;
+            }
+            munmap(buf, len);
+        }
+    }
+    buf = readfd(fd, st.st_size > 0 ? st.st_size : 0);
+    close(fd);
+    return buf;
+}
+
+char *readfd(int fd, size_t hint)
+{
+    ssize_t n;
+    size_t bsize, nbytes = 0;
+    char *buf, *tmp;
+    
+    bsize = hint + 1 > INITFBUF_SIZE ? hint + 1 : INITFBUF_SIZE;
+    buf = malloc(bsize);
     if (!buf) {
         perror("Memory Allocation Error");
-        fclose(f);
         return NULL;
     }
-    for (nbytes = 0; (buf[nbytes] = fgetc(f)) != EOF; nbytes++) {
-        if (nbytes+1 == bsize) {
+    for (;;) {
+        if (nbytes + 1 == bsize) {
             bsize *= 2;
-            buf = realloc(buf, bsize);
-            if (!buf) {
+            tmp = realloc(buf, bsize);
+            if (!tmp) {
                 perror("Memory Allocation Error");
-                fclose(f);
+                free(buf);
                 return NULL;
             }
+            buf = tmp;
+        }
+        n = read(fd, &buf[nbytes], bsize - nbytes - 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("File IO Error");
+            free(buf);
+            return NULL;
         }
+        if (!n)
+            break;
+        nbytes += n;
     }
-    fclose(f);
-    if (nbytes < bsize)
-        buf = realloc(buf, nbytes+1);
+    buf[nbytes] = EOF;
     return buf;
 }
 
@@ -406,13 +476,111 @@ uint16_t pjw_hashf(void *key)
 
 bool str_isequalf(void *key1, void *key2)
 {
-    int i;
+    return !strcmp(key1, key2);
+}
+
+uint32_t atom_hash(const char *str, size_t len)
+{
+    size_t i;
+    uint32_t h = 2166136261u;
     
-    for (i = 0; i < (MAX_LEXLEN + 1) / sizeof(uint64_t); i++) {
-        if (((uint64_t *)key1)[i] != ((uint64_t *)key2)[i])
-            return false;
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)str[i]) * 16777619u;
+    return h;
+}
+
+void atom_grow(void)
+{
+    uint32_t i, j;
+    
+    atoms.size = atoms.size ? 2 * atoms.size : ATOM_INITSIZE;
+    atoms.names = realloc(atoms.names, atoms.size * sizeof(*atoms.names));
+    atoms.hashes = realloc(atoms.hashes, atoms.size * sizeof(*atoms.hashes));
+    free(atoms.slots);
+    atoms.nslots = 2 * atoms.size;
+    atoms.slots = calloc(atoms.nslots, sizeof(*atoms.slots));
+    if (!atoms.names || !atoms.hashes || !atoms.slots) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
     }
-    return true;
+    for (i = 1; i < atoms.n; i++) {
+        for (j = atoms.hashes[i] & (atoms.nslots - 1); atoms.slots[j]; j = (j + 1) & (atoms.nslots - 1));
+        atoms.slots[j] = i;
+    }
+}
+
+/*
+ Returns the atom of the len bytes at str, giving them one if they have
+ none yet. Not safe to call from more than one thread at a time.
+ */
+uint32_t intern(const char *str, size_t len)
+{
+    uint32_t h, j, a;
+    
+    if (!len)
+        return 0;
+    if (atoms.n + 1 >= atoms.size) {
+        if (!atoms.n)
+            atoms.n = 1;
+        atom_grow();
+        atoms.names[0] = "";
+        atoms.hashes[0] = 0;
+    }
+    h = atom_hash(str, len);
+    for (j = h & (atoms.nslots - 1); (a = atoms.slots[j]); j = (j + 1) & (atoms.nslots - 1)) {
+        if (atoms.hashes[a] == h && !strncmp(atoms.names[a], str, len) && !atoms.names[a][len])
+            return a;
+    }
+    if (len + 1 > atoms.textleft) {
+        atoms.textleft = len + 1 > ATOM_TEXTBLOCK ? len + 1 : ATOM_TEXTBLOCK;
+        atoms.text = malloc(atoms.textleft);
+        if (!atoms.text) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(atoms.text, str, len);
+    atoms.text[len] = '\0';
+    a = atoms.n++;
+    atoms.names[a] = atoms.text;
+    atoms.hashes[a] = h;
+    atoms.slots[j] = a;
+    atoms.text += len + 1;
+    atoms.textleft -= len + 1;
+    return a;
+}
+
+/*
+ Returns the atom of str, or 0 if it was never interned.
+ */
+uint32_t atomlookup(const char *str)
+{
+    size_t len;
+    uint32_t h, j, a;
+    
+    if (!atoms.nslots || !*str)
+        return 0;
+    len = strlen(str);
+    h = atom_hash(str, len);
+    for (j = h & (atoms.nslots - 1); (a = atoms.slots[j]); j = (j + 1) & (atoms.nslots - 1)) {
+        if (atoms.hashes[a] == h && !strcmp(atoms.names[a], str))
+            return a;
+    }
+    return 0;
+}
+
+char *atomname(uint32_t atom)
+{
+    return atom < atoms.n ? atoms.names[atom] : NULL;
+}
+
+/*
+ One more than the highest atom given out, for sizing tables indexed by
+ atom.
+ */
+uint32_t atomcount(void)
+{
+    return atoms.n ? atoms.n : 1;
 }
 
 void free_hash(hash_s *hash)
@@ -472,6 +640,7 @@ void addline(linetable_s **linelist_ptr, char *line)
     linelist->table[linelist->nlines].line = line;
     linelist->table[linelist->nlines].errors = NULL;
     linelist->table[linelist->nlines].tail = NULL;
+    linelist->table[linelist->nlines].lexerrs = NULL;
     linelist->nlines++;
 }
 
@@ -489,6 +658,27 @@ void adderror(linetable_s *linelist, char *message, unsigned lineno)
     linelist->table[lineno].tail = n;
 }
 
+void addlexerror(linetable_s *linelist, char *message, unsigned lineno)
+{
+    llist_s *n;
+    ltablerec_s *rec;
+    
+    assert(lineno <= linelist->nlines);
+    n = llist_(message);
+    rec = &linelist->table[lineno-1];
+    if (!rec->lexerrs) {
+        n->next = rec->errors;
+        rec->errors = n;
+    }
+    else {
+        n->next = rec->lexerrs->next;
+        rec->lexerrs->next = n;
+    }
+    if (!n->next)
+        rec->tail = n;
+    rec->lexerrs = n;
+}
+
 bool check_listing(linetable_s *linelist, unsigned lineno, char *str)
 {
     llist_s *list;
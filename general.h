@@ -19,6 +19,8 @@
 #include <stddef.h>
 
 #define HTABLE_SIZE 53
+#define ATOM_INITSIZE 1024
+#define ATOM_TEXTBLOCK (1 << 14)
 #define FS_INTWIDTH_DEC(num) ((size_t)ceil(log10((num)+1)))
 
 typedef unsigned long ulong_bool;
@@ -65,11 +67,16 @@ struct hashiterator_s
     hrecord_s *curr;
 };
 
+/*
+ lexerrs is the last of the line's lexical errors, which are kept ahead of
+ the others however the lexer and parser take turns.
+ */
 struct ltablerec_s
 {
     char *line;
     llist_s *errors;
     llist_s *tail;
+    llist_s *lexerrs;
 };
 
 struct linetable_s
@@ -91,7 +98,7 @@ struct sem_type_s
         char *tuple;
         queue_s *q;
     };
-    struct token_s *tok;
+    uint32_t tok;
     long low, high;
     int mark;
 };
@@ -154,9 +161,15 @@ extern bool str_isequalf(void *key1, void *key2);
 extern void free_hash(hash_s *hash);
 extern void print_hash(hash_s *hash, void (*callback)(void *, void *));
 
+extern uint32_t intern(const char *str, size_t len);
+extern uint32_t atomlookup(const char *str);
+extern char *atomname(uint32_t atom);
+extern uint32_t atomcount(void);
+
 extern inline linetable_s *linetable_s_(void);
 extern void addline(linetable_s **linelist_ptr, char *line);
 extern void adderror(linetable_s *listing, char *message, unsigned lineno);
+extern void addlexerror(linetable_s *listing, char *message, unsigned lineno);
 extern bool check_listing(linetable_s *listing, unsigned lineno, char *str);
 
 extern void print_listing(linetable_s *table, void *stream);
@@ -0,0 +1,153 @@
+/*
+ idbench.c
+ Author: Jonathan Hamm
+
+ Description:
+    Microbenchmark for the identifier table. Times lookups in an idtable_s
+    against the same lookups in a hash_s keyed with pjw_hashf, on Pascal's
+    keywords and on a set of generated identifiers, and prints the lookups
+    per second of each. The same words are then checked against Pascal's
+    keywords, in a keyword idtable_s as well as in the kwhash_s the lexer
+    uses. Built and run by make bench.
+ */
+
+#include "lex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_NIDS      20000
+#define BENCH_NLOOKUPS  (1 << 22)
+
+static char *keywords[] = {
+    "and", "array", "begin", "case", "const", "div", "do", "downto", "else",
+    "end", "file", "for", "function", "goto", "if", "in", "integer", "label",
+    "mod", "nil", "not", "of", "or", "packed", "procedure", "program", "real",
+    "record", "repeat", "set", "then", "to", "type", "until", "var", "while",
+    "with"
+};
+
+static double now(void);
+static char **gen_ids(size_t n);
+static void run(const char *name, char **words, size_t n, idtable_s *kwtable, kwhash_s *kwhash);
+
+int main(int argc, char *argv[])
+{
+    size_t i, nkw = sizeof(keywords) / sizeof(*keywords);
+    tdat_s tdat = {0};
+    idtable_s *kwtable;
+    kwhash_s *kwhash;
+
+    kwtable = idtable_s_();
+    for (i = 0; i < nkw; i++) {
+        tdat.itype = i;
+        idtable_insert(kwtable, keywords[i], tdat);
+    }
+    kwhash = kwhash_s_(kwtable);
+    run("keywords", keywords, nkw, kwtable, kwhash);
+    run("identifiers", gen_ids(BENCH_NIDS), BENCH_NIDS, kwtable, kwhash);
+    return 0;
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ Identifiers of 1 to 12 letters, digits and underscores, all distinct.
+ */
+char **gen_ids(size_t n)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+    size_t i, j, len;
+    char **ids;
+
+    ids = malloc(n * sizeof(*ids));
+    if (!ids) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (i = 0; i < n; i++) {
+        len = 1 + rand() % 12;
+        ids[i] = malloc(len + 16);
+        if (!ids[i]) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        ids[i][0] = chars[rand() % 26];
+        for (j = 1; j < len; j++)
+            ids[i][j] = chars[rand() % (sizeof(chars) - 1)];
+        sprintf(&ids[i][len], "%zu", i);
+    }
+    return ids;
+}
+
+void run(const char *name, char **words, size_t n, idtable_s *kwtable, kwhash_s *kwhash)
+{
+    size_t i, found;
+    double start, idt, hash, kwtrie, kwperf;
+    tdat_s tdat = {0};
+    idtable_s *table;
+    hash_s *h;
+    char **queries;
+    size_t *qlens;
+
+    table = idtable_s_();
+    h = hash_(pjw_hashf, str_isequalf);
+    for (i = 0; i < n; i++) {
+        tdat.itype = i;
+        idtable_insert(table, words[i], tdat);
+        hashinsert(h, words[i], words[i]);
+    }
+    queries = malloc(BENCH_NLOOKUPS * sizeof(*queries));
+    qlens = malloc(BENCH_NLOOKUPS * sizeof(*qlens));
+    if (!queries || !qlens) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < BENCH_NLOOKUPS; i++) {
+        queries[i] = words[rand() % n];
+        qlens[i] = strlen(queries[i]);
+    }
+
+    start = now();
+    for (i = 0, found = 0; i < BENCH_NLOOKUPS; i++)
+        found += idtable_lookup(table, queries[i]).is_found;
+    idt = now() - start;
+    if (found != BENCH_NLOOKUPS)
+        fprintf(stderr, "idtable: %zu of %d found\n", found, BENCH_NLOOKUPS);
+
+    start = now();
+    for (i = 0, found = 0; i < BENCH_NLOOKUPS; i++)
+        found += hashlookup(h, queries[i]) != NULL;
+    hash = now() - start;
+    if (found != BENCH_NLOOKUPS)
+        fprintf(stderr, "hash: %zu of %d found\n", found, BENCH_NLOOKUPS);
+
+    start = now();
+    for (i = 0, found = 0; i < BENCH_NLOOKUPS; i++)
+        found += idtable_lookup(kwtable, queries[i]).is_found;
+    kwtrie = now() - start;
+
+    start = now();
+    for (i = 0; i < BENCH_NLOOKUPS; i++)
+        found -= kwhash_lookup(kwhash, queries[i], qlens[i]) != NULL;
+    kwperf = now() - start;
+    if (found)
+        fprintf(stderr, "kwhash: %zu keywords missed\n", found);
+
+    printf("%-12s %6zu words  idtable %7.2f M lookups/s  hash %7.2f M lookups/s\n",
+           name, n, BENCH_NLOOKUPS / idt / 1e6, BENCH_NLOOKUPS / hash / 1e6);
+    printf("%-12s %6s keyword check  idtable %7.2f M lookups/s  kwhash %7.2f M lookups/s\n",
+           "", "", BENCH_NLOOKUPS / kwtrie / 1e6, BENCH_NLOOKUPS / kwperf / 1e6);
+    free_idtable(table);
+    free_hash(h);
+    free(queries);
+    free(qlens);
+}
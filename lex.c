@@ -9,10 +9,16 @@
  */
 
 #include "lex.h"
+#include "dfa.h"
+#include "lexcache.h"
+#include "scanrun.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <math.h>
 
 enum basic_ops_ {
@@ -31,7 +37,7 @@ enum basic_ops_ {
 #define STACK_DIRECTION STACK_DIRECTION_DOWN
 
 
-#define LERR_PREFIX         "      --Lexical Error: at line: %d: "
+#define LERR_PREFIX         "      --Lexical Error: at line: %d, column: %d: "
 #define LERR_UNKNOWNSYM     LERR_PREFIX "Unknown Character: %s"
 #define LERR_TOOLONG        LERR_PREFIX "Token too long: %s"
 #define LERR_SPECTOOLONG    LERR_PREFIX "%s too long: %s"
@@ -49,14 +55,20 @@ enum basic_ops_ {
 
 #define INT_CHAR_WIDTH      10
 
+#define MEMO_INITSIZE       256
+
 typedef struct exp__s exp__s;
 typedef struct nodelist_s nodelist_s;
 typedef struct lexargs_s lexargs_s;
 typedef struct pnonterm_s pnonterm_s;
 typedef struct overflow_s overflow_s;
 typedef struct match_s match_s;
+typedef struct nfamemo_entry_s nfamemo_entry_s;
 typedef struct regex_ann_s regex_ann_s;
 typedef struct prxa_expression_s prxa_expression_s;
+typedef struct machfirst_s machfirst_s;
+typedef struct lexshard_s lexshard_s;
+typedef struct lexlog_s lexlog_s;
 
 typedef void (*ann_callback_f) (token_s **, void *);
 typedef void (*regex_callback_f) (token_s **, void *);
@@ -67,6 +79,36 @@ struct exp__s
     nfa_s *nfa;
 };
 
+/*
+ What lex_token did to the lexer while lexing tok from at on a shard's
+ thread: the name, identifier and error, at erroff, it has yet to record.
+ */
+struct lexlog_s
+{
+    size_t at;
+    size_t end;
+    uint32_t tok;
+    bool valid;
+    char *stype;
+    mach_s *mach;
+    bool hashed;
+    unsigned long hashkey;
+    char *hashname;
+    const char *errmsg;
+    size_t erroff;
+    char *errtext;
+};
+
+struct lexshard_s
+{
+    pthread_t thread;
+    lexstate_s ls;
+    size_t stop;
+    size_t n;
+    size_t size;
+    lexlog_s *log;
+};
+
 struct lexargs_s
 {
     lex_s *lex;
@@ -97,6 +139,30 @@ struct match_s
     overflow_s overflow;
 };
 
+struct nfamemo_entry_s
+{
+    uint32_t gen;
+    nfa_node_s *node;
+    size_t offset;
+    match_s result;
+};
+
+/*
+ Results of nfa_match for the token starting at base, keyed by node and
+ offset from base. Only entries of the current generation are valid, so
+ moving on to the next token only has to bump gen.
+ */
+struct nfamemo_s
+{
+    char *base;
+    uint32_t gen;
+    uint32_t n;
+    uint32_t size;
+    nfamemo_entry_s *entries;
+    unsigned long hits;
+    unsigned long misses;
+};
+
 struct regex_ann_s
 {
     int *count;
@@ -111,19 +177,34 @@ struct prxa_expression_s
     char *strval;
 };
 
+/*
+ The bytes a machine's tokens can start with, and whether it matches the
+ empty string. state is 0 until computed and 1 while being computed.
+ */
+struct machfirst_s
+{
+    uint8_t state;
+    bool nullable;
+    uint8_t set[DFA_NSYMBOLS / 8];
+};
+
 scope_s *scope_tree;
 unsigned scope_indent;
 scope_s *scope_root;
+unsigned lex_threads = 1;
 
 static void printlist(token_s *list);
-static void parray_insert(idtnode_s *tnode, uint8_t index, idtnode_s *child);
-static uint16_t bsearch_tr(idtnode_s *tnode, char key);
-static idtnode_s *trie_insert(idtable_s *table, idtnode_s *trie, char *str, tdat_s tdat);
-static tlookup_s trie_lookup(idtnode_s *trie, char *str);
+static void idt_reserve(idtable_s *table, uint32_t size);
+static int32_t idt_child(idtable_s *table, uint32_t s, uint16_t code);
+static uint32_t idt_addchild(idtable_s *table, uint32_t s, uint16_t code);
+static void idt_walk(idtable_s *table, uint32_t s, char *buf, size_t len, void (*f)(char *, size_t, tdat_s *, void *), void *arg);
+static void kw_collect(char *word, size_t len, tdat_s *tdat, void *kw);
+static uint32_t kw_hash(kwhash_s *kw, const char *str, size_t len);
+static uint32_t kw_slot(uint32_t h, uint32_t disp, uint32_t n);
+static bool kw_place(kwhash_s *kw, uint32_t *hashes);
 static unsigned regex_annotate(token_s **tlist, char *buf, unsigned *lineno, void *data);
 
-static lex_s *lex_s_(void);
-static idtnode_s *patch_search(llist_s *patch, char *lexeme);
+static tdat_s *patch_search(llist_s *patch, char *lexeme);
 static int parseregex(lex_s *lex, token_s **curr);
 static void prx_keywords(lex_s *lex, token_s **curr, int *count);
 static void prx_tokens(lex_s *lex, token_s **curr, int *count);
@@ -155,11 +236,40 @@ static int prx_tokenid(lex_s *lex, token_s **curr);
 static void addcycle(nfa_node_s *start, nfa_node_s *dest);
 static int tokmatch(char *buf, token_s *tok, unsigned *lineno, bool negate);
 match_s nfa_match(lex_s *lex, nfa_s *nfa, nfa_node_s *state, char *buf, unsigned *lineno);
-static char *make_lexerr(const char *errstr, int lineno, char *lexeme);
+static void nfamemo_reset(nfamemo_s *memo, char *base);
+static nfamemo_entry_s *nfamemo_slot(nfamemo_s *memo, nfa_node_s *node, size_t offset);
+static void nfamemo_insert(nfamemo_s *memo, nfa_node_s *node, size_t offset, match_s result);
+static void dfa_scan(dfa_s *dfa, char *buf, match_s *res);
+static match_s dfa_match(dfa_s *dfa, char *buf);
+static bool bnfa_scan(bnfa_s *nfa, char *buf, match_s *res);
+static bool ldfa_scan(ldfa_s *l, char *buf, match_s *res);
+static void dfa_setmatch(match_s *m, dfa_accept_s *accept, size_t n);
+static void dfa_settle(uint16_t *bitmach, dfa_info_s *info, size_t n, match_s *res, match_s *tent, uint32_t *tmask);
+static void dfa_confirm(uint16_t *bitmach, match_s *res, match_s *tent, uint32_t mask);
+static void lexstate_init(lexstate_s *ls, lex_s *lex, int fd, char *buf, bool listing);
+static void lex_index(lexstate_s *ls, uint32_t linestart);
+static void lex_fill(lexstate_s *ls, size_t need);
+static void lex_listlines(lexstate_s *ls);
+static void lex_skipspace(lexstate_s *ls);
+static uint32_t lex_token(lexstate_s *ls, bool *valid);
+static char *lex_text(lexstate_s *ls, char *buf, size_t n);
+static void lex_hashname(lexstate_s *ls, unsigned long token_val, char *name);
+static void lex_error(lexstate_s *ls, const char *errmsg, char *lexeme, size_t off);
+static void lex_resolve(lexstate_s *ls, uint32_t tok, mach_s *mach);
+static void lex_sharded(lexstate_s *ls, size_t len, unsigned nshards);
+static void *lex_shardrun(void *arg);
+static void lex_replay(lexstate_s *ls, lexshard_s *w, lexlog_s *e);
+static void lineidx_edit(lineidx_s *idx, char *buf, size_t off, size_t oldlen, size_t newlen);
+static void tokbuf_grow(tokbuf_s *toks, uint32_t n);
+static void tokbuf_splice(tokbuf_s *toks, uint32_t from, uint32_t to, tokbuf_s *src, uint32_t n);
+static uint32_t tokbuf_push(tokbuf_s *toks, char *lexeme, size_t len, size_t off, uint16_t type, uint16_t attribute, char *stype);
+static void tokbuf_pop(tokbuf_s *toks);
+static char *make_lexerr(const char *errstr, int lineno, int column, char *lexeme);
 static void mscan(lexargs_s *args);
 static mach_s *getmach(lex_s *lex, char *id);
- 
-static int addtok_(token_s **tlist, char *lexeme, uint32_t lineno, uint16_t type, uint16_t attribute, char *stype, bool unlimited);
+static void lex_buildfirst(lex_s *lex);
+static machfirst_s *mach_first(lex_s *lex, machfirst_s *firsts, mach_s *mach);
+static bool node_first(lex_s *lex, machfirst_s *firsts, nfa_s *nfa, nfa_node_s *node, uint8_t *set, llist_s **visited);
 
 static void print_indent(FILE *f);
 static void print_scope_(scope_s *root, FILE *f);
@@ -171,9 +281,36 @@ lex_s *buildlex(const char *file)
     token_s *list;
     lex_s *lex;
 
+    if (lexcache_enabled && (lex = lexcache_load(file))) {
+        lex->kwhash = kwhash_s_(lex->kwtable);
+        lex_buildfirst(lex);
+        return lex;
+    }
     lex = lex_s_();
     list = lexspec(file, regex_annotate, NULL, true);
     lex->typestart = parseregex(lex, &list);
+    dfa_buildall(lex);
+    if (lexcache_enabled)
+        lexcache_save(lex, file);
+    lex->kwhash = kwhash_s_(lex->kwtable);
+    lex_buildfirst(lex);
+    lc_spechash(LC_HASHINIT, file, &lex->spechash);
+    return lex;
+}
+
+/*
+ Loads the lexer in image, a cache file compiled into the program, or
+ returns NULL if image was written for another build.
+ */
+lex_s *buildlex_image(uint8_t *image, size_t size)
+{
+    lex_s *lex;
+
+    lex = lexcache_image(image, size);
+    if (!lex)
+        return NULL;
+    lex->kwhash = kwhash_s_(lex->kwtable);
+    lex_buildfirst(lex);
     return lex;
 }
 
@@ -488,6 +625,7 @@ int addtok(token_s **tlist, char *lexeme, uint32_t lineno, uint16_t type, uint16
     ntok->type.attribute = attribute;
     ntok->lineno = lineno;
     ntok->stype = stype;
+    ntok->atom = intern(lexeme, strlen(lexeme));
     strcpy(ntok->lexeme, lexeme);
     if (!*tlist)
         *tlist = ntok;
@@ -530,12 +668,10 @@ int parseregex(lex_s *lex, token_s **list)
 void prx_keywords(lex_s *lex, token_s **curr, int *counter)
 {
     char *lexeme;
-    idtnode_s *node;
     sem_type_s init_type;
     
     init_type.type = ATTYPE_NULL;
     while ((*curr)->type.val == LEXTYPE_TERM) {
-        node = NULL;
         lexeme = (*curr)->lexeme;
         ++*counter;
         idtable_insert(lex->kwtable, lexeme, (tdat_s){.is_string = false, .itype = *counter, .att = 0, .type = init_type});
@@ -602,6 +738,7 @@ token_s *make_epsilon(void)
         exit(EXIT_FAILURE);
     }
     strcpy(new->lexeme, "EPSILON");
+    new->atom = intern("EPSILON", sizeof("EPSILON") - 1);
     new->type.val = LEXTYPE_EPSILON;
     new->type.attribute = LEXATTR_DEFAULT;
     return new;
@@ -663,7 +800,7 @@ void insert_at_branch(nfa_s *unfa, nfa_s *concat, nfa_s *insert)
 
 regex_ann_s *prx_texp(lex_s *lex, token_s **curr, int *count)
 {
-    idtnode_s *tnode = NULL;
+    tdat_s *tnode = NULL;
     nfa_s *uparent = NULL, *concat = NULL;
     regex_ann_s *reg;
     
@@ -1192,11 +1329,11 @@ lex_s *lex_s_(void)
     return lex;
 }
 
-idtnode_s *patch_search(llist_s *patch, char *lexeme)
+tdat_s *patch_search(llist_s *patch, char *lexeme)
 {
     while (patch) {
-        if (((idtnode_s *)patch->ptr)->tdat.is_string) {
-            if (!strcmp(((idtnode_s *)patch->ptr)->tdat.stype, lexeme))
+        if (((tdat_s *)patch->ptr)->is_string) {
+            if (!strcmp(((tdat_s *)patch->ptr)->stype, lexeme))
                 return patch->ptr;
         }
         patch = patch->next;
@@ -1208,22 +1345,52 @@ idtable_s *idtable_s_(void)
 {
     idtable_s *table;
     
-    table = malloc(sizeof(*table));
+    table = calloc(1, sizeof(*table));
     if (!table) {
         perror("Memory Allocation Error");
         return NULL;
     }
-    table->root = calloc(1, sizeof(*table->root));
-    if (!table->root) {
-        perror("Memory Allocation Error");
-        return NULL;
-    }
+    idt_reserve(table, IDTABLE_INITSIZE);
+    table->base[1] = 2;
+    table->check[1] = 1;
+    table->free = 2;
     return table;
 }
 
+/*
+ Returns the word's data, which moves as the table grows, or NULL if
+ str was already in the table.
+ */
 void *idtable_insert(idtable_s *table, char *str, tdat_s tdat)
 {
-    return trie_insert(table, table->root, str, tdat);
+    size_t i, len;
+    int32_t t;
+    uint32_t s = 1;
+    
+    len = strlen(str);
+    for (i = 0; i <= len; i++) {
+        t = idt_child(table, s, i < len ? (uint8_t)str[i] + 1 : 0);
+        if (t < 0)
+            break;
+        s = t;
+    }
+    if (i > len)
+        return NULL;
+    for (; i <= len; i++)
+        s = idt_addchild(table, s, i < len ? (uint8_t)str[i] + 1 : 0);
+    if (table->n == table->nslots) {
+        table->nslots = table->nslots ? 2 * table->nslots : 64;
+        table->data = realloc(table->data, table->nslots * sizeof(*table->data));
+        if (!table->data) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    table->base[s] = -(int32_t)table->n - 1;
+    table->data[table->n] = tdat;
+    if (len > table->maxlen)
+        table->maxlen = len;
+    return &table->data[table->n++];
 }
 
 void idtable_set(idtable_s *table, char *str, tdat_s tdat)
@@ -1231,91 +1398,352 @@ void idtable_set(idtable_s *table, char *str, tdat_s tdat)
     tlookup_s lookup;
     
     lookup = idtable_lookup(table, str);
-    lookup.node->tdat = tdat;
+    if (lookup.is_found)
+        table->data[lookup.slot] = tdat;
+    else
+        idtable_insert(table, str, tdat);
 }
 
 tlookup_s idtable_lookup(idtable_s *table, char *str)
 {
-    return trie_lookup(table->root, str);
+    int32_t b;
+    uint32_t s = 1, t;
+    
+    for (;; str++) {
+        b = table->base[s];
+        if (b <= 0)
+            return (tlookup_s){.is_found = false};
+        t = b + (*str ? (uint8_t)*str + 1 : 0);
+        if (t >= table->size || table->check[t] != s)
+            return (tlookup_s){.is_found = false};
+        if (!*str)
+            break;
+        s = t;
+    }
+    b = -table->base[t] - 1;
+    return (tlookup_s){.is_found = true, .tdat = table->data[b], .slot = b};
 }
 
-idtnode_s *trie_insert(idtable_s *table, idtnode_s *trie, char *str, tdat_s tdat)
+/*
+ Calls f on every word in the table, in byte order.
+ */
+void idtable_walk(idtable_s *table, void (*f)(char *, size_t, tdat_s *, void *), void *arg)
 {
-    int search;
-    idtnode_s *nnode;
+    char *buf;
+    
+    buf = malloc(table->maxlen + 1);
+    if (!buf) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    idt_walk(table, 1, buf, 0, f, arg);
+    free(buf);
+}
 
-    if (!trie->nchildren)
-        search = 0; 
-    else {
-        search = bsearch_tr(trie, *str);
-        if (search & 0x8000)
-            search &= ~0x8000;
-        else if (*str)
-            return trie_insert(table, trie->children[search], str+1, tdat);
-        else
-            return NULL;
+void idt_walk(idtable_s *table, uint32_t s, char *buf, size_t len, void (*f)(char *, size_t, tdat_s *, void *), void *arg)
+{
+    uint16_t c;
+    uint32_t t;
+    int32_t b = table->base[s];
+    
+    if (b <= 0)
+        return;
+    for (c = 0; c < IDTABLE_NCODES && b + c < table->size; c++) {
+        t = b + c;
+        if (table->check[t] != s)
+            continue;
+        if (c) {
+            buf[len] = c - 1;
+            idt_walk(table, t, buf, len + 1, f, arg);
+        }
+        else {
+            buf[len] = '\0';
+            f(buf, len, &table->data[-table->base[t] - 1], arg);
+        }
+    }
+}
+
+void free_idtable(idtable_s *table)
+{
+    free(table->base);
+    free(table->check);
+    free(table->data);
+    free(table);
+}
+
+void idt_reserve(idtable_s *table, uint32_t size)
+{
+    uint32_t nsize;
+    
+    if (size <= table->size)
+        return;
+    for (nsize = table->size ? table->size : IDTABLE_INITSIZE; nsize < size; nsize *= 2);
+    table->base = realloc(table->base, nsize * sizeof(*table->base));
+    table->check = realloc(table->check, nsize * sizeof(*table->check));
+    if (!table->base || !table->check) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    memset(&table->base[table->size], 0, (nsize - table->size) * sizeof(*table->base));
+    memset(&table->check[table->size], 0, (nsize - table->size) * sizeof(*table->check));
+    table->size = nsize;
+}
+
+int32_t idt_child(idtable_s *table, uint32_t s, uint16_t code)
+{
+    uint32_t t;
+    
+    if (table->base[s] <= 0)
+        return -1;
+    t = table->base[s] + code;
+    if (t >= table->size || table->check[t] != s)
+        return -1;
+    return t;
+}
+
+/*
+ Adds a child to s on code. If its cell is taken, s's children move
+ to the first base where they and the new one all fit, and their own
+ children are pointed at the cells they moved to.
+ */
+uint32_t idt_addchild(idtable_s *table, uint32_t s, uint16_t code)
+{
+    int32_t b, nb;
+    uint16_t c, lo, n = 0, codes[IDTABLE_NCODES];
+    uint32_t i, t, old, g;
+    
+    b = table->base[s];
+    if (b > 0) {
+        idt_reserve(table, b + code + 1);
+        if (!table->check[b + code]) {
+            t = b + code;
+            table->check[t] = s;
+            table->base[t] = 0;
+            while (table->check[table->free])
+                idt_reserve(table, ++table->free + 1);
+            return t;
+        }
+        for (c = 0; c < IDTABLE_NCODES && b + c < table->size; c++) {
+            if (table->check[b + c] == s)
+                codes[n++] = c;
+        }
+    }
+    codes[n++] = code;
+    for (lo = code, i = 0; i < n; i++) {
+        if (codes[i] < lo)
+            lo = codes[i];
     }
-    nnode = calloc(1, sizeof(*nnode));
-    if (!nnode) {
+    for (nb = table->free > lo + 2 ? table->free - lo : 2;; nb++) {
+        for (i = 0; i < n; i++) {
+            idt_reserve(table, nb + codes[i] + 1);
+            if (table->check[nb + codes[i]])
+                break;
+        }
+        if (i == n)
+            break;
+    }
+    for (i = 0; i + 1 < n; i++) {
+        old = b + codes[i];
+        t = nb + codes[i];
+        table->base[t] = table->base[old];
+        table->check[t] = s;
+        if (table->base[old] > 0) {
+            for (c = 0; c < IDTABLE_NCODES && table->base[old] + c < table->size; c++) {
+                g = table->base[old] + c;
+                if (table->check[g] == old)
+                    table->check[g] = t;
+            }
+        }
+        table->base[old] = 0;
+        table->check[old] = 0;
+        if (old < table->free)
+            table->free = old;
+    }
+    table->base[s] = nb;
+    t = nb + code;
+    table->check[t] = s;
+    table->base[t] = 0;
+    while (table->check[table->free])
+        idt_reserve(table, ++table->free + 1);
+    return t;
+}
+
+kwhash_s *kwhash_s_(idtable_s *kwtable)
+{
+    uint32_t i, *hashes;
+    kwhash_s *kw;
+    
+    kw = calloc(1, sizeof(*kw));
+    if (!kw) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    kw->words = malloc((kwtable->n + 1) * sizeof(*kw->words));
+    kw->lens = malloc((kwtable->n + 1) * sizeof(*kw->lens));
+    kw->data = malloc((kwtable->n + 1) * sizeof(*kw->data));
+    kw->disp = calloc(kwtable->n + 1, sizeof(*kw->disp));
+    hashes = malloc((kwtable->n + 1) * sizeof(*hashes));
+    if (!kw->words || !kw->lens || !kw->data || !kw->disp || !hashes) {
         perror("Memory Allocation Error");
         exit(EXIT_FAILURE);
     }
-    nnode->c = *str;
-    if (!*str) {
-        nnode->tdat = tdat;
-        parray_insert (trie, search, nnode);
-        return nnode;
+    idtable_walk(kwtable, kw_collect, kw);
+    for (kw->seed = 0; ; kw->seed++) {
+        kw->full = kw->seed >= KWHASH_SAMPLESEEDS;
+        for (i = 0; i < kw->n; i++)
+            hashes[i] = kw_hash(kw, kw->words[i], kw->lens[i]);
+        if (kw_place(kw, hashes))
+            break;
     }
-    parray_insert(trie, search, nnode);
-    return trie_insert(table, trie->children[search], str+1, tdat);
+    free(hashes);
+    return kw;
 }
 
-void parray_insert(idtnode_s *tnode, uint8_t index, idtnode_s *child)
+/*
+ Returns the data of the len bytes at str if they are a keyword.
+ */
+tdat_s *kwhash_lookup(kwhash_s *kw, const char *str, size_t len)
 {
-    uint8_t i, j, n;
-    idtnode_s **children;
+    uint32_t h, slot;
     
-    if (tnode->nchildren)
-        tnode->children = realloc(tnode->children, sizeof(*tnode->children) * (tnode->nchildren + 1));
-    else
-        tnode->children = malloc(sizeof(*tnode->children));
-    children = tnode->children;
-    n = tnode->nchildren - index;
-    for (i = 0, j = tnode->nchildren; i < n; i++, j--)
-        children[j] = children[j-1];
-    children[j] = child;
-    tnode->nchildren++;
+    if (!(kw->lenmask & (1ull << (len < 63 ? len : 63))))
+        return NULL;
+    h = kw_hash(kw, str, len);
+    slot = kw_slot(h, kw->disp[h % kw->n], kw->n);
+    if (kw->lens[slot] != len || memcmp(kw->words[slot], str, len))
+        return NULL;
+    return &kw->data[slot];
 }
 
-tlookup_s trie_lookup(idtnode_s *trie, char *str)
+void kw_collect(char *word, size_t len, tdat_s *tdat, void *kw)
 {
-    uint16_t search;
+    kwhash_s *k = kw;
     
-    search = bsearch_tr(trie, *str);
-    if (search & 0x8000)
-        return (tlookup_s){.is_found = false, .tdat = trie->tdat};
-    if (!*str)
-        return (tlookup_s){.is_found = true, .tdat = trie->children[search]->tdat, .node = trie->children[search]};
-    return trie_lookup(trie->children[search], str+1);
+    k->words[k->n] = strdup(word);
+    if (!k->words[k->n]) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    k->lens[k->n] = len;
+    k->lenmask |= 1ull << (len < 63 ? len : 63);
+    k->data[k->n++] = *tdat;
 }
 
-uint16_t bsearch_tr(idtnode_s *tnode, char key)
+/*
+ Like gperf, only the length and the first, middle and last bytes are
+ hashed, unless no seed separates the keywords that way.
+ */
+uint32_t kw_hash(kwhash_s *kw, const char *str, size_t len)
 {
-	int16_t mid, low, high;
+    size_t i;
+    uint32_t h = (2166136261u ^ kw->seed) * 16777619u;
     
-    low = 0;
-    high = tnode->nchildren-1;
-    for (mid = low+(high-low)/2; high >= low; mid = low+(high-low)/2) {
-        if (key < tnode->children[mid]->c)
-            high = mid - 1;
-        else if (key > tnode->children[mid]->c)
-            low = mid + 1;
-        else
-            return mid;
+    if (kw->full) {
+        for (i = 0; i < len; i++)
+            h = (h ^ (uint8_t)str[i]) * 16777619u;
+        return h;
+    }
+    h = (h ^ len) * 16777619u;
+    if (len) {
+        h = (h ^ (uint8_t)str[0]) * 16777619u;
+        h = (h ^ (uint8_t)str[len / 2]) * 16777619u;
+        h = (h ^ (uint8_t)str[len - 1]) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t kw_slot(uint32_t h, uint32_t disp, uint32_t n)
+{
+    h ^= disp * 0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h % n;
+}
+
+/*
+ Places the biggest buckets first, moving the words into the slots their
+ bucket's displacement gives them. Returns false if two words hash the
+ same or some bucket found no displacement, which wants another seed.
+ */
+bool kw_place(kwhash_s *kw, uint32_t *hashes)
+{
+    bool ok = true;
+    uint32_t i, j, k, b, d, size, n = kw->n;
+    uint32_t *start, *members, *order, *slots;
+    uint8_t *taken;
+    char **words;
+    uint32_t *lens;
+    tdat_s *data;
+    
+    start = calloc(n + 2, sizeof(*start));
+    members = malloc((n + 1) * sizeof(*members));
+    order = malloc((n + 1) * sizeof(*order));
+    slots = malloc((n + 1) * sizeof(*slots));
+    taken = calloc(n + 1, sizeof(*taken));
+    words = malloc((n + 1) * sizeof(*words));
+    lens = malloc((n + 1) * sizeof(*lens));
+    data = malloc((n + 1) * sizeof(*data));
+    if (!start || !members || !order || !slots || !taken || !words || !lens || !data) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++)
+        start[hashes[i] % n + 2]++;
+    for (b = 0; b < n; b++)
+        start[b + 2] += start[b + 1];
+    for (i = 0; i < n; i++)
+        members[start[hashes[i] % n + 1]++] = i;
+    for (k = 0, size = n; size > 0; size--) {
+        for (b = 0; b < n; b++) {
+            if (start[b + 1] - start[b] == size)
+                order[k++] = b;
+        }
+    }
+    for (b = 0; b < n && ok; b++) {
+        for (i = start[b]; i < start[b + 1] && ok; i++) {
+            for (j = start[b]; j < i; j++) {
+                if (hashes[members[i]] == hashes[members[j]])
+                    ok = false;
+            }
+        }
     }
-    if (high < low)
-        return mid | 0x8000;
-    return mid;
+    for (i = 0; i < k && ok; i++) {
+        b = order[i];
+        for (d = 0; d < KWHASH_MAXDISP; d++) {
+            for (j = start[b]; j < start[b + 1]; j++) {
+                slots[members[j]] = kw_slot(hashes[members[j]], d, n);
+                if (taken[slots[members[j]]])
+                    break;
+                taken[slots[members[j]]] = 1;
+            }
+            if (j == start[b + 1])
+                break;
+            while (j-- > start[b])
+                taken[slots[members[j]]] = 0;
+        }
+        kw->disp[b] = d;
+        ok = d < KWHASH_MAXDISP;
+    }
+    if (ok) {
+        for (i = 0; i < n; i++) {
+            words[slots[i]] = kw->words[i];
+            lens[slots[i]] = kw->lens[i];
+            data[slots[i]] = kw->data[i];
+        }
+        memcpy(kw->words, words, n * sizeof(*words));
+        memcpy(kw->lens, lens, n * sizeof(*lens));
+        memcpy(kw->data, data, n * sizeof(*data));
+    }
+    free(start);
+    free(members);
+    free(order);
+    free(slots);
+    free(taken);
+    free(words);
+    free(lens);
+    free(data);
+    return ok;
 }
 
 int ntstrcmp(char *nterm, char *str)
@@ -1399,7 +1827,16 @@ match_s nfa_match(lex_s *lex, nfa_s *nfa, nfa_node_s *state, char *buf, unsigned
     mach_s *tmp;
     match_s curr, result;
     char *old;
+    nfamemo_entry_s *entry;
     
+    if (lex->memo) {
+        entry = nfamemo_slot(lex->memo, state, buf - lex->memo->base);
+        if (entry->gen == lex->memo->gen) {
+            lex->memo->hits++;
+            return entry->result;
+        }
+        lex->memo->misses++;
+    }
     curr.n = 0;
     curr.stype = NULL;
     curr.attribute = 0;
@@ -1467,223 +1904,1380 @@ match_s nfa_match(lex_s *lex, nfa_s *nfa, nfa_node_s *state, char *buf, unsigned
                 break;
         }
     }
+    if (lex->memo)
+        nfamemo_insert(lex->memo, state, buf - lex->memo->base, curr);
     return curr;
 }
 
-lextok_s lexf(lex_s *lex, char *buf, uint32_t linestart, bool listing)
+/*
+ Chooses what lexf matches with: the combined DFA (the default), the
+ bitset NFA, a lazy DFA over the bitset NFA keeping at most cachesize
+ states (0 for the default), or nfa_match alone. The bitset NFA is only
+ built on request. Tokens the chosen engine cannot handle fall back to
+ nfa_match.
+ */
+void lex_setbackend(lex_s *lex, int backend, uint32_t cachesize)
 {
-    int lcheck;
-    bool unlimited;
-    int idatt = 0;
-    mach_s *mach, *bmach;
-    match_s res, best;
-    unsigned lineno = linestart;
-    char c[2], *backup, *error, tmpbuf[MAX_LEXLEN];
-    tlookup_s lookup;
-    token_s *head = NULL, *tlist = NULL;
-    overflow_s overflow;
-    sem_type_s init_type;;
-    
-    c[1] = '\0';
-    backup = buf;
-    init_type.type = ATTYPE_NULL;
-    if (listing && *buf != EOF) {
-        addline(&lex->listing, buf);
-        lineno++;
-    }
-    while (*buf != EOF) {
-        best.attribute = 0;
-        best.n = 0;
-        best.success = false;
-        best.stype = NULL;
-        overflow.str = NULL;
-        overflow.len = 0;
-        bmach = NULL;
-        
-        while (isspace(*buf)) {
-            if (*buf == '\n') {
-                lineno++;
-                if (listing)
-                    addline(&lex->listing, buf+1);
-            }
-            else if (*buf == EOF)
-                break;
-            buf++;
-        }
-        if (*buf == EOF)
-            break;
-        for (mach = lex->machs; mach; mach = mach->next) {
-            if (*buf == EOF)
-                break;
-            res = nfa_match(lex, mach->nfa, mach->nfa->start, buf, &lineno);
-            if (mach->unlimited || (!res.overflow.str &&  res.n <= mach->lexlen)) {
-                if (res.success && !mach->composite && res.n > best.n) {
-                    best = res;
-                    bmach = mach;
-                }
-            }
-            else {
-                if (mach->unlimited || !res.overflow.str) {
-                    overflow.str = buf;
-                    overflow.len = res.n;
-                    best.success = false;
-                }
-                else
-                    overflow = res.overflow;
-            }
-        }
-        for(lcheck = 0; lcheck < best.n; lcheck++) {
-            if(buf[lcheck] == '\n')
-                lineno++;
-        }
-        unlimited = bmach ? bmach->unlimited : false;
-        c[0] = buf[best.n];
-        buf[best.n] = '\0';
-        if (best.success) {
-            if (unlimited || best.n <= bmach->lexlen) {
-                lookup = idtable_lookup(lex->kwtable, buf);
-                if (lookup.is_found) {
-                    addtok_(&tlist, buf, lineno, lookup.tdat.itype, best.attribute, best.stype, unlimited);
-                    hashname(lex, lookup.tdat.itype, buf);
-                }
-                else {
-                    lookup = idtable_lookup(lex->idtable, buf);
-                    if (lookup.is_found) {
-                        addtok_(&tlist, buf, lineno, lookup.tdat.itype, lookup.tdat.att, best.stype, unlimited);
-                        hashname(lex, lookup.tdat.itype, buf);
-                    }
-                    else if (bmach->attr_id) {
-                        idatt++;
-                        addtok_(&tlist, buf, lineno, bmach->nterm->type.val, idatt, best.stype, unlimited);
-                        idtable_insert(lex->idtable, buf, (tdat_s){.is_string = false, .itype = bmach->nterm->type.val, .att = idatt, .type = init_type});
-                        hashname(lex, lex->typestart, bmach->nterm->lexeme);
-                    }
-                    else {
-                        addtok_(&tlist, buf, lineno, bmach->nterm->type.val, best.attribute, best.stype, unlimited);
-                        hashname(lex, lex->typestart, bmach->nterm->lexeme);
-                    }
-                }
-                if (!head)
-                    head = tlist;
-            }
-            else {
-                addtok_(&tlist, c, lineno, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype, unlimited);
-                if (listing) {
-                    error = make_lexerr(LERR_TOOLONG, lineno, buf);
-                    adderror(lex->listing, error, lineno);
-                }
-            }
-        }
-        else if (overflow.str) {
-            buf[best.n] = c[0];
-            c[0] = buf[overflow.len];
-            buf[overflow.len] = '\0';
-            memset(tmpbuf, 0, sizeof(tmpbuf));
-            snprintf(tmpbuf, MAX_LEXLEN, "%s", buf);
-            addtok(&tlist, tmpbuf, lineno, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype);
-            if (listing)
-                adderror(lex->listing, make_lexerr (LERR_TOOLONG, lineno, buf), lineno);
-            best.n = overflow.len;
-        }
-        else {
-            lookup = idtable_lookup(lex->kwtable, c);
-            if (lookup.is_found) {
-                addtok_(&tlist, c, lineno, lookup.tdat.itype, LEXATTR_DEFAULT, best.stype, unlimited);
-                hashname(lex, lookup.tdat.itype, NULL);
-                if (!head)
-                    head = tlist;
-            }
-            else {
-                if (best.n) {
-                    addtok(&tlist, c, lineno, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype);
-                    if (listing) {
-                        assert(*buf != EOF);
-                        error = make_lexerr(LERR_UNKNOWNSYM, lineno, buf);
-                        adderror(lex->listing, error, lineno);
-                    }
-                }
-                else {
-                    addtok(&tlist, c, lineno, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype);
-                    if (listing) {
-                        assert(c[0] != EOF);
-                        error = make_lexerr(LERR_UNKNOWNSYM, lineno, c);
-                        adderror(lex->listing, error, lineno);
-                    }
-                }
-            }
-        }
-        buf[best.n] = c[0];
-        if (best.n)
-            buf += best.n;
-        else 
-            buf++;
+    lex->backend = backend;
+    if ((backend == LEXER_BITSET || backend == LEXER_LAZY) && !lex->bnfa)
+        lex->bnfa = bnfa_build(lex);
+    if (backend == LEXER_LAZY && lex->bnfa) {
+        free_ldfa(lex->ldfa);
+        lex->ldfa = ldfa_(lex->bnfa, cachesize);
     }
-    addtok(&tlist, "$", lineno, LEXTYPE_EOF, LEXATTR_DEFAULT, best.stype);
-    if (!head)
-        head = tlist;
-    hashname(lex, LEXTYPE_EOF, "$");
-    return (lextok_s){.lex = lex, .lines = lineno, .tokens = head};
 }
 
-char *make_lexerr(const char *errmsg, int lineno, char *lexeme)
+/*
+ Memoizing nfa_match is opt in. Without it, references and epsilon edges
+ make nfa_match revisit the same node at the same offset many times.
+ */
+void nfamemo_enable(lex_s *lex)
 {
-    char *error;
-    size_t errsize;
-    
-    errsize = strlen(errmsg) + strlen(lexeme) + INT_CHAR_WIDTH;
-    error = calloc(1, errsize);
-    if (!error) {
+    if (lex->memo)
+        return;
+    lex->memo = calloc(1, sizeof(*lex->memo));
+    if (!lex->memo) {
         perror("Memory Allocation Error");
         exit(EXIT_FAILURE);
     }
-    sprintf(error, errmsg, lineno, lexeme);
-    error[errsize-1] = '\n';
-    return error;
+    lex->memo->size = MEMO_INITSIZE;
+    lex->memo->entries = calloc(MEMO_INITSIZE, sizeof(*lex->memo->entries));
+    if (!lex->memo->entries) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    lex->memo->gen = 1;
 }
 
-mach_s *getmach(lex_s *lex, char *id)
+void print_nfamemo(lex_s *lex, void *stream)
 {
-    mach_s *iter;
-    
-    for (iter = lex->machs; iter && strcmp(iter->nterm->lexeme, id); iter = iter->next);
-    if (!iter) {
-        fprintf(stderr, "Regex Error: Regex %s never defined", id);
-        exit(EXIT_FAILURE);
-    }
-    return iter;
+    if (lex->memo)
+        fprintf(stream, "nfa_match memo: %lu hits, %lu misses\n", lex->memo->hits, lex->memo->misses);
 }
 
-void settype(lex_s *lex, char *id, sem_type_s type)
+void nfamemo_reset(nfamemo_s *memo, char *base)
 {
-   /* tdat_s tdat;
-    
-    tdat = idtable_lookup(lex->idtable, id).tdat;
-    tdat.type = type;
-    idtable_set(lex->idtable, id, tdat);*/
-    check_id_s check = check_id(id);
-    
-    if(check.isfound)
-        *check.type = type;
+    memo->base = base;
+    memo->n = 0;
+    if (!++memo->gen) {
+        memset(memo->entries, 0, memo->size * sizeof(*memo->entries));
+        memo->gen = 1;
+    }
 }
 
-sem_type_s gettype(lex_s *lex, char *id)
+/*
+ Returns the entry for node and offset, or the empty slot it would go in.
+ */
+nfamemo_entry_s *nfamemo_slot(nfamemo_s *memo, nfa_node_s *node, size_t offset)
 {
-    check_id_s check;
-    sem_type_s init = {0};
-    
-    init.type = ATTYPE_NULL;
-    check = check_id(id);
-    if(check.isfound)
-        return *check.type;
-    return init;
+    uint32_t i, mask = memo->size - 1;
+    nfamemo_entry_s *entry;
+
+    i = (uint32_t)((((uintptr_t)node >> 4) * 31 + offset) * 2654435761u) & mask;
+    for (;; i = (i + 1) & mask) {
+        entry = &memo->entries[i];
+        if (entry->gen != memo->gen || (entry->node == node && entry->offset == offset))
+            return entry;
+    }
 }
 
-toktype_s gettoktype(lex_s *lex, char *id)
+void nfamemo_insert(nfamemo_s *memo, nfa_node_s *node, size_t offset, match_s result)
 {
-    toktype_s type;
+    uint32_t i, oldsize;
+    nfamemo_entry_s *entry, *old;
+
+    if ((memo->n + 1) * 2 > memo->size) {
+        old = memo->entries;
+        oldsize = memo->size;
+        memo->size *= 2;
+        memo->entries = calloc(memo->size, sizeof(*memo->entries));
+        if (!memo->entries) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < oldsize; i++) {
+            if (old[i].gen == memo->gen)
+                *nfamemo_slot(memo, old[i].node, old[i].offset) = old[i];
+        }
+        free(old);
+    }
+    entry = nfamemo_slot(memo, node, offset);
+    if (entry->gen != memo->gen)
+        memo->n++;
+    entry->gen = memo->gen;
+    entry->node = node;
+    entry->offset = offset;
+    entry->result = result;
+}
+
+/*
+ Table driven longest match over a DFA, giving the longest match of each of
+ its machines in res. Stops at the first dead transition; the EOF sentinel
+ always leads to the dead state. Accepts that are only valid if a referenced
+ machine's match turns out to be its longest are held in tent until the DFA
+ has settled them (see dfa.c).
+ */
+void dfa_scan(dfa_s *dfa, char *buf, match_s *res)
+{
+    size_t i;
+    uint16_t m;
+    int32_t state;
+    uint32_t tmask = 0;
+    match_s tent[DFA_MAXTRACK];
+    
+    for (m = 0; m < dfa->nmachs; m++) {
+        res[m].n = 0;
+        res[m].success = false;
+        res[m].attribute = 0;
+        res[m].stype = NULL;
+        res[m].overflow.str = NULL;
+        res[m].overflow.len = 0;
+    }
+    for (i = 0, state = DFA_START; state != DFA_DEAD; state = dfa_next(dfa, state, (uint8_t)buf[i++])) {
+        if (dfa->accel[state] && !tmask)
+            i += scan_run(&buf[i], dfa->accel[state]);
+        if (dfa->flags[state] || tmask)
+            dfa_settle(dfa->bitmach, &dfa->info[state], i, res, tent, &tmask);
+    }
+    dfa_confirm(dfa->bitmach, res, tent, tmask);
+}
+
+/*
+ Same as dfa_scan, stepping the bitset NFA instead of a DFA. Returns false
+ if the NFA cannot decide this token; res is undefined then.
+ */
+bool bnfa_scan(bnfa_s *nfa, char *buf, match_s *res)
+{
+    size_t i;
+    uint16_t m;
+    int r;
+    uint32_t tmask = 0;
+    match_s tent[DFA_MAXTRACK];
+    
+    for (m = 0; m < nfa->nmachs; m++) {
+        res[m].n = 0;
+        res[m].success = false;
+        res[m].attribute = 0;
+        res[m].stype = NULL;
+        res[m].overflow.str = NULL;
+        res[m].overflow.len = 0;
+    }
+    for (i = 0, r = bnfa_start(nfa); r == BNFA_LIVE; r = bnfa_step(nfa, (uint8_t)buf[i++]))
+        dfa_settle(nfa->bitmach, &nfa->info, i, res, tent, &tmask);
+    if (r == BNFA_FAIL)
+        return false;
+    dfa_confirm(nfa->bitmach, res, tent, tmask);
+    return true;
+}
+
+/*
+ Same as dfa_scan over the lazy DFA, which builds the states it reaches.
+ */
+bool ldfa_scan(ldfa_s *l, char *buf, match_s *res)
+{
+    size_t i;
+    uint16_t m;
+    int32_t state;
+    uint32_t tmask = 0;
+    match_s tent[DFA_MAXTRACK];
+    
+    for (m = 0; m < l->nfa->nmachs; m++) {
+        res[m].n = 0;
+        res[m].success = false;
+        res[m].attribute = 0;
+        res[m].stype = NULL;
+        res[m].overflow.str = NULL;
+        res[m].overflow.len = 0;
+    }
+    for (i = 0, state = ldfa_start(l); state > DFA_DEAD; state = ldfa_next(l, state, (uint8_t)buf[i++]))
+        dfa_settle(l->nfa->bitmach, &l->info[state], i, res, tent, &tmask);
+    if (state == LDFA_FAIL)
+        return false;
+    dfa_confirm(l->nfa->bitmach, res, tent, tmask);
+    return true;
+}
+
+match_s dfa_match(dfa_s *dfa, char *buf)
+{
+    match_s res;
+    
+    dfa_scan(dfa, buf, &res);
+    return res;
+}
+
+void dfa_setmatch(match_s *m, dfa_accept_s *accept, size_t n)
+{
+    m->success = true;
+    m->n = n;
+    m->attribute = accept->attribute;
+    m->stype = accept->stype;
+    m->overflow.str = NULL;
+    m->overflow.len = 0;
+}
+
+/*
+ Drops the tentative accepts a state kills, confirms the ones whose
+ referenced machine stopped running, then records the state's own accepts.
+ A final accept of a machine supersedes that machine's earlier tentative
+ ones.
+ */
+void dfa_settle(uint16_t *bitmach, dfa_info_s *info, size_t n, match_s *res, match_s *tent, uint32_t *tmask)
+{
+    uint16_t i;
+    uint8_t b;
+    
+    if (*tmask) {
+        *tmask &= ~info->kill;
+        dfa_confirm(bitmach, res, tent, *tmask & ~info->live);
+        *tmask &= info->live;
+    }
+    for (i = 0; i < info->naccept; i++) {
+        if (info->accept[i].pend < 0) {
+            dfa_setmatch(&res[info->accept[i].mach], &info->accept[i], n);
+            for (b = 0; *tmask && b < DFA_MAXTRACK; b++) {
+                if (bitmach[b] == info->accept[i].mach)
+                    *tmask &= ~(1u << b);
+            }
+        }
+        else {
+            dfa_setmatch(&tent[info->accept[i].pend], &info->accept[i], n);
+            *tmask |= 1u << info->accept[i].pend;
+        }
+    }
+}
+
+void dfa_confirm(uint16_t *bitmach, match_s *res, match_s *tent, uint32_t mask)
+{
+    uint8_t b;
+    match_s *m;
+    
+    for (b = 0; mask; b++, mask >>= 1) {
+        m = &res[bitmach[b]];
+        if ((mask & 1) && (!m->success || tent[b].n > m->n))
+            *m = tent[b];
+    }
+}
+
+/*
+ Lexes a whole buffer ending in EOF. Large buffers are split between
+ lex_threads threads when the backend allows it (see lex_sharded).
+ */
+lextok_s lexf(lex_s *lex, char *buf, uint32_t linestart, bool listing)
+{
+    size_t len;
+    unsigned nshards = 0;
+    lexstate_s ls;
+    
+    lexstate_init(&ls, lex, -1, buf, listing);
+    lex_index(&ls, linestart);
+    len = ls.toks->lines->scanned;
+    if (lex_threads > 1 && !lex->memo && (lex->backend == LEXER_DFA || lex->backend == LEXER_NFA)) {
+        nshards = len / LEX_SHARDMIN;
+        if (nshards > lex_threads)
+            nshards = lex_threads;
+    }
+    if (nshards > 1)
+        lex_sharded(&ls, len, nshards);
+    else
+        while (lex_next(&ls));
+    free(ls.mres);
+    free(ls.text);
+    return (lextok_s){.lex = lex, .lines = ls.toks->lines->first + lineidx_find(ls.toks->lines, len), .idatt = ls.idatt, .toks = ls.toks, .stream = NULL};
+}
+
+/*
+ Splits buf into nshards pieces at newlines and lexes each on its own
+ thread, logging the effects lexing has on the lexer instead of applying
+ them. The logs are then replayed in order. A shard's tokens are only
+ used from the first point where it called lex_token at the same offset
+ the tokens before it ended on, after which both would lex alike; tokens
+ up to that point are lexed again here. Identifiers are numbered as they
+ are replayed, so the numbering is the same as lexing in one go.
+ */
+void lex_sharded(lexstate_s *ls, size_t len, unsigned nshards)
+{
+    int status;
+    unsigned i;
+    size_t j, k, start;
+    char *nl;
+    lexshard_s *shards, *w;
+    
+    shards = calloc(nshards, sizeof(*shards));
+    if (!shards) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0, start = 0; i < nshards; i++) {
+        w = &shards[i];
+        lexstate_init(&w->ls, ls->lex, -1, ls->buf, ls->listing);
+        w->ls.toks->lines = ls->toks->lines;
+        w->ls.pos = start;
+        w->ls.shard = w;
+        if (i + 1 < nshards) {
+            start = len * (i + 1) / nshards;
+            if (start < w->ls.pos)
+                start = w->ls.pos;
+            nl = memchr(&ls->buf[start], '\n', len - start);
+            start = nl ? (size_t)(nl - ls->buf) + 1 : len;
+            w->stop = start;
+        }
+        else
+            w->stop = SIZE_MAX;
+        status = pthread_create(&w->thread, NULL, lex_shardrun, w);
+        if (status) {
+            perror("Error: Could not start new thread");
+            exit(status);
+        }
+    }
+    for (i = 0; i < nshards; i++)
+        pthread_join(shards[i].thread, NULL);
+    
+    for (i = 0, j = 0; !ls->done; ) {
+        while (i + 1 < nshards && ls->pos >= shards[i].stop) {
+            i++;
+            j = 0;
+        }
+        w = &shards[i];
+        while (j < w->n && w->log[j].at < ls->pos)
+            j++;
+        if (j < w->n && w->log[j].at == ls->pos) {
+            for (; j < w->n; j++)
+                lex_replay(ls, w, &w->log[j]);
+        }
+        else
+            lex_next(ls);
+    }
+    for (i = 0; i < nshards; i++) {
+        w = &shards[i];
+        for (k = 0; k < w->n; k++)
+            free(w->log[k].errtext);
+        /* the replayed tokens' lexemes are still in the shard's text */
+        ls->toks->blocks = llconcat(w->ls.toks->blocks, ls->toks->blocks);
+        w->ls.toks->blocks = NULL;
+        w->ls.toks->text = NULL;
+        w->ls.toks->lines = NULL;
+        free_tokbuf(w->ls.toks);
+        free(w->log);
+        free(w->ls.mres);
+        free(w->ls.text);
+    }
+    free(shards);
+}
+
+void *lex_shardrun(void *arg)
+{
+    bool valid;
+    lexlog_s *e;
+    lexshard_s *w = arg;
+    lexstate_s *ls = &w->ls;
+    
+    while (!ls->done && ls->pos < w->stop) {
+        if (w->n == w->size) {
+            w->size = w->size ? 2 * w->size : 1024;
+            w->log = realloc(w->log, w->size * sizeof(*w->log));
+            if (!w->log) {
+                perror("Memory Allocation Error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        e = &w->log[w->n];
+        memset(e, 0, sizeof(*e));
+        e->at = ls->pos;
+        e->tok = lex_token(ls, &valid);
+        e->valid = valid;
+        e->end = ls->pos;
+        e->stype = ls->stype;
+        w->n++;
+    }
+    return NULL;
+}
+
+/*
+ Does what lex_token left in e for the lexer, and adds the token if
+ lex_next would have. The token's lexeme is left in the shard's text.
+ */
+void lex_replay(lexstate_s *ls, lexshard_s *w, lexlog_s *e)
+{
+    uint32_t tok;
+    tokbuf_s *from = w->ls.toks;
+    
+    tok = tokbuf_push(ls->toks, from->lexeme[e->tok], from->len[e->tok], from->off[e->tok],
+                      from->type[e->tok], from->attribute[e->tok], from->stype[e->tok]);
+    if (e->mach)
+        lex_resolve(ls, tok, e->mach);
+    else if (e->hashed)
+        hashname(ls->lex, e->hashkey, e->hashname);
+    if (e->errmsg)
+        lex_error(ls, e->errmsg, e->errtext, e->erroff);
+    ls->pos = e->end;
+    ls->stype = e->stype;
+    if (ls->toks->type[tok] == LEXTYPE_EOF)
+        ls->done = true;
+    if (e->valid || ls->head || ls->done) {
+        ls->head = true;
+        ls->toks->atom[tok] = intern(ls->toks->lexeme[tok], ls->toks->len[tok]);
+    }
+    else
+        ls->toks->n--;
+}
+
+/*
+ Brings the tokens lexf made from a buffer up to date after the oldlen
+ bytes at off were replaced by the newlen bytes now there in buf, which
+ may have moved. Lexing starts again from the start of the line the edit
+ is on, as lex_sharded does, or of an earlier line if a token runs into
+ it, and stops at the first token past the edit that starts where an old
+ one did, shifted by the edit, since every token from there on would come
+ out the same. The listing is left as it was.
+ */
+void lex_update(lextok_s *lt, char *buf, size_t off, size_t oldlen, size_t newlen)
+{
+    uint32_t lo, hi, mid, line, j, tok;
+    size_t from, noff;
+    lexstate_s ls;
+    tokbuf_s *toks = lt->toks;
+    
+    line = lineidx_find(toks->lines, off);
+    for (;;) {
+        from = toks->lines->start[line];
+        for (lo = 1, hi = toks->n; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+            if (toks->off[mid] < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == 1 || toks->off[lo - 1] + toks->len[lo - 1] <= from)
+            break;
+        line = lineidx_find(toks->lines, toks->off[lo - 1]);
+    }
+    lexstate_init(&ls, lt->lex, -1, buf, false);
+    ls.idatt = lt->idatt;
+    ls.pos = from;
+    ls.head = lo > 1;
+    for (j = lo; j < toks->n && toks->off[j] < off + oldlen; j++);
+    while ((tok = lex_next(&ls))) {
+        noff = ls.toks->off[tok];
+        /* the EOF token takes the semantic type of the token before it */
+        if (ls.toks->type[tok] == LEXTYPE_ERROR || ls.toks->type[tok] == LEXTYPE_EOF || noff < off + newlen)
+            continue;
+        while (j < toks->n && toks->off[j] - oldlen + newlen < noff)
+            j++;
+        if (j < toks->n && toks->off[j] - oldlen + newlen == noff && toks->type[j] != LEXTYPE_ERROR)
+            break;
+    }
+    if (!tok) {
+        j = toks->n;
+        tok = ls.toks->n;
+    }
+    tokbuf_splice(toks, lo, j, ls.toks, tok);
+    for (j = lo + tok - 1; j < toks->n; j++)
+        toks->off[j] = toks->off[j] - oldlen + newlen;
+    lineidx_edit(toks->lines, buf, off, oldlen, newlen);
+    lt->lines = toks->lines->first + lineidx_find(toks->lines, toks->lines->scanned);
+    lt->idatt = ls.idatt;
+    
+    toks->blocks = llconcat(ls.toks->blocks, toks->blocks);
+    ls.toks->blocks = NULL;
+    ls.toks->text = NULL;
+    free_tokbuf(ls.toks);
+    free(ls.mres);
+    free(ls.text);
+}
+
+/*
+ Starts lexing the file open on fd, which the parser then pulls tokens from
+ as it goes (see lex_next).
+ */
+lextok_s lex_stream(lex_s *lex, int fd, uint32_t linestart, bool listing)
+{
+    lexstate_s *ls;
+    
+    ls = lexstate_s_(lex, fd, linestart, listing);
+    lex_next(ls);
+    return (lextok_s){.lex = lex, .lines = linestart, .toks = ls->toks, .stream = ls};
+}
+
+lexstate_s *lexstate_s_(lex_s *lex, int fd, uint32_t linestart, bool listing)
+{
+    lexstate_s *ls;
+    
+    ls = malloc(sizeof(*ls));
+    if (!ls) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    lexstate_init(ls, lex, fd, NULL, listing);
+    lex_index(ls, linestart);
+    return ls;
+}
+
+void lexstate_init(lexstate_s *ls, lex_s *lex, int fd, char *buf, bool listing)
+{
+    ls->lex = lex;
+    ls->fd = fd;
+    ls->listing = listing;
+    ls->head = false;
+    ls->done = false;
+    ls->eof = fd < 0;
+    ls->idatt = 0;
+    ls->stype = NULL;
+    ls->listed = 0;
+    ls->base = 0;
+    ls->buf = buf;
+    ls->pos = 0;
+    ls->end = 0;
+    ls->size = 0;
+    ls->lookahead = LEX_LOOKAHEAD;
+    ls->text = NULL;
+    ls->textsize = 0;
+    ls->toks = tokbuf_s_();
+    ls->shard = NULL;
+    ls->mres = NULL;
+    if (lex->dfa || lex->bnfa || lex->ldfa) {
+        ls->mres = malloc((lex->nmachs ? lex->nmachs : 1) * sizeof(*ls->mres));
+        if (!ls->mres) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (fd >= 0) {
+        ls->size = 2 * LEX_LOOKAHEAD;
+        ls->buf = malloc(ls->size);
+        if (!ls->buf) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ Starts indexing the lines of the input, which are numbered from
+ linestart + 1 if there is a listing to add them to, and from linestart
+ otherwise. All of a buffer is indexed here, while a file is indexed as
+ it is read.
+ */
+void lex_index(lexstate_s *ls, uint32_t linestart)
+{
+    if (ls->fd >= 0)
+        lex_fill(ls, ls->lookahead);
+    if (ls->listing && *ls->buf != EOF)
+        linestart++;
+    ls->toks->lines = lineidx_s_(linestart);
+    if (ls->fd < 0)
+        lineidx_scan(ls->toks->lines, ls->buf, scan_run(ls->buf, RUN_TEXT));
+    else
+        lineidx_scan(ls->toks->lines, ls->buf, ls->end);
+    lex_listlines(ls);
+}
+
+void free_lexstate(lexstate_s *ls)
+{
+    free(ls->mres);
+    free(ls->text);
+    if (ls->fd >= 0)
+        free(ls->buf);
+    free(ls);
+}
+
+/*
+ Adds the next token to ls->toks and returns its index, or 0 after the EOF
+ token. Error tokens ahead of the first good token are dropped.
+ */
+uint32_t lex_next(lexstate_s *ls)
+{
+    bool valid;
+    uint32_t tok;
+    
+    while (!ls->done) {
+        tok = lex_token(ls, &valid);
+        if (valid || ls->head || ls->done) {
+            ls->head = true;
+            ls->toks->atom[tok] = intern(ls->toks->lexeme[tok], ls->toks->len[tok]);
+            return tok;
+        }
+        tokbuf_pop(ls->toks);
+    }
+    return 0;
+}
+
+tokbuf_s *tokbuf_s_(void)
+{
+    tokbuf_s *toks;
+    
+    toks = calloc(1, sizeof(*toks));
+    if (!toks) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    tokbuf_push(toks, "", 0, 0, LEXTYPE_ERROR, LEXATTR_DEFAULT, NULL);
+    return toks;
+}
+
+/*
+ Adds a token, copying its lexeme into the buffer's text.
+ */
+uint32_t tokbuf_add(tokbuf_s *toks, char *lexeme, size_t len, size_t off, uint16_t type, uint16_t attribute, char *stype)
+{
+    char *text;
+    
+    if (toks->textused + len + 1 > toks->textsize) {
+        toks->textsize = len + 1 > TOKBUF_TEXTBLOCK ? len + 1 : TOKBUF_TEXTBLOCK;
+        toks->text = malloc(toks->textsize);
+        if (!toks->text) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        llpush(&toks->blocks, toks->text);
+        toks->textused = 0;
+    }
+    text = &toks->text[toks->textused];
+    memcpy(text, lexeme, len);
+    text[len] = '\0';
+    toks->textused += len + 1;
+    return tokbuf_push(toks, text, len, off, type, attribute, stype);
+}
+
+/*
+ Adds a token whose lexeme is already somewhere that outlives the buffer.
+ */
+uint32_t tokbuf_push(tokbuf_s *toks, char *lexeme, size_t len, size_t off, uint16_t type, uint16_t attribute, char *stype)
+{
+    if (toks->n == toks->size)
+        tokbuf_grow(toks, toks->n + 1);
+    toks->type[toks->n] = type;
+    toks->attribute[toks->n] = attribute;
+    toks->off[toks->n] = off;
+    toks->len[toks->n] = len;
+    toks->atom[toks->n] = 0;
+    toks->lexeme[toks->n] = lexeme;
+    toks->stype[toks->n] = stype;
+    return toks->n++;
+}
+
+/*
+ Makes room for n tokens.
+ */
+void tokbuf_grow(tokbuf_s *toks, uint32_t n)
+{
+    if (n > toks->size) {
+        if (!toks->size)
+            toks->size = TOKBUF_INITSIZE;
+        while (n > toks->size)
+            toks->size *= 2;
+        toks->type = realloc(toks->type, toks->size * sizeof(*toks->type));
+        toks->attribute = realloc(toks->attribute, toks->size * sizeof(*toks->attribute));
+        toks->off = realloc(toks->off, toks->size * sizeof(*toks->off));
+        toks->len = realloc(toks->len, toks->size * sizeof(*toks->len));
+        toks->atom = realloc(toks->atom, toks->size * sizeof(*toks->atom));
+        toks->lexeme = realloc(toks->lexeme, toks->size * sizeof(*toks->lexeme));
+        toks->stype = realloc(toks->stype, toks->size * sizeof(*toks->stype));
+        if (!toks->type || !toks->attribute || !toks->off || !toks->len || !toks->atom || !toks->lexeme || !toks->stype) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ Replaces the tokens from up to to with tokens 1 up to n of src, whose
+ lexemes are only pointed to.
+ */
+void tokbuf_splice(tokbuf_s *toks, uint32_t from, uint32_t to, tokbuf_s *src, uint32_t n)
+{
+    uint32_t dest = from + n - 1, tail = toks->n - to;
+    
+    tokbuf_grow(toks, toks->n - (to - from) + n - 1);
+    memmove(&toks->type[dest], &toks->type[to], tail * sizeof(*toks->type));
+    memmove(&toks->attribute[dest], &toks->attribute[to], tail * sizeof(*toks->attribute));
+    memmove(&toks->off[dest], &toks->off[to], tail * sizeof(*toks->off));
+    memmove(&toks->len[dest], &toks->len[to], tail * sizeof(*toks->len));
+    memmove(&toks->atom[dest], &toks->atom[to], tail * sizeof(*toks->atom));
+    memmove(&toks->lexeme[dest], &toks->lexeme[to], tail * sizeof(*toks->lexeme));
+    memmove(&toks->stype[dest], &toks->stype[to], tail * sizeof(*toks->stype));
+    memcpy(&toks->type[from], &src->type[1], (n - 1) * sizeof(*toks->type));
+    memcpy(&toks->attribute[from], &src->attribute[1], (n - 1) * sizeof(*toks->attribute));
+    memcpy(&toks->off[from], &src->off[1], (n - 1) * sizeof(*toks->off));
+    memcpy(&toks->len[from], &src->len[1], (n - 1) * sizeof(*toks->len));
+    memcpy(&toks->atom[from], &src->atom[1], (n - 1) * sizeof(*toks->atom));
+    memcpy(&toks->lexeme[from], &src->lexeme[1], (n - 1) * sizeof(*toks->lexeme));
+    memcpy(&toks->stype[from], &src->stype[1], (n - 1) * sizeof(*toks->stype));
+    toks->n = dest + tail;
+}
+
+/*
+ Drops the last token, along with its lexeme if it was the last one
+ written.
+ */
+void tokbuf_pop(tokbuf_s *toks)
+{
+    toks->n--;
+    if (toks->text && toks->lexeme[toks->n] + toks->len[toks->n] + 1 == &toks->text[toks->textused])
+        toks->textused -= toks->len[toks->n] + 1;
+}
+
+/*
+ Copies the tokens into a list of token_s, for code that walks tokens by
+ their links. lexeme_ points at the whole lexeme in toks' text.
+ */
+token_s *tokbuf_list(tokbuf_s *toks)
+{
+    uint32_t i;
+    token_s *head = NULL, *tail = NULL, *tok;
+    
+    for (i = 1; i < toks->n; i++) {
+        tok = calloc(1, sizeof(*tok));
+        if (!tok) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        tok->type.val = toks->type[i];
+        tok->type.attribute = toks->attribute[i];
+        tok->lineno = tokbuf_lineno(toks, i);
+        tok->stype = toks->stype[i];
+        tok->atom = toks->atom[i];
+        snprintf(tok->lexeme, sizeof(tok->lexeme), "%s", toks->lexeme[i]);
+        tok->lexeme_ = toks->lexeme[i];
+        if (!head)
+            head = tok;
+        else {
+            tail->next = tok;
+            tok->prev = tail;
+        }
+        tail = tok;
+    }
+    return head;
+}
+
+void free_tokbuf(tokbuf_s *toks)
+{
+    llist_s *node;
+    
+    while ((node = llpop(&toks->blocks))) {
+        free(node->ptr);
+        free(node);
+    }
+    free(toks->type);
+    free(toks->attribute);
+    free(toks->off);
+    free(toks->len);
+    free(toks->atom);
+    free(toks->lexeme);
+    free(toks->stype);
+    if (toks->lines)
+        free_lineidx(toks->lines);
+    free(toks);
+}
+
+uint32_t tokbuf_lineno(tokbuf_s *toks, uint32_t tok)
+{
+    if (!toks->lines)
+        return 0;
+    return toks->lines->first + lineidx_find(toks->lines, toks->off[tok]);
+}
+
+uint32_t tokbuf_column(tokbuf_s *toks, uint32_t tok)
+{
+    if (!toks->lines)
+        return 0;
+    return toks->off[tok] - toks->lines->start[lineidx_find(toks->lines, toks->off[tok])] + 1;
+}
+
+lineidx_s *lineidx_s_(uint32_t first)
+{
+    lineidx_s *idx;
+    
+    idx = malloc(sizeof(*idx));
+    if (!idx) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    idx->first = first;
+    idx->size = LINEIDX_INITSIZE;
+    idx->start = malloc(idx->size * sizeof(*idx->start));
+    if (!idx->start) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    idx->start[0] = 0;
+    idx->n = 1;
+    idx->scanned = 0;
+    return idx;
+}
+
+/*
+ Indexes the len bytes at buf, which are the next ones of the source.
+ */
+void lineidx_scan(lineidx_s *idx, const char *buf, size_t len)
+{
+    size_t n;
+    
+    n = scan_newlines(buf, len, idx->scanned, NULL);
+    if (idx->n + n > idx->size) {
+        while (idx->n + n > idx->size)
+            idx->size *= 2;
+        idx->start = realloc(idx->start, idx->size * sizeof(*idx->start));
+        if (!idx->start) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (n)
+        idx->n += scan_newlines(buf, len, idx->scanned, &idx->start[idx->n]);
+    idx->scanned += len;
+}
+
+/*
+ Returns i for the line first + i that off is on.
+ */
+uint32_t lineidx_find(lineidx_s *idx, size_t off)
+{
+    uint32_t lo = 0, hi = idx->n - 1, mid;
+    
+    while (lo < hi) {
+        mid = hi - (hi - lo) / 2;
+        if (idx->start[mid] <= off)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ Drops the lines starting in the oldlen bytes replaced at off and adds
+ those starting in the newlen bytes now at buf[off].
+ */
+void lineidx_edit(lineidx_s *idx, char *buf, size_t off, size_t oldlen, size_t newlen)
+{
+    uint32_t a, b, i, n;
+    
+    a = lineidx_find(idx, off) + 1;
+    b = lineidx_find(idx, off + oldlen) + 1;
+    n = scan_newlines(&buf[off], newlen, off, NULL);
+    if (idx->n - (b - a) + n > idx->size) {
+        while (idx->n - (b - a) + n > idx->size)
+            idx->size *= 2;
+        idx->start = realloc(idx->start, idx->size * sizeof(*idx->start));
+        if (!idx->start) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(&idx->start[a + n], &idx->start[b], (idx->n - b) * sizeof(*idx->start));
+    scan_newlines(&buf[off], newlen, off, &idx->start[a]);
+    idx->n = idx->n - (b - a) + n;
+    for (i = a + n; i < idx->n; i++)
+        idx->start[i] = idx->start[i] - oldlen + newlen;
+    idx->scanned = idx->scanned - oldlen + newlen;
+}
+
+void free_lineidx(lineidx_s *idx)
+{
+    free(idx->start);
+    free(idx);
+}
+
+/*
+ Makes sure the window holds need bytes past pos, or the rest of the file,
+ followed by an EOF byte, and indexes the bytes read. Bytes before pos are
+ dropped, except for the start of a listing line whose end has not been
+ read yet.
+ */
+void lex_fill(lexstate_s *ls, size_t need)
+{
+    ssize_t n;
+    size_t keep, last;
+    lineidx_s *idx = ls->toks->lines;
+    linetable_s *listing = ls->lex->listing;
+    
+    if (ls->eof || ls->end - ls->pos >= need)
+        return;
+    keep = ls->pos;
+    if (ls->listing && ls->listed && !listing->table[listing->nlines - 1].line) {
+        last = idx->start[idx->n - 1] - ls->base;
+        if (last < keep)
+            keep = last;
+    }
+    memmove(ls->buf, &ls->buf[keep], ls->end - keep);
+    ls->pos -= keep;
+    ls->end -= keep;
+    ls->base += keep;
+    if (ls->pos + need >= ls->size) {
+        ls->size = 2 * (ls->pos + need);
+        ls->buf = realloc(ls->buf, ls->size);
+        if (!ls->buf) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (!ls->eof && ls->end - ls->pos < need) {
+        n = read(ls->fd, &ls->buf[ls->end], ls->size - 1 - ls->end);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("File IO Error");
+            exit(EXIT_FAILURE);
+        }
+        if (!n)
+            ls->eof = true;
+        ls->end += n;
+    }
+    ls->buf[ls->end] = EOF;
+    if (idx) {
+        lineidx_scan(idx, &ls->buf[idx->scanned - ls->base], ls->base + ls->end - idx->scanned);
+        lex_listlines(ls);
+    }
+}
+
+/*
+ Adds the lines indexed since the last call to the listing. The lines of
+ a buffer stay where they are, while those of a file are copied once
+ their end has been read, since the window moves on.
+ */
+void lex_listlines(lexstate_s *ls)
+{
+    uint32_t i, row;
+    size_t from, to;
+    char *line;
+    lineidx_s *idx = ls->toks->lines;
+    
+    if (!ls->listing || !idx->scanned)
+        return;
+    if (ls->fd < 0) {
+        for (; ls->listed < idx->n; ls->listed++)
+            addline(&ls->lex->listing, &ls->buf[idx->start[ls->listed]]);
+        return;
+    }
+    i = ls->listed ? ls->listed - 1 : 0;
+    for (; ls->listed < idx->n; ls->listed++)
+        addline(&ls->lex->listing, NULL);
+    row = ls->lex->listing->nlines - ls->listed;
+    for (; i < idx->n && (i + 1 < idx->n || ls->eof); i++) {
+        if (ls->lex->listing->table[row + i].line)
+            continue;
+        from = idx->start[i] - ls->base;
+        to = (i + 1 < idx->n ? idx->start[i + 1] : idx->scanned) - ls->base;
+        line = malloc(to - from + 1);
+        if (!line) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(line, &ls->buf[from], to - from);
+        line[to - from] = EOF;
+        ls->lex->listing->table[row + i].line = line;
+    }
+}
+
+void lex_skipspace(lexstate_s *ls)
+{
+    for (;;) {
+        lex_fill(ls, ls->lookahead);
+        ls->pos += scan_run(&ls->buf[ls->pos], RUN_SPACE);
+        if (ls->eof || ls->pos < ls->end)
+            return;
+    }
+}
+
+/*
+ Copies the n bytes at buf into the state's scratch buffer as a string.
+ The input itself is left alone, as other threads may be reading it.
+ */
+char *lex_text(lexstate_s *ls, char *buf, size_t n)
+{
+    if (n + 1 > ls->textsize) {
+        ls->textsize = 2 * (n + 1) > MAX_LEXLEN + 1 ? 2 * (n + 1) : MAX_LEXLEN + 1;
+        ls->text = realloc(ls->text, ls->textsize);
+        if (!ls->text) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(ls->text, buf, n);
+    ls->text[n] = '\0';
+    return ls->text;
+}
+
+void lex_hashname(lexstate_s *ls, unsigned long token_val, char *name)
+{
+    lexlog_s *e;
+    
+    if (ls->shard) {
+        e = &ls->shard->log[ls->shard->n];
+        e->hashed = true;
+        e->hashkey = token_val;
+        e->hashname = name;
+    }
+    else
+        hashname(ls->lex, token_val, name);
+}
+
+/*
+ Records an error for the listing at off.
+ */
+void lex_error(lexstate_s *ls, const char *errmsg, char *lexeme, size_t off)
+{
+    uint32_t i, lineno;
+    lexlog_s *e;
+    lineidx_s *idx = ls->toks->lines;
+    
+    if (!ls->listing)
+        return;
+    if (ls->shard) {
+        e = &ls->shard->log[ls->shard->n];
+        e->errmsg = errmsg;
+        e->erroff = off;
+        e->errtext = strdup(lexeme);
+        if (!e->errtext) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        i = lineidx_find(idx, off);
+        lineno = idx->first + i;
+        addlexerror(ls->lex->listing, make_lexerr(errmsg, lineno, off - idx->start[i] + 1, lexeme), lineno);
+    }
+}
+
+/*
+ Gives a token that is not a keyword its identifier entry, adding one for
+ identifiers seen for the first time.
+ */
+void lex_resolve(lexstate_s *ls, uint32_t tok, mach_s *mach)
+{
+    char *name;
+    tlookup_s lookup;
+    sem_type_s init_type;
+    lex_s *lex = ls->lex;
+    
+    name = ls->toks->lexeme[tok];
+    lookup = idtable_lookup(lex->idtable, name);
+    if (lookup.is_found) {
+        ls->toks->type[tok] = lookup.tdat.itype;
+        ls->toks->attribute[tok] = lookup.tdat.att;
+        hashname(lex, lookup.tdat.itype, name);
+    }
+    else if (mach->attr_id) {
+        init_type.type = ATTYPE_NULL;
+        ls->idatt++;
+        ls->toks->attribute[tok] = ls->idatt;
+        idtable_insert(lex->idtable, name, (tdat_s){.is_string = false, .itype = mach->nterm->type.val, .att = ls->idatt, .type = init_type});
+        hashname(lex, lex->typestart, mach->nterm->lexeme);
+    }
+    else
+        hashname(lex, lex->typestart, mach->nterm->lexeme);
+}
+
+/*
+ Lexes one token. valid is set for the tokens that may start the token
+ list, which excludes errors.
+ */
+uint32_t lex_token(lexstate_s *ls, bool *valid)
+{
+    bool scanned;
+    uint16_t m;
+    uint32_t f, tok;
+    size_t reach, off;
+    mach_s *mach, *bmach;
+    match_s res, best;
+    char c[2], *buf, *text;
+    tdat_s *kwdat;
+    overflow_s overflow;
+    lex_s *lex = ls->lex;
+    match_s *mres = ls->mres;
+    
+    c[1] = '\0';
+    *valid = false;
+    lex_fill(ls, ls->lookahead);
+    if (ls->buf[ls->pos] != EOF) {
+        ls->stype = NULL;
+        lex_skipspace(ls);
+    }
+    buf = &ls->buf[ls->pos];
+    if (*buf == EOF) {
+        tok = tokbuf_add(ls->toks, "$", 1, ls->base + ls->pos, LEXTYPE_EOF, LEXATTR_DEFAULT, ls->stype);
+        lex_hashname(ls, LEXTYPE_EOF, "$");
+        ls->done = true;
+        return tok;
+    }
+    for (;;) {
+        best.attribute = 0;
+        best.n = 0;
+        best.success = false;
+        best.stype = NULL;
+        overflow.str = NULL;
+        overflow.len = 0;
+        bmach = NULL;
+        reach = 0;
+        scanned = false;
+        if (lex->backend == LEXER_DFA && lex->dfa) {
+            dfa_scan(lex->dfa, buf, mres);
+            scanned = true;
+        }
+        else if (lex->backend == LEXER_BITSET && lex->bnfa)
+            scanned = bnfa_scan(lex->bnfa, buf, mres);
+        else if (lex->backend == LEXER_LAZY && lex->ldfa)
+            scanned = ldfa_scan(lex->ldfa, buf, mres);
+        if (lex->memo)
+            nfamemo_reset(lex->memo, buf);
+        for (f = lex->firstpos[(uint8_t)*buf]; f < lex->firstpos[(uint8_t)*buf + 1]; f++) {
+            m = lex->first[f];
+            mach = lex->machv[m];
+            if (scanned)
+                res = mres[m];
+            else if (lex->backend == LEXER_DFA && mach->dfa)
+                res = dfa_match(mach->dfa, buf);
+            else
+                res = nfa_match(lex, mach->nfa, mach->nfa->start, buf, NULL);
+            if (res.n > reach)
+                reach = res.n;
+            if (mach->unlimited || (!res.overflow.str &&  res.n <= mach->lexlen)) {
+                if (res.success && !mach->composite && res.n > best.n) {
+                    best = res;
+                    bmach = mach;
+                }
+            }
+            else {
+                if (mach->unlimited || !res.overflow.str) {
+                    overflow.str = buf;
+                    overflow.len = res.n;
+                    best.success = false;
+                }
+                else
+                    overflow = res.overflow;
+            }
+        }
+        /* a match running close to the end of the window may go on past it */
+        if (ls->eof || reach <= ls->lookahead / 2)
+            break;
+        ls->lookahead *= 2;
+        lex_fill(ls, ls->lookahead);
+        buf = &ls->buf[ls->pos];
+    }
+    off = ls->base + ls->pos;
+    c[0] = buf[best.n];
+    text = lex_text(ls, buf, best.n);
+    if (best.success) {
+        if (bmach->unlimited || best.n <= bmach->lexlen) {
+            kwdat = kwhash_lookup(lex->kwhash, text, best.n);
+            if (kwdat) {
+                tok = tokbuf_add(ls->toks, text, best.n, off, kwdat->itype, best.attribute, best.stype);
+                lex_hashname(ls, kwdat->itype, ls->toks->lexeme[tok]);
+            }
+            else {
+                tok = tokbuf_add(ls->toks, text, best.n, off, bmach->nterm->type.val, best.attribute, best.stype);
+                if (ls->shard)
+                    ls->shard->log[ls->shard->n].mach = bmach;
+                else
+                    lex_resolve(ls, tok, bmach);
+            }
+            *valid = true;
+        }
+        else {
+            tok = tokbuf_add(ls->toks, c, 1, off + best.n, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype);
+            lex_error(ls, LERR_TOOLONG, text, off);
+        }
+    }
+    else if (overflow.str) {
+        text = lex_text(ls, buf, overflow.len);
+        tok = tokbuf_add(ls->toks, text, overflow.len, off, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype);
+        lex_error(ls, LERR_TOOLONG, text, off);
+        best.n = overflow.len;
+    }
+    else {
+        kwdat = kwhash_lookup(lex->kwhash, c, 1);
+        if (kwdat) {
+            tok = tokbuf_add(ls->toks, c, 1, off, kwdat->itype, LEXATTR_DEFAULT, best.stype);
+            lex_hashname(ls, kwdat->itype, NULL);
+            *valid = true;
+        }
+        else {
+            tok = tokbuf_add(ls->toks, c, 1, off, LEXTYPE_ERROR, LEXATTR_DEFAULT, best.stype);
+            if (best.n) {
+                assert(*text != EOF);
+                lex_error(ls, LERR_UNKNOWNSYM, text, off);
+            }
+            else {
+                assert(!ls->listing || c[0] != EOF);
+                lex_error(ls, LERR_UNKNOWNSYM, c, off + best.n);
+            }
+        }
+    }
+    ls->stype = best.stype;
+    ls->pos += best.n ? best.n : 1;
+    return tok;
+}
+
+char *make_lexerr(const char *errmsg, int lineno, int column, char *lexeme)
+{
+    char *error;
+    size_t errsize;
+    
+    errsize = strlen(errmsg) + strlen(lexeme) + 2 * INT_CHAR_WIDTH;
+    error = calloc(1, errsize);
+    if (!error) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(error, errmsg, lineno, column, lexeme);
+    error[errsize-1] = '\n';
+    return error;
+}
+
+mach_s *getmach(lex_s *lex, char *id)
+{
+    mach_s *iter;
+    
+    for (iter = lex->machs; iter && strcmp(iter->nterm->lexeme, id); iter = iter->next);
+    if (!iter) {
+        fprintf(stderr, "Regex Error: Regex %s never defined", id);
+        exit(EXIT_FAILURE);
+    }
+    return iter;
+}
+
+/*
+ Builds the table of which machines can start a token with each byte, so
+ lexf only tries those. Machines reached through a cycle of references are
+ assumed to start with anything.
+ */
+void lex_buildfirst(lex_s *lex)
+{
+    int c;
+    uint16_t m;
+    uint32_t *count;
+    mach_s *mach;
+    machfirst_s *firsts;
+
+    lex->machv = malloc((lex->nmachs ? lex->nmachs : 1) * sizeof(*lex->machv));
+    firsts = calloc(lex->nmachs ? lex->nmachs : 1, sizeof(*firsts));
+    lex->firstpos = calloc(DFA_NSYMBOLS + 1, sizeof(*lex->firstpos));
+    count = calloc(DFA_NSYMBOLS, sizeof(*count));
+    if (!lex->machv || !firsts || !lex->firstpos || !count) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (m = 0, mach = lex->machs; mach; m++, mach = mach->next)
+        lex->machv[m] = mach;
+    for (m = 0; m < lex->nmachs; m++) {
+        mach_first(lex, firsts, lex->machv[m]);
+        for (c = 0; c < DFA_NSYMBOLS; c++) {
+            if (firsts[m].set[c / 8] & (1 << (c % 8)))
+                lex->firstpos[c + 1]++;
+        }
+    }
+    for (c = 0; c < DFA_NSYMBOLS; c++)
+        lex->firstpos[c + 1] += lex->firstpos[c];
+    lex->first = malloc((lex->firstpos[DFA_NSYMBOLS] ? lex->firstpos[DFA_NSYMBOLS] : 1) * sizeof(*lex->first));
+    if (!lex->first) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (m = 0; m < lex->nmachs; m++) {
+        for (c = 0; c < DFA_NSYMBOLS; c++) {
+            if (firsts[m].set[c / 8] & (1 << (c % 8)))
+                lex->first[lex->firstpos[c] + count[c]++] = m;
+        }
+    }
+    free(count);
+    free(firsts);
+}
+
+machfirst_s *mach_first(lex_s *lex, machfirst_s *firsts, mach_s *mach)
+{
+    uint16_t m;
+    llist_s *visited = NULL;
+    machfirst_s *first;
+
+    for (m = 0; lex->machv[m] != mach; m++);
+    first = &firsts[m];
+    if (first->state == 1) {
+        memset(first->set, 0xFF, sizeof(first->set));
+        first->nullable = true;
+    }
+    if (first->state)
+        return first;
+    first->state = 1;
+    first->nullable = node_first(lex, firsts, mach->nfa, mach->nfa->start, first->set, &visited);
+    first->state = 2;
+    free_llist(visited);
+    return first;
+}
+
+/*
+ Adds the bytes that can be read first from node on to set. Returns true
+ if the final state can be reached from node without reading anything.
+ */
+bool node_first(lex_s *lex, machfirst_s *firsts, nfa_s *nfa, nfa_node_s *node, uint8_t *set, llist_s **visited)
+{
+    int i;
+    uint16_t e;
+    bool nullable = node == nfa->final;
+    nfa_edge_s *edge;
+    machfirst_s *sub;
+
+    if (llcontains(*visited, node))
+        return false;
+    llpush(visited, node);
+    for (e = 0; e < node->nedges; e++) {
+        edge = node->edges[e];
+        switch (edge->token->type.val) {
+            case LEXTYPE_EPSILON:
+                nullable |= node_first(lex, firsts, nfa, edge->state, set, visited);
+                break;
+            case LEXTYPE_NONTERM:
+                sub = mach_first(lex, firsts, getmach(lex, edge->token->lexeme));
+                for (i = 0; i < DFA_NSYMBOLS / 8; i++)
+                    set[i] |= sub->set[i];
+                if (sub->nullable)
+                    nullable |= node_first(lex, firsts, nfa, edge->state, set, visited);
+                break;
+            case LEXTYPE_DOT:
+                memset(set, 0xFF, DFA_NSYMBOLS / 8);
+                break;
+            default:
+                if (edge->negate)
+                    memset(set, 0xFF, DFA_NSYMBOLS / 8);
+                else if (edge->token->lexeme[0])
+                    set[(uint8_t)edge->token->lexeme[0] / 8] |= 1 << ((uint8_t)edge->token->lexeme[0] % 8);
+                break;
+        }
+    }
+    return nullable;
+}
+
+void settype(lex_s *lex, char *id, sem_type_s type)
+{
+   /* tdat_s tdat;
+    
+    tdat = idtable_lookup(lex->idtable, id).tdat;
+    tdat.type = type;
+    idtable_set(lex->idtable, id, tdat);*/
+    check_id_s check = check_id(id);
+    
+    if(check.isfound)
+        *check.type = type;
+}
+
+sem_type_s gettype(lex_s *lex, char *id)
+{
+    check_id_s check;
+    sem_type_s init = {0};
+    
+    init.type = ATTYPE_NULL;
+    check = check_id(id);
+    if(check.isfound)
+        return *check.type;
+    return init;
+}
+
+toktype_s gettoktype(lex_s *lex, char *id)
+{
+    toktype_s type;
     size_t len;
+    uint32_t i;
     lextok_s ltok;
-    token_s *iter;
     
     len = strlen(id);
     id[len] = EOF;
@@ -1691,12 +3285,12 @@ toktype_s gettoktype(lex_s *lex, char *id)
     id[len] = '\0';
     type.val = LEXTYPE_ERROR;
     type.attribute = LEXATTR_DEFAULT;
-    for (iter = ltok.tokens; iter; iter = iter->next) {
-        if (iter->type.val == LEXTYPE_ERROR || iter->type.val == LEXTYPE_EOF)
+    for (i = 1; i < ltok.toks->n; i++) {
+        if (ltok.toks->type[i] == LEXTYPE_ERROR || ltok.toks->type[i] == LEXTYPE_EOF)
             continue;
-        type = iter->type;
+        type.val = ltok.toks->type[i];
+        type.attribute = ltok.toks->attribute[i];
     }
-    iter = ltok.tokens;
     return type;
 }
 
@@ -1710,29 +3304,6 @@ inline char *getname(lex_s *lex, unsigned long token_val)
     return hashlookup(lex->tok_hash, (void *)token_val);
 }
 
-int addtok_(token_s **tlist, char *lexeme, uint32_t lineno, uint16_t type, uint16_t attribute, char *stype, bool unlimited)
-{
-    int ret;
-    char buf[MAX_LEXLEN+1], *backup = lexeme;
-    
-    if (unlimited) {
-        if(strlen(lexeme) >= MAX_LEXLEN) {
-            snprintf(buf, MAX_LEXLEN, "%s", lexeme);
-            lexeme = buf;
-        }
-        ret = addtok(tlist, lexeme, lineno, type, attribute, stype);
-        (*tlist)->lexeme_ = malloc(strlen(backup)+1);
-        if (!(*tlist)->lexeme_) {
-            perror("Memory Allocation Error");
-            exit(EXIT_FAILURE);
-        }
-        snprintf((*tlist)->lexeme_, strlen(backup)+1, "%s", backup);
-    }
-    else
-        ret = addtok(tlist, lexeme, lineno, type, attribute, stype);
-    return ret;
-}
-
 regex_match_s lex_matches(lex_s *lex, char *machid, char *str)
 {
     mach_s *m;
@@ -1742,6 +3313,8 @@ regex_match_s lex_matches(lex_s *lex, char *machid, char *str)
     
     for(m = lex->machs; m; m = m->next) {
         if(!ntstrcmp(m->nterm->lexeme, machid)) {
+            if (lex->memo)
+                nfamemo_reset(lex->memo, str);
             match = nfa_match(lex, m->nfa, m->nfa->start, str, &dummy);
             return (regex_match_s){.matched = match.success, .attribute = match.attribute};
         }
@@ -1762,6 +3335,7 @@ void push_scope(char *id)
         exit(EXIT_FAILURE);
     }
     s->id = id;
+    s->atom = intern(id, strlen(id));
     s->parent = scope_tree;
     s->last_arg_addr = -INTEGER_WIDTH;
     s->code = linetable_s_();
@@ -1793,10 +3367,11 @@ check_id_s check_id(char *id)
 {
     unsigned i;
     scope_s *iter;
+    uint32_t atom = intern(id, strlen(id));
     
     for(iter = scope_tree; iter; iter = iter->parent) {
         for(i = 0; i < iter->nentries; i++) {
-            if(!strcmp(iter->entries[i].entry, id))
+            if(iter->entries[i].atom == atom)
                 return (check_id_s){
                     .isfound = true,
                     .address = iter->entries[i].address,
@@ -1806,7 +3381,7 @@ check_id_s check_id(char *id)
                 };
         }
         for(i = 0; i < iter->nchildren; i++) {
-            if(!strcmp(iter->children[i].child->id, id)) {
+            if(iter->children[i].child->atom == atom) {
                 return (check_id_s){
                     .isfound = true,
                     .address = 0,
@@ -1823,15 +3398,17 @@ check_id_s check_id(char *id)
 bool check_redeclared(char *id)
 {
     unsigned i;
+    uint32_t atom;
     
     if(!scope_tree)
         return false;
+    atom = intern(id, strlen(id));
     for(i = 0; i < scope_tree->nentries; i++) {
-        if(!strcmp(scope_tree->entries[i].entry, id))
+        if(scope_tree->entries[i].atom == atom)
             return true;
     }
     for(i = 0; i < scope_tree->nchildren; i++) {
-        if(!strcmp(scope_tree->children[i].child->id, id))
+        if(scope_tree->children[i].child->atom == atom)
             return true;
     }
     return false;
@@ -1852,6 +3429,7 @@ void add_id(char *id, sem_type_s type, bool islocal)
         exit(EXIT_FAILURE);
     }
     scope_tree->entries[index].entry = id;
+    scope_tree->entries[index].atom = intern(id, strlen(id));
     scope_tree->entries[index].type = type;
     if(type.type == ATTYPE_ID) {
         if(!strcmp(type.str_, "integer")) {
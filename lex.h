@@ -15,6 +15,7 @@
 #define REAL_WIDTH 8
 
 #include "general.h"
+#include <sys/types.h>
 
 enum lex_attr_ {
     LEXATTR_NUM,
@@ -24,6 +25,13 @@ enum lex_attr_ {
     LEXATTR_FAKEEOF
 };
 
+enum lex_backend_ {
+    LEXER_DFA,
+    LEXER_BITSET,
+    LEXER_LAZY,
+    LEXER_NFA
+};
+
 enum lex_attr_num {
     LEXATTR_INT,
     LEXATTR_REAL,
@@ -86,6 +94,16 @@ enum lex_types_ {
 #define LEXID_START         LEXTYPE_ANNOTATE
 
 #define MAX_LEXLEN 31
+#define LEX_LOOKAHEAD 4096
+#define LEX_SHARDMIN (1 << 16)
+#define LEX_MAXTHREADS 256
+#define TOKBUF_INITSIZE 1024
+#define TOKBUF_TEXTBLOCK (1 << 16)
+#define LINEIDX_INITSIZE 256
+#define IDTABLE_INITSIZE 1024
+#define IDTABLE_NCODES 257
+#define KWHASH_MAXDISP (1 << 16)
+#define KWHASH_SAMPLESEEDS 64
 
 #define LEXATTR_DEFAULT     0
 #define LEXATTR_WSPACEEOL   1
@@ -109,14 +127,21 @@ typedef struct tdat_s tdat_s;
 typedef struct annotation_s annotation_s;
 typedef struct tlookup_s tlookup_s;
 typedef struct idtable_s idtable_s;
-typedef struct idtnode_s idtnode_s;
+typedef struct kwhash_s kwhash_s;
 typedef struct toktype_s toktype_s;
 typedef struct token_s token_s;
+typedef struct tokbuf_s tokbuf_s;
+typedef struct lineidx_s lineidx_s;
 typedef struct nfa_s nfa_s;
 typedef struct nfa_node_s nfa_node_s;
 typedef struct nfa_edge_s nfa_edge_s;
+typedef struct dfa_s dfa_s;
+typedef struct bnfa_s bnfa_s;
+typedef struct ldfa_s ldfa_s;
+typedef struct nfamemo_s nfamemo_s;
 typedef struct mach_s mach_s;
 typedef struct lextok_s lextok_s;
+typedef struct lexstate_s lexstate_s;
 typedef struct iditer_s iditer_s;
 typedef struct regex_match_s regex_match_s;
 typedef struct scope_entry_s scope_entry_s;
@@ -136,12 +161,53 @@ struct token_s
     toktype_s type;
     char *stype;
     unsigned lineno;
+    uint32_t atom;
     char lexeme[MAX_LEXLEN + 1];
     char *lexeme_;
     token_s *prev;
     token_s *next;
 };
 
+/*
+ Where the lines of a source start, as byte offsets from its start. Line
+ first starts at start[0], which is 0, and line first + i at start[i].
+ scanned is how many bytes of the source have been looked through.
+ */
+struct lineidx_s
+{
+    uint32_t first;
+    uint32_t n;
+    uint32_t size;
+    size_t *start;
+    size_t scanned;
+};
+
+/*
+ Tokens lexed from a source, kept field by field and found by index. Index
+ 0 is an empty token standing for none, the way NULL does for token_s.
+ Lexemes are written to blocks of text that never move, so a lexeme may be
+ held onto while more tokens are added. atom is set as the lexer hands a
+ token over, and stays 0 on the threads of lexf's parallel mode. off is
+ where the token starts in the source, whose lines are indexed in lines.
+ */
+struct tokbuf_s
+{
+    uint32_t n;
+    uint32_t size;
+    uint16_t *type;
+    uint16_t *attribute;
+    size_t *off;
+    uint32_t *len;
+    uint32_t *atom;
+    char **lexeme;
+    char **stype;
+    char *text;
+    size_t textused;
+    size_t textsize;
+    llist_s *blocks;
+    lineidx_s *lines;
+};
+
 struct tdat_s
 {
     bool is_string;
@@ -165,21 +231,45 @@ struct tlookup_s
 {
     bool is_found;
     tdat_s tdat;
-    idtnode_s *node;
+    uint32_t slot;
 };
 
-struct idtnode_s
+/*
+ Double array trie. The child of cell s on code c is cell base[s] + c
+ when check of that cell is s. Byte b has code b + 1 and code 0 ends a
+ word; the cell it leads to holds -(slot + 1) in base, slot being the
+ word's index in data. A check of 0 marks a free cell.
+ */
+struct idtable_s
 {
-    bool isterm;
-    char c;
-    tdat_s tdat;
-    uint8_t nchildren;
-    idtnode_s **children;
+    uint32_t size;
+    int32_t *base;
+    uint32_t *check;
+    uint32_t free;
+    uint32_t n;
+    uint32_t nslots;
+    tdat_s *data;
+    size_t maxlen;
 };
 
-struct idtable_s
+/*
+ Minimal perfect hash of the keywords, built by hash and displace. A
+ word's hash picks its bucket, and the bucket's displacement mixed into
+ the hash picks its slot. Each bucket was given the first displacement
+ sending all of its words to free slots, so a lookup compares against
+ at most one word. Bit l of lenmask is set if a keyword is l bytes long,
+ bit 63 standing for all the longer ones.
+ */
+struct kwhash_s
 {
-    idtnode_s *root;
+    uint32_t n;
+    uint32_t seed;
+    bool full;
+    uint64_t lenmask;
+    uint32_t *disp;
+    char **words;
+    uint32_t *lens;
+    tdat_s *data;
 };
 
 struct nfa_s
@@ -213,26 +303,83 @@ struct mach_s
     token_s *nterm;
     nfa_s   *nfa;
     nfa_s   *follow;
+    dfa_s   *dfa;
     mach_s *next;
 };
 
+/*
+ machv lists the machines by index, in the order of machs. The machines
+ that can start a token with byte c are first[firstpos[c]] up to
+ first[firstpos[c + 1]], by index. spechash is a hash of the regex file
+ the lexer was built from.
+ */
 struct lex_s
 {
     int typestart;
     uint16_t nmachs;
     mach_s *machs;
+    mach_s **machv;
+    uint16_t *first;
+    uint32_t *firstpos;
+    int backend;
+    dfa_s *dfa;
+    bnfa_s *bnfa;
+    ldfa_s *ldfa;
+    nfamemo_s *memo;
     idtable_s *kwtable;
     idtable_s *idtable;
+    kwhash_s *kwhash;
     hash_s *tok_hash;
     llist_s *patch;
     linetable_s *listing;
+    uint64_t spechash;
 };
 
+/*
+ stream is set when the tokens are pulled from a file as they are parsed,
+ and only the first token has been lexed. The first token is toks' token 1.
+ */
 struct lextok_s
 {
     lex_s *lex;
     uint32_t lines;
-    token_s *tokens;
+    int idatt;
+    tokbuf_s *toks;
+    lexstate_s *stream;
+};
+
+/*
+ State of lex_next. A file on fd is read through a window of the bytes
+ from pos to end, kept at least lookahead bytes long until the file runs
+ out, and base is where the window starts in the file; buf is the whole
+ input otherwise, and fd is -1. The lines of a file are indexed as they
+ are read; listed of them are in the listing, the last one without its
+ text until its end has been read. text
+ holds the lexeme being looked up, toks the tokens lexed so far, and
+ shard is set on the threads of lexf's parallel mode.
+ */
+struct lexstate_s
+{
+    lex_s *lex;
+    int fd;
+    bool listing;
+    bool head;
+    bool done;
+    bool eof;
+    int idatt;
+    char *stype;
+    uint32_t listed;
+    size_t base;
+    char *buf;
+    size_t size;
+    size_t pos;
+    size_t end;
+    size_t lookahead;
+    char *text;
+    size_t textsize;
+    tokbuf_s *toks;
+    struct lexshard_s *shard;
+    struct match_s *mres;
 };
 
 struct regex_match_s
@@ -245,6 +392,7 @@ struct scope_entry_s
 {
     int width;
     char *entry;
+    uint32_t atom;
     int address;
     sem_type_s type;
 };
@@ -257,6 +405,7 @@ struct scope_s
         scope_s *child;
     } *children;
     char *id;
+    uint32_t atom;
     char *full_id;
     int last_local_addr;
     int last_arg_addr;
@@ -278,8 +427,27 @@ struct check_id_s
 extern scope_s *scope_root;
 extern scope_s *scope_tree;
 
+extern unsigned lex_threads;
+
 extern lextok_s lexf (lex_s *lex, char *buf, uint32_t linestart, bool listing);
+extern lextok_s lex_stream(lex_s *lex, int fd, uint32_t linestart, bool listing);
+extern void lex_update(lextok_s *lt, char *buf, size_t off, size_t oldlen, size_t newlen);
+extern lexstate_s *lexstate_s_(lex_s *lex, int fd, uint32_t linestart, bool listing);
+extern void free_lexstate(lexstate_s *ls);
+extern uint32_t lex_next(lexstate_s *ls);
+extern tokbuf_s *tokbuf_s_(void);
+extern uint32_t tokbuf_add(tokbuf_s *toks, char *lexeme, size_t len, size_t off, uint16_t type, uint16_t attribute, char *stype);
+extern uint32_t tokbuf_lineno(tokbuf_s *toks, uint32_t tok);
+extern uint32_t tokbuf_column(tokbuf_s *toks, uint32_t tok);
+extern lineidx_s *lineidx_s_(uint32_t first);
+extern void lineidx_scan(lineidx_s *idx, const char *buf, size_t len);
+extern uint32_t lineidx_find(lineidx_s *idx, size_t off);
+extern void free_lineidx(lineidx_s *idx);
+extern token_s *tokbuf_list(tokbuf_s *toks);
+extern void free_tokbuf(tokbuf_s *toks);
 extern lex_s *buildlex (const char *file);
+extern lex_s *buildlex_image (uint8_t *image, size_t size);
+extern lex_s *lex_s_ (void);
 extern token_s *lexspec (const char *file, annotation_f af, void *data, bool lexmode);
 extern idtable_s *idtable_s_ (void);
 extern int ntstrcmp (char *nterm, char *str);
@@ -289,6 +457,10 @@ extern void addmachine (lex_s *lex, token_s *tok);
 extern void *idtable_insert(idtable_s *table, char *str, tdat_s tdat);
 extern void idtable_set(idtable_s *table, char *str, tdat_s tdat);
 extern tlookup_s idtable_lookup (idtable_s *table, char *str);
+extern void idtable_walk(idtable_s *table, void (*f)(char *, size_t, tdat_s *, void *), void *arg);
+extern void free_idtable(idtable_s *table);
+extern kwhash_s *kwhash_s_(idtable_s *kwtable);
+extern tdat_s *kwhash_lookup(kwhash_s *kw, const char *str, size_t len);
 extern int addtok (token_s **tlist, char *lexeme, uint32_t lineno, uint16_t type, uint16_t attribute, char *stype);
 extern inline bool hashname(lex_s *lex, unsigned long token_val, char *name);
 extern inline char *getname(lex_s *lex, unsigned long token_val);
@@ -296,6 +468,9 @@ extern void settype(lex_s *lex, char *id, sem_type_s type);
 extern sem_type_s gettype(lex_s *lex, char *id);
 extern toktype_s gettoktype (lex_s *lex, char *id);
 extern regex_match_s lex_matches(lex_s *lex, char *machid, char *str);
+extern void lex_setbackend(lex_s *lex, int backend, uint32_t cachesize);
+extern void nfamemo_enable(lex_s *lex);
+extern void print_nfamemo(lex_s *lex, void *stream);
 
 extern void push_scope(char *id);
 extern void pop_scope(void);
@@ -0,0 +1,836 @@
+/*
+ lexcache.c
+ Author: Jonathan Hamm
+
+ Description:
+    Implementation of the lexer cache. A cache file is a header followed by
+    the keywords, then each machine's token, NFA and DFA in the order of
+    lex->machs, then the combined DFA. Numbers are in the byte order of the
+    host that wrote the file, which the header records.
+
+    The tables of the DFAs are aligned to 8 bytes in the file, and loaded
+    DFAs use them where they lie in the mapping. Machines, NFAs and the
+    keyword table are rebuilt as buildlex would make them, since the rest
+    of the compiler walks them through pointers. A loaded lexer keeps its
+    mapping for the life of the program.
+ */
+
+#include "lexcache.h"
+#include "dfa.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LC_MAGIC        "PCLEXC\r\n"
+#define LC_NULLSTR      UINT32_MAX
+#define LC_STRREF       (UINT32_MAX - 1)
+#define LC_NONODE       UINT32_MAX
+
+typedef struct lchdr_s lchdr_s;
+
+/*
+ sum is a hash of everything after the header, and size the size of the
+ whole file.
+ */
+struct lchdr_s
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint64_t spechash;
+    uint64_t sum;
+    uint64_t size;
+    uint16_t maxlexlen;
+    uint16_t maxtrack;
+    uint16_t nsymbols;
+    uint16_t pad;
+};
+
+bool lexcache_enabled = true;
+
+static bool lc_checkhdr(lchdr_s *hdr, size_t size);
+
+static void lc_puttoken(lcbuf_s *b, token_s *tok);
+static void lc_putkeyword(char *word, size_t len, tdat_s *tdat, void *b);
+static void lc_putnfa(lcbuf_s *b, nfa_s *nfa);
+static bool lc_putdfa(lcbuf_s *b, dfa_s *dfa, mach_s **machs, uint16_t nmachs);
+static void lcmap_grow(lcmap_s *m);
+
+static void lc_gettoken(lcread_s *r, token_s *tok);
+static nfa_s *lc_getnfa(lcread_s *r);
+static dfa_s *lc_getdfa(lcread_s *r, mach_s *machs, uint16_t nmachs);
+static lex_s *lc_getlex(lcread_s *r);
+
+/*
+ Returns the lexer cached for spec, or NULL if there is no cache for the
+ spec's current contents.
+ */
+lex_s *lexcache_load(const char *spec)
+{
+    void *map;
+    size_t size;
+    lex_s *lex;
+
+    map = lexcache_map(spec, &size);
+    if (!map)
+        return NULL;
+
+    /*
+     The sum was checked, so only a file written by another build of this
+     version can fail here. What was read of it is not freed.
+     */
+    lex = lexcache_image(map, size);
+    if (!lex)
+        munmap(map, size);
+    return lex;
+}
+
+/*
+ Maps spec's cache file, returning NULL if there is none for the spec's
+ current contents.
+ */
+void *lexcache_map(const char *spec, size_t *size)
+{
+    char *path;
+    void *map;
+    uint64_t hash;
+    lchdr_s hdr;
+
+    if (!lc_spechash(LC_HASHINIT, spec, &hash))
+        return NULL;
+    path = lc_path(spec, LEXCACHE_SUFFIX);
+    map = lc_map(path, sizeof(hdr), size);
+    free(path);
+    if (!map)
+        return NULL;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (!lc_checkhdr(&hdr, *size) || hdr.spechash != hash
+        || hdr.sum != lc_hash(LC_HASHINIT, (uint8_t *)map + sizeof(hdr), *size - sizeof(hdr))) {
+        munmap(map, *size);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ Loads the lexer in image, the contents of a cache file, which it keeps
+ using in place. Only the header is checked against this build, not the
+ spec or the sum, and the lexer's spechash is the one image was written
+ with.
+ */
+lex_s *lexcache_image(uint8_t *image, size_t size)
+{
+    lchdr_s hdr;
+    lcread_s r;
+    lex_s *lex;
+
+    if (size < sizeof(hdr))
+        return NULL;
+    memcpy(&hdr, image, sizeof(hdr));
+    if (!lc_checkhdr(&hdr, size))
+        return NULL;
+    r.data = image;
+    r.pos = sizeof(hdr);
+    r.len = size;
+    r.bad = false;
+    lex = lc_getlex(&r);
+    if (lex)
+        lex->spechash = hdr.spechash;
+    return lex;
+}
+
+/*
+ Writes lex, as built from spec, to spec's cache file. The file is written
+ under a temporary name first, so concurrent runs never see half of it.
+ Returns false if it could not be written.
+ */
+bool lexcache_save(lex_s *lex, const char *spec)
+{
+    uint16_t nmachs = 0, i;
+    uint32_t nkw = 0;
+    int32_t typestart = lex->typestart;
+    size_t kwcount;
+    bool ok = true;
+    char *path;
+    uint8_t has;
+    lchdr_s hdr;
+    lcbuf_s b = {0};
+    mach_s *mach, **machs;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (!lc_spechash(LC_HASHINIT, spec, &hdr.spechash))
+        return false;
+    b.strings = hash_(pjw_hashf, str_isequalf);
+    memcpy(hdr.magic, LC_MAGIC, sizeof(hdr.magic));
+    hdr.version = LEXCACHE_VERSION;
+    hdr.order = LC_ORDER;
+    hdr.maxlexlen = MAX_LEXLEN;
+    hdr.maxtrack = DFA_MAXTRACK;
+    hdr.nsymbols = DFA_NSYMBOLS;
+    lc_put(&b, &hdr, sizeof(hdr));
+
+    for (mach = lex->machs; mach; mach = mach->next)
+        nmachs++;
+    machs = malloc((nmachs ? nmachs : 1) * sizeof(*machs));
+    if (!machs) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0, mach = lex->machs; mach; i++, mach = mach->next)
+        machs[i] = mach;
+
+    LC_PUT(&b, typestart);
+    LC_PUT(&b, nmachs);
+    kwcount = b.len;
+    LC_PUT(&b, nkw);
+    idtable_walk(lex->kwtable, lc_putkeyword, &b);
+    nkw = b.nkw;
+    memcpy(&b.data[kwcount], &nkw, sizeof(nkw));
+
+    for (i = 0; i < nmachs && ok; i++) {
+        mach = machs[i];
+        LC_PUT(&b, mach->unlimited);
+        LC_PUT(&b, mach->attr_id);
+        LC_PUT(&b, mach->composite);
+        LC_PUT(&b, mach->typecount);
+        LC_PUT(&b, mach->lexlen);
+        lc_puttoken(&b, mach->nterm);
+        lc_putnfa(&b, mach->nfa);
+        has = mach->dfa != NULL;
+        LC_PUT(&b, has);
+        if (has)
+            ok = lc_putdfa(&b, mach->dfa, machs, nmachs);
+    }
+    has = lex->dfa != NULL;
+    LC_PUT(&b, has);
+    if (has && ok)
+        ok = lc_putdfa(&b, lex->dfa, machs, nmachs);
+    free(machs);
+
+    hdr.size = b.len;
+    hdr.sum = lc_hash(LC_HASHINIT, b.data + sizeof(hdr), b.len - sizeof(hdr));
+    memcpy(b.data, &hdr, sizeof(hdr));
+
+    path = lc_path(spec, LEXCACHE_SUFFIX);
+    ok = ok && lc_write(path, &b);
+    free(path);
+    free(b.data);
+    free_hash(b.strings);
+    return ok;
+}
+
+bool lc_checkhdr(lchdr_s *hdr, size_t size)
+{
+    return !memcmp(hdr->magic, LC_MAGIC, sizeof(hdr->magic)) && hdr->version == LEXCACHE_VERSION && hdr->order == LC_ORDER
+        && hdr->size == size && hdr->maxlexlen == MAX_LEXLEN && hdr->maxtrack == DFA_MAXTRACK && hdr->nsymbols == DFA_NSYMBOLS;
+}
+
+/*
+ 64 bit FNV-1a, continuing from hash.
+ */
+uint64_t lc_hash(uint64_t hash, const void *data, size_t len)
+{
+    size_t i;
+    const uint8_t *p = data;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*
+ Hashes the contents of spec, continuing from hash.
+ */
+bool lc_spechash(uint64_t hash, const char *spec, uint64_t *result)
+{
+    FILE *f;
+    size_t n;
+    char buf[4096];
+    uint64_t h = hash;
+
+    f = fopen(spec, "rb");
+    if (!f)
+        return false;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        h = lc_hash(h, buf, n);
+    if (ferror(f)) {
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    *result = h;
+    return true;
+}
+
+char *lc_path(const char *spec, const char *suffix)
+{
+    char *path;
+
+    path = malloc(strlen(spec) + strlen(suffix) + 1);
+    if (!path) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(path, spec);
+    strcat(path, suffix);
+    return path;
+}
+
+/*
+ Maps the file at path privately, returning NULL if it cannot be mapped
+ or is smaller than min bytes.
+ */
+void *lc_map(const char *path, size_t min, size_t *size)
+{
+    int fd;
+    void *map;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || (size_t)st.st_size < min || !st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return map;
+}
+
+/*
+ Writes b to path. The file is written under a temporary name first, so
+ concurrent runs never see half of it.
+ */
+bool lc_write(const char *path, lcbuf_s *b)
+{
+    bool ok;
+    char *tmp;
+    FILE *f;
+
+    tmp = malloc(strlen(path) + 24);
+    if (!tmp) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(tmp, "%s.%ld", path, (long)getpid());
+    if ((f = fopen(tmp, "wb"))) {
+        ok = fwrite(b->data, 1, b->len, f) == b->len;
+        ok = !fclose(f) && ok;
+        ok = ok && !rename(tmp, path);
+        if (!ok)
+            remove(tmp);
+    }
+    else
+        ok = false;
+    free(tmp);
+    return ok;
+}
+
+void lc_put(lcbuf_s *b, const void *src, size_t n)
+{
+    if (b->len + n > b->size) {
+        while (b->len + n > b->size)
+            b->size = b->size ? 2 * b->size : 4096;
+        b->data = realloc(b->data, b->size);
+        if (!b->data) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(&b->data[b->len], src, n);
+    b->len += n;
+}
+
+void lc_align(lcbuf_s *b)
+{
+    static const uint8_t zero[LC_ALIGN];
+
+    if (b->len % LC_ALIGN)
+        lc_put(b, zero, LC_ALIGN - b->len % LC_ALIGN);
+}
+
+/*
+ A string is its length and its bytes with the terminating null, or a
+ length of LC_NULLSTR for NULL.
+ */
+void lc_putbytes(lcbuf_s *b, const char *str)
+{
+    uint32_t len = str ? strlen(str) : LC_NULLSTR;
+
+    LC_PUT(b, len);
+    if (str)
+        lc_put(b, str, len + 1);
+}
+
+/*
+ Writes a string the loaded lexer uses in place. A string written before
+ is written as LC_STRREF and the offset of its bytes instead, so equal
+ strings are loaded as one, the way the DFA builder expects annotation
+ types to be shared.
+ */
+void lc_putstr(lcbuf_s *b, char *str)
+{
+    uint32_t ref = LC_STRREF, offset;
+    void *found;
+
+    if (str && (found = hashlookup(b->strings, str))) {
+        offset = (uintptr_t)found;
+        LC_PUT(b, ref);
+        LC_PUT(b, offset);
+        return;
+    }
+    if (str)
+        hashinsert(b->strings, str, (void *)(uintptr_t)(b->len + sizeof(uint32_t)));
+    lc_putbytes(b, str);
+}
+
+void lc_puttoken(lcbuf_s *b, token_s *tok)
+{
+    LC_PUT(b, tok->type.val);
+    LC_PUT(b, tok->type.attribute);
+    LC_PUT(b, tok->lineno);
+    lc_putbytes(b, tok->lexeme);
+    lc_putstr(b, tok->stype);
+}
+
+/*
+ Keywords longer than MAX_LEXLEN are left out.
+ */
+void lc_putkeyword(char *word, size_t len, tdat_s *tdat, void *b)
+{
+    int32_t val;
+
+    if (len > MAX_LEXLEN)
+        return;
+    val = tdat->itype;
+    LC_PUT((lcbuf_s *)b, val);
+    val = tdat->att;
+    LC_PUT((lcbuf_s *)b, val);
+    lc_putbytes(b, word);
+    ((lcbuf_s *)b)->nkw++;
+}
+
+/*
+ Nodes are numbered breadth first from the start node, with the final
+ node numbered right after it, and edges name their destination by
+ number. Edges shared between nodes are written once for each node.
+ */
+void lc_putnfa(lcbuf_s *b, nfa_s *nfa)
+{
+    uint32_t i, nedges = 0, start, final, dest;
+    uint16_t j;
+    nfa_node_s *node;
+    nfa_edge_s *edge;
+    lcmap_s map = {0};
+
+    start = lcmap_index(&map, nfa->start);
+    final = nfa->final ? lcmap_index(&map, nfa->final) : LC_NONODE;
+    for (i = 0; i < map.n; i++) {
+        node = map.nodes[i];
+        nedges += node->nedges;
+        for (j = 0; j < node->nedges; j++) {
+            if (node->edges[j]->state)
+                lcmap_index(&map, node->edges[j]->state);
+        }
+    }
+    LC_PUT(b, map.n);
+    LC_PUT(b, nedges);
+    LC_PUT(b, start);
+    LC_PUT(b, final);
+    for (i = 0; i < map.n; i++) {
+        node = map.nodes[i];
+        LC_PUT(b, node->nedges);
+        for (j = 0; j < node->nedges; j++) {
+            edge = node->edges[j];
+            LC_PUT(b, edge->negate);
+            LC_PUT(b, edge->annotation.attcount);
+            LC_PUT(b, edge->annotation.attribute);
+            LC_PUT(b, edge->annotation.length);
+            lc_putstr(b, edge->annotation.type);
+            lc_puttoken(b, edge->token);
+            dest = edge->state ? lcmap_index(&map, edge->state) : LC_NONODE;
+            LC_PUT(b, dest);
+        }
+    }
+    free_lcmap(&map);
+}
+
+bool lc_putdfa(lcbuf_s *b, dfa_s *dfa, mach_s **machs, uint16_t nmachs)
+{
+    uint32_t s;
+    uint16_t i, m;
+    dfa_accept_s *accept;
+
+    LC_PUT(b, dfa->nstates);
+    LC_PUT(b, dfa->nraw);
+    LC_PUT(b, dfa->ncomb);
+    LC_PUT(b, dfa->nmachs);
+    LC_PUT(b, dfa->nclasses);
+    for (i = 0; i < dfa->nmachs; i++) {
+        for (m = 0; m < nmachs && machs[m] != dfa->machs[i]; m++);
+        if (m == nmachs)
+            return false;
+        LC_PUT(b, m);
+    }
+    lc_put(b, dfa->bitmach, sizeof(dfa->bitmach));
+    lc_put(b, dfa->classes, sizeof(dfa->classes));
+    for (s = 0; s < dfa->nstates; s++) {
+        LC_PUT(b, dfa->info[s].live);
+        LC_PUT(b, dfa->info[s].kill);
+        LC_PUT(b, dfa->info[s].naccept);
+        for (i = 0; i < dfa->info[s].naccept; i++) {
+            accept = &dfa->info[s].accept[i];
+            LC_PUT(b, accept->mach);
+            LC_PUT(b, accept->pend);
+            LC_PUT(b, accept->attribute);
+            lc_putstr(b, accept->stype);
+        }
+    }
+    lc_align(b);
+    lc_put(b, dfa->trans, (size_t)dfa->nstates * dfa->nclasses * sizeof(*dfa->trans));
+    lc_align(b);
+    lc_put(b, dfa->base, dfa->nstates * sizeof(*dfa->base));
+    lc_align(b);
+    lc_put(b, dfa->deflt, dfa->nstates * sizeof(*dfa->deflt));
+    lc_align(b);
+    lc_put(b, dfa->next, dfa->ncomb * sizeof(*dfa->next));
+    lc_align(b);
+    lc_put(b, dfa->check, dfa->ncomb * sizeof(*dfa->check));
+    lc_align(b);
+    lc_put(b, dfa->flags, dfa->nstates * sizeof(*dfa->flags));
+    return true;
+}
+
+static inline uint32_t lc_ptrhash(const void *ptr)
+{
+    return (uint32_t)(((uintptr_t)ptr >> 4) * 2654435761u);
+}
+
+uint32_t lcmap_index(lcmap_s *m, void *node)
+{
+    uint32_t i, mask;
+
+    if (2 * (m->n + 1) > m->size)
+        lcmap_grow(m);
+    mask = m->size - 1;
+    for (i = lc_ptrhash(node) & mask; m->keys[i]; i = (i + 1) & mask) {
+        if (m->keys[i] == node)
+            return m->vals[i];
+    }
+    m->keys[i] = node;
+    m->vals[i] = m->n;
+    m->nodes[m->n] = node;
+    return m->n++;
+}
+
+void free_lcmap(lcmap_s *m)
+{
+    free(m->keys);
+    free(m->vals);
+    free(m->nodes);
+}
+
+void lcmap_grow(lcmap_s *m)
+{
+    uint32_t i, j, size = m->size, mask;
+    void **keys = m->keys;
+    uint32_t *vals = m->vals;
+
+    m->size = size ? 2 * size : 64;
+    mask = m->size - 1;
+    m->keys = calloc(m->size, sizeof(*m->keys));
+    m->vals = malloc(m->size * sizeof(*m->vals));
+    m->nodes = realloc(m->nodes, m->size * sizeof(*m->nodes));
+    if (!m->keys || !m->vals || !m->nodes) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < size; i++) {
+        if (!keys[i])
+            continue;
+        for (j = lc_ptrhash(keys[i]) & mask; m->keys[j]; j = (j + 1) & mask);
+        m->keys[j] = keys[i];
+        m->vals[j] = vals[i];
+    }
+    free(keys);
+    free(vals);
+}
+
+void lc_get(lcread_s *r, void *dst, size_t n)
+{
+    if (r->bad || n > r->len - r->pos) {
+        r->bad = true;
+        memset(dst, 0, n);
+        return;
+    }
+    memcpy(dst, &r->data[r->pos], n);
+    r->pos += n;
+}
+
+/*
+ Returns n bytes at the next aligned position, in place.
+ */
+void *lc_getarray(lcread_s *r, size_t n)
+{
+    void *ptr;
+
+    if (r->pos % LC_ALIGN)
+        r->pos += LC_ALIGN - r->pos % LC_ALIGN;
+    if (r->bad || r->pos > r->len || n > r->len - r->pos) {
+        r->bad = true;
+        return NULL;
+    }
+    ptr = &r->data[r->pos];
+    r->pos += n;
+    return ptr;
+}
+
+/*
+ Strings are used in place.
+ */
+char *lc_getstr(lcread_s *r)
+{
+    uint32_t len, offset;
+    char *str;
+
+    LC_GET(r, len);
+    if (r->bad || len == LC_NULLSTR)
+        return NULL;
+    if (len == LC_STRREF) {
+        LC_GET(r, offset);
+        if (r->bad || offset >= r->pos || !memchr(&r->data[offset], '\0', r->pos - offset)) {
+            r->bad = true;
+            return NULL;
+        }
+        return (char *)&r->data[offset];
+    }
+    if ((size_t)len + 1 > r->len - r->pos || r->data[r->pos + len]) {
+        r->bad = true;
+        return NULL;
+    }
+    str = (char *)&r->data[r->pos];
+    r->pos += len + 1;
+    return str;
+}
+
+void lc_gettoken(lcread_s *r, token_s *tok)
+{
+    char *lexeme;
+
+    LC_GET(r, tok->type.val);
+    LC_GET(r, tok->type.attribute);
+    LC_GET(r, tok->lineno);
+    lexeme = lc_getstr(r);
+    if (!lexeme || strlen(lexeme) > MAX_LEXLEN)
+        r->bad = true;
+    else
+        strcpy(tok->lexeme, lexeme);
+    tok->stype = lc_getstr(r);
+}
+
+/*
+ The nodes, edges and edge tokens of an NFA are each allocated as one
+ block.
+ */
+nfa_s *lc_getnfa(lcread_s *r)
+{
+    uint32_t nnodes, nedges, start, final, dest, i, e = 0;
+    uint16_t j;
+    nfa_s *nfa;
+    nfa_node_s *nodes;
+    nfa_edge_s *edges, **eptrs;
+    token_s *tokens;
+
+    LC_GET(r, nnodes);
+    LC_GET(r, nedges);
+    LC_GET(r, start);
+    LC_GET(r, final);
+    if (r->bad || !nnodes || start >= nnodes || (final != LC_NONODE && final >= nnodes)
+        || nnodes > r->len || nedges > r->len) {
+        r->bad = true;
+        return NULL;
+    }
+    nfa = calloc(1, sizeof(*nfa));
+    nodes = calloc(nnodes, sizeof(*nodes));
+    edges = calloc(nedges ? nedges : 1, sizeof(*edges));
+    eptrs = malloc((nedges ? nedges : 1) * sizeof(*eptrs));
+    tokens = calloc(nedges ? nedges : 1, sizeof(*tokens));
+    if (!nfa || !nodes || !edges || !eptrs || !tokens) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nnodes && !r->bad; i++) {
+        LC_GET(r, nodes[i].nedges);
+        if (nodes[i].nedges > nedges - e) {
+            r->bad = true;
+            break;
+        }
+        if (nodes[i].nedges)
+            nodes[i].edges = &eptrs[e];
+        for (j = 0; j < nodes[i].nedges; j++, e++) {
+            eptrs[e] = &edges[e];
+            LC_GET(r, edges[e].negate);
+            LC_GET(r, edges[e].annotation.attcount);
+            LC_GET(r, edges[e].annotation.attribute);
+            LC_GET(r, edges[e].annotation.length);
+            edges[e].annotation.type = lc_getstr(r);
+            lc_gettoken(r, &tokens[e]);
+            edges[e].token = &tokens[e];
+            LC_GET(r, dest);
+            if (dest != LC_NONODE && dest >= nnodes)
+                r->bad = true;
+            else if (dest != LC_NONODE)
+                edges[e].state = &nodes[dest];
+        }
+    }
+    nfa->start = &nodes[start];
+    nfa->final = (final != LC_NONODE) ? &nodes[final] : NULL;
+    return nfa;
+}
+
+dfa_s *lc_getdfa(lcread_s *r, mach_s *machs, uint16_t nmachs)
+{
+    uint32_t s;
+    uint16_t i, m;
+    dfa_s *dfa;
+    dfa_accept_s *accept;
+
+    dfa = calloc(1, sizeof(*dfa));
+    if (!dfa) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    dfa->mapped = true;
+    LC_GET(r, dfa->nstates);
+    LC_GET(r, dfa->nraw);
+    LC_GET(r, dfa->ncomb);
+    LC_GET(r, dfa->nmachs);
+    LC_GET(r, dfa->nclasses);
+    if (r->bad || !dfa->nstates || dfa->nstates > DFA_MAXSTATES || !dfa->nclasses || dfa->nclasses > DFA_NSYMBOLS
+        || dfa->nmachs > nmachs || dfa->ncomb > r->len) {
+        r->bad = true;
+        return dfa;
+    }
+    dfa->machs = malloc((dfa->nmachs ? dfa->nmachs : 1) * sizeof(*dfa->machs));
+    dfa->info = calloc(dfa->nstates, sizeof(*dfa->info));
+    if (!dfa->machs || !dfa->info) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < dfa->nmachs; i++) {
+        LC_GET(r, m);
+        if (m >= nmachs) {
+            r->bad = true;
+            return dfa;
+        }
+        dfa->machs[i] = &machs[m];
+    }
+    lc_get(r, dfa->bitmach, sizeof(dfa->bitmach));
+    lc_get(r, dfa->classes, sizeof(dfa->classes));
+    for (s = 0; s < dfa->nstates && !r->bad; s++) {
+        LC_GET(r, dfa->info[s].live);
+        LC_GET(r, dfa->info[s].kill);
+        LC_GET(r, dfa->info[s].naccept);
+        if (!dfa->info[s].naccept)
+            continue;
+        if (dfa->info[s].naccept > r->len) {
+            r->bad = true;
+            break;
+        }
+        dfa->info[s].accept = malloc(dfa->info[s].naccept * sizeof(*dfa->info[s].accept));
+        if (!dfa->info[s].accept) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < dfa->info[s].naccept; i++) {
+            accept = &dfa->info[s].accept[i];
+            LC_GET(r, accept->mach);
+            LC_GET(r, accept->pend);
+            LC_GET(r, accept->attribute);
+            accept->stype = lc_getstr(r);
+        }
+    }
+    dfa->trans = lc_getarray(r, (size_t)dfa->nstates * dfa->nclasses * sizeof(*dfa->trans));
+    dfa->base = lc_getarray(r, dfa->nstates * sizeof(*dfa->base));
+    dfa->deflt = lc_getarray(r, dfa->nstates * sizeof(*dfa->deflt));
+    dfa->next = lc_getarray(r, dfa->ncomb * sizeof(*dfa->next));
+    dfa->check = lc_getarray(r, dfa->ncomb * sizeof(*dfa->check));
+    dfa->flags = lc_getarray(r, dfa->nstates * sizeof(*dfa->flags));
+    if (!r->bad)
+        dfa_accel(dfa);
+    return dfa;
+}
+
+lex_s *lc_getlex(lcread_s *r)
+{
+    int32_t typestart, itype, att;
+    uint32_t nkw, k;
+    uint16_t nmachs, i;
+    uint8_t has;
+    char *lexeme;
+    sem_type_s init_type = {0};
+    mach_s *machs;
+    lex_s *lex;
+
+    init_type.type = ATTYPE_NULL;
+    LC_GET(r, typestart);
+    LC_GET(r, nmachs);
+    LC_GET(r, nkw);
+    if (r->bad || !nmachs)
+        return NULL;
+    lex = lex_s_();
+    lex->typestart = typestart;
+    lex->idtable = idtable_s_();
+    for (k = 0; k < nkw && !r->bad; k++) {
+        LC_GET(r, itype);
+        LC_GET(r, att);
+        lexeme = lc_getstr(r);
+        if (lexeme)
+            idtable_insert(lex->kwtable, lexeme, (tdat_s){.is_string = false, .itype = itype, .att = att, .type = init_type});
+        else
+            r->bad = true;
+    }
+
+    machs = calloc(nmachs, sizeof(*machs));
+    if (!machs) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nmachs && !r->bad; i++) {
+        if (i + 1 < nmachs)
+            machs[i].next = &machs[i + 1];
+        LC_GET(r, machs[i].unlimited);
+        LC_GET(r, machs[i].attr_id);
+        LC_GET(r, machs[i].composite);
+        LC_GET(r, machs[i].typecount);
+        LC_GET(r, machs[i].lexlen);
+        machs[i].nterm = calloc(1, sizeof(*machs[i].nterm));
+        if (!machs[i].nterm) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        lc_gettoken(r, machs[i].nterm);
+        machs[i].nfa = lc_getnfa(r);
+        LC_GET(r, has);
+        if (has)
+            machs[i].dfa = lc_getdfa(r, machs, nmachs);
+    }
+    LC_GET(r, has);
+    if (has)
+        lex->dfa = lc_getdfa(r, machs, nmachs);
+    if (r->bad || r->pos != r->len)
+        return NULL;
+    lex->machs = machs;
+    lex->nmachs = nmachs;
+    return lex;
+}
@@ -0,0 +1,94 @@
+/*
+ lexcache.h
+ Author: Jonathan Hamm
+
+ Description:
+    On disk cache of lexers built by buildlex. A lexer is written next to
+    its regex file, as <file>.lexc, along with a hash of the regex file's
+    contents. Later runs map the cache into memory instead of parsing the
+    regex file and building the DFAs again, as long as the hash still
+    matches. The hash only covers the regex file, so LEXCACHE_VERSION has to
+    change whenever the lexer's layout or the way it is built does.
+ */
+
+#ifndef LEXCACHE_H_
+#define LEXCACHE_H_
+
+#include "lex.h"
+
+#define LEXCACHE_SUFFIX     ".lexc"
+#define LEXCACHE_VERSION    1
+
+#define LC_ORDER        0x01020304u
+#define LC_ALIGN        8
+#define LC_HASHINIT     0xcbf29ce484222325ull
+
+#define LC_PUT(b, v)    lc_put((b), &(v), sizeof(v))
+#define LC_GET(r, v)    lc_get((r), &(v), sizeof(v))
+
+typedef struct lcbuf_s lcbuf_s;
+typedef struct lcread_s lcread_s;
+typedef struct lcmap_s lcmap_s;
+
+/*
+ strings maps the strings written so far to their offsets in data, and
+ nkw counts the keywords written.
+ */
+struct lcbuf_s
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    hash_s *strings;
+    uint32_t nkw;
+};
+
+struct lcread_s
+{
+    uint8_t *data;
+    size_t pos;
+    size_t len;
+    bool bad;
+};
+
+/*
+ Numbers pointers in the order they are first seen. nodes lists them by
+ number.
+ */
+struct lcmap_s
+{
+    uint32_t size;
+    uint32_t n;
+    void **keys;
+    uint32_t *vals;
+    void **nodes;
+};
+
+extern bool lexcache_enabled;
+
+extern lex_s *lexcache_load(const char *spec);
+extern void *lexcache_map(const char *spec, size_t *size);
+extern lex_s *lexcache_image(uint8_t *image, size_t size);
+extern bool lexcache_save(lex_s *lex, const char *spec);
+
+/*
+ The reading and writing below is shared with the grammar cache.
+ */
+extern uint64_t lc_hash(uint64_t hash, const void *data, size_t len);
+extern bool lc_spechash(uint64_t hash, const char *spec, uint64_t *result);
+extern char *lc_path(const char *spec, const char *suffix);
+extern void *lc_map(const char *path, size_t min, size_t *size);
+extern bool lc_write(const char *path, lcbuf_s *b);
+
+extern void lc_put(lcbuf_s *b, const void *src, size_t n);
+extern void lc_align(lcbuf_s *b);
+extern void lc_putbytes(lcbuf_s *b, const char *str);
+extern void lc_putstr(lcbuf_s *b, char *str);
+extern uint32_t lcmap_index(lcmap_s *m, void *node);
+extern void free_lcmap(lcmap_s *m);
+
+extern void lc_get(lcread_s *r, void *dst, size_t n);
+extern void *lc_getarray(lcread_s *r, size_t n);
+extern char *lc_getstr(lcread_s *r);
+
+#endif
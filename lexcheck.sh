@@ -0,0 +1,19 @@
+# Checks the byte classes --lex-stats reports for the Pascal lexer. A
+# machine that is a union of single characters minimizes to two states,
+# and should need no more than three classes.
+
+./pc --no-lex-cache --lex-stats samples/check1.pas | awk '
+    $1 == "<letter>" || $1 == "<digit>" || $1 == "<id>" {
+        seen++
+        if ($4 > 3) {
+            print "Too many classes: " $0
+            bad = 1
+        }
+    }
+    END {
+        if (seen != 3) {
+            print "Missing machines in --lex-stats"
+            bad = 1
+        }
+        exit bad
+    }'
@@ -0,0 +1,367 @@
+/*
+ lexgen.c
+ Author: Jonathan Hamm
+
+ Description:
+    Implementation of the lexer code generator. The generated file has no
+    dependencies beyond the C library. Its scanner is the combined DFA of
+    the lexer with every state turned into a label and a switch on the next
+    byte, and its driver, <prefix>_next, repeats the choices lexf makes
+    between the machines' matches, keywords and errors. Identifiers are
+    left to the caller to number, since that needs a symbol table.
+ */
+
+#include "lexgen.h"
+#include "dfa.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct kwentry_s kwentry_s;
+typedef struct kwlist_s kwlist_s;
+
+struct kwentry_s
+{
+    char *lexeme;
+    int type;
+};
+
+struct kwlist_s
+{
+    kwentry_s *kw;
+    size_t n;
+    size_t size;
+};
+
+static void gen_keyword(char *word, size_t len, tdat_s *tdat, void *list);
+static int kwentry_cmp(const void *a, const void *b);
+static void gen_cstring(FILE *out, const char *str);
+static void gen_constname(FILE *out, const char *upper, const char *kind, const char *name);
+static void gen_case(FILE *out, int c);
+static void gen_tables(FILE *out, lex_s *lex, const char *p);
+static void gen_scanner(FILE *out, dfa_s *dfa, const char *p);
+static void gen_driver(FILE *out, lex_s *lex, const char *p, const char *P, size_t nkw);
+
+/*
+ Writes the scanner for lex to out. prefix is prepended to every name in
+ the generated file, and spec is only mentioned in its header. Returns
+ false if the lexer has no combined DFA to generate code from.
+ */
+bool gen_lexer(lex_s *lex, const char *prefix, const char *spec, FILE *out)
+{
+    size_t i, nkw;
+    char *upper;
+    kwentry_s *kw;
+    kwlist_s list = {0};
+    mach_s *mach;
+
+    if (!lex->dfa)
+        return false;
+    upper = strdup(prefix);
+    if (!upper) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; upper[i]; i++)
+        upper[i] = toupper(upper[i]);
+    idtable_walk(lex->kwtable, gen_keyword, &list);
+    kw = list.kw;
+    nkw = list.n;
+    qsort(kw, nkw, sizeof(*kw), kwentry_cmp);
+
+    fprintf(out, "/*\n Generated by pc --gen-lexer from %s. Do not edit.\n\n", spec);
+    fprintf(out, " Buffers passed to %s_next end with the byte (char)EOF, like the ones\n", prefix);
+    fprintf(out, " readfile returns. Tokens with id set are identifiers, which the caller\n");
+    fprintf(out, " numbers.\n */\n\n");
+    fprintf(out, "#include <ctype.h>\n#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n#include <stdio.h>\n#include <string.h>\n\n");
+
+    fprintf(out, "#define %s_TOKEN_ERROR %d\n", upper, LEXTYPE_ERROR);
+    fprintf(out, "#define %s_TOKEN_EOF %d\n\n", upper, LEXTYPE_EOF);
+    for (i = 0; i < nkw; i++)
+        gen_constname(out, upper, "KW", kw[i].lexeme), fprintf(out, " %d\n", kw[i].type);
+    fprintf(out, "\n");
+    for (mach = lex->machs; mach; mach = mach->next)
+        gen_constname(out, upper, "TOK", mach->nterm->lexeme), fprintf(out, " %d\n", mach->nterm->type.val);
+    fprintf(out, "\n#define %s_ERR_NONE 0\n#define %s_ERR_UNKNOWN 1\n#define %s_ERR_TOOLONG 2\n\n", upper, upper, upper);
+
+    fprintf(out, "typedef struct %s_token_s %s_token_s;\ntypedef struct %s_match_s %s_match_s;\n\n", prefix, prefix, prefix, prefix);
+    fprintf(out, "struct %s_token_s\n{\n    int type;\n    int attribute;\n    const char *stype;\n    int error;\n", prefix);
+    fprintf(out, "    bool id;\n    unsigned lineno;\n    const char *lexeme;\n    size_t len;\n};\n\n");
+    fprintf(out, "struct %s_match_s\n{\n    size_t n;\n    int attribute;\n    const char *stype;\n    bool success;\n};\n\n", prefix);
+
+    fprintf(out, "static const char *const %s_kwlexeme[] = {\n", prefix);
+    for (i = 0; i < nkw; i++) {
+        fprintf(out, "    ");
+        gen_cstring(out, kw[i].lexeme);
+        fprintf(out, ",\n");
+    }
+    if (!nkw)
+        fprintf(out, "    NULL\n");
+    fprintf(out, "};\n\nstatic const int %s_kwtype[] = {\n", prefix);
+    for (i = 0; i < nkw; i++)
+        fprintf(out, "    %d,\n", kw[i].type);
+    if (!nkw)
+        fprintf(out, "    0\n");
+    fprintf(out, "};\n\n");
+
+    gen_tables(out, lex, prefix);
+    gen_scanner(out, lex->dfa, prefix);
+    gen_driver(out, lex, prefix, upper, nkw);
+
+    for (i = 0; i < nkw; i++)
+        free(kw[i].lexeme);
+    free(kw);
+    free(upper);
+    return true;
+}
+
+/*
+ Adds a keyword to list. Keywords longer than MAX_LEXLEN are left out.
+ */
+void gen_keyword(char *word, size_t len, tdat_s *tdat, void *list)
+{
+    kwlist_s *l = list;
+
+    if (len > MAX_LEXLEN)
+        return;
+    if (l->n == l->size) {
+        l->size = l->size ? 2 * l->size : 32;
+        l->kw = realloc(l->kw, l->size * sizeof(*l->kw));
+        if (!l->kw) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->kw[l->n].lexeme = strdup(word);
+    if (!l->kw[l->n].lexeme) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    l->kw[l->n++].type = tdat->itype;
+}
+
+int kwentry_cmp(const void *a, const void *b)
+{
+    return strcmp(((kwentry_s *)a)->lexeme, ((kwentry_s *)b)->lexeme);
+}
+
+void gen_cstring(FILE *out, const char *str)
+{
+    if (!str) {
+        fprintf(out, "NULL");
+        return;
+    }
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(out, "\\%c", *str);
+        else if (isprint((unsigned char)*str))
+            fputc(*str, out);
+        else
+            fprintf(out, "\\%03o", (unsigned char)*str);
+    }
+    fputc('"', out);
+}
+
+/*
+ Writes "#define <upper>_<kind>_<name>", with name upper cased and stripped
+ of the brackets of a machine name. Names that are not identifiers are
+ spelled out in hex.
+ */
+void gen_constname(FILE *out, const char *upper, const char *kind, const char *name)
+{
+    size_t i, len = strlen(name);
+    bool ident = len > 0;
+
+    if (len > 2 && name[0] == '<' && name[len - 1] == '>') {
+        name++;
+        len -= 2;
+    }
+    for (i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+            ident = false;
+    }
+    fprintf(out, "#define %s_%s_", upper, kind);
+    if (ident) {
+        for (i = 0; i < len; i++)
+            fputc(toupper((unsigned char)name[i]), out);
+    }
+    else {
+        fprintf(out, "SYM");
+        for (i = 0; i < len; i++)
+            fprintf(out, "_%02X", (unsigned char)name[i]);
+    }
+}
+
+void gen_case(FILE *out, int c)
+{
+    if (isalnum(c))
+        fprintf(out, "case '%c': ", c);
+    else
+        fprintf(out, "case 0x%02x: ", c);
+}
+
+/*
+ The per state data dfa_settle reads, and the machines' properties lexf
+ checks.
+ */
+void gen_tables(FILE *out, lex_s *lex, const char *p)
+{
+    uint16_t i;
+    uint32_t s, n = 0;
+    dfa_s *dfa = lex->dfa;
+    dfa_accept_s *a;
+    mach_s *mach;
+
+    fprintf(out, "static const struct {\n    int type;\n    long lexlen;\n    bool unlimited;\n");
+    fprintf(out, "    bool composite;\n    bool attr_id;\n} %s_machs[%u] = {\n", p, dfa->nmachs);
+    for (mach = lex->machs; mach; mach = mach->next) {
+        fprintf(out, "    {%d, %ldL, %s, %s, %s},\n", mach->nterm->type.val, mach->lexlen, mach->unlimited ? "true" : "false",
+                mach->composite ? "true" : "false", mach->attr_id ? "true" : "false");
+    }
+    fprintf(out, "};\n\nstatic const uint16_t %s_bitmach[%d] = {", p, DFA_MAXTRACK);
+    for (i = 0; i < DFA_MAXTRACK; i++)
+        fprintf(out, "%s%u", i ? ", " : "", dfa->bitmach[i]);
+    fprintf(out, "};\n\nstatic const struct {\n    uint32_t live;\n    uint32_t kill;\n    uint32_t accept;\n");
+    fprintf(out, "    uint16_t naccept;\n} %s_info[%u] = {\n", p, dfa->nstates);
+    for (s = 0; s < dfa->nstates; s++) {
+        fprintf(out, "    {0x%xu, 0x%xu, %u, %u},\n", dfa->info[s].live, dfa->info[s].kill, n, dfa->info[s].naccept);
+        n += dfa->info[s].naccept;
+    }
+    fprintf(out, "};\n\nstatic const struct {\n    uint16_t mach;\n    int8_t pend;\n    int attribute;\n");
+    fprintf(out, "    const char *stype;\n} %s_accept[%u] = {\n", p, n ? n : 1);
+    for (s = 0; s < dfa->nstates; s++) {
+        for (i = 0; i < dfa->info[s].naccept; i++) {
+            a = &dfa->info[s].accept[i];
+            fprintf(out, "    {%u, %d, %d, ", a->mach, a->pend, a->attribute);
+            gen_cstring(out, a->stype);
+            fprintf(out, "},\n");
+        }
+    }
+    if (!n)
+        fprintf(out, "    {0, -1, 0, NULL}\n");
+    fprintf(out, "};\n\n");
+}
+
+/*
+ The scanner proper. Each state settles its accepts if it has any, or if
+ tentative accepts are outstanding, and then jumps on the next byte.
+ */
+void gen_scanner(FILE *out, dfa_s *dfa, const char *p)
+{
+    int c;
+    uint32_t s, d;
+    int32_t t;
+    bool any;
+
+    fprintf(out, "static void %s_setmatch(%s_match_s *m, uint32_t a, size_t n)\n{\n", p, p);
+    fprintf(out, "    m->success = true;\n    m->n = n;\n    m->attribute = %s_accept[a].attribute;\n", p);
+    fprintf(out, "    m->stype = %s_accept[a].stype;\n}\n\n", p);
+    fprintf(out, "static void %s_confirm(%s_match_s *res, %s_match_s *tent, uint32_t mask)\n{\n", p, p, p);
+    fprintf(out, "    uint8_t b;\n    %s_match_s *m;\n\n", p);
+    fprintf(out, "    for (b = 0; mask; b++, mask >>= 1) {\n        m = &res[%s_bitmach[b]];\n", p);
+    fprintf(out, "        if ((mask & 1) && (!m->success || tent[b].n > m->n))\n            *m = tent[b];\n    }\n}\n\n");
+    fprintf(out, "static void %s_settle(uint32_t s, size_t n, %s_match_s *res, %s_match_s *tent, uint32_t *tmask)\n{\n", p, p, p);
+    fprintf(out, "    uint32_t a;\n    uint8_t b;\n\n");
+    fprintf(out, "    if (*tmask) {\n        *tmask &= ~%s_info[s].kill;\n", p);
+    fprintf(out, "        %s_confirm(res, tent, *tmask & ~%s_info[s].live);\n        *tmask &= %s_info[s].live;\n    }\n", p, p, p);
+    fprintf(out, "    for (a = %s_info[s].accept; a < %s_info[s].accept + %s_info[s].naccept; a++) {\n", p, p, p);
+    fprintf(out, "        if (%s_accept[a].pend < 0) {\n            %s_setmatch(&res[%s_accept[a].mach], a, n);\n", p, p, p);
+    fprintf(out, "            for (b = 0; *tmask && b < %d; b++) {\n", DFA_MAXTRACK);
+    fprintf(out, "                if (%s_bitmach[b] == %s_accept[a].mach)\n                    *tmask &= ~(1u << b);\n            }\n        }\n", p, p);
+    fprintf(out, "        else {\n            %s_setmatch(&tent[%s_accept[a].pend], a, n);\n", p, p);
+    fprintf(out, "            *tmask |= 1u << %s_accept[a].pend;\n        }\n    }\n}\n\n", p);
+
+    fprintf(out, "static void %s_scan(const unsigned char *buf, %s_match_s *res)\n{\n", p, p);
+    fprintf(out, "    size_t i = 0;\n    uint32_t tmask = 0;\n    %s_match_s tent[%d];\n\n", p, DFA_MAXTRACK);
+    fprintf(out, "    memset(res, 0, %u * sizeof(*res));\n    goto s0;\n", dfa->nmachs);
+    for (s = 0; s < dfa->nstates; s++) {
+        fprintf(out, "s%u:\n", s);
+        if (dfa->flags[s])
+            fprintf(out, "    %s_settle(%u, i, res, tent, &tmask);\n", p, s);
+        else
+            fprintf(out, "    if (tmask)\n        %s_settle(%u, i, res, tent, &tmask);\n", p, s);
+        for (c = 0, any = false; c < DFA_NSYMBOLS && !any; c++)
+            any = dfa->trans[s * dfa->nclasses + dfa->classes[c]] != DFA_DEAD;
+        if (!any) {
+            fprintf(out, "    goto done;\n");
+            continue;
+        }
+        fprintf(out, "    switch (buf[i++]) {\n");
+        for (d = 0; d < dfa->nstates; d++) {
+            if ((int32_t)d == dfa->deflt[s])
+                continue;
+            for (c = 0, any = false; c < DFA_NSYMBOLS; c++) {
+                t = dfa->trans[s * dfa->nclasses + dfa->classes[c]];
+                if (t != (int32_t)d)
+                    continue;
+                if (!any)
+                    fprintf(out, "    ");
+                gen_case(out, c);
+                any = true;
+            }
+            if (any)
+                fprintf(out, "\n        goto s%u;\n", d);
+        }
+        if (dfa->deflt[s] != DFA_DEAD) {
+            for (c = 0, any = false; c < DFA_NSYMBOLS; c++) {
+                if (dfa->trans[s * dfa->nclasses + dfa->classes[c]] != DFA_DEAD)
+                    continue;
+                if (!any)
+                    fprintf(out, "    ");
+                gen_case(out, c);
+                any = true;
+            }
+            if (any)
+                fprintf(out, "\n        goto done;\n");
+            fprintf(out, "    default:\n        goto s%d;\n    }\n", dfa->deflt[s]);
+        }
+        else
+            fprintf(out, "    default:\n        goto done;\n    }\n");
+    }
+    fprintf(out, "done:\n    %s_confirm(res, tent, tmask);\n}\n\n", p);
+}
+
+/*
+ <prefix>_next follows lexf: the longest match wins, earlier machines win
+ ties, a match longer than its machine allows makes the token an error,
+ and matches of a keyword's text become that keyword.
+ */
+void gen_driver(FILE *out, lex_s *lex, const char *p, const char *P, size_t nkw)
+{
+    fprintf(out, "static int %s_keyword(const char *str, size_t len)\n{\n", p);
+    fprintf(out, "    int cmp;\n    size_t lo = 0, hi = %zu, mid;\n\n", nkw);
+    fprintf(out, "    while (lo < hi) {\n        mid = (lo + hi) / 2;\n");
+    fprintf(out, "        cmp = strncmp(%s_kwlexeme[mid], str, len);\n", p);
+    fprintf(out, "        if (!cmp && %s_kwlexeme[mid][len])\n            cmp = 1;\n", p);
+    fprintf(out, "        if (!cmp)\n            return %s_kwtype[mid];\n", p);
+    fprintf(out, "        if (cmp < 0)\n            lo = mid + 1;\n        else\n            hi = mid;\n    }\n    return -1;\n}\n\n");
+
+    fprintf(out, "/*\n Reads the token at buf into tok and returns where the next one starts.\n");
+    fprintf(out, " lineno is advanced past the newlines read.\n */\n");
+    fprintf(out, "const char *%s_next(const char *buf, unsigned *lineno, %s_token_s *tok)\n{\n", p, p);
+    fprintf(out, "    int m, bmach = -1, kw;\n    size_t i, overflow = 0;\n    bool overflowed = false;\n");
+    fprintf(out, "    %s_match_s res[%u], best = {0};\n\n", p, lex->dfa->nmachs);
+    fprintf(out, "    while (isspace(*buf)) {\n        if (*buf == '\\n')\n            ++*lineno;\n        buf++;\n    }\n");
+    fprintf(out, "    tok->attribute = 0;\n    tok->stype = NULL;\n    tok->error = %s_ERR_NONE;\n    tok->id = false;\n", P);
+    fprintf(out, "    tok->lexeme = buf;\n    if (*buf == (char)EOF) {\n        tok->type = %s_TOKEN_EOF;\n", P);
+    fprintf(out, "        tok->lineno = *lineno;\n        tok->len = 0;\n        return buf;\n    }\n");
+    fprintf(out, "    %s_scan((const unsigned char *)buf, res);\n", p);
+    fprintf(out, "    for (m = 0; m < %u; m++) {\n", lex->dfa->nmachs);
+    fprintf(out, "        if (%s_machs[m].unlimited || res[m].n <= (size_t)%s_machs[m].lexlen) {\n", p, p);
+    fprintf(out, "            if (res[m].success && !%s_machs[m].composite && res[m].n > best.n) {\n", p);
+    fprintf(out, "                best = res[m];\n                bmach = m;\n            }\n        }\n");
+    fprintf(out, "        else {\n            overflowed = true;\n            overflow = res[m].n;\n            best.success = false;\n        }\n    }\n");
+    fprintf(out, "    for (i = 0; i < best.n; i++) {\n        if (buf[i] == '\\n')\n            ++*lineno;\n    }\n");
+    fprintf(out, "    tok->lineno = *lineno;\n");
+    fprintf(out, "    if (best.success) {\n        tok->len = best.n;\n        tok->stype = best.stype;\n");
+    fprintf(out, "        tok->attribute = best.attribute;\n");
+    fprintf(out, "        if ((kw = %s_keyword(buf, best.n)) > -1)\n            tok->type = kw;\n", p);
+    fprintf(out, "        else {\n            tok->type = %s_machs[bmach].type;\n            tok->id = %s_machs[bmach].attr_id;\n        }\n", p, p);
+    fprintf(out, "        return buf + best.n;\n    }\n");
+    fprintf(out, "    if (overflowed) {\n        tok->type = %s_TOKEN_ERROR;\n        tok->error = %s_ERR_TOOLONG;\n", P, P);
+    fprintf(out, "        tok->len = overflow;\n        return buf + overflow;\n    }\n");
+    fprintf(out, "    tok->len = 1;\n    if ((kw = %s_keyword(buf, 1)) > -1)\n        tok->type = kw;\n", p);
+    fprintf(out, "    else {\n        tok->type = %s_TOKEN_ERROR;\n        tok->error = %s_ERR_UNKNOWN;\n    }\n", P, P);
+    fprintf(out, "    return buf + 1;\n}\n");
+}
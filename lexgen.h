@@ -0,0 +1,20 @@
+/*
+ lexgen.h
+ Author: Jonathan Hamm
+
+ Description:
+    Generates a standalone C scanner from a lexer built by buildlex. The
+    combined DFA of the lexer is written out as code, one label per state,
+    along with the keyword table, token type constants and a driver that
+    picks the token the way lexf does.
+ */
+
+#ifndef LEXGEN_H_
+#define LEXGEN_H_
+
+#include "lex.h"
+#include <stdio.h>
+
+extern bool gen_lexer(lex_s *lex, const char *prefix, const char *spec, FILE *out);
+
+#endif
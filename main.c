@@ -9,11 +9,23 @@
  */
 
 #include "lex.h"
+#include "dfa.h"
+#include "lexgen.h"
+#include "lexcache.h"
+#include "parsecache.h"
 #include "parse.h"
+#include "scanrun.h"
 #include "general.h"
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef PC_TABLES
+#include "pctables.h"
+#endif
 
 enum term_args_ {
     ARG_CHAR,
@@ -26,14 +38,30 @@ enum term_args_ {
 #define DEFAULT_REGEX   "regex_pascal"
 #define DEFAULT_CFG     "cfg_pascal"
 #define DEFAULT_SOURCE  "samples/smallworking.pas"
+#define TABLES_WIDTH    12
 
 #define COMP_HELP       "Usage: \n" \
+                        "pc --gen-lexer <regexfile> [-o <cfile> | --output=<cfile>]\n" \
+                        "pc --gen-tables [-r <regexfile>] [-p <cfgfile>] [-o <hfile> | --output=<hfile>]\n" \
                         "pc [--help] [<sourcefile>] [-s <sourcefile> | --source=<sourcefile>] " \
-                        "[-r <regexfile> | --regex=<regexfile>] [-p <cfgfile> | --cfg=<cfgfile>]\n\n" \
+                        "[-r <regexfile> | --regex=<regexfile>] [-p <cfgfile> | --cfg=<cfgfile>] [--lex-stats] [--parse-stats] [--nfa-memo] [--lexer=dfa|bitset|lazy|nfa] [--scanner=auto|scalar|sse2|avx2] [--parser=stack|recursive] [--lazy-states=<n>] [--lex-threads=<n>] [--no-lex-cache] [--no-parse-cache]\n\n" \
                         "%-20sPrints this Message\n" \
                         "%-20sSpecify Regex File\n" \
                         "%-20sSpecify File Containing Language's Backus-Naur Form\n" \
-                        "%-20sSpecify Source File"
+                        "%-20sSpecify Source File\n" \
+                        "%-20sPrint Lexer State Counts and Table Sizes\n" \
+                        "%-20sPrint First/Follow Set Timing\n" \
+                        "%-20sMemoize the Backtracking Matcher\n" \
+                        "%-20sSelect the Lexer's Matching Engine\n" \
+                        "%-20sSelect the Instruction Set Used to Skip Runs of Bytes\n" \
+                        "%-20sSelect the Parser's Driver\n" \
+                        "%-20sStates Kept by the Lazy Lexer\n" \
+                        "%-20sLex the Whole Source up Front on n Threads (0 for All Cores)\n" \
+                        "%-20sBuild the Lexer from its Regex File, Skipping its Cache and the Built-in Tables\n" \
+                        "%-20sBuild the Parser from its Grammar File, Skipping its Cache and the Built-in Tables\n" \
+                        "%-20sWrite a C Scanner for a Regex File\n" \
+                        "%-20sWrite the Built Lexer and Parser as a C Header for PC_TABLES\n" \
+                        "%-20sOutput File of the Generated Scanner or Tables"
 
 typedef struct argtok_s argtok_s;
 typedef struct files_s files_s;
@@ -50,6 +78,19 @@ struct files_s
     const char *regex;
     const char *cfg;
     const char *source;
+    const char *lexer;
+    const char *scanner;
+    const char *parser;
+    const char *lazystates;
+    const char *lexthreads;
+    const char *genlexer;
+    const char *output;
+    bool lexstats;
+    bool parsestats;
+    bool nfamemo;
+    bool nolexcache;
+    bool noparsecache;
+    bool gentables;
 };
 
 static void add_argtoken (argtok_s **tlist, const char *lexeme, int id);
@@ -66,21 +107,128 @@ static const char **argparse_char (argtok_s **curr, files_s *parent);
 static const char **argparse_word (argtok_s **curr, files_s *parent);
 
 static void print_usage (const char *message, const char *curr);
+static void gen_lexfile (const char *spec, const char *output);
+static void gen_tablefile (const char *regex, const char *cfg, const char *output);
+static void print_image (FILE *out, const char *name, uint8_t *image, size_t size);
 
 int main(int argc, const char *argv[])
 {
-    char *outname, *scopename, *listingname;
+    int fd, scanner;
+    char *outname, *scopename, *listingname, *end;
+    unsigned long cachesize = 0;
     files_s files;
     argtok_s *list;
+#ifdef PC_TABLES
+    bool builtin = false;
+#endif
+    lex_s *lex = NULL;
     lextok_s lextok;
-    parse_s *p;
+    parse_s *p = NULL;
     FILE *gen, *scope, *listing;
     
     list = arg_tokenize(argc, argv);
     files = argsparse_start(&list);
     free_tokens(list);
-    lextok = lexf(buildlex(files.regex), readfile(files.source), 0, true);
-    p = build_parse(files.cfg, lextok);
+    if (files.nolexcache)
+        lexcache_enabled = false;
+    if (files.noparsecache)
+        parsecache_enabled = false;
+    if (files.genlexer) {
+        gen_lexfile(files.genlexer, files.output);
+        return 0;
+    }
+    if (files.gentables) {
+        gen_tablefile(files.regex ? files.regex : DEFAULT_REGEX, files.cfg ? files.cfg : DEFAULT_CFG, files.output);
+        return 0;
+    }
+#ifdef PC_TABLES
+    if (!files.regex && !files.nolexcache)
+        builtin = (lex = buildlex_image(pctables_lex, sizeof(pctables_lex))) != NULL;
+#endif
+    if (!lex)
+        lex = buildlex(files.regex ? files.regex : DEFAULT_REGEX);
+    if (files.lazystates) {
+        cachesize = strtoul(files.lazystates, &end, 10);
+        if (*end || !cachesize || cachesize > UINT32_MAX) {
+            print_usage("Error: Invalid State Count: %s", files.lazystates);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (files.lexthreads) {
+        lex_threads = strtoul(files.lexthreads, &end, 10);
+        if (*end || *files.lexthreads == '-' || lex_threads > LEX_MAXTHREADS) {
+            print_usage("Error: Invalid Thread Count: %s", files.lexthreads);
+            exit(EXIT_FAILURE);
+        }
+        if (!lex_threads)
+            lex_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (files.lexer) {
+        if (!strcasecmp(files.lexer, "dfa"))
+            lex_setbackend(lex, LEXER_DFA, 0);
+        else if (!strcasecmp(files.lexer, "bitset"))
+            lex_setbackend(lex, LEXER_BITSET, 0);
+        else if (!strcasecmp(files.lexer, "lazy"))
+            lex_setbackend(lex, LEXER_LAZY, cachesize);
+        else if (!strcasecmp(files.lexer, "nfa"))
+            lex_setbackend(lex, LEXER_NFA, 0);
+        else {
+            print_usage("Error: Unknown Lexer: %s", files.lexer);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (files.scanner) {
+        if (!strcasecmp(files.scanner, "auto"))
+            scanner = SCAN_AUTO;
+        else if (!strcasecmp(files.scanner, "scalar"))
+            scanner = SCAN_SCALAR;
+        else if (!strcasecmp(files.scanner, "sse2"))
+            scanner = SCAN_SSE2;
+        else if (!strcasecmp(files.scanner, "avx2"))
+            scanner = SCAN_AVX2;
+        else {
+            print_usage("Error: Unknown Scanner: %s", files.scanner);
+            exit(EXIT_FAILURE);
+        }
+        if (!scan_select(scanner)) {
+            printf("Error: Scanner %s is not Supported on this Machine\n", files.scanner);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (files.nfamemo)
+        nfamemo_enable(lex);
+    if (files.lexstats)
+        print_lexstats(lex, stdout);
+    if (files.lexthreads) {
+        fd = -1;
+        lextok = lexf(lex, readfile(files.source), 0, true);
+    }
+    else {
+        fd = open(files.source, O_RDONLY);
+        if (fd < 0) {
+            perror("File IO Error");
+            printf("Could not read %s\n", files.source);
+            exit(EXIT_FAILURE);
+        }
+        lextok = lex_stream(lex, fd, 0, true);
+    }
+    if (files.parser) {
+        if (!strcasecmp(files.parser, "stack"))
+            parse_driver = PARSE_STACK;
+        else if (!strcasecmp(files.parser, "recursive"))
+            parse_driver = PARSE_RECURSIVE;
+        else {
+            print_usage("Error: Unknown Parser: %s", files.parser);
+            exit(EXIT_FAILURE);
+        }
+    }
+    parse_stats = files.parsestats;
+#ifdef PC_TABLES
+    if (builtin && !files.cfg && !files.noparsecache)
+        p = build_parse_image(pctables_cfg, sizeof(pctables_cfg), lextok);
+#endif
+    if (!p)
+        p = build_parse(files.cfg ? files.cfg : DEFAULT_CFG, lextok);
     
     outname = malloc(strlen(files.source)+5);
     if(!outname) {
@@ -119,8 +267,15 @@ int main(int argc, const char *argv[])
     }
     
     parse(p, lextok, gen);
-    print_listing(p->listing, listing);
-    free_listing(p->listing);
+    if (fd >= 0)
+        close(fd);
+    if (files.lexstats) {
+        print_nfamemo(lex, stdout);
+        if (lex->ldfa)
+            print_lazystats(lex->ldfa, stdout);
+    }
+    print_listing(p->lex->listing, listing);
+    free_listing(p->lex->listing);
     print_scope(scope);
     fclose(gen);
     fclose(scope);
@@ -180,7 +335,7 @@ argtok_s *arg_tokenize (int argc, const char *argv[])
                     startptr = argv[i];
                     if (*++argv[i]) {
                         while ((c = *argv[i])) {
-                            if (c == '-' || c == '=') {
+                            if (c == '=') {
                                 allocated = malloc(argv[i] - startptr + 1);
                                 if (!allocated) {
                                     perror("Memory Allocation Error");
@@ -232,16 +387,12 @@ void free_tokens (argtok_s *list)
 
 files_s argsparse_start (argtok_s **curr)
 {
-    files_s files = (files_s){NULL, NULL, NULL};
+    files_s files = (files_s){NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, false, false, false, false, false, false};
 
     if (!*curr)
-        return (files_s){.regex = DEFAULT_REGEX, .cfg = DEFAULT_CFG, .source = DEFAULT_SOURCE};
+        return (files_s){.source = DEFAULT_SOURCE};
     argparse_actionlist(curr, &files);
     if ((*curr)->id == ARG_EOF) {
-        if (!files.regex)
-            files.regex = DEFAULT_REGEX;
-        if (!files.cfg)
-            files.cfg = DEFAULT_CFG;
         if (!files.source)
             files.source = DEFAULT_SOURCE;
         return files;
@@ -287,14 +438,17 @@ void argparse_type (argtok_s **curr, files_s *parent)
     switch ((*curr)->id) {
         case ARG_CHAR:
             assign = argparse_char(curr, parent);
+            *curr = (*curr)->next;
             break;
         case ARG_DASH:
             *curr = (*curr)->next;
             assign = argparse_word(curr, parent);
             *curr = (*curr)->next;
+            if (!assign)
+                return;
             if ((*curr)->id == ARG_ASSIGN)
-                break;
-            else {
+                *curr = (*curr)->next;
+            else if ((*curr)->id != ARG_WORD && (*curr)->id != ARG_CHAR) {
                 print_usage("Syntax Error: Expected '=' but got %s", (*curr)->lexeme);
                 exit(EXIT_FAILURE);
             }
@@ -304,7 +458,6 @@ void argparse_type (argtok_s **curr, files_s *parent)
             exit(EXIT_FAILURE);
             break;
     }
-    *curr = (*curr)->next;
     if (*assign) {
         print_usage("Error: Property Already Assigned", NULL);
         exit(EXIT_FAILURE);
@@ -332,6 +485,9 @@ const char **argparse_char (argtok_s **curr, files_s *parent)
         case 'S':
             return &parent->source;
             break;
+        case 'o':
+        case 'O':
+            return &parent->output;
         default:
             print_usage("Error: Undefined Program Option: %s", (*curr)->lexeme);
             exit(EXIT_FAILURE);
@@ -349,6 +505,44 @@ const char **argparse_word (argtok_s **curr, files_s *parent)
         return &parent->cfg;
     if (!strcasecmp("source", (*curr)->lexeme))
         return &parent->source;
+    if (!strcasecmp("lexer", (*curr)->lexeme))
+        return &parent->lexer;
+    if (!strcasecmp("scanner", (*curr)->lexeme))
+        return &parent->scanner;
+    if (!strcasecmp("parser", (*curr)->lexeme))
+        return &parent->parser;
+    if (!strcasecmp("gen-lexer", (*curr)->lexeme))
+        return &parent->genlexer;
+    if (!strcasecmp("output", (*curr)->lexeme))
+        return &parent->output;
+    if (!strcasecmp("lazy-states", (*curr)->lexeme))
+        return &parent->lazystates;
+    if (!strcasecmp("lex-threads", (*curr)->lexeme))
+        return &parent->lexthreads;
+    if (!strcasecmp("lex-stats", (*curr)->lexeme)) {
+        parent->lexstats = true;
+        return NULL;
+    }
+    if (!strcasecmp("parse-stats", (*curr)->lexeme)) {
+        parent->parsestats = true;
+        return NULL;
+    }
+    if (!strcasecmp("nfa-memo", (*curr)->lexeme)) {
+        parent->nfamemo = true;
+        return NULL;
+    }
+    if (!strcasecmp("no-lex-cache", (*curr)->lexeme)) {
+        parent->nolexcache = true;
+        return NULL;
+    }
+    if (!strcasecmp("no-parse-cache", (*curr)->lexeme)) {
+        parent->noparsecache = true;
+        return NULL;
+    }
+    if (!strcasecmp("gen-tables", (*curr)->lexeme)) {
+        parent->gentables = true;
+        return NULL;
+    }
     if (!strcasecmp("help", (*curr)->lexeme)) {
         print_usage(NULL, NULL);
         exit(EXIT_SUCCESS);
@@ -367,5 +561,96 @@ void print_usage (const char *message, const char *curr)
         else
             puts(message);
     }
-    printf("\n"COMP_HELP, "--help:", "-r | --regex:", "-p | --cfg:", "-s | --source:");
-}
\ No newline at end of file
+    printf("\n"COMP_HELP, "--help:", "-r | --regex:", "-p | --cfg:", "-s | --source:", "--lex-stats:", "--parse-stats:", "--nfa-memo:", "--lexer:", "--scanner:", "--parser:", "--lazy-states:", "--lex-threads:", "--no-lex-cache:", "--no-parse-cache:", "--gen-lexer:", "--gen-tables:", "-o | --output:");
+}
+
+/*
+ Names in the generated scanner are prefixed with the output file's name,
+ without directory and extension.
+ */
+void gen_lexfile (const char *spec, const char *output)
+{
+    size_t i;
+    char *prefix;
+    const char *base;
+    FILE *out = stdout;
+    lex_s *lex;
+
+    lex = buildlex(spec);
+    base = "lexer";
+    if (output) {
+        base = strrchr(output, '/') ? strrchr(output, '/') + 1 : output;
+        out = fopen(output, "w");
+        if (!out) {
+            perror("Error Creating File");
+            exit(EXIT_FAILURE);
+        }
+    }
+    prefix = malloc(strlen(base) + 2);
+    if (!prefix) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    i = 0;
+    if (isdigit(*base))
+        prefix[i++] = '_';
+    for (; *base && *base != '.'; base++)
+        prefix[i++] = isalnum(*base) ? *base : '_';
+    prefix[i] = '\0';
+    if (!gen_lexer(lex, i ? prefix : "lexer", spec, out)) {
+        fprintf(stderr, "Error: %s could not be converted to a single DFA\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    if (out != stdout)
+        fclose(out);
+    free(prefix);
+}
+
+/*
+ The tables are the cache images of the lexer and parser built from regex
+ and cfg, written as arrays that main loads in place of the default files
+ when compiled with PC_TABLES. The arrays are left writable, as the cache
+ mappings are, and aligned the way the images expect to be read.
+ */
+void gen_tablefile (const char *regex, const char *cfg, const char *output)
+{
+    size_t lsize, psize;
+    void *limage, *pimage;
+    FILE *out = stdout;
+    lex_s *lex;
+
+    lexcache_enabled = true;
+    parsecache_enabled = true;
+    lex = buildlex(regex);
+    build_parse(cfg, (lextok_s){.lex = lex});
+    limage = lexcache_map(regex, &lsize);
+    pimage = parsecache_map(cfg, lex, &psize);
+    if (!(limage && pimage)) {
+        fprintf(stderr, "Error: Could not cache %s and %s\n", regex, cfg);
+        exit(EXIT_FAILURE);
+    }
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror("Error Creating File");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fprintf(out, "/*\n Lexer and parser tables built from %s and %s by pc --gen-tables.\n */\n\n", regex, cfg);
+    fprintf(out, "#ifndef PCTABLES_H_\n#define PCTABLES_H_\n\n#include <stdint.h>\n\n");
+    print_image(out, "pctables_lex", limage, lsize);
+    print_image(out, "pctables_cfg", pimage, psize);
+    fprintf(out, "#endif\n");
+    if (out != stdout)
+        fclose(out);
+}
+
+void print_image (FILE *out, const char *name, uint8_t *image, size_t size)
+{
+    size_t i;
+
+    fprintf(out, "static _Alignas(%d) uint8_t %s[%zu] = {", LC_ALIGN, name, size);
+    for (i = 0; i < size; i++)
+        fprintf(out, "%s0x%02x%s", i % TABLES_WIDTH ? " " : "\n    ", image[i], i + 1 < size ? "," : "");
+    fprintf(out, "\n};\n\n");
+}
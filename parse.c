@@ -11,11 +11,13 @@
 #include "general.h"
 #include "parse.h"
 #include "semantics.h"
+#include "parsecache.h"
+#include "lexcache.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
-#include <pthread.h>
+#include <time.h>
 
 #define INIT_SYNERRSIZE 64
 #define SYNERR_PREFIX "      --Syntax Error at line %u: Expected "
@@ -24,31 +26,53 @@
 #define LLFF(node) ((ffnode_s *)node->ptr)
 #define LLTOKEN(node ) (LLFF(node)->token)
 
-typedef struct follow_s follow_s;
-typedef struct ffnode_s ffnode_s;
+#define FF_WORDBITS 64
+#define FF_HAS(set, i) ((set)[(i) / FF_WORDBITS] >> ((i) % FF_WORDBITS) & 1)
+#define FF_ADD(set, i) ((set)[(i) / FF_WORDBITS] |= (uint64_t)1 << ((i) % FF_WORDBITS))
+
+typedef struct ffsets_s ffsets_s;
+typedef struct ffedges_s ffedges_s;
 typedef struct tfind_s tfind_s;
+typedef struct llframe_s llframe_s;
+typedef struct llstack_s llstack_s;
 
-struct follow_s
+/*
+ FIRST and FOLLOW of each nonterminal, as sets of nwords words with a bit
+ for each terminal. Terminals are numbered in the order the productions
+ use them, after $ as 0, and nonterminals in phash order; termno and
+ ntermno give one more than the number an atom has, or 0 for none.
+ Productions are numbered through all the nonterminals, those of
+ nonterminal i from prodstart[i].
+ */
+struct ffsets_s
 {
-    pda_s *pda;
-    parse_s *parser;
-    uint16_t index;
-    pthread_t thread;
-    follow_s *table;
-    llist_s *firsts;
-    llist_s *follows;
-    uint16_t *count;
-    bool *ready;
-    pthread_mutex_t *jlock;
-    pthread_cond_t *jcond;
-    uint16_t ninherit;
-    follow_s **inherit;
+    uint32_t nterms;
+    uint32_t nnterms;
+    uint32_t nprods;
+    uint32_t nwords;
+    uint32_t *termno;
+    uint32_t *ntermno;
+    token_s **terms;
+    pda_s **pdas;
+    uint32_t *prodstart;
+    token_s *epsilon;
+    bool *nullable;
+    uint64_t *first;
+    uint64_t *follow;
 };
 
-struct ffnode_s
+/*
+ Edges between numbered nodes, collected in from and to and then sorted by
+ ff_sortedges, after which the edges out of node i lead to to[start[i]] up
+ to to[start[i + 1]].
+ */
+struct ffedges_s
 {
-    uint16_t prod;
-    token_s *token;
+    uint32_t n;
+    uint32_t size;
+    uint32_t *from;
+    uint32_t *to;
+    uint32_t *start;
 };
 
 struct tfind_s
@@ -57,15 +81,39 @@ struct tfind_s
     token_s *token;
 };
 
+/*
+ An expansion of pda by its production index, with pnode the next of the
+ production's nodes to parse, i its position and pcp the copy of the
+ nodes the semantic actions see.
+ */
+struct llframe_s
+{
+    pda_s *pda;
+    int index;
+    int i;
+    unsigned pass;
+    pnode_s *pnode;
+    pna_s *pcp;
+    semantics_s *synhash;
+};
+
+struct llstack_s
+{
+    uint32_t n;
+    uint32_t size;
+    llframe_s *frames;
+};
+
 extern FILE *emitdest;
-token_s *tok_lastmatched;
+uint32_t tok_lastmatched;
+bool parse_stats;
+int parse_driver = PARSE_STACK;
+static tokbuf_s *toks;
+static lexstate_s *tokstream;
+static uint32_t eof_atom;
 
 static void match_phase(lextok_s regex, token_s *cfg);
 static tfind_s findtok(mach_s *mlist, char *lexeme);
-static parse_s *parse_(void);
-static pda_s *pda_(token_s *token);
-static production_s *addproduction(pda_s *pda);
-static pnode_s *pnode_(token_s *token);
 
 static void pp_start(parse_s *parse, token_s **curr);
 static void pp_nonterminal(parse_s *parse, token_s **curr);
@@ -75,32 +123,39 @@ static void pp_productions(parse_s *parse, token_s **curr, pda_s *pda);
 static pnode_s *pp_tokens(parse_s *parse, token_s **curr, pda_s *pda, int *count);
 static void pp_decoration(parse_s *parse, token_s **curr, production_s *prod);
 
-static ffnode_s *makeffnode (token_s *token, uint16_t prod);
-static bool isespsilon(production_s *production);
-static bool hasepsilon(parse_s *parser, pnode_s *nonterm);
-static llist_s *clone_firsts(llist_s *firsts, int production);
-static llist_s *getfirsts(parse_s *parser, pda_s *pda);
-static void getfollows(follow_s *fparams);
-static inline ffnode_s *makeEOF(void);
 static inline token_s *tmakeEOF(void);
-static follow_s *get_neighbor_params (follow_s *table, pda_s *pda);
-static llist_s *lldeep_concat_foll (llist_s *first, llist_s *second);
-static bool llpnode_contains(llist_s *list, token_s *tok);
-static void add_inherit(follow_s *nonterm, follow_s *dependent);
-static llist_s *inherit_follows(follow_s *params, llist_s **stack);
 static void compute_firstfollows(parse_s *parser);
+static void ff_number(ffsets_s *ff, parse_s *parser);
+static void ff_nullable(ffsets_s *ff);
+static void ff_first(ffsets_s *ff);
+static void ff_follow(ffsets_s *ff, parse_s *parser);
+static bool ff_seqfirst(ffsets_s *ff, pnode_s *iter, uint64_t *set);
+static void ff_lists(ffsets_s *ff);
+static void ff_addedge(ffedges_s *edges, uint32_t from, uint32_t to);
+static void ff_sortedges(ffedges_s *edges, uint32_t n);
+static void ff_propagate(uint64_t *sets, uint32_t nwords, uint32_t n, ffedges_s *edges);
+static void free_ffedges(ffedges_s *edges);
+static void *ff_alloc(size_t size);
 
-static bool lllex_contains(llist_s *list, char *lex);
 static void build_parse_table(parse_s *parse, token_s *tokens);
+static void build_predict(parsetable_s *ptable);
+static parse_s *parse_ready(parse_s *parse, lextok_s lextok);
+static void print_loadstats(const char *from, struct timespec *t0);
 static void print_parse_table(parsetable_s *ptable, FILE *stream);
 static void print_firfol(parse_s *parse, FILE *stream);
 
-static int match(token_s **curr, pnode_s *p);
-static semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *machs, token_s **curr, pda_s *pda, int index);
-static int get_production(parsetable_s *ptable, pda_s *pda, token_s **curr);
+static uint32_t next_token(uint32_t tok);
+static int match(uint32_t *curr, pnode_s *p);
+static semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *machs, uint32_t *curr, pda_s *pda, int index);
+static semantics_s *ll_drive(parse_s *parse, pnode_s *root, mach_s *machs, uint32_t *curr, pda_s *pda, int index);
+static bool ll_push(llstack_s *stack, parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *machs, pda_s *pda, int index, semantics_s **ret);
+static void ll_resume(llstack_s *stack, parse_s *parse, mach_s *machs, semantics_s *syn);
+static pna_s *pna_(production_s *prod, semantics_s *in);
+static int get_production(parsetable_s *ptable, pda_s *pda, uint32_t *curr);
 static size_t errbuf_check(char **buffer, size_t *bsize, size_t *errsize, char *lexeme);
-static char *make_synerr(pda_s *pda, token_s **curr);
-static void panic_recovery(llist_s *follow, token_s **curr);
+static char *make_synerr(pda_s *pda, uint32_t *curr);
+static char *make_matcherr(pnode_s *pnode, uint32_t *curr);
+static void panic_recovery(llist_s *follow, uint32_t *curr);
 static void print_pnode_hash(void *key, void *data);
 
 static uint16_t str_hashf(void *key);
@@ -120,34 +175,83 @@ void printpda(pda_s *start)
 
 parse_s *build_parse(const char *file, lextok_s lextok)
 {
+    char *path;
     lex_s *semantics;
     parse_s *parse;
     token_s *list, *head;
-    llist_s *firsts;
+    struct timespec t0;
+
+    assert(idtable_lookup(lextok.lex->kwtable, ")").is_found);
+    eof_atom = intern("$", 1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (parsecache_enabled && (parse = parsecache_load(file, lextok.lex))) {
+        path = lc_path(file, PARSECACHE_SUFFIX);
+        print_loadstats(path, &t0);
+        free(path);
+    }
+    else {
+        semantics = semant_init();
+        list = lexspec(file, cfg_annotate, semantics, false);
+        head = list;
+        parse = parse_();
+        pp_start(parse, &list);
+        compute_firstfollows(parse);
+        build_parse_table(parse, head);
+        match_phase(lextok, head);
+        build_predict(parse->parse_table);
+        if (parsecache_enabled)
+            parsecache_save(parse, head, file, lextok.lex);
+    }
+    return parse_ready(parse, lextok);
+}
+
+/*
+ Loads the parser in image, a cache file compiled into the program whose
+ terminals were matched to lextok's lexer, or returns NULL if image was
+ written for another build.
+ */
+parse_s *build_parse_image(uint8_t *image, size_t size, lextok_s lextok)
+{
+    parse_s *parse;
+    struct timespec t0;
+
+    eof_atom = intern("$", 1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    parse = parsecache_image(image, size);
+    if (!parse)
+        return NULL;
+    print_loadstats("the built-in tables", &t0);
+    return parse_ready(parse, lextok);
+}
+
+/*
+ The sets of a loaded parser are not computed, so --parse-stats reports
+ where they came from and how long loading took instead.
+ */
+void print_loadstats(const char *from, struct timespec *t0)
+{
+    struct timespec t1;
+
+    if (!parse_stats)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("first/follow: loaded from %s in %.3f ms\n", from, (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6);
+}
+
+parse_s *parse_ready(parse_s *parse, lextok_s lextok)
+{
     FILE *fptable, *firfol;
-    
+
     fptable = fopen("parsetable", "w");
     firfol = fopen("firstfollow", "w");
     if (!(fptable && firfol)) {
         perror("File IO Error");
         exit(EXIT_FAILURE);
     }
-    assert(idtable_lookup(lextok.lex->kwtable, ")").is_found);
-
-    semantics = semant_init();
-    list = lexspec(file, cfg_annotate, semantics, false);
-    head = list;
-    parse = parse_();
-    parse->listing = lextok.lex->listing;
-    pp_start(parse, &list);
-    compute_firstfollows(parse);
-    firsts = getfirsts(parse, get_pda(parse, parse->start->nterm->lexeme));
-    build_parse_table(parse, head);
     print_parse_table(parse->parse_table, fptable);
     print_firfol(parse, firfol);
     fclose(fptable);
     fclose(firfol);
-    match_phase(lextok, head);
     parse->lex = lextok.lex;
     return parse;
 }
@@ -210,7 +314,10 @@ parse_s *parse_(void)
         exit(EXIT_FAILURE);
     }
     parse->start = NULL;
+    parse->toks = NULL;
     parse->phash = hash_(pjw_hashf, str_isequalf);
+    parse->npdas = 0;
+    parse->pdas = NULL;
     return parse;
 }
 
@@ -224,6 +331,7 @@ pda_s *pda_(token_s *token)
         exit(EXIT_FAILURE);
     }
     pda->nterm = token;
+    pda->index = 0;
     pda->nproductions = 0;
     pda->productions = NULL;
     return pda;
@@ -425,338 +533,430 @@ ffnode_s *makeffnode(token_s *token, uint16_t prod)
     return ffnode;
 }
 
-bool isespsilon(production_s *production)
+inline token_s *tmakeEOF(void)
 {
-    return production->start->token->type.val == LEXTYPE_EPSILON && !production->start->next;
+    token_s *tok;
+    
+    tok = calloc(1, sizeof(*tok));
+    if (!tok) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    tok->lexeme[0] = '$';
+    tok->atom = eof_atom;
+    tok->type.val = LEXTYPE_EOF;
+    tok->type.attribute = LEXATTR_FAKEEOF;
+    return tok;
 }
 
-bool hasepsilon(parse_s *parser, pnode_s *nonterm)
+/*
+ Computes nullable, FIRST and FOLLOW over bitsets, each as a worklist
+ fixpoint, and turns them into the pdas' firsts and follows lists for
+ build_parse_table and the error messages.
+ */
+void compute_firstfollows(parse_s *parser)
 {
-    pda_s *pda;
-    uint16_t i;
+    struct timespec t0, t1;
+    ffsets_s ff;
     
-    if (!nonterm || nonterm->token->type.val == LEXTYPE_TERM || nonterm->token->type.val == LEXTYPE_DOT || nonterm->token->type.val == LEXTYPE_EPSILON)
-        return false;
-    pda = get_pda(parser, nonterm->token->lexeme);
-    assert(pda);
-    for (i = 0; i < pda->nproductions; i++) {
-        if (isespsilon(&pda->productions[i]))
-            return true;
-    }
-    return false;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ff_number(&ff, parser);
+    ff_nullable(&ff);
+    ff_first(&ff);
+    ff_follow(&ff, parser);
+    ff_lists(&ff);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (parse_stats)
+        printf("first/follow: %u nonterminals, %u terminals, %u productions in %.3f ms\n", ff.nnterms, ff.nterms, ff.nprods,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    free(ff.termno);
+    free(ff.ntermno);
+    free(ff.terms);
+    free(ff.pdas);
+    free(ff.prodstart);
+    free(ff.nullable);
+    free(ff.first);
+    free(ff.follow);
 }
 
-llist_s *clone_firsts(llist_s *firsts, int production)
+void ff_number(ffsets_s *ff, parse_s *parser)
 {
-    llist_s *new = NULL, *start = NULL;
+    uint32_t i, natoms = atomcount(), tsize = FF_WORDBITS;
+    uint16_t j;
+    pda_s *pda;
+    pnode_s *iter;
+    hrecord_s *curr;
+    hashiterator_s *iterator;
     
-    if (firsts) {
-        new = llcopy(firsts);
-        start = new;
-        LLFF(new)->prod = production;
-        firsts = firsts->next;
-        while (firsts) {
-            new->next = llcopy(firsts);
-            firsts = firsts->next;
-            new = new->next;
-            LLFF(new)->prod = production;
+    ff->termno = ff_alloc(natoms * sizeof(*ff->termno));
+    ff->ntermno = ff_alloc(natoms * sizeof(*ff->ntermno));
+    ff->pdas = ff_alloc(parser->phash->nitems * sizeof(*ff->pdas));
+    ff->prodstart = ff_alloc((parser->phash->nitems + 1) * sizeof(*ff->prodstart));
+    ff->terms = ff_alloc(tsize * sizeof(*ff->terms));
+    ff->terms[0] = tmakeEOF();
+    ff->termno[eof_atom] = 1;
+    ff->nterms = 1;
+    ff->nnterms = 0;
+    ff->nprods = 0;
+    ff->epsilon = NULL;
+    iterator = hashiterator_(parser->phash);
+    for (curr = hashnext(iterator); curr; curr = hashnext(iterator)) {
+        pda = curr->data;
+        ff->ntermno[pda->nterm->atom] = ff->nnterms + 1;
+        ff->prodstart[ff->nnterms] = ff->nprods;
+        ff->pdas[ff->nnterms++] = pda;
+        ff->nprods += pda->nproductions;
+    }
+    free(iterator);
+    ff->prodstart[ff->nnterms] = ff->nprods;
+    for (i = 0; i < ff->nnterms; i++) {
+        pda = ff->pdas[i];
+        for (j = 0; j < pda->nproductions; j++) {
+            for (iter = pda->productions[j].start; iter; iter = iter->next) {
+                if (iter->token->type.val == LEXTYPE_EPSILON) {
+                    if (!ff->epsilon)
+                        ff->epsilon = iter->token;
+                }
+                else if (iter->token->type.val == LEXTYPE_TERM || iter->token->type.val == LEXTYPE_DOT) {
+                    if (ff->termno[iter->token->atom])
+                        continue;
+                    if (ff->nterms == tsize) {
+                        tsize *= 2;
+                        ff->terms = realloc(ff->terms, tsize * sizeof(*ff->terms));
+                        if (!ff->terms) {
+                            perror("Memory Allocation Error");
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    ff->terms[ff->nterms] = iter->token;
+                    ff->termno[iter->token->atom] = ++ff->nterms;
+                }
+                else if (!ff->ntermno[iter->token->atom]) {
+                    fprintf(stderr, "Error: Undefined nonterminal: %s\n", iter->token->lexeme);
+                    exit(EXIT_FAILURE);
+                }
+            }
         }
     }
-    
-    assert(start);
-    return start;
+    ff->nwords = (ff->nterms + FF_WORDBITS - 1) / FF_WORDBITS;
+    ff->nullable = ff_alloc(ff->nnterms * sizeof(*ff->nullable));
+    ff->first = ff_alloc(ff->nnterms * ff->nwords * sizeof(*ff->first));
+    ff->follow = ff_alloc(ff->nnterms * ff->nwords * sizeof(*ff->follow));
 }
 
-
-llist_s *getfirsts(parse_s *parser, pda_s *pda)
+/*
+ A production is nullable once every nonterminal in it is, counted down in
+ left as they become nullable; productions with a terminal never are.
+ */
+void ff_nullable(ffsets_s *ff)
 {
-    uint16_t i;
-    pda_s *tmp;
+    uint32_t i, p, n, e, *left, *owner, *stack;
+    uint16_t j;
+    pda_s *pda;
     pnode_s *iter;
-    llist_s *list = NULL;
+    ffedges_s uses = {0};
     
-    for (i = 0; i < pda->nproductions; i++) {
-        if (isespsilon(&pda->productions[i]))
-            llpush(&list, makeffnode(pda->productions[i].start->token, i));
-        else {
-            iter = pda->productions[i].start;
-            if (!iter)
-                return NULL;
-            do {
-                if (iter->token->type.val == LEXTYPE_TERM || iter->token->type.val == LEXTYPE_DOT || iter->token->type.val == LEXTYPE_EPSILON)
-                    llpush(&list, makeffnode(iter->token, i));
-                else {
-                    tmp = get_pda(parser, iter->token->lexeme);
-                    assert(tmp);
-                    list = llconcat(list, clone_firsts(getfirsts(parser, tmp), i));
+    left = ff_alloc(ff->nprods * sizeof(*left));
+    owner = ff_alloc(ff->nprods * sizeof(*owner));
+    stack = ff_alloc(ff->nnterms * sizeof(*stack));
+    for (i = 0, n = 0; i < ff->nnterms; i++) {
+        pda = ff->pdas[i];
+        for (j = 0, p = ff->prodstart[i]; j < pda->nproductions; j++, p++) {
+            owner[p] = i;
+            for (iter = pda->productions[j].start; iter; iter = iter->next) {
+                if (iter->token->type.val == LEXTYPE_TERM || iter->token->type.val == LEXTYPE_DOT) {
+                    left[p] = UINT32_MAX;
+                    break;
                 }
+                if (iter->token->type.val != LEXTYPE_EPSILON) {
+                    left[p]++;
+                    ff_addedge(&uses, ff->ntermno[iter->token->atom] - 1, p);
+                }
+            }
+            if (!left[p] && !ff->nullable[i]) {
+                ff->nullable[i] = true;
+                stack[n++] = i;
             }
-            while (hasepsilon(parser, iter) && (iter = iter->next));
         }
     }
-    return list;
+    ff_sortedges(&uses, ff->nnterms);
+    while (n) {
+        i = stack[--n];
+        for (e = uses.start[i]; e < uses.start[i + 1]; e++) {
+            p = uses.to[e];
+            if (left[p] != UINT32_MAX && !--left[p] && !ff->nullable[owner[p]]) {
+                ff->nullable[owner[p]] = true;
+                stack[n++] = owner[p];
+            }
+        }
+    }
+    free_ffedges(&uses);
+    free(left);
+    free(owner);
+    free(stack);
 }
 
-void getfollows(follow_s *fparams)
+/*
+ FIRST of a nonterminal holds the terminals its productions start with,
+ directly or after nullable nonterminals, and FIRST of every nonterminal
+ they start with, which is an edge from that one to it.
+ */
+void ff_first(ffsets_s *ff)
 {
-    uint16_t i;
-    bool has_epsilon;
-    ffnode_s *tmpeof;
-    pda_s *pda, *nterm;
+    uint32_t i, b;
+    uint16_t j;
+    pda_s *pda;
     pnode_s *iter;
-    hrecord_s *curr;
-    follow_s *neighbor;
-    hashiterator_s *iterator;
+    ffedges_s edges = {0};
     
-    if (fparams->pda == fparams->parser->start) {
-        tmpeof = makeEOF();
-        if (!llpnode_contains(fparams->follows, tmpeof->token))
-            llpush(&fparams->follows, tmpeof);
-        else
-            free(tmpeof);
-    }
-    iterator = hashiterator_(fparams->parser->phash);
-    for (curr = hashnext(iterator); curr; curr = hashnext(iterator)) {
-        pda = curr->data;
-        for (i = 0; i < pda->nproductions; i++) {
-            for (iter = pda->productions[i].start; iter; iter = iter->next) {
-                if (get_pda(fparams->parser, iter->token->lexeme) == fparams->pda) {
-                    do {
-                        if (!iter->next) {
-                            has_epsilon = false;
-                            neighbor = get_neighbor_params(fparams->table, pda);
-                            add_inherit(fparams, neighbor);
-                        }
-                        else {
-                            iter = iter->next;
-                            has_epsilon = hasepsilon(fparams->parser, iter);
-                            if (iter->token->type.val == LEXTYPE_TERM || iter->token->type.val == LEXTYPE_DOT || iter->token->type.val == LEXTYPE_EPSILON) {
-                                if (!llpnode_contains(fparams->follows, iter->token))
-                                    llpush(&fparams->follows, makeffnode(iter->token, 0));
-                            }
-                            else {
-                                nterm = get_pda(fparams->parser, iter->token->lexeme);
-                                neighbor = get_neighbor_params(fparams->table, nterm);
-                                fparams->follows = lldeep_concat_foll(fparams->follows, neighbor->firsts);
-                                if (has_epsilon)
-                                    add_inherit(fparams, neighbor);
-                            }
-                        }                        
-                    }
-                    while (has_epsilon);
+    for (i = 0; i < ff->nnterms; i++) {
+        pda = ff->pdas[i];
+        for (j = 0; j < pda->nproductions; j++) {
+            for (iter = pda->productions[j].start; iter; iter = iter->next) {
+                if (iter->token->type.val == LEXTYPE_EPSILON)
+                    continue;
+                if (iter->token->type.val == LEXTYPE_TERM || iter->token->type.val == LEXTYPE_DOT) {
+                    FF_ADD(&ff->first[i * ff->nwords], ff->termno[iter->token->atom] - 1);
+                    break;
                 }
+                b = ff->ntermno[iter->token->atom] - 1;
+                ff_addedge(&edges, b, i);
+                if (!ff->nullable[b])
+                    break;
             }
         }
     }
-    
-    pthread_mutex_lock(fparams->jlock);
-    --*fparams->count;
-    pthread_cond_signal(fparams->jcond);
-    pthread_mutex_unlock(fparams->jlock);
-    
-    free(iterator);
-    pthread_exit(0);
+    ff_sortedges(&edges, ff->nnterms);
+    ff_propagate(ff->first, ff->nwords, ff->nnterms, &edges);
+    free_ffedges(&edges);
 }
 
-inline ffnode_s *makeEOF (void)
-{
-    return makeffnode(tmakeEOF(), 1);
-}
-
-inline token_s *tmakeEOF(void)
+/*
+ FOLLOW of a nonterminal holds FIRST of whatever comes after it in a
+ production, and FOLLOW of the production's nonterminal where all of that
+ is nullable, which is an edge from that one to it. The start symbol is
+ followed by $.
+ */
+void ff_follow(ffsets_s *ff, parse_s *parser)
 {
-    token_s *tok;
+    uint32_t i, b;
+    uint16_t j;
+    pda_s *pda;
+    pnode_s *iter;
+    ffedges_s edges = {0};
     
-    tok = calloc(1, sizeof(*tok));
-    if (!tok) {
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
+    FF_ADD(&ff->follow[(ff->ntermno[parser->start->nterm->atom] - 1) * ff->nwords], 0);
+    for (i = 0; i < ff->nnterms; i++) {
+        pda = ff->pdas[i];
+        for (j = 0; j < pda->nproductions; j++) {
+            for (iter = pda->productions[j].start; iter; iter = iter->next) {
+                if (iter->token->type.val != LEXTYPE_NONTERM)
+                    continue;
+                b = ff->ntermno[iter->token->atom] - 1;
+                if (ff_seqfirst(ff, iter->next, &ff->follow[b * ff->nwords]))
+                    ff_addedge(&edges, i, b);
+            }
+        }
     }
-    tok->lexeme[0] = '$';
-    tok->type.val = LEXTYPE_EOF;
-    tok->type.attribute = LEXATTR_FAKEEOF;
-    return tok;
+    ff_sortedges(&edges, ff->nnterms);
+    ff_propagate(ff->follow, ff->nwords, ff->nnterms, &edges);
+    free_ffedges(&edges);
 }
 
-follow_s *get_neighbor_params(follow_s *table, pda_s *pda)
-{
-    while (table->pda != pda)
-        table++;
-    return table;
-}
-
-llist_s *lldeep_concat_foll(llist_s *first, llist_s *second)
+/*
+ Adds FIRST of the symbols from iter on to set, and returns whether they
+ are all nullable.
+ */
+bool ff_seqfirst(ffsets_s *ff, pnode_s *iter, uint64_t *set)
 {
-    llist_s *second_ = NULL, *iter = NULL;
+    uint32_t b, w;
     
-   if (!second)
-       return first;
-    while (LLTOKEN(second)->type.val == LEXTYPE_EPSILON ||
-           llpnode_contains(first, LLTOKEN(second))) {
-        second = second->next;
-        if (!second)
-            return first;
-    }
-    second_ = iter = llcopy(second);
-    for (second = second->next; second; second = second->next) {
-        if (LLTOKEN(second)->type.val == LEXTYPE_EPSILON ||
-            llpnode_contains(first, LLTOKEN(second)))
+    for (; iter; iter = iter->next) {
+        if (iter->token->type.val == LEXTYPE_EPSILON)
             continue;
-        iter->next = llcopy(second);
-        iter = iter->next;
+        if (iter->token->type.val == LEXTYPE_TERM || iter->token->type.val == LEXTYPE_DOT) {
+            FF_ADD(set, ff->termno[iter->token->atom] - 1);
+            return false;
+        }
+        b = ff->ntermno[iter->token->atom] - 1;
+        for (w = 0; w < ff->nwords; w++)
+            set[w] |= ff->first[b * ff->nwords + w];
+        if (!ff->nullable[b])
+            return false;
     }
-    return llconcat (first, second_);
+    return true;
 }
 
-bool llpnode_contains(llist_s *list, token_s *tok)
+/*
+ A pda's firsts start with an epsilon for each nullable production, then
+ hold the terminals each production starts with, production by production;
+ its follows hold the terminals of FOLLOW. Both are in terminal order.
+ */
+void ff_lists(ffsets_s *ff)
 {
-    while (list) {
-        if (!strcmp(LLTOKEN(list)->lexeme, tok->lexeme))
-            return true;
-        list = list->next;
+    uint32_t i, t, w;
+    int j;
+    pda_s *pda;
+    uint64_t *set;
+    bool *nullprod;
+    
+    set = ff_alloc(ff->nwords * sizeof(*set));
+    for (i = 0; i < ff->nnterms; i++) {
+        pda = ff->pdas[i];
+        pda->firsts = NULL;
+        pda->follows = NULL;
+        nullprod = ff_alloc((pda->nproductions ? pda->nproductions : 1) * sizeof(*nullprod));
+        for (j = pda->nproductions - 1; j >= 0; j--) {
+            for (w = 0; w < ff->nwords; w++)
+                set[w] = 0;
+            nullprod[j] = ff_seqfirst(ff, pda->productions[j].start, set);
+            for (t = ff->nterms; t-- > 0; ) {
+                if (FF_HAS(set, t))
+                    llpush(&pda->firsts, makeffnode(ff->terms[t], j));
+            }
+        }
+        for (j = pda->nproductions - 1; j >= 0; j--) {
+            if (nullprod[j]) {
+                assert(ff->epsilon);
+                llpush(&pda->firsts, makeffnode(ff->epsilon, j));
+            }
+        }
+        for (t = ff->nterms; t-- > 0; ) {
+            if (FF_HAS(&ff->follow[i * ff->nwords], t))
+                llpush(&pda->follows, makeffnode(ff->terms[t], 0));
+        }
+        free(nullprod);
     }
-    return false;
+    free(set);
 }
 
-void add_inherit(follow_s *nonterm, follow_s *dependent)
+void ff_addedge(ffedges_s *edges, uint32_t from, uint32_t to)
 {
-    uint16_t i;
-    
-    if (nonterm->ninherit)
-        nonterm->inherit = realloc(nonterm->inherit, (nonterm->ninherit + 1) * sizeof(*nonterm->inherit));
-    else
-        nonterm->inherit = malloc(sizeof(*nonterm->inherit));
-    if (!nonterm->inherit) {
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
-    }
-    for (i = 0; i < nonterm->ninherit; i++) {
-        if (nonterm->inherit[i] == dependent)
-            return;
+    if (edges->n == edges->size) {
+        edges->size = edges->size ? 2 * edges->size : 256;
+        edges->from = realloc(edges->from, edges->size * sizeof(*edges->from));
+        edges->to = realloc(edges->to, edges->size * sizeof(*edges->to));
+        if (!edges->from || !edges->to) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
     }
-    nonterm->inherit[nonterm->ninherit] = dependent;
-    nonterm->ninherit++;
+    edges->from[edges->n] = from;
+    edges->to[edges->n] = to;
+    edges->n++;
 }
 
-llist_s *inherit_follows(follow_s *nterm, llist_s **stack)
+/*
+ Sorts the edges by the node they leave, for nodes numbered below n.
+ */
+void ff_sortedges(ffedges_s *edges, uint32_t n)
 {
-    uint16_t i;
-    llist_s *tmp;
+    uint32_t i, *to;
     
-    if (llcontains(*stack, nterm)) {
-        return NULL;
-    }
-    else
-        llpush(stack, nterm);
-    for (i = 0; i < nterm->ninherit; i++) {
-        nterm->follows = lldeep_concat_foll(nterm->follows, inherit_follows(nterm->inherit[i], stack));
-    }
-    tmp = llpop(stack);
-    free(tmp);
-    return nterm->follows;
+    edges->start = ff_alloc((n + 2) * sizeof(*edges->start));
+    to = ff_alloc((edges->n ? edges->n : 1) * sizeof(*to));
+    for (i = 0; i < edges->n; i++)
+        edges->start[edges->from[i] + 2]++;
+    for (i = 2; i < n + 2; i++)
+        edges->start[i] += edges->start[i - 1];
+    for (i = 0; i < edges->n; i++)
+        to[edges->start[edges->from[i] + 1]++] = edges->to[i];
+    free(edges->to);
+    edges->to = to;
 }
 
-void compute_firstfollows(parse_s *parser)
+/*
+ Adds each node's set to the sets of the nodes its edges lead to, going
+ over the nodes whose sets grew until none do.
+ */
+void ff_propagate(uint64_t *sets, uint32_t nwords, uint32_t n, ffedges_s *edges)
 {
-    bool ready = false;
-    int i, status, nitems = parser->phash->nitems;
-    pda_s *tmp;
-    hrecord_s *curr;
-    hashiterator_s *iterator;
-    follow_s ftable[nitems];
-    pthread_mutex_t jlock;
-    pthread_cond_t jcond;
-    llist_s *stack = NULL;
-    uint16_t threadcount = 0;
-
-    memset(ftable, 0, sizeof(ftable));
-    nitems = parser->phash->nitems;
-    status = pthread_mutex_init(&jlock, NULL);
-    if (status) {
-        perror("Error: Failed to initialize mutex lock");
-        exit(status);
-    }
-    status = pthread_cond_init(&jcond, NULL);
-    if (status) {
-        perror("Error: Failed to initialize condition variable");
-        exit(status);
-    }
-    iterator = hashiterator_(parser->phash);
-    for (curr = hashnext(iterator), i = 0; curr; curr = hashnext(iterator), i++) {
-        tmp = curr->data;
-        tmp->firsts = getfirsts(parser, tmp);
-        ftable[i].parser = parser;
-        ftable[i].table = ftable;
-        ftable[i].index = i;
-        ftable[i].pda = curr->data;
-        ftable[i].firsts = tmp->firsts;
-        ftable[i].jlock = &jlock;
-        ftable[i].jcond = &jcond;
-        ftable[i].ready = &ready;
-        ftable[i].count = &threadcount;
-        ftable[i].ninherit = 0;
+    bool grew, *queued;
+    uint32_t i, e, w, to, head, count, *queue;
+    uint64_t bits, *from, *dest;
+    
+    queue = ff_alloc((n ? n : 1) * sizeof(*queue));
+    queued = ff_alloc((n ? n : 1) * sizeof(*queued));
+    for (i = 0; i < n; i++) {
+        queue[i] = i;
+        queued[i] = true;
     }
-    free(iterator);
-    threadcount = nitems;
-    for (i = 0; i < nitems; i++) {
-        status = pthread_create(&ftable[i].thread, NULL, (void *(*)())getfollows, &ftable[i]);
-        if (status) {
-            perror("Error: Could not start new thread");
-            exit(status);
+    for (head = 0, count = n; count; count--) {
+        i = queue[head];
+        head = (head + 1) % n;
+        queued[i] = false;
+        from = &sets[i * nwords];
+        for (e = edges->start[i]; e < edges->start[i + 1]; e++) {
+            to = edges->to[e];
+            dest = &sets[to * nwords];
+            for (w = 0, grew = false; w < nwords; w++) {
+                bits = from[w] & ~dest[w];
+                if (bits) {
+                    dest[w] |= bits;
+                    grew = true;
+                }
+            }
+            if (grew && !queued[to]) {
+                queue[(head + count - 1) % n] = to;
+                queued[to] = true;
+                count++;
+            }
         }
     }
-            
-    pthread_mutex_lock(&jlock);
-    while(threadcount)
-        pthread_cond_wait(&jcond, &jlock);
-    pthread_mutex_unlock(&jlock);
+    free(queue);
+    free(queued);
+}
 
-    for (i = 0; i < nitems; i++)
-        ftable[i].pda->follows = inherit_follows(&ftable[i], &stack);
-    pthread_mutex_destroy(&jlock);
-    pthread_cond_destroy(&jcond);
+void free_ffedges(ffedges_s *edges)
+{
+    free(edges->from);
+    free(edges->to);
+    free(edges->start);
 }
 
-bool lllex_contains(llist_s *list, char *lex)
+void *ff_alloc(size_t size)
 {
-    while (list) {
-        if (!strcmp(((token_s *)list->ptr)->lexeme, lex))
-            return true;
-        list = list->next;
+    void *p;
+    
+    p = calloc(1, size);
+    if (!p) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
     }
-    return false;
+    return p;
 }
 
+/*
+ Numbers the terminals and nonterminals by atom, in the table's order of
+ last appearance first with $ as the last terminal, and gives each pda
+ its row.
+ */
 void build_parse_table(parse_s *parse, token_s *tokens)
 {
-    uint16_t    i, j, k,
+    uint16_t    i, j,
                 n_terminals = 1,
-                n_nonterminals = 0;
-    llist_s *terminals = NULL,
-            *nonterminals = NULL, *tmp;
+                n_nonterminals = 0,
+                *column, *row;
+    uint32_t natoms = atomcount();
     parsetable_s *ptable;
     llist_s *first_iter, *foll_iter;
+    token_s *iter;
     pda_s *curr;
     hrecord_s *hcurr;
     hashiterator_s *hiterator;
     
-    llpush(&terminals, tmakeEOF());
-    while (tokens) {
-        
-        
-        if (tokens->type.val == LEXTYPE_TERM || tokens->type.val == LEXTYPE_DOT) {
-            if (!lllex_contains(terminals, tokens->lexeme)) {
-                llpush(&terminals, tokens);
-                n_terminals++;
-            }
+    column = ff_alloc(natoms * sizeof(*column));
+    row = ff_alloc(natoms * sizeof(*row));
+    column[eof_atom] = 1;
+    for (iter = tokens; iter; iter = iter->next) {
+        if (iter->type.val == LEXTYPE_TERM || iter->type.val == LEXTYPE_DOT) {
+            if (!column[iter->atom])
+                column[iter->atom] = ++n_terminals;
         }
-        else if (tokens->type.val == LEXTYPE_NONTERM) {
-            if (!lllex_contains(nonterminals, tokens->lexeme)) {
-                llpush(&nonterminals, tokens);
-                n_nonterminals++;
-            }
+        else if (iter->type.val == LEXTYPE_NONTERM) {
+            if (!row[iter->atom])
+                row[iter->atom] = ++n_nonterminals;
         }
-        tokens = tokens->next;
     }
     ptable = malloc(sizeof(*ptable));
     if (!ptable) {
@@ -765,6 +965,8 @@ void build_parse_table(parse_s *parse, token_s *tokens)
     }
     ptable->n_terminals = n_terminals;
     ptable->n_nonterminals = n_nonterminals;
+    ptable->ntypes = 0;
+    ptable->predict = NULL;
     ptable->table = malloc(n_nonterminals * sizeof(*ptable->table));
     if (!ptable->table) {
         perror("Memory Allocation Error");
@@ -779,48 +981,70 @@ void build_parse_table(parse_s *parse, token_s *tokens)
         for (j = 0; j < n_terminals; j++)
             ptable->table[i][j] = -1;
     }
-    ptable->terms = calloc(sizeof(*ptable->terms), n_terminals);
-    ptable->nterms = calloc(sizeof(*ptable->nterms), n_nonterminals);
-    if (!ptable->terms || !ptable->nterms) {
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
-    }
-    for (i = 0; i < n_terminals; i++) {
-        tmp = llpop(&terminals);
-        ptable->terms[i] = tmp->ptr;
-        free(tmp);
-    }
-    for (i = 0; i < n_nonterminals; i++) {
-        tmp = llpop(&nonterminals);
-        ptable->nterms[i] = tmp->ptr;
-        free(tmp);
+    ptable->terms = ff_alloc(n_terminals * sizeof(*ptable->terms));
+    ptable->nterms = ff_alloc(n_nonterminals * sizeof(*ptable->nterms));
+    ptable->terms[n_terminals - 1] = tmakeEOF();
+    for (iter = tokens; iter; iter = iter->next) {
+        if (iter->type.val == LEXTYPE_TERM || iter->type.val == LEXTYPE_DOT) {
+            j = n_terminals - column[iter->atom];
+            if (!ptable->terms[j])
+                ptable->terms[j] = iter;
+        }
+        else if (iter->type.val == LEXTYPE_NONTERM) {
+            i = n_nonterminals - row[iter->atom];
+            if (!ptable->nterms[i])
+                ptable->nterms[i] = iter;
+        }
     }
     hiterator = hashiterator_(parse->phash);
     for (hcurr = hashnext(hiterator); hcurr; hcurr = hashnext(hiterator)) {
         curr = hcurr->data;
-        for (i = 0; i < n_nonterminals; i++) {
-            if (!strcmp(curr->nterm->lexeme, ptable->nterms[i]->lexeme))
-                break;
-        }
-         for (first_iter = curr->firsts; first_iter; first_iter = first_iter->next) {
-            for (j = 0; j < n_terminals; j++) {
-                if (!strcmp(LLTOKEN(first_iter)->lexeme, ptable->terms[j]->lexeme))
-                    ptable->table[i][j] = LLFF(first_iter)->prod;
-                else if (LLTOKEN(first_iter)->type.val == LEXTYPE_EPSILON) {
-                    for (foll_iter = curr->follows; foll_iter; foll_iter = foll_iter->next) {
-                        for (k = 0; k < n_terminals; k++) {
-                            if (!strcmp(LLTOKEN(foll_iter)->lexeme, ptable->terms[k]->lexeme)) {
-                                ptable->table[i][k] = LLFF(first_iter)->prod;
-                            }
-                        }
-                    }
-                }
+        i = curr->index = n_nonterminals - row[curr->nterm->atom];
+        for (first_iter = curr->firsts; first_iter; first_iter = first_iter->next) {
+            if (LLTOKEN(first_iter)->type.val == LEXTYPE_EPSILON) {
+                for (foll_iter = curr->follows; foll_iter; foll_iter = foll_iter->next)
+                    ptable->table[i][n_terminals - column[LLTOKEN(foll_iter)->atom]] = LLFF(first_iter)->prod;
             }
+            else
+                ptable->table[i][n_terminals - column[LLTOKEN(first_iter)->atom]] = LLFF(first_iter)->prod;
         }
     }
+    free(hiterator);
+    free(column);
+    free(row);
     parse->parse_table = ptable;
 }
 
+/*
+ Flattens the table into predict, indexed by row and token type, once
+ match_phase has given the terminals their lexer types. Where terminals
+ share a type, the first of them with an entry in the row wins.
+ */
+void build_predict(parsetable_s *ptable)
+{
+    uint16_t i, j, type;
+    int16_t *entry;
+    
+    for (j = 0; j < ptable->n_terminals; j++) {
+        if (ptable->terms[j]->type.val >= ptable->ntypes)
+            ptable->ntypes = ptable->terms[j]->type.val + 1;
+    }
+    ptable->predict = malloc((ptable->n_nonterminals * ptable->ntypes + 1) * sizeof(*ptable->predict));
+    if (!ptable->predict) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    memset(ptable->predict, 0xff, (ptable->n_nonterminals * ptable->ntypes + 1) * sizeof(*ptable->predict));
+    for (i = 0; i < ptable->n_nonterminals; i++) {
+        for (j = 0; j < ptable->n_terminals; j++) {
+            type = ptable->terms[j]->type.val;
+            entry = &ptable->predict[i * ptable->ntypes + type];
+            if (*entry < 0 && ptable->table[i][j] >= 0)
+                *entry = ptable->table[i][j];
+        }
+    }
+}
+
 void print_parse_table (parsetable_s *ptable, FILE *stream)
 {
     uint16_t i, j, accum;
@@ -870,45 +1094,67 @@ void print_firfol (parse_s *parse, FILE *stream)
 void parse(parse_s *parse, lextok_s lex, FILE *out)
 {
     int index;
+    uint32_t curr = 1;
     size_t errsize;
     char *synerr;
     pda_s *nterm;
     pnode_s *root;
     
     emitdest = out;
+    toks = parse->toks = lex.toks;
+    tokstream = lex.stream;
     root = pnode_(parse->start->nterm);
-    index = get_production(parse->parse_table, parse->start, &lex.tokens);
+    index = get_production(parse->parse_table, parse->start, &curr);
     if (index < 0) {
         nterm = get_pda(parse, parse->start->nterm->lexeme);
         for (index = 0; parse->parse_table->nterms[index]->type.val != parse->start->nterm->type.val; index++);
-        synerr = make_synerr (nterm, &lex.tokens);
-        adderror(parse->listing, synerr, lex.tokens->lineno);
-        panic_recovery(parse->start->follows, &lex.tokens);
+        synerr = make_synerr (nterm, &curr);
+        adderror(parse->lex->listing, synerr, tokbuf_lineno(toks, curr));
+        panic_recovery(parse->start->follows, &curr);
     }
     root->in = NULL;
-    nonterm(parse, NULL, root, lex.lex->machs, &lex.tokens, parse->start, index);
-    if (lex.tokens->type.val != LEXTYPE_EOF) {
-        errsize = (sizeof(SYNERR_PREFIX)-1)+FS_INTWIDTH_DEC(lex.tokens->lineno)+sizeof("EOF but got: ")+strlen(lex.tokens->lexeme);
+    if (parse_driver == PARSE_RECURSIVE)
+        nonterm(parse, NULL, root, lex.lex->machs, &curr, parse->start, index);
+    else
+        ll_drive(parse, root, lex.lex->machs, &curr, parse->start, index);
+    if (toks->type[curr] != LEXTYPE_EOF) {
+        errsize = (sizeof(SYNERR_PREFIX)-1)+FS_INTWIDTH_DEC(tokbuf_lineno(toks, curr))+sizeof("EOF but got: ")+strlen(toks->lexeme[curr]);
         synerr = malloc(errsize);
         if (!synerr) {
             perror("Memory Allocation Error");
             exit(EXIT_FAILURE);
         }
-        sprintf(synerr, SYNERR_PREFIX "EOF but got %s", lex.tokens->lineno, lex.tokens->lexeme);
+        sprintf(synerr, SYNERR_PREFIX "EOF but got %s", tokbuf_lineno(toks, curr), toks->lexeme[curr]);
         synerr[errsize-1] = '\n';
-        adderror(parse->listing, synerr, lex.tokens->lineno);
-        panic_recovery(parse->start->follows, &lex.tokens);
+        adderror(parse->lex->listing, synerr, tokbuf_lineno(toks, curr));
+        panic_recovery(parse->start->follows, &curr);
+    }
+    if (tokstream) {
+        while (lex_next(tokstream));
+        free_lexstate(tokstream);
+        tokstream = NULL;
     }
     write_code();
 }
 
-int match(token_s **curr, pnode_s *p)
+/*
+ Returns the token after tok, lexing it first when the source is lexed as
+ it is parsed, or 0 past the last token.
+ */
+uint32_t next_token(uint32_t tok)
+{
+    if (tok + 1 == toks->n && tokstream)
+        lex_next(tokstream);
+    return tok + 1 < toks->n ? tok + 1 : 0;
+}
+
+int match(uint32_t *curr, pnode_s *p)
 {
-    if ((*curr)->type.val == p->token->type.val) {
+    if (toks->type[*curr] == p->token->type.val) {
         p->matched = *curr;
         tok_lastmatched = *curr;
-        if ((*curr)->type.val != LEXTYPE_EOF) {
-            *curr = (*curr)->next;
+        if (toks->type[*curr] != LEXTYPE_EOF) {
+            *curr = next_token(*curr);
             return 1;
         }
         return 2;
@@ -916,14 +1162,12 @@ int match(token_s **curr, pnode_s *p)
     return 0;
 }
 
-semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *machs, token_s **curr, pda_s *pda, int index)
+semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *machs, uint32_t *curr, pda_s *pda, int index)
 {
     int result, i;
     pda_s *nterm;
     pnode_s *pnode;
     bool success;
-    char *synerr;
-    size_t errsize;
     pna_s *pcp, *synth;
     llist_s *child_inll;
     semantics_s *child_in;
@@ -935,19 +1179,7 @@ semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *m
     
     grstack_push();
     
-    pcp = malloc(sizeof(*pcp) + pda->productions[index].nnodes * sizeof(pnode_s));
-    if(!pcp) {
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
-    }
-    pcp->size = pda->productions[index].nnodes;
-    memset(pcp, 0, sizeof(*pcp) + pda->productions[index].nnodes * sizeof(pnode_s));
-    pcp->size = pda->productions[index].nnodes;
-    for(pnode = pda->productions[index].start, i = 0; i < pcp->size; pnode = pnode->next, i++) {
-        pcp->array[i].matched = NULL;
-        pcp->array[i] = *pnode;
-        pcp->array[i].in = in;
-    }
+    pcp = pna_(&pda->productions[index], in);
     
     pnode = pda->productions[index].start;
     if (pnode->token->type.val == LEXTYPE_EPSILON) {
@@ -963,12 +1195,12 @@ semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *m
                 if (!*curr)
                     return synhash;
                 success = true;
-                if ((nterm = get_pda(parse, pnode->token->lexeme))) {
+                if ((nterm = get_pda_(parse, pnode->token->atom))) {
                     result = get_production(parse->parse_table, nterm, curr);
                     if (result < 0) {
-                        adderror(parse->listing, make_synerr(nterm, curr), (*curr)->lineno);
+                        adderror(parse->lex->listing, make_synerr(nterm, curr), tokbuf_lineno(toks, *curr));
                         panic_recovery(pda->follows, curr);
-                        if ((*curr)->type.val == LEXTYPE_EOF) {
+                        if (toks->type[*curr] == LEXTYPE_EOF) {
                             grstack_pop();
                             return NULL;
                         }
@@ -993,17 +1225,8 @@ semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *m
                     pcp->array[i].pass = true;
                     result = match(curr, pnode);
                     if (!result) {
-                        errsize = sizeof(SYNERR_PREFIX)+FS_INTWIDTH_DEC((*curr)->lineno)
-                                + strlen(pnode->token->lexeme)+sizeof(" but got ")+strlen((*curr)->lexeme)-3;
-                        synerr = malloc(errsize);
-                        if (!synerr) {
-                            perror("Memory Allocation Error");
-                            exit(EXIT_FAILURE);
-                        }
-                        sprintf(synerr, SYNERR_PREFIX "%s but got %s", (*curr)->lineno, pnode->token->lexeme, (*curr)->lexeme);
-                        synerr[errsize-1] = '\n';
-                        adderror(parse->listing, synerr, (*curr)->lineno);
-                        if ((*curr)->type.val == LEXTYPE_EOF) {
+                        adderror(parse->lex->listing, make_matcherr(pnode, curr), tokbuf_lineno(toks, *curr));
+                        if (toks->type[*curr] == LEXTYPE_EOF) {
                             grstack_pop();
                             return NULL;
                         }
@@ -1019,6 +1242,157 @@ semantics_s *nonterm(parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *m
     return synhash;
 }
 
+/*
+ Parses as nonterm does, keeping the expansions on a stack of frames
+ rather than the C stack. A frame at a nonterminal waits for the child
+ pushed above it, and when the child is popped its synthesized attributes
+ are handed down and the frame's actions for that node run.
+ */
+semantics_s *ll_drive(parse_s *parse, pnode_s *root, mach_s *machs, uint32_t *curr, pda_s *pda, int index)
+{
+    int result;
+    pda_s *nterm;
+    llframe_s *f;
+    llist_s *child_inll;
+    semantics_s *child_in, *ret = NULL;
+    llstack_s stack = {0, 0, NULL};
+    
+    ll_push(&stack, parse, NULL, root, machs, pda, index, &ret);
+    while (stack.n) {
+        f = &stack.frames[stack.n - 1];
+        if (!f->pnode) {
+            sem_start(NULL, parse, machs, f->pda, &f->pda->productions[f->index], f->pcp, f->synhash, ++f->pass, true);
+            grstack_pop();
+            ret = f->synhash;
+        }
+        else if (!*curr)
+            ret = f->synhash;
+        else if ((nterm = get_pda_(parse, f->pnode->token->atom))) {
+            result = get_production(parse->parse_table, nterm, curr);
+            if (result >= 0) {
+                f->pcp->curr = &f->pcp->array[f->i];
+                child_inll = sem_start(NULL, parse, machs, f->pda, &f->pda->productions[f->index], f->pcp, f->synhash, ++f->pass, false);
+                child_in = llremove_(&child_inll, find_in, f->pnode);
+                if (!ll_push(&stack, parse, child_in, f->pnode, machs, nterm, result, &ret))
+                    ll_resume(&stack, parse, machs, ret);
+                continue;
+            }
+            adderror(parse->lex->listing, make_synerr(nterm, curr), tokbuf_lineno(toks, *curr));
+            panic_recovery(f->pda->follows, curr);
+            if (toks->type[*curr] == LEXTYPE_EOF) {
+                grstack_pop();
+                ret = NULL;
+            }
+            else {
+                panic_recovery(f->pda->follows, curr);
+                f->pnode = f->pnode->next;
+                f->i++;
+                continue;
+            }
+        }
+        else {
+            f->pcp->curr = &f->pcp->array[f->i];
+            f->pcp->array[f->i].matched = *curr;
+            f->pcp->array[f->i].pass = true;
+            if (!match(curr, f->pnode)) {
+                adderror(parse->lex->listing, make_matcherr(f->pnode, curr), tokbuf_lineno(toks, *curr));
+                if (toks->type[*curr] == LEXTYPE_EOF) {
+                    grstack_pop();
+                    ret = NULL;
+                    goto popframe;
+                }
+                panic_recovery(f->pda->follows, curr);
+            }
+            f->pnode = f->pnode->next;
+            f->i++;
+            continue;
+        }
+    popframe:
+        if (--stack.n)
+            ll_resume(&stack, parse, machs, ret);
+    }
+    free(stack.frames);
+    return ret;
+}
+
+/*
+ Pushes a frame expanding pda by its production index, returning false
+ if it is an epsilon production, which is done at once and leaves its
+ attributes in ret.
+ */
+bool ll_push(llstack_s *stack, parse_s *parse, semantics_s *in, pnode_s *pnterm, mach_s *machs, pda_s *pda, int index, semantics_s **ret)
+{
+    llframe_s *f;
+    production_s *prod = &pda->productions[index];
+    
+    assert(!prod->annot || prod->annot->prev->type.val == LEXTYPE_ANNOTATE);
+    if (stack->n == stack->size) {
+        stack->size = stack->size ? 2 * stack->size : 64;
+        stack->frames = realloc(stack->frames, stack->size * sizeof(*stack->frames));
+        if (!stack->frames) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    f = &stack->frames[stack->n];
+    f->pda = pda;
+    f->index = index;
+    f->i = 0;
+    f->pass = 0;
+    f->synhash = semantics_s_(parse, machs);
+    f->synhash->n = pnterm;
+    grstack_push();
+    f->pcp = pna_(prod, in);
+    f->pnode = prod->start;
+    if (f->pnode->token->type.val == LEXTYPE_EPSILON) {
+        f->pcp->curr = f->pcp->array;
+        sem_start(NULL, parse, machs, pda, prod, f->pcp, f->synhash, ++f->pass, true);
+        f->pnode->pass = true;
+        grstack_pop();
+        *ret = f->synhash;
+        return false;
+    }
+    stack->n++;
+    return true;
+}
+
+/*
+ Hands the attributes a child synthesized to the frame on top of the
+ stack and moves it past the child's node.
+ */
+void ll_resume(llstack_s *stack, parse_s *parse, mach_s *machs, semantics_s *syn)
+{
+    llframe_s *f = &stack->frames[stack->n - 1];
+    
+    f->pcp->curr->syn = syn;
+    f->pnode->pass = true;
+    sem_start(NULL, parse, machs, f->pda, &f->pda->productions[f->index], f->pcp, f->synhash, ++f->pass, false);
+    f->pnode = f->pnode->next;
+    f->i++;
+}
+
+/*
+ Copies prod's nodes for one expansion, each inheriting in.
+ */
+pna_s *pna_(production_s *prod, semantics_s *in)
+{
+    int i;
+    pna_s *pcp;
+    pnode_s *pnode;
+    
+    pcp = calloc(1, sizeof(*pcp) + prod->nnodes * sizeof(pnode_s));
+    if(!pcp) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    pcp->size = prod->nnodes;
+    for(pnode = prod->start, i = 0; i < pcp->size; pnode = pnode->next, i++) {
+        pcp->array[i] = *pnode;
+        pcp->array[i].in = in;
+    }
+    return pcp;
+}
+
 size_t errbuf_check(char **buffer, size_t *bsize, size_t *errsize, char *lexeme)
 {    
     size_t oldsize = *errsize;
@@ -1034,7 +1408,7 @@ size_t errbuf_check(char **buffer, size_t *bsize, size_t *errsize, char *lexeme)
     return oldsize+1;
 }
 
-char *make_synerr(pda_s *pda, token_s **curr)
+char *make_synerr(pda_s *pda, uint32_t *curr)
 {
     bool gotepsilon = false;
     size_t errsize, bsize, oldsize;
@@ -1042,13 +1416,13 @@ char *make_synerr(pda_s *pda, token_s **curr)
     char *errstr;
     
     bsize = INIT_SYNERRSIZE;
-    errsize = sizeof(SYNERR_PREFIX) + FS_INTWIDTH_DEC((*curr)->lineno);
+    errsize = sizeof(SYNERR_PREFIX) + FS_INTWIDTH_DEC(tokbuf_lineno(toks, *curr));
     errstr = calloc(1, INIT_SYNERRSIZE);
     if (!errstr) {
         perror("Memory Allocation Error");
         exit(EXIT_FAILURE);
     }
-    sprintf(errstr, SYNERR_PREFIX, (*curr)->lineno);
+    sprintf(errstr, SYNERR_PREFIX, tokbuf_lineno(toks, *curr));
     oldsize = errsize;
     for (start = iter = pda->firsts; iter->next; iter = iter->next) {
         if (LLTOKEN(iter)->type.val == LEXTYPE_EPSILON)
@@ -1068,9 +1442,9 @@ char *make_synerr(pda_s *pda, token_s **curr)
     }
     oldsize = errsize;
     if (iter == start)
-        errsize += sizeof(" but got: ") + strlen(LLTOKEN(iter)->lexeme) + strlen((*curr)->lexeme);
+        errsize += sizeof(" but got: ") + strlen(LLTOKEN(iter)->lexeme) + strlen(toks->lexeme[*curr]);
     else
-        errsize += sizeof("  but got: ") + strlen(LLTOKEN(iter)->lexeme) + strlen((*curr)->lexeme);
+        errsize += sizeof("  but got: ") + strlen(LLTOKEN(iter)->lexeme) + strlen(toks->lexeme[*curr]);
     if (errsize > bsize) {
         bsize = errsize;
         errstr = realloc(errstr, bsize);
@@ -1086,55 +1460,86 @@ char *make_synerr(pda_s *pda, token_s **curr)
             exit(EXIT_FAILURE);
         } 
     }
-    sprintf(&errstr[oldsize], "%s but got: %s", LLTOKEN(iter)->lexeme, (*curr)->lexeme);
+    sprintf(&errstr[oldsize], "%s but got: %s", LLTOKEN(iter)->lexeme, toks->lexeme[*curr]);
 
     errstr[errsize-1] = '\n';
     return errstr;
 }
 
-void panic_recovery(llist_s *follow, token_s **curr)
+char *make_matcherr(pnode_s *pnode, uint32_t *curr)
+{
+    size_t errsize;
+    char *synerr;
+    
+    errsize = sizeof(SYNERR_PREFIX)+FS_INTWIDTH_DEC(tokbuf_lineno(toks, *curr))
+            + strlen(pnode->token->lexeme)+sizeof(" but got ")+strlen(toks->lexeme[*curr])-3;
+    synerr = malloc(errsize);
+    if (!synerr) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(synerr, SYNERR_PREFIX "%s but got %s", tokbuf_lineno(toks, *curr), pnode->token->lexeme, toks->lexeme[*curr]);
+    synerr[errsize-1] = '\n';
+    return synerr;
+}
+
+void panic_recovery(llist_s *follow, uint32_t *curr)
 {
     llist_s *iter;    
     
-    while ((*curr)->type.val != LEXTYPE_EOF) {
+    while (toks->type[*curr] != LEXTYPE_EOF) {
         for (iter = follow; iter; iter = iter->next) {
-            if (LLTOKEN(iter)->type.val == (*curr)->type.val)
+            if (LLTOKEN(iter)->type.val == toks->type[*curr])
                 return;
         }
-        *curr = (*curr)->next;
+        *curr = next_token(*curr);
     }
 }
 
-int get_production(parsetable_s *ptable, pda_s *pda, token_s **curr)
+int get_production(parsetable_s *ptable, pda_s *pda, uint32_t *curr)
 {
-    uint16_t i, j;
+    uint16_t type = toks->type[*curr];
     
-    for (i = 0; i < ptable->n_nonterminals; i++) {
-        if (!strcmp(pda->nterm->lexeme, ptable->nterms[i]->lexeme)) {
-            for (j = 0; j < ptable->n_terminals; j++) {
-                //printf("comparing: %s %d to %s %d\n", (*curr)->lexeme, (*curr)->type.val, ptable->terms[j]->lexeme, ptable->terms[j]->type.val);
-                if ((*curr)->type.val == ptable->terms[j]->type.val) {
-                    if (ptable->table[i][j] == -1)
-                        continue;
-                    return ptable->table[i][j];
-                }
-            }
-            return -1;
-        }
-    }
-    return -1;
+    if (type >= ptable->ntypes)
+        return -1;
+    return ptable->predict[pda->index * ptable->ntypes + type];
 }
 
 pda_s *get_pda(parse_s *parser, char *name)
 {
-    return hashlookup(parser->phash, name);
+    return get_pda_(parser, atomlookup(name));
+}
+
+pda_s *get_pda_(parse_s *parser, uint32_t atom)
+{
+    return atom < parser->npdas ? parser->pdas[atom] : NULL;
 }
 
+/*
+ Adds pda under name, both to phash, which keeps the nonterminals' order
+ for building the tables, and to pdas, indexed by the name's atom.
+ */
 bool hash_pda(parse_s *parser, char *name, pda_s *pda)
 {
+    uint32_t atom, n;
+    
     if (!parser->start)
         parser->start = pda;
-    return hashinsert (parser->phash, name, pda);
+    if (!hashinsert(parser->phash, name, pda))
+        return false;
+    atom = intern(name, strlen(name));
+    if (atom >= parser->npdas) {
+        n = atomcount();
+        parser->pdas = realloc(parser->pdas, n * sizeof(*parser->pdas));
+        if (!parser->pdas) {
+            perror("Memory Allocation Error");
+            exit(EXIT_FAILURE);
+        }
+        memset(&parser->pdas[parser->npdas], 0, (n - parser->npdas) * sizeof(*parser->pdas));
+        parser->npdas = n;
+    }
+    parser->pdas[atom] = pda;
+    return true;
 }
 
 uint16_t str_hashf(void *key)
@@ -18,24 +18,33 @@
 
 #define PDATABLE_SIZE 19
 
+enum parse_driver_ {
+    PARSE_STACK,
+    PARSE_RECURSIVE
+};
+
 typedef struct parse_s parse_s;
 typedef struct pda_s pda_s;
 typedef struct production_s production_s;
 typedef struct pnode_s pnode_s;
 typedef struct parsetable_s parsetable_s;
+typedef struct ffnode_s ffnode_s;
 
 struct parse_s
 {
     lex_s *lex;
+    tokbuf_s *toks;
     pda_s *start;
     hash_s *phash;
-    linetable_s *listing;
+    uint32_t npdas;
+    pda_s **pdas;
     parsetable_s *parse_table;
 };
 
 struct pda_s
 {
     token_s *nterm;
+    uint16_t index;
     uint16_t nproductions;
     production_s *productions;
     llist_s *firsts;
@@ -54,7 +63,7 @@ struct pnode_s
 {
     pnode_s *self;
     token_s *token;
-    token_s *matched;
+    uint32_t matched;
     token_s *annotation;
     pnode_s *next;
     pnode_s *prev;
@@ -63,19 +72,43 @@ struct pnode_s
     struct semantics_s *syn;
 };
 
+/*
+ table is indexed by pda index and terminal, in the printed order, and
+ predict by pda index and token type, ntypes to a row.
+ */
 struct parsetable_s
 {
     uint16_t n_terminals;
     uint16_t n_nonterminals;
+    uint16_t ntypes;
     token_s **terms;
     token_s **nterms;
     int32_t **table;
+    int16_t *predict;
+};
+
+/*
+ An entry of a pda's firsts or follows, with the production it predicts.
+ */
+struct ffnode_s
+{
+    uint16_t prod;
+    token_s *token;
 };
 
-extern token_s *tok_lastmatched;
+extern uint32_t tok_lastmatched;
+extern bool parse_stats;
+extern int parse_driver;
 
 extern parse_s *build_parse(const char *file, lextok_s lextok);
+extern parse_s *build_parse_image(uint8_t *image, size_t size, lextok_s lextok);
+extern parse_s *parse_(void);
+extern pda_s *pda_(token_s *token);
+extern production_s *addproduction(pda_s *pda);
+extern pnode_s *pnode_(token_s *token);
+extern ffnode_s *makeffnode(token_s *token, uint16_t prod);
 extern pda_s *get_pda(parse_s *parser, char *name);
+extern pda_s *get_pda_(parse_s *parser, uint32_t atom);
 extern bool hash_pda(parse_s *parser, char *name, pda_s *pda);
 extern void parse(parse_s *parse, lextok_s lex, FILE *out);
 
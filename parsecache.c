@@ -0,0 +1,510 @@
+/*
+ parsecache.c
+ Author: Jonathan Hamm
+
+ Description:
+    Implementation of the grammar cache. A cache file is a header followed by
+    the tokens of the grammar, then each pda with its productions, firsts and
+    follows, in the order the grammar defines them, then the parse table.
+    The tokens are those of the grammar's token list, annotations included,
+    as match_phase left them, followed by the tokens outside the list that
+    the sets and the table use. Everything else names tokens by number.
+
+    The table and predict are aligned to 8 bytes in the file and used where
+    they lie in the mapping, as are the tokens' strings. Tokens, pdas and
+    productions are rebuilt as build_parse would make them, and a loaded
+    parser keeps its mapping for the life of the program.
+ */
+
+#include "parsecache.h"
+#include "lexcache.h"
+#include "semantics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PC_MAGIC        "PCCFGC\r\n"
+#define PC_NOTOKEN      UINT32_MAX
+
+#define PC_ATOM         0x1
+#define PC_WHOLE        0x2
+
+typedef struct pchdr_s pchdr_s;
+
+/*
+ spechash covers the grammar, the annotations' regex file and the hash
+ of the lexer's regex file, sum everything after the header, and size the
+ size of the whole file.
+ */
+struct pchdr_s
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint64_t spechash;
+    uint64_t sum;
+    uint64_t size;
+    uint16_t maxlexlen;
+    uint16_t pad[3];
+};
+
+bool parsecache_enabled = true;
+
+static bool pc_spechash(const char *cfg, lex_s *lex, uint64_t *hash);
+static bool pc_checkhdr(pchdr_s *hdr, size_t size);
+
+static bool pc_checkhdr(pchdr_s *hdr, size_t size)
+{
+    return !memcmp(hdr->magic, PC_MAGIC, sizeof(hdr->magic)) && hdr->version == PARSECACHE_VERSION
+        && hdr->order == LC_ORDER && hdr->size == size && hdr->maxlexlen == MAX_LEXLEN;
+}
+
+uint32_t pc_ref(lcmap_s *map, token_s *tok);
+static void pc_puttoken(lcbuf_s *b, token_s *tok);
+static void pc_putset(lcbuf_s *b, lcmap_s *map, llist_s *set);
+static void pc_putpda(lcbuf_s *b, lcmap_s *map, pda_s *pda);
+static void pc_puttable(lcbuf_s *b, lcmap_s *map, parsetable_s *ptable);
+
+static token_s *pc_gettok(lcread_s *r, token_s *toks, uint32_t ntoks, bool null);
+static void pc_gettoken(lcread_s *r, token_s *tok);
+static llist_s *pc_getset(lcread_s *r, token_s *toks, uint32_t ntoks);
+static void pc_getpda(lcread_s *r, parse_s *parse, token_s *toks, uint32_t ntoks);
+static parsetable_s *pc_gettable(lcread_s *r, token_s *toks, uint32_t ntoks);
+static parse_s *pc_getparse(lcread_s *r);
+
+/*
+ Returns the parser cached for cfg, with its terminals matched to lex, or
+ NULL if there is no cache for the current contents of the files it was
+ built from.
+ */
+parse_s *parsecache_load(const char *cfg, lex_s *lex)
+{
+    void *map;
+    size_t size;
+    parse_s *parse;
+
+    map = parsecache_map(cfg, lex, &size);
+    if (!map)
+        return NULL;
+
+    /*
+     As with the lexer cache, only a file written by another build of this
+     version can fail here, and what was read of it is not freed.
+     */
+    parse = parsecache_image(map, size);
+    if (!parse)
+        munmap(map, size);
+    return parse;
+}
+
+/*
+ Maps cfg's cache file, returning NULL if there is none for the current
+ contents of the files it was built from.
+ */
+void *parsecache_map(const char *cfg, lex_s *lex, size_t *size)
+{
+    char *path;
+    void *map;
+    uint64_t hash;
+    pchdr_s hdr;
+
+    if (!pc_spechash(cfg, lex, &hash))
+        return NULL;
+    path = lc_path(cfg, PARSECACHE_SUFFIX);
+    map = lc_map(path, sizeof(hdr), size);
+    free(path);
+    if (!map)
+        return NULL;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (!pc_checkhdr(&hdr, *size) || hdr.spechash != hash
+        || hdr.sum != lc_hash(LC_HASHINIT, (uint8_t *)map + sizeof(hdr), *size - sizeof(hdr))) {
+        munmap(map, *size);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ Loads the parser in image, which it keeps using in place. As with
+ lexcache_image, only the header is checked, so the caller has to know
+ which lexer image's terminals were matched to.
+ */
+parse_s *parsecache_image(uint8_t *image, size_t size)
+{
+    pchdr_s hdr;
+    lcread_s r;
+
+    if (size < sizeof(hdr))
+        return NULL;
+    memcpy(&hdr, image, sizeof(hdr));
+    if (!pc_checkhdr(&hdr, size))
+        return NULL;
+    r.data = image;
+    r.pos = sizeof(hdr);
+    r.len = size;
+    r.bad = false;
+    return pc_getparse(&r);
+}
+
+/*
+ Writes parse, as built from cfg's token list and matched to lex, to cfg's
+ cache file. Returns false if it could not be written.
+ */
+bool parsecache_save(parse_s *parse, token_s *list, const char *cfg, lex_s *lex)
+{
+    uint32_t i, j, ntoks, nlist = 0, npdas = 0;
+    bool ok;
+    char *path;
+    token_s *tok;
+    llist_s *iter;
+    pda_s *pda, **pdas;
+    parsetable_s *ptable = parse->parse_table;
+    pchdr_s hdr;
+    lcbuf_s b = {0};
+    lcmap_s map = {0};
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (!pc_spechash(cfg, lex, &hdr.spechash))
+        return false;
+    pdas = malloc((parse->phash->nitems ? parse->phash->nitems : 1) * sizeof(*pdas));
+    if (!pdas) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (tok = list; tok; tok = tok->next, nlist++) {
+        lcmap_index(&map, tok);
+        pda = get_pda_(parse, tok->atom);
+        if (pda && pda->nterm == tok && npdas < parse->phash->nitems)
+            pdas[npdas++] = pda;
+    }
+    if (npdas != parse->phash->nitems) {
+        free(pdas);
+        free_lcmap(&map);
+        return false;
+    }
+    for (i = 0; i < npdas; i++) {
+        for (iter = pdas[i]->firsts; iter; iter = iter->next)
+            lcmap_index(&map, ((ffnode_s *)iter->ptr)->token);
+        for (iter = pdas[i]->follows; iter; iter = iter->next)
+            lcmap_index(&map, ((ffnode_s *)iter->ptr)->token);
+    }
+    for (j = 0; j < ptable->n_terminals; j++)
+        lcmap_index(&map, ptable->terms[j]);
+    for (i = 0; i < ptable->n_nonterminals; i++)
+        lcmap_index(&map, ptable->nterms[i]);
+
+    b.strings = hash_(pjw_hashf, str_isequalf);
+    memcpy(hdr.magic, PC_MAGIC, sizeof(hdr.magic));
+    hdr.version = PARSECACHE_VERSION;
+    hdr.order = LC_ORDER;
+    hdr.maxlexlen = MAX_LEXLEN;
+    lc_put(&b, &hdr, sizeof(hdr));
+
+    ntoks = map.n;
+    LC_PUT(&b, ntoks);
+    LC_PUT(&b, nlist);
+    for (i = 0; i < ntoks; i++)
+        pc_puttoken(&b, map.nodes[i]);
+    LC_PUT(&b, npdas);
+    for (i = 0; i < npdas; i++)
+        pc_putpda(&b, &map, pdas[i]);
+    pc_puttable(&b, &map, ptable);
+    free(pdas);
+    free_lcmap(&map);
+
+    hdr.size = b.len;
+    hdr.sum = lc_hash(LC_HASHINIT, b.data + sizeof(hdr), b.len - sizeof(hdr));
+    memcpy(b.data, &hdr, sizeof(hdr));
+
+    path = lc_path(cfg, PARSECACHE_SUFFIX);
+    ok = lc_write(path, &b);
+    free(path);
+    free(b.data);
+    free_hash(b.strings);
+    return ok;
+}
+
+bool pc_spechash(const char *cfg, lex_s *lex, uint64_t *hash)
+{
+    uint64_t h;
+
+    if (!lc_spechash(LC_HASHINIT, cfg, &h) || !lc_spechash(h, REGEX_DECORATIONS_FILE, &h))
+        return false;
+    *hash = lc_hash(h, &lex->spechash, sizeof(lex->spechash));
+    return true;
+}
+
+uint32_t pc_ref(lcmap_s *map, token_s *tok)
+{
+    return tok ? lcmap_index(map, tok) : PC_NOTOKEN;
+}
+
+/*
+ A token's lexeme is written whole, from lexeme_ when it has one, and
+ flags say whether it had lexeme_ and an atom.
+ */
+void pc_puttoken(lcbuf_s *b, token_s *tok)
+{
+    uint8_t flags = 0;
+
+    if (tok->atom)
+        flags |= PC_ATOM;
+    if (tok->lexeme_)
+        flags |= PC_WHOLE;
+    LC_PUT(b, tok->type.val);
+    LC_PUT(b, tok->type.attribute);
+    LC_PUT(b, tok->lineno);
+    LC_PUT(b, flags);
+    lc_putstr(b, tok->lexeme_ ? tok->lexeme_ : tok->lexeme);
+    lc_putstr(b, tok->stype);
+}
+
+void pc_putset(lcbuf_s *b, lcmap_s *map, llist_s *set)
+{
+    uint32_t n = 0, ref;
+    llist_s *iter;
+
+    for (iter = set; iter; iter = iter->next)
+        n++;
+    LC_PUT(b, n);
+    for (iter = set; iter; iter = iter->next) {
+        ref = pc_ref(map, ((ffnode_s *)iter->ptr)->token);
+        LC_PUT(b, ref);
+        LC_PUT(b, ((ffnode_s *)iter->ptr)->prod);
+    }
+}
+
+void pc_putpda(lcbuf_s *b, lcmap_s *map, pda_s *pda)
+{
+    uint32_t ref;
+    uint16_t i;
+    production_s *prod;
+    pnode_s *node;
+
+    ref = pc_ref(map, pda->nterm);
+    LC_PUT(b, ref);
+    LC_PUT(b, pda->index);
+    LC_PUT(b, pda->nproductions);
+    for (i = 0; i < pda->nproductions; i++) {
+        prod = &pda->productions[i];
+        ref = pc_ref(map, prod->annot);
+        LC_PUT(b, ref);
+        LC_PUT(b, prod->nnodes);
+        for (node = prod->start; node; node = node->next) {
+            ref = pc_ref(map, node->token);
+            LC_PUT(b, ref);
+        }
+    }
+    pc_putset(b, map, pda->firsts);
+    pc_putset(b, map, pda->follows);
+}
+
+void pc_puttable(lcbuf_s *b, lcmap_s *map, parsetable_s *ptable)
+{
+    uint32_t ref;
+    uint16_t i;
+
+    LC_PUT(b, ptable->n_terminals);
+    LC_PUT(b, ptable->n_nonterminals);
+    LC_PUT(b, ptable->ntypes);
+    for (i = 0; i < ptable->n_terminals; i++) {
+        ref = pc_ref(map, ptable->terms[i]);
+        LC_PUT(b, ref);
+    }
+    for (i = 0; i < ptable->n_nonterminals; i++) {
+        ref = pc_ref(map, ptable->nterms[i]);
+        LC_PUT(b, ref);
+    }
+    lc_align(b);
+    for (i = 0; i < ptable->n_nonterminals; i++)
+        lc_put(b, ptable->table[i], ptable->n_terminals * sizeof(**ptable->table));
+    lc_align(b);
+    lc_put(b, ptable->predict, ((size_t)ptable->n_nonterminals * ptable->ntypes + 1) * sizeof(*ptable->predict));
+}
+
+/*
+ Reads a token number, which may only be PC_NOTOKEN if null is set.
+ */
+token_s *pc_gettok(lcread_s *r, token_s *toks, uint32_t ntoks, bool null)
+{
+    uint32_t ref;
+
+    LC_GET(r, ref);
+    if (r->bad)
+        return NULL;
+    if (ref == PC_NOTOKEN && null)
+        return NULL;
+    if (ref >= ntoks) {
+        r->bad = true;
+        return NULL;
+    }
+    return &toks[ref];
+}
+
+void pc_gettoken(lcread_s *r, token_s *tok)
+{
+    uint8_t flags;
+    char *lexeme;
+
+    LC_GET(r, tok->type.val);
+    LC_GET(r, tok->type.attribute);
+    LC_GET(r, tok->lineno);
+    LC_GET(r, flags);
+    lexeme = lc_getstr(r);
+    tok->stype = lc_getstr(r);
+    if (!lexeme) {
+        r->bad = true;
+        return;
+    }
+    snprintf(tok->lexeme, sizeof(tok->lexeme), "%s", lexeme);
+    if (flags & PC_WHOLE)
+        tok->lexeme_ = lexeme;
+    if (flags & PC_ATOM)
+        tok->atom = intern(lexeme, strlen(lexeme));
+}
+
+/*
+ Sets are written in list order and pushed back in reverse.
+ */
+llist_s *pc_getset(lcread_s *r, token_s *toks, uint32_t ntoks)
+{
+    uint32_t n, i;
+    uint16_t *prods;
+    token_s **tokens;
+    llist_s *set = NULL;
+
+    LC_GET(r, n);
+    if (r->bad || n > r->len) {
+        r->bad = true;
+        return NULL;
+    }
+    tokens = malloc((n ? n : 1) * sizeof(*tokens));
+    prods = malloc((n ? n : 1) * sizeof(*prods));
+    if (!tokens || !prods) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n && !r->bad; i++) {
+        tokens[i] = pc_gettok(r, toks, ntoks, false);
+        LC_GET(r, prods[i]);
+    }
+    while (i-- && !r->bad)
+        llpush(&set, makeffnode(tokens[i], prods[i]));
+    free(tokens);
+    free(prods);
+    return set;
+}
+
+void pc_getpda(lcread_s *r, parse_s *parse, token_s *toks, uint32_t ntoks)
+{
+    int nnodes, k;
+    uint16_t nproductions, i;
+    token_s *nterm;
+    production_s *prod;
+    pnode_s *node, *last = NULL;
+    pda_s *pda;
+
+    nterm = pc_gettok(r, toks, ntoks, false);
+    if (!nterm)
+        return;
+    pda = pda_(nterm);
+    pda->firsts = NULL;
+    pda->follows = NULL;
+    if (!hash_pda(parse, nterm->lexeme, pda)) {
+        r->bad = true;
+        return;
+    }
+    LC_GET(r, pda->index);
+    LC_GET(r, nproductions);
+    for (i = 0; i < nproductions && !r->bad; i++) {
+        prod = addproduction(pda);
+        prod->annot = pc_gettok(r, toks, ntoks, true);
+        LC_GET(r, nnodes);
+        if (r->bad || nnodes < 1 || (size_t)nnodes > r->len) {
+            r->bad = true;
+            return;
+        }
+        for (k = 0; k < nnodes && !r->bad; k++) {
+            node = pnode_(pc_gettok(r, toks, ntoks, false));
+            if (!k)
+                prod->start = node;
+            else {
+                last->next = node;
+                if (k > 1)
+                    node->prev = last;
+            }
+            last = node;
+        }
+        prod->nnodes = nnodes;
+    }
+    pda->firsts = pc_getset(r, toks, ntoks);
+    pda->follows = pc_getset(r, toks, ntoks);
+}
+
+parsetable_s *pc_gettable(lcread_s *r, token_s *toks, uint32_t ntoks)
+{
+    uint16_t i;
+    int32_t *rows;
+    parsetable_s *ptable;
+
+    ptable = calloc(1, sizeof(*ptable));
+    if (!ptable) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    LC_GET(r, ptable->n_terminals);
+    LC_GET(r, ptable->n_nonterminals);
+    LC_GET(r, ptable->ntypes);
+    if (r->bad)
+        return ptable;
+    ptable->terms = malloc((ptable->n_terminals ? ptable->n_terminals : 1) * sizeof(*ptable->terms));
+    ptable->nterms = malloc((ptable->n_nonterminals ? ptable->n_nonterminals : 1) * sizeof(*ptable->nterms));
+    ptable->table = malloc((ptable->n_nonterminals ? ptable->n_nonterminals : 1) * sizeof(*ptable->table));
+    if (!ptable->terms || !ptable->nterms || !ptable->table) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ptable->n_terminals; i++)
+        ptable->terms[i] = pc_gettok(r, toks, ntoks, false);
+    for (i = 0; i < ptable->n_nonterminals; i++)
+        ptable->nterms[i] = pc_gettok(r, toks, ntoks, false);
+    rows = lc_getarray(r, (size_t)ptable->n_nonterminals * ptable->n_terminals * sizeof(*rows));
+    for (i = 0; i < ptable->n_nonterminals && rows; i++)
+        ptable->table[i] = &rows[(size_t)i * ptable->n_terminals];
+    ptable->predict = lc_getarray(r, ((size_t)ptable->n_nonterminals * ptable->ntypes + 1) * sizeof(*ptable->predict));
+    return ptable;
+}
+
+parse_s *pc_getparse(lcread_s *r)
+{
+    uint32_t ntoks, nlist, npdas, i;
+    token_s *toks;
+    parse_s *parse;
+
+    LC_GET(r, ntoks);
+    LC_GET(r, nlist);
+    if (r->bad || !nlist || nlist > ntoks || ntoks > r->len)
+        return NULL;
+    toks = calloc(ntoks, sizeof(*toks));
+    if (!toks) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ntoks && !r->bad; i++) {
+        pc_gettoken(r, &toks[i]);
+        if (i && i < nlist) {
+            toks[i - 1].next = &toks[i];
+            toks[i].prev = &toks[i - 1];
+        }
+    }
+    parse = parse_();
+    LC_GET(r, npdas);
+    for (i = 0; i < npdas && !r->bad; i++)
+        pc_getpda(r, parse, toks, ntoks);
+    if (!r->bad)
+        parse->parse_table = pc_gettable(r, toks, ntoks);
+    if (r->bad || r->pos != r->len || !parse->start)
+        return NULL;
+    return parse;
+}
@@ -0,0 +1,30 @@
+/*
+ parsecache.h
+ Author: Jonathan Hamm
+
+ Description:
+    On disk cache of parsers built by build_parse. A parser is written next
+    to its grammar, as <file>.cfgc, along with a hash of the grammar, of
+    the regex file its annotations are lexed with and of the regex file of
+    the lexer its terminals were matched to. Later runs map the cache into
+    memory instead of lexing the grammar and building its sets and table
+    again, as long as the hash still matches. PARSECACHE_VERSION has to
+    change whenever the parser's layout or the way it is built does.
+ */
+
+#ifndef PARSECACHE_H_
+#define PARSECACHE_H_
+
+#include "parse.h"
+
+#define PARSECACHE_SUFFIX   ".cfgc"
+#define PARSECACHE_VERSION  1
+
+extern bool parsecache_enabled;
+
+extern parse_s *parsecache_load(const char *cfg, lex_s *lex);
+extern void *parsecache_map(const char *cfg, lex_s *lex, size_t *size);
+extern parse_s *parsecache_image(uint8_t *image, size_t size);
+extern bool parsecache_save(parse_s *parse, token_s *list, const char *cfg, lex_s *lex);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ relexcheck.c
+ Author: Jonathan Hamm
+
+ Description:
+    Regression driver for lex_update. Each file given is lexed with lexf,
+    then edited at random a few hundred times; after every edit the tokens
+    lex_update brought up to date are compared with those of a fresh lexf
+    over the edited buffer, token by token and line by line. The first
+    difference in a file is printed and the file given up on. Exits with 1
+    if any file differed. Built and run by make relex.
+ */
+
+#include "lex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RELEX_NEDITS    300
+
+static const char *frags[] = {
+    " ", "\n", "\n\n", "\t", "a", "x", "b1", "begin", "end", "program", ":=",
+    ";", ":", ".", "..", "(", ")", "<", ">", "=", "+", "0", "3", "12.5", "E",
+    "E+3", "9000000000000", "{ c }", "'s'", "}", "~",
+    "omglololololololololololololololol"
+};
+
+static int check(lex_s *lex, const char *file, unsigned seed);
+static void edit(char **buf, size_t *len, size_t *off, size_t *oldlen, size_t *newlen);
+static int compare(lextok_s *lt, lextok_s *ft);
+
+int main(int argc, char *argv[])
+{
+    int i, bad = 0;
+    lex_s *lex;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    lex = buildlex("regex_pascal");
+    for (i = 1; i < argc; i++)
+        bad |= check(lex, argv[i], i);
+    return bad;
+}
+
+int check(lex_s *lex, const char *file, unsigned seed)
+{
+    int i;
+    size_t len, off, oldlen, newlen;
+    char *src, *buf;
+    lextok_s lt, ft;
+
+    src = readfile(file);
+    for (len = 0; src[len] != EOF; len++);
+    buf = malloc(len + 1);
+    if (!buf) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(buf, src, len + 1);
+
+    srand(seed);
+    lt = lexf(lex, buf, 0, false);
+    for (i = 0; i < RELEX_NEDITS; i++) {
+        edit(&buf, &len, &off, &oldlen, &newlen);
+        lex_update(&lt, buf, off, oldlen, newlen);
+        ft = lexf(lex, buf, 0, false);
+        if (compare(&lt, &ft)) {
+            printf("%s: edit %d at %zu, %zu bytes replaced by %zu\n", file, i, off, oldlen, newlen);
+            free_tokbuf(ft.toks);
+            free_tokbuf(lt.toks);
+            free(buf);
+            return 1;
+        }
+        free_tokbuf(ft.toks);
+    }
+    printf("%s: %d edits, %u tokens\n", file, RELEX_NEDITS, lt.toks->n);
+    free_tokbuf(lt.toks);
+    free(buf);
+    return 0;
+}
+
+/*
+ Replaces a short run of buf, now and then a longer one, with up to three
+ fragments. buf keeps its EOF at len.
+ */
+void edit(char **buf, size_t *len, size_t *off, size_t *oldlen, size_t *newlen)
+{
+    char ins[256];
+    int n;
+
+    *off = *len ? rand() % (*len + 1) : 0;
+    *oldlen = rand() % 4 ? rand() % 6 : rand() % 60;
+    if (*off + *oldlen > *len)
+        *oldlen = *len - *off;
+    ins[0] = '\0';
+    for (n = rand() % 4; n > 0; n--)
+        strcat(ins, frags[rand() % (sizeof(frags) / sizeof(*frags))]);
+    *newlen = strlen(ins);
+
+    *buf = realloc(*buf, *len + *newlen + 1);
+    if (!*buf) {
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    memmove(&(*buf)[*off + *newlen], &(*buf)[*off + *oldlen], *len - *off - *oldlen + 1);
+    memcpy(&(*buf)[*off], ins, *newlen);
+    *len = *len - *oldlen + *newlen;
+}
+
+int compare(lextok_s *lt, lextok_s *ft)
+{
+    uint32_t k;
+    tokbuf_s *a = lt->toks, *b = ft->toks;
+
+    if (a->n != b->n || lt->lines != ft->lines) {
+        printf("%u tokens on %u lines, lexf has %u on %u\n", a->n, lt->lines, b->n, ft->lines);
+        return 1;
+    }
+    for (k = 1; k < a->n; k++) {
+        if (a->type[k] != b->type[k] || a->attribute[k] != b->attribute[k] ||
+            a->stype[k] != b->stype[k] || a->off[k] != b->off[k] ||
+            a->len[k] != b->len[k] || a->atom[k] != b->atom[k] ||
+            strcmp(a->lexeme[k], b->lexeme[k]) ||
+            tokbuf_lineno(a, k) != tokbuf_lineno(b, k) ||
+            tokbuf_column(a, k) != tokbuf_column(b, k)) {
+            printf("token %u: \"%s\" at %zu, lexf has \"%s\" at %zu\n",
+                   k, a->lexeme[k], a->off[k], b->lexeme[k], b->off[k]);
+            return 1;
+        }
+    }
+    if (a->lines->n != b->lines->n ||
+        memcmp(a->lines->start, b->lines->start, a->lines->n * sizeof(*a->lines->start))) {
+        printf("line index of %u lines, lexf has %u\n", a->lines->n, b->lines->n);
+        return 1;
+    }
+    return 0;
+}
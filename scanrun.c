@@ -0,0 +1,352 @@
+/*
+ scanrun.c
+ Author: Jonathan Hamm
+
+ Description:
+    Implementation of the run scanners. The vector versions load whole
+    aligned blocks, starting with the one holding the run's first byte, and
+    turn each into a bit mask of the bytes in the class. An aligned block
+    never crosses a page, so reading past the run's end cannot fault even
+    though it may read past the end of the buffer.
+ */
+
+#include "scanrun.h"
+#include <stdio.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define SCANRUN_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*run_f)(const char *buf, int class, unsigned *newlines);
+typedef size_t (*lines_f)(const char *buf, size_t len, size_t base, size_t *starts);
+
+static size_t run_select(const char *buf, int class, unsigned *newlines);
+static size_t run_scalar(const char *buf, int class, unsigned *newlines);
+static size_t lines_select(const char *buf, size_t len, size_t base, size_t *starts);
+static size_t lines_scalar(const char *buf, size_t len, size_t base, size_t *starts);
+#ifdef SCANRUN_X86
+static size_t run_sse2(const char *buf, int class, unsigned *newlines);
+static size_t run_avx2(const char *buf, int class, unsigned *newlines);
+static size_t lines_sse2(const char *buf, size_t len, size_t base, size_t *starts);
+static size_t lines_avx2(const char *buf, size_t len, size_t base, size_t *starts);
+#endif
+
+static run_f run_impl = run_select;
+static lines_f lines_impl = lines_select;
+
+/*
+ Returns the length of the whitespace run at buf, and the number of
+ newlines in it in newlines.
+ */
+size_t scan_space(const char *buf, unsigned *newlines)
+{
+    *newlines = 0;
+    return __atomic_load_n(&run_impl, __ATOMIC_RELAXED)(buf, RUN_SPACE, newlines);
+}
+
+size_t scan_run(const char *buf, int class)
+{
+    return __atomic_load_n(&run_impl, __ATOMIC_RELAXED)(buf, class, NULL);
+}
+
+/*
+ Stores base + i + 1, where the line after it starts, for each newline
+ buf[i] in the len bytes at buf, and returns how many there were. starts
+ may be NULL to only count them.
+ */
+size_t scan_newlines(const char *buf, size_t len, size_t base, size_t *starts)
+{
+    return __atomic_load_n(&lines_impl, __ATOMIC_RELAXED)(buf, len, base, starts);
+}
+
+bool run_member(int class, uint8_t c)
+{
+    switch (class) {
+        case RUN_SPACE:
+            return c == ' ' || (c >= '\t' && c <= '\r');
+        case RUN_WORD:
+            if (c == '_')
+                return true;
+            /* fall through */
+        case RUN_ALNUM:
+            if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+                return true;
+            /* fall through */
+        case RUN_DIGIT:
+            return c >= '0' && c <= '9';
+        case RUN_TEXT:
+            return c != (uint8_t)EOF;
+        default:
+            return false;
+    }
+}
+
+/*
+ Makes the scanners use impl, or pick by what the CPU supports again for
+ SCAN_AUTO. Returns false if impl cannot run on this machine.
+ */
+bool scan_select(int impl)
+{
+    run_f run;
+    lines_f lines;
+
+    switch (impl) {
+        case SCAN_AUTO:
+            run = run_select;
+            lines = lines_select;
+            break;
+        case SCAN_SCALAR:
+            run = run_scalar;
+            lines = lines_scalar;
+            break;
+#ifdef SCANRUN_X86
+        case SCAN_SSE2:
+            run = run_sse2;
+            lines = lines_sse2;
+            break;
+        case SCAN_AVX2:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("avx2"))
+                return false;
+            run = run_avx2;
+            lines = lines_avx2;
+            break;
+#endif
+        default:
+            return false;
+    }
+    __atomic_store_n(&run_impl, run, __ATOMIC_RELAXED);
+    __atomic_store_n(&lines_impl, lines, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ Picks the scanner on first use. Threads lexing at once may race to pick
+ it, which is harmless as they all pick the same one.
+ */
+size_t run_select(const char *buf, int class, unsigned *newlines)
+{
+    run_f impl;
+
+#ifdef SCANRUN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = run_avx2;
+    else
+        impl = run_sse2;
+#else
+    impl = run_scalar;
+#endif
+    __atomic_store_n(&run_impl, impl, __ATOMIC_RELAXED);
+    return impl(buf, class, newlines);
+}
+
+size_t lines_select(const char *buf, size_t len, size_t base, size_t *starts)
+{
+    lines_f impl;
+
+#ifdef SCANRUN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = lines_avx2;
+    else
+        impl = lines_sse2;
+#else
+    impl = lines_scalar;
+#endif
+    __atomic_store_n(&lines_impl, impl, __ATOMIC_RELAXED);
+    return impl(buf, len, base, starts);
+}
+
+size_t run_scalar(const char *buf, int class, unsigned *newlines)
+{
+    size_t i;
+
+    for (i = 0; run_member(class, buf[i]); i++) {
+        if (newlines && buf[i] == '\n')
+            ++*newlines;
+    }
+    return i;
+}
+
+size_t lines_scalar(const char *buf, size_t len, size_t base, size_t *starts)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            if (starts)
+                starts[n] = base + i + 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+#ifdef SCANRUN_X86
+
+/*
+ Bytes from lo to hi, as unsigned, compared with one signed comparison.
+ */
+static inline __m128i sse2_range(__m128i x, char lo, char hi)
+{
+    return _mm_cmplt_epi8(_mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - lo))), _mm_set1_epi8((char)(0x80 + hi - lo + 1)));
+}
+
+static inline unsigned sse2_mask(__m128i x, int class)
+{
+    __m128i m;
+
+    switch (class) {
+        case RUN_SPACE:
+            m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), sse2_range(x, '\t', '\r'));
+            break;
+        case RUN_DIGIT:
+            m = sse2_range(x, '0', '9');
+            break;
+        case RUN_TEXT:
+            m = _mm_xor_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8((char)EOF)), _mm_set1_epi8(-1));
+            break;
+        default:
+            m = _mm_or_si128(sse2_range(x, '0', '9'), sse2_range(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z'));
+            if (class == RUN_WORD)
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+            break;
+    }
+    return _mm_movemask_epi8(m);
+}
+
+size_t run_sse2(const char *buf, int class, unsigned *newlines)
+{
+    unsigned skip, mask, nl = 0, end;
+    const char *p = (const char *)((uintptr_t)buf & ~(uintptr_t)15);
+    __m128i x;
+
+    skip = (1u << (buf - p)) - 1;
+    for (;;) {
+        x = _mm_load_si128((const __m128i *)p);
+        mask = sse2_mask(x, class) | skip;
+        if (newlines)
+            nl = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n'))) & ~skip;
+        if (mask != 0xFFFF)
+            break;
+        if (newlines)
+            *newlines += __builtin_popcount(nl);
+        skip = 0;
+        p += 16;
+    }
+    end = __builtin_ctz(~mask);
+    if (newlines)
+        *newlines += __builtin_popcount(nl & ((1u << end) - 1));
+    return p + end - buf;
+}
+
+/*
+ The blocks are aligned like the run scanners', with the bytes before buf
+ and from buf + len on masked off.
+ */
+size_t lines_sse2(const char *buf, size_t len, size_t base, size_t *starts)
+{
+    size_t n = 0;
+    unsigned mask, skip;
+    const char *p = (const char *)((uintptr_t)buf & ~(uintptr_t)15), *end = buf + len;
+
+    if (!len)
+        return 0;
+    skip = (1u << (buf - p)) - 1;
+    for (; p < end; p += 16, skip = 0) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), _mm_set1_epi8('\n'))) & ~skip;
+        if (end - p < 16)
+            mask &= (1u << (end - p)) - 1;
+        if (!starts)
+            n += __builtin_popcount(mask);
+        else {
+            for (; mask; mask &= mask - 1)
+                starts[n++] = base + (p - buf) + __builtin_ctz(mask) + 1;
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_range(__m256i x, char lo, char hi)
+{
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + hi - lo + 1)), _mm256_add_epi8(x, _mm256_set1_epi8((char)(0x80 - lo))));
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t avx2_mask(__m256i x, int class)
+{
+    __m256i m;
+
+    switch (class) {
+        case RUN_SPACE:
+            m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), avx2_range(x, '\t', '\r'));
+            break;
+        case RUN_DIGIT:
+            m = avx2_range(x, '0', '9');
+            break;
+        case RUN_TEXT:
+            m = _mm256_xor_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8((char)EOF)), _mm256_set1_epi8(-1));
+            break;
+        default:
+            m = _mm256_or_si256(avx2_range(x, '0', '9'), avx2_range(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z'));
+            if (class == RUN_WORD)
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+            break;
+    }
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+size_t run_avx2(const char *buf, int class, unsigned *newlines)
+{
+    uint32_t skip, mask, nl = 0, end;
+    const char *p = (const char *)((uintptr_t)buf & ~(uintptr_t)31);
+    __m256i x;
+
+    skip = (uint32_t)((1ull << (buf - p)) - 1);
+    for (;;) {
+        x = _mm256_load_si256((const __m256i *)p);
+        mask = avx2_mask(x, class) | skip;
+        if (newlines)
+            nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'))) & ~skip;
+        if (mask != 0xFFFFFFFFu)
+            break;
+        if (newlines)
+            *newlines += __builtin_popcount(nl);
+        skip = 0;
+        p += 32;
+    }
+    end = __builtin_ctz(~mask);
+    if (newlines)
+        *newlines += __builtin_popcount(nl & (uint32_t)((1ull << end) - 1));
+    return p + end - buf;
+}
+
+__attribute__((target("avx2")))
+size_t lines_avx2(const char *buf, size_t len, size_t base, size_t *starts)
+{
+    size_t n = 0;
+    uint32_t mask, skip;
+    const char *p = (const char *)((uintptr_t)buf & ~(uintptr_t)31), *end = buf + len;
+
+    if (!len)
+        return 0;
+    skip = (uint32_t)((1ull << (buf - p)) - 1);
+    for (; p < end; p += 32, skip = 0) {
+        mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), _mm256_set1_epi8('\n'))) & ~skip;
+        if (end - p < 32)
+            mask &= (uint32_t)((1ull << (end - p)) - 1);
+        if (!starts)
+            n += __builtin_popcount(mask);
+        else {
+            for (; mask; mask &= mask - 1)
+                starts[n++] = base + (p - buf) + __builtin_ctz(mask) + 1;
+        }
+    }
+    return n;
+}
+
+#endif
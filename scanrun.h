@@ -0,0 +1,45 @@
+/*
+ scanrun.h
+ Author: Jonathan Hamm
+
+ Description:
+    Measures runs of bytes of a few common classes, such as whitespace and
+    the letters and digits of identifiers, 16 or 32 bytes at a time, and
+    finds the newlines in a span of bytes the same way. AVX2 or SSE2 is
+    picked at run time by what the CPU supports, with plain C on other
+    machines. scan_select can force either of them, or plain C, instead.
+
+    Runs must be followed by a byte outside their class, such as the EOF
+    byte ending readfile's buffers, before the end of the buffer.
+ */
+
+#ifndef SCANRUN_H_
+#define SCANRUN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum run_class_ {
+    RUN_NONE,
+    RUN_SPACE,      /* the bytes isspace accepts in the C locale */
+    RUN_WORD,       /* [A-Za-z0-9_] */
+    RUN_ALNUM,      /* [A-Za-z0-9] */
+    RUN_DIGIT,      /* [0-9] */
+    RUN_TEXT        /* every byte but (char)EOF */
+};
+
+enum scan_impl_ {
+    SCAN_AUTO,
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+extern bool scan_select(int impl);
+extern size_t scan_space(const char *buf, unsigned *newlines);
+extern size_t scan_run(const char *buf, int class);
+extern bool run_member(int class, uint8_t c);
+extern size_t scan_newlines(const char *buf, size_t len, size_t base, size_t *starts);
+
+#endif
@@ -14,7 +14,6 @@
 #include <stdlib.h>
 #include <math.h>
 
-#define REGEX_DECORATIONS_FILE "regex_decorations"
 #define MACHID_START            37
 
 #define SEMSIGN_POS 0
@@ -253,15 +252,15 @@ static unsigned lablecount;
 
 static uint16_t semgrammar_hashf(void *key);
 static bool semgrammar_isequalf(void *key1, void *key2);
-static sem_type_s sem_type_s_(parse_s *parse, token_s *token);
+static sem_type_s sem_type_s_(parse_s *parse, uint32_t token);
 static test_s test_semtype(sem_type_s value);
 static inline unsigned toaddop(unsigned val);
 static inline unsigned tomulop(unsigned val);
 static inline unsigned torelop(unsigned val);
-static pnode_s *getpnode_token(pna_s *pn, char *lexeme, unsigned index);
-static pnode_s *getpnode_nterm_copy(pna_s *pn, char *lexeme, unsigned index);
-static pnode_s *getpnode_nterm(production_s *prod, char *lexeme, unsigned index);
-static sem_type_s sem_op(token_s **curr, parse_s *parse, token_s *tok, sem_type_s v1, sem_type_s v2, int op);
+static pnode_s *getpnode_token(pna_s *pn, uint32_t atom, unsigned index);
+static pnode_s *getpnode_nterm_copy(pna_s *pn, uint32_t atom, unsigned index);
+static pnode_s *getpnode_nterm(production_s *prod, uint32_t atom, unsigned index);
+static sem_type_s sem_op(token_s **curr, parse_s *parse, uint32_t tok, sem_type_s v1, sem_type_s v2, int op);
 static sem_statements_s sem_statements (parse_s *parse, token_s **curr, llist_s **il, pda_s *pda, production_s *prod, pna_s *pn, semantics_s *syn, unsigned pass, test_s evaluate, bool elprev, bool isfinal);
 static sem_statement_s sem_statement (parse_s *parse, token_s **curr, llist_s **il, pda_s *pda, production_s *prod, pna_s *pn, semantics_s *syn, unsigned pass, test_s evaluate, bool elprev, bool isfinal);
 static sem_else_s sem_else (parse_s *parse, token_s **curr, llist_s **il, pda_s *pda, production_s *prod, pna_s *pn, semantics_s *syn, unsigned pass, test_s evaluate, bool elprev, bool isfinal);
@@ -306,7 +305,7 @@ static void *sem_resolveproc(token_s **curr, semantics_s *s, pda_s *pda, pna_s *
 static void *sem_getwidth(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse_s *parse, sem_paramlist_s params, unsigned pass, sem_type_s *type, bool eval, bool isfinal);
 static void *sem_low(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse_s *parse, sem_paramlist_s params, unsigned pass, sem_type_s *type, bool eval, bool isfinal);
 
-static int arglist_cmp(token_s **curr, parse_s *parse, token_s *tok, sem_type_s formal, sem_type_s actual);
+static int arglist_cmp(token_s **curr, parse_s *parse, uint32_t tok, sem_type_s formal, sem_type_s actual);
 
 
 static int ftable_strcmp(char *key, ftable_s *b);
@@ -316,7 +315,8 @@ static char *semstr_concat(char *base, sem_type_s val);
 static void set_type(semantics_s *s, char *id, sem_type_s type);
 static sem_type_s get_type(semantics_s *s, char *id);
 static char *make_semerror(unsigned lineno, char *lexeme, char *message);
-static void add_semerror(parse_s *p, token_s *t, char *message);
+static void add_semerror(parse_s *p, uint32_t t, char *message);
+static void add_semerror_(parse_s *p, unsigned lineno, char *lexeme, char *message);
 
 static sem_type_s sem_newtemp(token_s **curr);
 static sem_type_s sem_newlabel(token_s **curr);
@@ -372,25 +372,25 @@ bool semgrammar_isequalf(void *key1, void *key2)
     return key1 == key2;
 }
 
-sem_type_s sem_type_s_(parse_s *parse, token_s *token)
+sem_type_s sem_type_s_(parse_s *parse, uint32_t token)
 {
     sem_type_s s;
     tlookup_s res;
     regex_match_s match;
-    
+    char *lexeme = parse->toks->lexeme[token], *stype = parse->toks->stype[token];
     
     s.str_ = NULL;
     s.low = 0 ;
     s.high = 0;
-    if(!token->stype) {
-        res = idtable_lookup(parse->lex->idtable, token->lexeme);
+    if(!stype) {
+        res = idtable_lookup(parse->lex->idtable, lexeme);
         if(res.is_found) {
             s = res.tdat.type;
-            s.str_ = token->lexeme;
+            s.str_ = lexeme;
         }
         else {
             s.type = ATTYPE_CODE;
-            if((match = lex_matches(parse->lex, "addop", token->lexeme)).matched) {
+            if((match = lex_matches(parse->lex, "addop", lexeme)).matched) {
                 switch(match.attribute){
                     case LEXATTR_PLUS:
                         s.str_ = "+";
@@ -406,7 +406,7 @@ sem_type_s sem_type_s_(parse_s *parse, token_s *token)
                         break;
                 }
             }
-            else if((match = lex_matches(parse->lex, "mulop", token->lexeme)).matched) {
+            else if((match = lex_matches(parse->lex, "mulop", lexeme)).matched) {
                 switch(match.attribute){
                     case LEXATTR_MULT:
                         s.str_ = "*";
@@ -426,7 +426,7 @@ sem_type_s sem_type_s_(parse_s *parse, token_s *token)
                         break;
                 }
             }
-            else if((match = lex_matches(parse->lex, "relop", token->lexeme)).matched) {
+            else if((match = lex_matches(parse->lex, "relop", lexeme)).matched) {
                 switch(match.attribute) {
                     case LEXATTR_EQ:
                         s.str_ = "=";
@@ -451,31 +451,31 @@ sem_type_s sem_type_s_(parse_s *parse, token_s *token)
                         break;
                 }
             }
-            else if (!strcmp(token->lexeme, "integer")) {
+            else if (!strcmp(lexeme, "integer")) {
                 s.type = ATTYPE_ID;
                 s.str_ = "integer";
             }
-            else if (!strcmp(token->lexeme, "real")) {
+            else if (!strcmp(lexeme, "real")) {
                 s.type = ATTYPE_ID;
                 s.str_ = "real";
             }
             else {
                 s.type = ATTYPE_ID;
-                s.str_ = token->lexeme;
+                s.str_ = lexeme;
             }
         }
     }
-    else if(!strcmp(token->stype, "integer")) {
+    else if(!strcmp(stype, "integer")) {
         s.type = ATTYPE_ID;
         s.str_ = "integer";
     }
-    else if(!strcmp(token->stype, "real")) {
+    else if(!strcmp(stype, "real")) {
         s.type = ATTYPE_ID;
         s.str_ = "real";
     }
     else {
         s.type = ATTYPE_ID;
-        s.str_ = token->lexeme;
+        s.str_ = lexeme;
     }
     return s;
 }
@@ -564,8 +564,8 @@ uint32_t cfg_annotate (token_s **tlist, char *buf, uint32_t *lineno, void *data)
     ltok = lexf(data, &buf[1], anlineno, true);
     anlineno = ltok.lines;
     *lineno = ltok.lines;
-    (*tlist)->next = ltok.tokens;
-    ltok.tokens->prev = *tlist;
+    (*tlist)->next = tokbuf_list(ltok.toks);
+    (*tlist)->next->prev = *tlist;
     while ((*tlist)->next)
         *tlist = (*tlist)->next;
     last = *lineno;
@@ -618,12 +618,12 @@ unsigned torelop(unsigned val)
     }
 }
 
-pnode_s *getpnode_token(pna_s *pn, char *lexeme, unsigned index)
+pnode_s *getpnode_token(pna_s *pn, uint32_t atom, unsigned index)
 {
     unsigned i, j;
     
     for (i = 0, j = 1; i < pn->size; i++) {
-        if (!strcmp(pn->array[i].token->lexeme, lexeme)) {
+        if (pn->array[i].token->atom == atom) {
             if (j == index)
                 return &pn->array[i];
             j++;
@@ -632,12 +632,12 @@ pnode_s *getpnode_token(pna_s *pn, char *lexeme, unsigned index)
     return NULL;
 }
 
-pnode_s *getpnode_nterm_copy(pna_s *pn, char *lexeme, unsigned index)
+pnode_s *getpnode_nterm_copy(pna_s *pn, uint32_t atom, unsigned index)
 {
     unsigned i, j;
     
     for (i = 0, j = 1; i < pn->size; i++) {
-        if (!strcmp(pn->array[i].token->lexeme, lexeme)) {
+        if (pn->array[i].token->atom == atom) {
             if (j == index)
                 return &pn->array[i];
             i++;
@@ -646,13 +646,13 @@ pnode_s *getpnode_nterm_copy(pna_s *pn, char *lexeme, unsigned index)
     return NULL;
 }
 
-pnode_s *getpnode_nterm(production_s *prod, char *lexeme, unsigned index)
+pnode_s *getpnode_nterm(production_s *prod, uint32_t atom, unsigned index)
 {
     unsigned j;
     pnode_s *p;
     
     for(p = prod->start, j = 1; p; p = p->next) {
-        if(!strcmp(p->token->lexeme, lexeme)) {
+        if(p->token->atom == atom) {
             if(j == index)
                 return p;
             j++;
@@ -662,7 +662,7 @@ pnode_s *getpnode_nterm(production_s *prod, char *lexeme, unsigned index)
 }
 
 /* performs basic arithmetic operations with implicit type coercion */
-sem_type_s sem_op(token_s **curr, parse_s *parse, token_s *tok, sem_type_s v1, sem_type_s v2, int op)
+sem_type_s sem_op(token_s **curr, parse_s *parse, uint32_t tok, sem_type_s v1, sem_type_s v2, int op)
 {
     sem_type_s result;
     result.str_ = NULL;
@@ -967,7 +967,8 @@ sem_statements_s sem_statements(parse_s *parse, token_s **curr, llist_s **il, pd
 sem_statement_s sem_statement(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda, production_s *prod, pna_s *pn, semantics_s *syn, unsigned pass, test_s evaluate, bool elprev, bool isfinal)
 {
     pnode_s *p;
-    char *id, *nterm;
+    char *id;
+    uint32_t nterm;
     unsigned index;
     sem_expression_s expression;
     sem_idsuffix_s idsuffix;
@@ -978,7 +979,7 @@ sem_statement_s sem_statement(parse_s *parse, token_s **curr, llist_s **il, pda_
     
     switch((*curr)->type.val) {
         case SEMTYPE_NONTERM:
-            nterm = (*curr)->lexeme;
+            nterm = (*curr)->atom;
             *curr = (*curr)->next;
             idsuffix = sem_idsuffix(parse, curr, il, pda, prod, pn, syn, pass, evaluate.evaluated && evaluate.result, isfinal);
             index = idsuffix.factor_.index;
@@ -986,7 +987,7 @@ sem_statement_s sem_statement(parse_s *parse, token_s **curr, llist_s **il, pda_
             sem_match(curr, SEMTYPE_ASSIGNOP);
             expression = sem_expression(parse, curr, il, pda, prod, pn, syn, pass, evaluate.evaluated && evaluate.result, isfinal);
             if (evaluate.result && evaluate.evaluated && expression.value.type != ATTYPE_NOT_EVALUATED) {
-                if(!strcmp(pda->nterm->lexeme, nterm) && !idsuffix.factor_.isset) {
+                if(pda->nterm->atom == nterm && !idsuffix.factor_.isset) {
                     if(syn) {
                         setatt(syn, id, alloc_semt(expression.value));
                     }
@@ -1075,9 +1076,9 @@ sem_expression_s sem_expression(parse_s *parse, token_s **curr, llist_s **il, pd
     
     expression.value.str_= NULL;
     expression.value.str_ = NULL;
-    expression.value.tok = NULL;
+    expression.value.tok = 0;
     simple_expression.value.str_ = NULL;
-    simple_expression.value.tok = NULL;
+    simple_expression.value.tok = 0;
     simple_expression = sem_simple_expression(parse, curr, il, pda, prod, pn, syn, pass, eval, isfinal);
     expression_ = sem_expression_(parse, curr, il, pda, prod, pn, syn, pass, eval, isfinal);
     expression.value = sem_op(curr, parse, tok_lastmatched, simple_expression.value, expression_.value, expression_.op);
@@ -1095,7 +1096,7 @@ sem_expression__s sem_expression_(parse_s *parse, token_s **curr, llist_s **il,
 {
     sem_expression__s expression_;
     
-    expression_.value.tok = NULL;
+    expression_.value.tok = 0;
     expression_.value.str_ = NULL;
     switch((*curr)->type.val) {
         case SEMTYPE_RELOP:
@@ -1134,11 +1135,11 @@ sem_simple_expression_s sem_simple_expression(parse_s *parse, token_s **curr, ll
     sem_simple_expression__s simple_expression_;
     
     simple_expression.value.str_ = NULL;
-    simple_expression.value.tok = NULL;
+    simple_expression.value.tok = 0;
     term.value.str_ = NULL;
-    term.value.tok = NULL;
+    term.value.tok = 0;
     simple_expression_.value.str_ = NULL;
-    simple_expression_.value.tok = NULL;
+    simple_expression_.value.tok = 0;
     switch((*curr)->type.val) {
         case SEMTYPE_ADDOP:
             sign = sem_sign(curr);
@@ -1179,11 +1180,11 @@ sem_simple_expression__s sem_simple_expression_(parse_s *parse, token_s **curr,
     sem_simple_expression__s simple_expression_, simple_expression__;
     
     term.value.str_ = NULL;
-    term.value.tok = NULL;
+    term.value.tok = 0;
     simple_expression_.value.str_ = NULL;
-    simple_expression_.value.tok = NULL;
+    simple_expression_.value.tok = 0;
     simple_expression__.value.str_ = NULL;
-    simple_expression__.value.tok = NULL;
+    simple_expression__.value.tok = 0;
     switch((*curr)->type.val) {
         case SEMTYPE_ADDOP:
             op = toaddop((*curr)->type.attribute);
@@ -1227,11 +1228,11 @@ sem_term_s sem_term(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda, pr
     sem_term__s term_;
     
     term.value.str_ = NULL;
-    term.value.tok = NULL;
+    term.value.tok = 0;
     factor.value.str_= NULL;
-    factor.value.tok = NULL;
+    factor.value.tok = 0;
     term_.value.str_ = NULL;
-    term_.value.tok = NULL;
+    term_.value.tok = 0;
     factor = sem_factor(parse, curr, il, pda, prod, pn, syn, pass, eval, isfinal);
     term_ = sem_term_(parse, curr, il, &factor.value, pda, prod, pn, syn, pass, eval, isfinal);
     term.value = factor.value;
@@ -1249,8 +1250,8 @@ sem_term__s sem_term_(parse_s *parse, token_s **curr, llist_s **il, sem_type_s *
     factor.value.str_ = NULL;
     term_.value.str_ = NULL;
     term__.value.str_ = NULL;
-    term_.value.tok = NULL;
-    term__.value.tok = NULL;
+    term_.value.tok = 0;
+    term__.value.tok = 0;
     switch((*curr)->type.val) {
         case SEMTYPE_MULOP:
             op = tomulop((*curr)->type.attribute);
@@ -1292,6 +1293,7 @@ sem_term__s sem_term_(parse_s *parse, token_s **curr, llist_s **il, sem_type_s *
 sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda, production_s *prod, pna_s *pn, semantics_s *syn, unsigned pass, bool eval, bool isfinal)
 {
     long difference;
+    uint32_t nterm;
     token_s *id;
     pnode_s *pnode, *ptmp;
     semantics_s *in;
@@ -1300,7 +1302,7 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
     sem_idsuffix_s idsuffix;
     sem_expression_s expression;
     
-    factor.value.tok = NULL;
+    factor.value.tok = 0;
     expression.value.str_ = NULL;
     value.str_ = NULL;
     switch((*curr)->type.val) {
@@ -1311,18 +1313,18 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
             //attadd (semantics_s *s, char *id, sem_type_s *data)
             if (idsuffix.dot.id) {
                 if (!strcmp(idsuffix.dot.id, "entry")) {
-                    pnode = getpnode_token(pn, id->lexeme, idsuffix.factor_.index);
+                    pnode = getpnode_token(pn, id->atom, idsuffix.factor_.index);
                     if(pnode && pnode->pass) {
-                        factor.value.str_ = pnode->matched->lexeme;
-                        factor.value.lexeme = pnode->matched->lexeme;
+                        factor.value.str_ = parse->toks->lexeme[pnode->matched];
+                        factor.value.lexeme = parse->toks->lexeme[pnode->matched];
                         factor.value.type = ATTYPE_ID;
                         factor.value.tok = pnode->matched;
                     }
                     if (idsuffix.dot.range.isset && idsuffix.dot.range.isready) {
                         factor.value.type = ATTYPE_RANGE;
-                        pnode = getpnode_token(pn, id->lexeme, idsuffix.factor_.index);
+                        pnode = getpnode_token(pn, id->atom, idsuffix.factor_.index);
                         if(pnode && pnode->pass) {
-                            factor.value.low = safe_atol(pnode->matched->lexeme);
+                            factor.value.low = safe_atol(parse->toks->lexeme[pnode->matched]);
                             factor.value.high = idsuffix.dot.range.value;
                             factor.value.tok = pnode->matched;
                             difference = factor.value.high - factor.value.low;
@@ -1333,12 +1335,12 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
 
                 }
                 else if (!strcmp(idsuffix.dot.id, "val")) {
-                    pnode = getpnode_token(pn, id->lexeme, idsuffix.factor_.index);
+                    pnode = getpnode_token(pn, id->atom, idsuffix.factor_.index);
                     if (idsuffix.dot.range.isset && idsuffix.dot.range.isready) {
                         factor.value.type = ATTYPE_RANGE;
-                        pnode = getpnode_token(pn, id->lexeme, idsuffix.factor_.index);
+                        pnode = getpnode_token(pn, id->atom, idsuffix.factor_.index);
                         if(pnode && pnode->pass) {
-                            factor.value.low = safe_atol(pnode->matched->lexeme);
+                            factor.value.low = safe_atol(parse->toks->lexeme[pnode->matched]);
                             factor.value.high = idsuffix.dot.range.value;
                             factor.value.tok = pnode->matched;
                             difference = factor.value.high - factor.value.low;
@@ -1347,14 +1349,14 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
                         }
                     }
                     else {
-                        if(pnode->matched->stype) {
-                            if(!strcmp(pnode->matched->stype, "integer")) {
+                        if(parse->toks->stype[pnode->matched]) {
+                            if(!strcmp(parse->toks->stype[pnode->matched], "integer")) {
                                 factor.value.type = ATTYPE_NUMINT;
-                                factor.value.int_ = safe_atol(pnode->matched->lexeme);
+                                factor.value.int_ = safe_atol(parse->toks->lexeme[pnode->matched]);
                             }
-                            else if(!strcmp(pnode->matched->stype, "real")) {
+                            else if(!strcmp(parse->toks->stype[pnode->matched], "real")) {
                                 factor.value.type = ATTYPE_NUMREAL;
-                                factor.value.real_ = safe_atod(pnode->matched->lexeme);
+                                factor.value.real_ = safe_atod(parse->toks->lexeme[pnode->matched]);
                             }
                             factor.value.tok = pnode->matched;
                         }
@@ -1363,7 +1365,7 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
 
                 }
                 else if(!strcmp(idsuffix.dot.id, "type")) {
-                    ptmp = getpnode_token(pn, id->lexeme, 1);
+                    ptmp = getpnode_token(pn, id->atom, 1);
                     factor.value = sem_type_s_(parse, ptmp->matched);
                     factor.value.tok = ptmp->matched;
                 }
@@ -1371,7 +1373,7 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
                     factor.value.str_ = id->lexeme;
                     factor.value.lexeme = id->lexeme;
                     factor.value.type = ATTYPE_ID;
-                    factor.value.tok = id;
+                    factor.value.tok = tok_lastmatched;
                 }
             }
             else if (idsuffix.hasparam) {
@@ -1409,12 +1411,13 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
             factor.value.type = ATTYPE_ID;
             factor.value.str_ = (*curr)->lexeme;
             factor.access.base = (*curr)->lexeme;
+            nterm = (*curr)->atom;
             *curr = (*curr)->next;
             idsuffix = sem_idsuffix(parse, curr, il, pda, prod, pn, syn, pass, eval, isfinal);
             factor.access.offset = idsuffix.factor_.index;
             factor.access.attribute = idsuffix.dot.id;
             if (idsuffix.dot.id) {
-                if (!strcmp(factor.value.str_, pda->nterm->lexeme) && !idsuffix.factor_.isset) {
+                if (nterm == pda->nterm->atom && !idsuffix.factor_.isset) {
                     if(pn->curr) {
                         factor.value = getatt(syn, idsuffix.dot.id);
 
@@ -1431,7 +1434,7 @@ sem_factor_s sem_factor(parse_s *parse, token_s **curr, llist_s **il, pda_s *pda
                 }
                 else {
                     factor.value.type = ATTYPE_NOT_EVALUATED;
-                    pnode = getpnode_token(pn, factor.value.str_, idsuffix.factor_.index);
+                    pnode = getpnode_token(pn, nterm, idsuffix.factor_.index);
                     if(pnode) {
                         factor.value = getatt(pnode->syn, idsuffix.dot.id);
                     }
@@ -1657,10 +1660,10 @@ sem_range_s sem_range(parse_s *parse, token_s **curr, llist_s **il, pna_s *pn, s
             sem_match(curr, SEMTYPE_DOT);
             id2 = *curr;
             sem_match(curr, SEMTYPE_ID);
-            p = getpnode_token(pn, id1->lexeme, index);
+            p = getpnode_token(pn, id1->atom, index);
             range.isset = true;
             if(p && p->pass) {
-                range.value = safe_atol(p->matched->lexeme);
+                range.value = safe_atol(parse->toks->lexeme[p->matched]);
                 range.isready = true;
             }
             else
@@ -1957,7 +1960,7 @@ void *sem_error(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pn, parse_s *
         str = val->str_;
         str[0] = ' ';
         str[strlen(str)-1] = ' ';
-        p = getpnode_nterm_copy(pn, id->str_, 1);
+        p = getpnode_nterm_copy(pn, atomlookup(id->str_), 1);
         if(p)
             add_semerror(parse, p->matched, str);
         else
@@ -1979,14 +1982,14 @@ void *sem_getarray(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pn, parse_
         val = node->ptr;
         free(node);
         
-        p = getpnode_nterm_copy(pn, val->str_, 1);
-        type = gettype(parse->lex, p->matched->lexeme);
+        p = getpnode_nterm_copy(pn, atomlookup(val->str_), 1);
+        type = gettype(parse->lex, parse->toks->lexeme[p->matched]);
         
         if(type.type == ATTYPE_ARRAY) {
             type.type = ATTYPE_ID;
-            check = check_id(p->matched->lexeme);
+            check = check_id(parse->toks->lexeme[p->matched]);
             if(!check.isfound && isfinal) {
-                check = check_id(p->matched->lexeme);
+                check = check_id(parse->toks->lexeme[p->matched]);
                 add_semerror(parse, p->matched, "undeclared identifier");
             }
         }
@@ -2039,9 +2042,9 @@ void *sem_lookup(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pn, parse_s
         val = node->ptr;
         free(node);
         
-        p = getpnode_nterm_copy(pn, val->str_, 1);
-        type = gettype(parse->lex, p->matched->lexeme);
-        if((type.type == ATTYPE_NULL || !check_id(p->matched->lexeme).isfound) && eval && isfinal) {
+        p = getpnode_nterm_copy(pn, atomlookup(val->str_), 1);
+        type = gettype(parse->lex, parse->toks->lexeme[p->matched]);
+        if((type.type == ATTYPE_NULL || !check_id(parse->toks->lexeme[p->matched]).isfound) && eval && isfinal) {
             add_semerror(parse, p->matched, "undeclared identifier");
         }
         return alloc_semt(type);
@@ -2074,7 +2077,6 @@ void *sem_addtype(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pn, parse_s
 {
     llist_s *node;
     sem_type_s *t, *id;
-    token_s *temp;
     bool declared;
     check_id_s check;
     
@@ -2095,14 +2097,7 @@ void *sem_addtype(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pn, parse_s
     check = check_id(id->lexeme);
     
     if(declared && (check.type->type != ATTYPE_NULL && check.type->type != ATTYPE_NOT_EVALUATED)) {
-        temp = malloc(sizeof(*temp));
-        if(!temp) {
-            perror("Memory Allocation Error");
-            exit(EXIT_FAILURE);
-        }
-        temp->lineno = id->tok->lineno;
-        strcpy(temp->lexeme, id->lexeme);
-        add_semerror(p, temp, "Redeclaration of identifier");
+        add_semerror_(p, tokbuf_lineno(p->toks, id->tok), id->lexeme, "Redeclaration of identifier");
         hashinsert(grammar_stack->ptr, *curr, *curr);
     }
     else {
@@ -2123,7 +2118,6 @@ void *sem_addarg(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse_s
 {
     llist_s *node;
     sem_type_s *t, *id, test;
-    token_s *temp;
     bool declared;
     
     if(hashlookup(grammar_stack->ptr, *curr))
@@ -2143,14 +2137,7 @@ void *sem_addarg(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse_s
     declared = check_redeclared(id->lexeme);
     test = gettype(p->lex, id->lexeme);
     if(declared && (test.type != ATTYPE_NOT_EVALUATED && test.type != ATTYPE_NULL)) {
-        temp = malloc(sizeof(*temp));
-        if(!temp) {
-            perror("Memory Allocation Error");
-            exit(EXIT_FAILURE);
-        }
-        temp->lineno = id->tok->lineno;
-        strcpy(temp->lexeme, id->lexeme);
-        add_semerror(p, temp, "Redeclaration of identifier");
+        add_semerror_(p, tokbuf_lineno(p->toks, id->tok), id->lexeme, "Redeclaration of identifier");
     }
     else {
         t->tok = id->tok;
@@ -2243,7 +2230,6 @@ void *sem_pushscope(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, pars
     llist_s *node;
     sem_type_s *final, *arg;
     check_id_s check;
-    token_s *temp;
     bool declared;
     
     if((final = hashlookup(grammar_stack->ptr, *curr)))
@@ -2259,14 +2245,7 @@ void *sem_pushscope(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, pars
     declared = check_redeclared(arg->str_);
     check = check_id(arg->str_);
     if(declared && check.type) {
-        temp = malloc(sizeof(*temp));
-        if(!temp) {
-            perror("Memory Allocation Error");
-            exit(EXIT_FAILURE);
-        }
-        temp->lineno = arg->tok->lineno;
-        strcpy(temp->lexeme, arg->str_);
-        add_semerror(parse, temp, "Redeclaration of identifier as procedure");
+        add_semerror_(parse, tokbuf_lineno(parse->toks, arg->tok), arg->str_, "Redeclaration of identifier as procedure");
     }
     push_scope(arg->str_);
     scope_tree->full_id = scoped_label();
@@ -2333,8 +2312,8 @@ void *sem_getwidth(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse
         return alloc_semt(id);
     node = llpop(&params.pstack);
     id = *(sem_type_s *)node->ptr;
-    p = getpnode_nterm_copy(pna, id.str_, 1);
-    str = p->matched->lexeme;
+    p = getpnode_nterm_copy(pna, atomlookup(id.str_), 1);
+    str = parse->toks->lexeme[p->matched];
     check = check_id(str);
     width.type = ATTYPE_NUMINT;
     width.int_ = check.width;
@@ -2354,12 +2333,12 @@ void *sem_low(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse_s *p
         return alloc_semt(id);
     node = llpop(&params.pstack);
     id = *(sem_type_s *)node->ptr;
-    p = getpnode_nterm_copy(pna, id.str_, 1);
+    p = getpnode_nterm_copy(pna, atomlookup(id.str_), 1);
     if(!p) {
         id.type = ATTYPE_NULL;
         return alloc_semt(id);
     }
-    str = p->matched->lexeme;
+    str = parse->toks->lexeme[p->matched];
     check = check_id(str);
     low.type = ATTYPE_NUMINT;
     if(!check.isfound) {
@@ -2373,7 +2352,7 @@ void *sem_low(token_s **curr, semantics_s *s, pda_s *pda, pna_s *pna, parse_s *p
     return alloc_semt(low);
 }
 
-int arglist_cmp(token_s **curr, parse_s *parse, token_s *tok, sem_type_s formal, sem_type_s actual)
+int arglist_cmp(token_s **curr, parse_s *parse, uint32_t tok, sem_type_s formal, sem_type_s actual)
 {
     llist_s *lf, *la, *la_last;
     sem_type_s *a, *f;
@@ -2592,14 +2571,19 @@ char *make_semerror(unsigned lineno, char *lexeme, char *message)
     return msg;
 }
 
-void add_semerror(parse_s *p, token_s *t, char *message)
+void add_semerror(parse_s *p, uint32_t t, char *message)
+{
+    add_semerror_(p, tokbuf_lineno(p->toks, t), p->toks->lexeme[t], message);
+}
+
+void add_semerror_(parse_s *p, unsigned lineno, char *lexeme, char *message)
 {
-    char *err = make_semerror(t->lineno, t->lexeme, message);
+    char *err = make_semerror(lineno, lexeme, message);
     
-    if(check_listing(p->listing, t->lineno, err))
+    if(check_listing(p->lex->listing, lineno, err))
         free(err);
     else
-        adderror(p->listing, err, t->lineno);
+        adderror(p->lex->listing, err, lineno);
 }
 
 sem_type_s sem_newtemp(token_s **curr)
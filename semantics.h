@@ -13,6 +13,8 @@
 #include "general.h"
 #include <stdint.h>
 
+#define REGEX_DECORATIONS_FILE "regex_decorations"
+
 typedef struct semantics_s semantics_s;
 typedef struct pna_s pna_s;
 